@@ -0,0 +1,336 @@
+#include "pch.h"
+#include <algorithm>
+#include <chrono>
+#include "call_graph.h"
+#include "string_format.h"
+#include "test_suite.h"
+
+// DOT や JSON の文字列リテラルとして書けるように、引用符と制御文字をエスケープする。
+static auto escape_string(Utf8String const& source) -> Utf8String {
+	auto text = Utf8String{};
+	for (auto c : source) {
+		switch ((char)c) {
+		case '"': text += as_utf8(u8"\\\""); break;
+		case '\\': text += as_utf8(u8"\\\\"); break;
+		case '\n': text += as_utf8(u8"\\n"); break;
+		case '\r': text += as_utf8(u8"\\r"); break;
+		case '\t': text += as_utf8(u8"\\t"); break;
+		default:
+			if ((unsigned char)c < 0x20) {
+				text += as_utf8(strf("\\u%04x", (int)(unsigned char)c));
+				break;
+			}
+			text += c;
+			break;
+		}
+	}
+	return text;
+}
+
+static auto name_of(std::vector<Utf8String> const& names, std::size_t cmdid) -> Utf8String {
+	if (cmdid == CallGraph::ROOT) {
+		return to_owned(as_utf8(u8"(main)"));
+	}
+	if (cmdid < names.size() && !names[cmdid].empty()) {
+		return names[cmdid];
+	}
+	return to_owned(as_utf8(strf("#%d", cmdid)));
+}
+
+// DOT のノードID。(同名の命令を区別するため、名前ではなく cmdid から作る。)
+static auto dot_node_id(std::size_t cmdid) -> Utf8String {
+	if (cmdid == CallGraph::ROOT) {
+		return to_owned(as_utf8(u8"main"));
+	}
+	return to_owned(as_utf8(strf("n%d", cmdid)));
+}
+
+// 辺に現れる命令の cmdid を昇順に並べたもの。(ROOT は最後)
+static auto edges_to_nodes(std::vector<CallGraphEdge> const& edges) -> std::vector<std::size_t> {
+	auto nodes = std::vector<std::size_t>{};
+	for (auto&& edge : edges) {
+		nodes.push_back(edge.caller());
+		nodes.push_back(edge.callee());
+	}
+
+	std::sort(nodes.begin(), nodes.end());
+	nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+	return nodes;
+}
+
+CallGraph::CallGraph()
+	: slots_(INITIAL_CAPACITY)
+	, size_()
+	, total_count_()
+{
+}
+
+auto CallGraph::call_count(std::size_t caller, std::size_t callee) const -> std::uint64_t {
+	auto mask = slots_.size() - 1;
+	for (auto i = hash(caller, callee) & mask; ; i = (i + 1) & mask) {
+		auto&& slot = slots_[i];
+		if (slot.count_ == 0) {
+			return 0;
+		}
+
+		if (slot.caller_ == caller && slot.callee_ == callee) {
+			return slot.count_;
+		}
+	}
+}
+
+void CallGraph::clear() {
+	std::fill(slots_.begin(), slots_.end(), Slot{ 0, 0, 0 });
+	size_ = 0;
+	total_count_ = 0;
+}
+
+void CallGraph::grow() {
+	auto old_slots = std::vector<Slot>(slots_.size() * 2);
+	std::swap(slots_, old_slots);
+
+	auto mask = slots_.size() - 1;
+	for (auto&& old_slot : old_slots) {
+		if (old_slot.count_ == 0) {
+			continue;
+		}
+
+		auto i = hash(old_slot.caller_, old_slot.callee_) & mask;
+		while (slots_[i].count_ != 0) {
+			i = (i + 1) & mask;
+		}
+		slots_[i] = old_slot;
+	}
+}
+
+auto CallGraph::to_edges() const -> std::vector<CallGraphEdge> {
+	auto edges = std::vector<CallGraphEdge>{};
+	edges.reserve(size_);
+	for (auto&& slot : slots_) {
+		if (slot.count_ != 0) {
+			edges.emplace_back(slot.caller_, slot.callee_, slot.count_);
+		}
+	}
+
+	// 出力が表の並びに左右されないように、回数が同じなら番号の順に並べる。
+	std::sort(
+		edges.begin(), edges.end(),
+		[](CallGraphEdge const& l, CallGraphEdge const& r) {
+			if (l.count() != r.count()) {
+				return l.count() > r.count();
+			}
+			return std::make_pair(l.caller(), l.callee()) < std::make_pair(r.caller(), r.callee());
+		});
+	return edges;
+}
+
+auto CallGraph::to_dot(std::vector<Utf8String> const& names) const -> Utf8String {
+	auto edges = to_edges();
+
+	auto text = to_owned(as_utf8(u8"digraph calls {\n"));
+	for (auto cmdid : edges_to_nodes(edges)) {
+		text += as_utf8(u8"\t");
+		text += dot_node_id(cmdid);
+		text += as_utf8(u8" [label=\"");
+		text += escape_string(name_of(names, cmdid));
+		text += as_utf8(u8"\"];\n");
+	}
+
+	for (auto&& edge : edges) {
+		text += as_utf8(u8"\t");
+		text += dot_node_id(edge.caller());
+		text += as_utf8(u8" -> ");
+		text += dot_node_id(edge.callee());
+		text += as_utf8(strf(" [label=\"%d\"];\n", edge.count()));
+	}
+	text += as_utf8(u8"}\n");
+	return text;
+}
+
+auto CallGraph::to_json(std::vector<Utf8String> const& names) const -> Utf8String {
+	auto edges = to_edges();
+
+	auto text = to_owned(as_utf8(u8"{\"nodes\":["));
+	auto first = true;
+	for (auto cmdid : edges_to_nodes(edges)) {
+		if (cmdid == ROOT) {
+			continue;
+		}
+
+		if (!first) {
+			text += as_utf8(u8",");
+		}
+		first = false;
+
+		text += as_utf8(strf("{\"id\":%d,\"name\":\"", cmdid));
+		text += escape_string(name_of(names, cmdid));
+		text += as_utf8(u8"\"}");
+	}
+
+	text += as_utf8(u8"],\"edges\":[");
+	first = true;
+	for (auto&& edge : edges) {
+		if (!first) {
+			text += as_utf8(u8",");
+		}
+		first = false;
+
+		text += as_utf8(u8"{\"caller\":");
+		if (edge.caller() == ROOT) {
+			text += as_utf8(u8"null");
+		} else {
+			text += as_utf8(strf("%d", edge.caller()));
+		}
+		text += as_utf8(strf(",\"callee\":%d,\"count\":%d}", edge.callee(), edge.count()));
+	}
+	text += as_utf8(u8"]}\n");
+	return text;
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+void call_graph_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"call_graph");
+
+	suite.test(
+		u8"辺ごとに呼び出し回数を数える",
+		[](TestCaseContext& t) {
+			auto graph = CallGraph{};
+
+			// main → f, f → g (2回), main → g
+			graph.add_call(CallGraph::ROOT, 0);
+			graph.add_call(0, 1);
+			graph.add_call(0, 1);
+			graph.add_call(CallGraph::ROOT, 1);
+
+			return t.eq(graph.size(), std::size_t{ 3 })
+				&& t.eq(graph.total_count(), std::uint64_t{ 4 })
+				&& t.eq(graph.call_count(CallGraph::ROOT, 0), std::uint64_t{ 1 })
+				&& t.eq(graph.call_count(0, 1), std::uint64_t{ 2 })
+				&& t.eq(graph.call_count(1, 0), std::uint64_t{ 0 });
+		});
+
+	suite.test(
+		u8"表を広げても回数が保たれる",
+		[](TestCaseContext& t) {
+			static constexpr auto NODE_COUNT = std::size_t{ 100 };
+
+			auto graph = CallGraph{};
+			for (auto caller = std::size_t{}; caller < NODE_COUNT; caller++) {
+				for (auto callee = std::size_t{}; callee < 10; callee++) {
+					for (auto k = std::size_t{}; k <= callee; k++) {
+						graph.add_call(caller, callee);
+					}
+				}
+			}
+
+			auto ok = true;
+			for (auto caller = std::size_t{}; caller < NODE_COUNT; caller++) {
+				for (auto callee = std::size_t{}; callee < 10; callee++) {
+					ok = ok && graph.call_count(caller, callee) == callee + 1;
+				}
+			}
+
+			auto capacity = graph.capacity();
+			graph.clear();
+
+			return t.eq(ok, true)
+				&& t.eq(capacity >= NODE_COUNT * 10 * 2, true)
+				&& t.eq(graph.size(), std::size_t{ 0 })
+				&& t.eq(graph.call_count(0, 0), std::uint64_t{ 0 });
+		});
+
+	suite.test(
+		u8"DOT と JSON で出力する",
+		[](TestCaseContext& t) {
+			auto graph = CallGraph{};
+			graph.add_call(CallGraph::ROOT, 0);
+			graph.add_call(0, 1);
+			graph.add_call(0, 1);
+			graph.add_call(1, 2);
+
+			auto names = std::vector<Utf8String>{
+				to_owned(as_utf8(u8"f")),
+				to_owned(as_utf8(u8"g\"")),
+			};
+
+			return t.eq(
+				as_native(graph.to_dot(names)),
+				u8"digraph calls {\n"
+				u8"\tn0 [label=\"f\"];\n"
+				u8"\tn1 [label=\"g\\\"\"];\n"
+				u8"\tn2 [label=\"#2\"];\n"
+				u8"\tmain [label=\"(main)\"];\n"
+				u8"\tn0 -> n1 [label=\"2\"];\n"
+				u8"\tn1 -> n2 [label=\"1\"];\n"
+				u8"\tmain -> n0 [label=\"1\"];\n"
+				u8"}\n")
+				&& t.eq(
+					as_native(graph.to_json(names)),
+					u8"{\"nodes\":["
+					u8"{\"id\":0,\"name\":\"f\"},"
+					u8"{\"id\":1,\"name\":\"g\\\"\"},"
+					u8"{\"id\":2,\"name\":\"#2\"}"
+					u8"],\"edges\":["
+					u8"{\"caller\":0,\"callee\":1,\"count\":2},"
+					u8"{\"caller\":1,\"callee\":2,\"count\":1},"
+					u8"{\"caller\":null,\"callee\":0,\"count\":1}"
+					u8"]}\n");
+		});
+
+	suite.test(
+		u8"同名の命令を区別し、制御文字をエスケープする",
+		[](TestCaseContext& t) {
+			// 別々のモジュールにある同名の命令 f (cmdid 0, 1)
+			auto graph = CallGraph{};
+			graph.add_call(0, 1);
+
+			auto names = std::vector<Utf8String>{
+				to_owned(as_utf8(u8"f")),
+				to_owned(as_utf8(u8"f")),
+			};
+
+			auto control_names = std::vector<Utf8String>{
+				to_owned(as_utf8(u8"a\x01\x1f\tb")),
+				to_owned(as_utf8(u8"c")),
+			};
+
+			return t.eq(
+				as_native(graph.to_dot(names)),
+				u8"digraph calls {\n"
+				u8"\tn0 [label=\"f\"];\n"
+				u8"\tn1 [label=\"f\"];\n"
+				u8"\tn0 -> n1 [label=\"1\"];\n"
+				u8"}\n")
+				&& t.eq(
+					as_native(graph.to_json(control_names)),
+					u8"{\"nodes\":["
+					u8"{\"id\":0,\"name\":\"a\\u0001\\u001f\\tb\"},"
+					u8"{\"id\":1,\"name\":\"c\"}"
+					u8"],\"edges\":["
+					u8"{\"caller\":0,\"callee\":1,\"count\":1}"
+					u8"]}\n");
+		});
+
+	suite.test(
+		u8"ベンチマーク: 呼び出しの記録",
+		[](TestCaseContext& t) {
+			static constexpr auto CALL_COUNT = std::size_t{ 10000000 };
+
+			auto graph = CallGraph{};
+
+			auto start = std::chrono::steady_clock::now();
+			for (auto i = std::size_t{}; i < CALL_COUNT; i++) {
+				graph.add_call(i % 50, i * 7 % 200);
+			}
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+
+			t.output()
+				<< u8"    " << (int)(ns / CALL_COUNT * 10) / 10.0 << u8" ns/呼び出し (" << graph.size() << u8" 辺)" << std::endl;
+
+			return t.eq(graph.total_count(), std::uint64_t{ CALL_COUNT });
+		});
+}
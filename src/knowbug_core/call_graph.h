@@ -0,0 +1,140 @@
+//! 呼び出しグラフ
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "encoding.h"
+
+class Tests;
+
+// 呼び出しグラフの辺: caller が callee を呼んだ回数
+class CallGraphEdge {
+	std::size_t caller_;
+	std::size_t callee_;
+	std::uint64_t count_;
+
+public:
+	CallGraphEdge(std::size_t caller, std::size_t callee, std::uint64_t count)
+		: caller_(caller)
+		, callee_(callee)
+		, count_(count)
+	{
+	}
+
+	auto caller() const -> std::size_t {
+		return caller_;
+	}
+
+	auto callee() const -> std::size_t {
+		return callee_;
+	}
+
+	auto count() const -> std::uint64_t {
+		return count_;
+	}
+};
+
+// ユーザー定義命令・関数の呼び出し元から呼び出し先への辺ごとに、呼び出し回数を数えるもの。
+//
+// 辺は (呼び出し元の cmdid, 呼び出し先の cmdid) をキーとする開番地法のハッシュ表に数える。
+// 表は埋まり具合が半分を超えたときだけ倍に広げるので、辺の種類が出揃った後は呼び出しごとのメモリー確保をしない。
+class CallGraph {
+public:
+	// 呼び出し元がないこと (メインのスクリプトからの呼び出し) を表す番号
+	static constexpr auto ROOT = std::numeric_limits<std::size_t>::max();
+
+	// ハッシュ表の最初の大きさ (2の累乗)
+	static constexpr auto INITIAL_CAPACITY = std::size_t{ 256 };
+
+private:
+	class Slot {
+	public:
+		std::size_t caller_;
+		std::size_t callee_;
+
+		// 0 なら空きスロット
+		std::uint64_t count_;
+	};
+
+	std::vector<Slot> slots_;
+
+	// 辺の数
+	std::size_t size_;
+
+	std::uint64_t total_count_;
+
+public:
+	CallGraph();
+
+	// 辺の数
+	auto size() const -> std::size_t {
+		return size_;
+	}
+
+	auto capacity() const -> std::size_t {
+		return slots_.size();
+	}
+
+	// 呼び出し回数の合計
+	auto total_count() const -> std::uint64_t {
+		return total_count_;
+	}
+
+	// caller が callee を呼んだ回数
+	auto call_count(std::size_t caller, std::size_t callee) const->std::uint64_t;
+
+	// 呼び出しを1回数える。(caller: 呼び出し元の cmdid または ROOT)
+	void add_call(std::size_t caller, std::size_t callee) {
+		auto mask = slots_.size() - 1;
+		for (auto i = hash(caller, callee) & mask; ; i = (i + 1) & mask) {
+			auto&& slot = slots_[i];
+			if (slot.count_ == 0) {
+				if ((size_ + 1) * 2 > slots_.size()) {
+					grow();
+					add_call(caller, callee);
+					return;
+				}
+
+				slot = Slot{ caller, callee, 1 };
+				size_++;
+				total_count_++;
+				return;
+			}
+
+			if (slot.caller_ == caller && slot.callee_ == callee) {
+				slot.count_++;
+				total_count_++;
+				return;
+			}
+		}
+	}
+
+	void clear();
+
+	// 辺を呼び出し回数の降順に並べたもの
+	auto to_edges() const->std::vector<CallGraphEdge>;
+
+	// Graphviz の DOT 形式にする。(names: cmdid ごとの命令の名前)
+	// 同名の命令を区別するため、ノードIDは cmdid から作り (n0, n1, ... メインのスクリプトは main)、名前はラベルにする。
+	auto to_dot(std::vector<Utf8String> const& names) const->Utf8String;
+
+	// `{"nodes":[{"id":0,"name":"f"}],"edges":[{"caller":null,"callee":0,"count":1}]}` の形式の JSON にする。
+	// (id, caller, callee は cmdid。メインのスクリプトからの呼び出しの caller は null)
+	auto to_json(std::vector<Utf8String> const& names) const->Utf8String;
+
+private:
+	static auto hash(std::size_t caller, std::size_t callee) -> std::size_t {
+		auto h = (std::uint64_t)caller * 0x9E3779B97F4A7C15ull ^ (std::uint64_t)callee;
+		h ^= h >> 31;
+		h *= 0xBF58476D1CE4E5B9ull;
+		h ^= h >> 29;
+		return (std::size_t)h;
+	}
+
+	// ハッシュ表を倍に広げる。
+	void grow();
+};
+
+extern void call_graph_tests(Tests& tests);
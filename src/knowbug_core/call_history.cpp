@@ -0,0 +1,466 @@
+#include "pch.h"
+#include <cstring>
+#include "call_history.h"
+#include "string_format.h"
+#include "test_suite.h"
+
+// 値の種類を表すバイトのうち、文字列が切り詰められたことを表すビット
+static constexpr auto TRUNCATED_BIT = std::uint8_t{ 0x80 };
+
+static auto name_of(std::vector<Utf8String> const& names, std::size_t cmdid) -> Utf8String {
+	if (cmdid < names.size() && !names[cmdid].empty()) {
+		return names[cmdid];
+	}
+	return to_owned(as_utf8(strf("#%d", cmdid)));
+}
+
+// -----------------------------------------------
+// CallHistoryValue
+// -----------------------------------------------
+
+auto CallHistoryValue::from_c_str(char const* str) -> CallHistoryValue {
+	// 長い文字列の全体を走査しないように、STR_LIMIT + 1 バイトまでしか読まない。
+	auto size = std::size_t{};
+	while (size <= STR_LIMIT && str[size] != '\0') {
+		size++;
+	}
+
+	auto truncated = size > STR_LIMIT;
+	return from_str(std::string_view{ str, truncated ? STR_LIMIT : size }, truncated);
+}
+
+auto CallHistoryValue::to_string() const -> Utf8String {
+	switch (kind_) {
+	case CallHistoryValueKind::Int:
+		return to_owned(as_utf8(strf("%d", int_value_)));
+
+	case CallHistoryValueKind::Double:
+		return to_owned(as_utf8(strf("%f", double_value_)));
+
+	case CallHistoryValueKind::Str: {
+		// 1行に収まるように制御文字と引用符をエスケープする。
+		// (これらのバイトは shift_jis の2バイト目に現れないので、バイト単位で置き換えてよい。)
+		auto escaped = std::string{};
+		for (auto c : text_) {
+			switch (c) {
+			case '\r': escaped += "\\r"; break;
+			case '\n': escaped += "\\n"; break;
+			case '\t': escaped += "\\t"; break;
+			case '"': escaped += "\\\""; break;
+			default: escaped += c; break;
+			}
+		}
+
+		auto text = to_owned(as_utf8(u8"\""));
+		text += to_utf8(as_hsp(std::move(escaped)));
+		if (truncated_) {
+			text += as_utf8(u8"…");
+		}
+		text += as_utf8(u8"\"");
+		return text;
+	}
+	case CallHistoryValueKind::Label:
+		return to_owned(as_utf8(u8"label"));
+
+	case CallHistoryValueKind::Other: {
+		auto text = to_owned(as_utf8(u8"<"));
+		text += as_utf8(text_);
+		text += as_utf8(u8">");
+		return text;
+	}
+	default:
+		assert(false && u8"unknown kind");
+		return to_owned(as_utf8(u8"?"));
+	}
+}
+
+// -----------------------------------------------
+// CallHistory
+// -----------------------------------------------
+
+CallHistory::CallHistory(std::size_t memory_budget)
+	: entries_(std::max(std::size_t{ 1 }, memory_budget / (sizeof(CallHistoryEntry) + SLOT_SIZE)))
+	, arena_(entries_.size() * SLOT_SIZE)
+	, next_()
+	, count_()
+	, current_()
+	, total_count_()
+{
+}
+
+void CallHistory::clear() {
+	next_ = 0;
+	count_ = 0;
+	current_ = std::nullopt;
+	total_count_ = 0;
+}
+
+void CallHistory::begin_args(std::size_t call_frame_id, std::size_t cmdid, std::size_t depth, hsx::HspCodeUnit const* caller_code) {
+	auto slot = allocate(call_frame_id, cmdid, depth, caller_code);
+	entries_[slot].has_args_ = true;
+	current_ = slot;
+}
+
+void CallHistory::add_arg(CallHistoryValue const& value) {
+	if (!current_) {
+		assert(false && u8"begin_args must be called before add_arg");
+		return;
+	}
+
+	auto&& entry = entries_[*current_];
+	if (!write_value(*current_, value, SLOT_SIZE - RESULT_RESERVE)) {
+		return;
+	}
+	entry.arg_size_ = entry.data_size_;
+	entry.arg_count_++;
+}
+
+void CallHistory::finish(std::size_t call_frame_id, std::size_t cmdid, std::size_t depth, hsx::HspCodeUnit const* caller_code, std::optional<CallHistoryValue> const& result) {
+	current_ = std::nullopt;
+
+	// 戻り値の式の中で別の呼び出しが記録されていることがあるので、いくつか遡って探す。
+	auto slot_opt = std::optional<std::size_t>{};
+	for (auto i = std::size_t{}; i < std::min(count_, SEARCH_LIMIT); i++) {
+		auto slot = slot_of(i);
+		auto&& entry = entries_[slot];
+		if (entry.call_frame_id_ == call_frame_id && !entry.finished_) {
+			slot_opt = slot;
+			break;
+		}
+	}
+
+	auto slot = slot_opt ? *slot_opt : allocate(call_frame_id, cmdid, depth, caller_code);
+	auto&& entry = entries_[slot];
+
+	if (result && write_value(slot, *result, SLOT_SIZE)) {
+		entry.has_result_ = true;
+	}
+	entry.finished_ = true;
+}
+
+auto CallHistory::entry_at(std::size_t index) const -> CallHistoryEntry const& {
+	assert(index < count_);
+	return entries_[slot_of(index)];
+}
+
+auto CallHistory::entry_to_args(std::size_t index) const -> std::vector<CallHistoryValue> {
+	auto slot = slot_of(index);
+	return read_values(slot, 0, entries_[slot].arg_size_);
+}
+
+auto CallHistory::entry_to_result(std::size_t index) const -> std::optional<CallHistoryValue> {
+	auto slot = slot_of(index);
+	auto&& entry = entries_[slot];
+	if (!entry.has_result_) {
+		return std::nullopt;
+	}
+
+	auto&& values = read_values(slot, entry.arg_size_, entry.data_size_);
+	if (values.empty()) {
+		return std::nullopt;
+	}
+	return values.front();
+}
+
+auto CallHistory::to_text(std::size_t limit, std::vector<Utf8String> const& names, DescribeCaller const& describe_caller) const -> Utf8String {
+	auto text = Utf8String{};
+	auto line_count = std::size_t{};
+	for (auto i = std::size_t{}; i < count_ && line_count < limit; i++) {
+		auto&& entry = entry_at(i);
+		if (!entry.finished_) {
+			continue;
+		}
+		line_count++;
+
+		text += name_of(names, entry.cmdid());
+		text += as_utf8(u8"(");
+		if (entry.has_args()) {
+			auto first = true;
+			for (auto&& arg : entry_to_args(i)) {
+				if (!first) {
+					text += as_utf8(u8", ");
+				}
+				first = false;
+				text += arg.to_string();
+			}
+
+			if (entry.is_truncated() && entry.arg_count_ != 0) {
+				text += as_utf8(u8", …");
+			} else if (entry.is_truncated()) {
+				text += as_utf8(u8"…");
+			}
+		} else {
+			// 引数を記録する前に終了した呼び出し
+			text += as_utf8(u8"?");
+		}
+		text += as_utf8(u8")");
+
+		if (auto&& result_opt = entry_to_result(i)) {
+			text += as_utf8(u8" = ");
+			text += result_opt->to_string();
+		}
+
+		text += as_utf8(u8"  (");
+		text += describe_caller(entry.caller_code());
+		text += as_utf8(u8")\r\n");
+	}
+	return text;
+}
+
+auto CallHistory::slot_of(std::size_t index) const -> std::size_t {
+	assert(index < entries_.size());
+	return (next_ + entries_.size() - 1 - index) % entries_.size();
+}
+
+auto CallHistory::allocate(std::size_t call_frame_id, std::size_t cmdid, std::size_t depth, hsx::HspCodeUnit const* caller_code) -> std::size_t {
+	auto slot = next_;
+	next_ = (next_ + 1) % entries_.size();
+	count_ = std::min(count_ + 1, entries_.size());
+	total_count_++;
+
+	entries_[slot] = CallHistoryEntry{ call_frame_id, cmdid, depth, caller_code, 0, 0, 0, false, false, false, false };
+	return slot;
+}
+
+auto CallHistory::write_value(std::size_t slot, CallHistoryValue const& value, std::size_t limit) -> bool {
+	auto&& entry = entries_[slot];
+	auto out = arena_.data() + slot * SLOT_SIZE;
+	auto pos = (std::size_t)entry.data_size_;
+
+	auto kind = value.kind();
+	auto tag = (std::uint8_t)kind;
+	auto size = std::size_t{ 1 };
+	auto text = value.text();
+
+	switch (kind) {
+	case CallHistoryValueKind::Int:
+		size += sizeof(hsx::HspInt);
+		break;
+
+	case CallHistoryValueKind::Double:
+		size += sizeof(hsx::HspDouble);
+		break;
+
+	case CallHistoryValueKind::Str:
+	case CallHistoryValueKind::Other: {
+		// 文字列は入るだけ書き込む。(長さのバイトも入らなければ書き込まない。)
+		if (pos + 2 > limit) {
+			entry.truncated_ = true;
+			return false;
+		}
+
+		auto room = std::min(limit - pos - 2, CallHistoryValue::STR_LIMIT);
+		if (text.size() > room) {
+			text = text.substr(0, room);
+		}
+		if (value.is_truncated() || text.size() < value.text().size()) {
+			tag |= TRUNCATED_BIT;
+		}
+
+		size += 1 + text.size();
+		break;
+	}
+	default:
+		break;
+	}
+
+	if (pos + size > limit) {
+		entry.truncated_ = true;
+		return false;
+	}
+
+	out[pos++] = tag;
+	switch (kind) {
+	case CallHistoryValueKind::Int: {
+		auto int_value = value.int_value();
+		std::memcpy(out + pos, &int_value, sizeof(int_value));
+		break;
+	}
+	case CallHistoryValueKind::Double: {
+		auto double_value = value.double_value();
+		std::memcpy(out + pos, &double_value, sizeof(double_value));
+		break;
+	}
+	case CallHistoryValueKind::Str:
+	case CallHistoryValueKind::Other:
+		out[pos] = (std::uint8_t)text.size();
+		std::memcpy(out + pos + 1, text.data(), text.size());
+		break;
+
+	default:
+		break;
+	}
+
+	entry.data_size_ = (std::uint16_t)(entry.data_size_ + size);
+	return true;
+}
+
+auto CallHistory::read_values(std::size_t slot, std::size_t begin, std::size_t end) const -> std::vector<CallHistoryValue> {
+	auto data = arena_.data() + slot * SLOT_SIZE;
+	auto values = std::vector<CallHistoryValue>{};
+
+	auto pos = begin;
+	while (pos < end) {
+		auto tag = data[pos++];
+		auto truncated = (tag & TRUNCATED_BIT) != 0;
+
+		switch ((CallHistoryValueKind)(tag & ~TRUNCATED_BIT)) {
+		case CallHistoryValueKind::Int: {
+			auto value = hsx::HspInt{};
+			std::memcpy(&value, data + pos, sizeof(value));
+			pos += sizeof(value);
+			values.push_back(CallHistoryValue::from_int(value));
+			break;
+		}
+		case CallHistoryValueKind::Double: {
+			auto value = hsx::HspDouble{};
+			std::memcpy(&value, data + pos, sizeof(value));
+			pos += sizeof(value);
+			values.push_back(CallHistoryValue::from_double(value));
+			break;
+		}
+		case CallHistoryValueKind::Str:
+		case CallHistoryValueKind::Other: {
+			auto size = (std::size_t)data[pos++];
+			auto text = std::string_view{ (char const*)data + pos, size };
+			pos += size;
+
+			if ((tag & ~TRUNCATED_BIT) == (std::uint8_t)CallHistoryValueKind::Str) {
+				values.push_back(CallHistoryValue::from_str(text, truncated));
+			} else {
+				values.push_back(CallHistoryValue::from_other(text));
+			}
+			break;
+		}
+		case CallHistoryValueKind::Label:
+			values.push_back(CallHistoryValue::from_label());
+			break;
+
+		default:
+			assert(false && u8"broken call history");
+			return values;
+		}
+	}
+	return values;
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+void call_history_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"call_history");
+
+	suite.test(
+		u8"引数と戻り値を記録して読み戻せる",
+		[](TestCaseContext& t) {
+			auto history = CallHistory{ 64 * 1024 };
+			auto describe = [](hsx::HspCodeUnit const* caller_code) {
+				return to_owned(as_utf8(u8"caller"));
+			};
+			auto names = std::vector<Utf8String>{
+				to_owned(as_utf8(u8"f")),
+				to_owned(as_utf8(u8"g")),
+			};
+
+			// f(1, 2.5, "a\nb", var) = g() のように、戻り値の式の中で g が呼ばれる。
+			history.begin_args(1, 0, 0, nullptr);
+			history.add_arg(CallHistoryValue::from_int(1));
+			history.add_arg(CallHistoryValue::from_double(2.5));
+			history.add_arg(CallHistoryValue::from_c_str(u8"a\nb"));
+			history.add_arg(CallHistoryValue::from_other(u8"var"));
+
+			history.begin_args(2, 1, 1, nullptr);
+			history.finish(2, 1, 1, nullptr, CallHistoryValue::from_int(3));
+
+			history.finish(1, 0, 0, nullptr, CallHistoryValue::from_int(3));
+
+			// 引数を記録せずに終了した命令
+			history.finish(3, 1, 0, nullptr, std::nullopt);
+
+			auto args = history.entry_to_args(2);
+			auto text = as_native(history.to_text(10, names, describe));
+
+			return t.eq(history.size(), std::size_t{ 3 })
+				&& t.eq(args.size(), std::size_t{ 4 })
+				&& t.eq(args[0].int_value(), 1)
+				&& t.eq(args[1].double_value() == 2.5, true)
+				&& t.eq(std::string{ args[2].text() }, std::string{ u8"a\nb" })
+				&& t.eq(history.entry_at(2).call_frame_id(), std::size_t{ 1 })
+				&& t.eq(
+					text,
+					u8"g(?)  (caller)\r\n"
+					u8"g() = 3  (caller)\r\n"
+					u8"f(1, 2.500000, \"a\\nb\", <var>) = 3  (caller)\r\n");
+		});
+
+	suite.test(
+		u8"古い記録から上書きする",
+		[](TestCaseContext& t) {
+			auto history = CallHistory{ 4 * (sizeof(CallHistoryEntry) + CallHistory::SLOT_SIZE) };
+
+			for (auto i = std::size_t{}; i < 10; i++) {
+				history.begin_args(i, 0, 0, nullptr);
+				history.add_arg(CallHistoryValue::from_int((hsx::HspInt)i));
+				history.finish(i, 0, 0, nullptr, std::nullopt);
+			}
+
+			return t.eq(history.capacity(), std::size_t{ 4 })
+				&& t.eq(history.size(), std::size_t{ 4 })
+				&& t.eq(history.total_count(), std::uint64_t{ 10 })
+				&& t.eq(history.entry_at(0).call_frame_id(), std::size_t{ 9 })
+				&& t.eq(history.entry_at(3).call_frame_id(), std::size_t{ 6 })
+				&& t.eq(history.entry_to_args(3)[0].int_value(), 6);
+		});
+
+	suite.test(
+		u8"値の大きさを制限する",
+		[](TestCaseContext& t) {
+			auto history = CallHistory{ 64 * 1024 };
+
+			auto long_str = std::string(1000, 'x');
+
+			history.begin_args(1, 0, 0, nullptr);
+			for (auto i = 0; i < 10; i++) {
+				history.add_arg(CallHistoryValue::from_c_str(long_str.c_str()));
+			}
+			history.finish(1, 0, 0, nullptr, CallHistoryValue::from_c_str(long_str.c_str()));
+
+			auto&& entry = history.entry_at(0);
+			auto args = history.entry_to_args(0);
+			auto result = history.entry_to_result(0);
+
+			// 引数の領域 (SLOT_SIZE - RESULT_RESERVE バイト) が残り1バイトのときは、
+			// 長さのバイトが入らないので文字列を記録しない。
+			auto exact_history = CallHistory{ 64 * 1024 };
+			auto str64 = std::string(64, 'x');
+			auto str55 = std::string(55, 'y');
+
+			exact_history.begin_args(1, 0, 0, nullptr);
+			exact_history.add_arg(CallHistoryValue::from_c_str(str64.c_str()));
+			exact_history.add_arg(CallHistoryValue::from_c_str(str64.c_str()));
+			exact_history.add_arg(CallHistoryValue::from_c_str(str55.c_str()));
+			exact_history.add_arg(CallHistoryValue::from_c_str(u8"z"));
+			exact_history.finish(1, 0, 0, nullptr, CallHistoryValue::from_int(7));
+
+			auto&& exact_entry = exact_history.entry_at(0);
+			auto exact_args = exact_history.entry_to_args(0);
+			auto exact_result = exact_history.entry_to_result(0);
+
+			auto args_are_bounded = true;
+			for (auto&& arg : args) {
+				args_are_bounded = args_are_bounded && arg.text().size() <= CallHistoryValue::STR_LIMIT && arg.is_truncated();
+			}
+
+			return t.eq(entry.is_truncated(), true)
+				&& t.eq(args.size() < 10, true)
+				&& t.eq(args_are_bounded, true)
+				&& t.eq(result.has_value(), true)
+				&& t.eq(result ? result->text().size() : 0, CallHistoryValue::STR_LIMIT)
+				&& t.eq(result ? result->is_truncated() : false, true)
+				&& t.eq(exact_entry.is_truncated(), true)
+				&& t.eq(exact_args.size(), std::size_t{ 3 })
+				&& t.eq(exact_args.size() == 3 ? exact_args[2].text().size() : 0, std::size_t{ 55 })
+				&& t.eq(exact_result ? exact_result->int_value() : 0, 7);
+		});
+}
@@ -0,0 +1,243 @@
+//! 呼び出し履歴
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <vector>
+#include "encoding.h"
+#include "hsx_types_fwd.h"
+
+class Tests;
+
+enum class CallHistoryValueKind : std::uint8_t {
+	Int,
+	Double,
+	Str,
+	Label,
+
+	// 値を記録しない引数 (var, modvar など)。型の名前だけを持つ。
+	Other,
+};
+
+// 呼び出し履歴に記録する引数や戻り値
+class CallHistoryValue {
+public:
+	// 記録する文字列の最大のバイト数
+	static constexpr auto STR_LIMIT = std::size_t{ 64 };
+
+private:
+	CallHistoryValueKind kind_;
+	hsx::HspInt int_value_;
+	hsx::HspDouble double_value_;
+
+	// Str: 文字列 (ランタイムの文字コード)、Other: 型の名前
+	std::string_view text_;
+
+	// 文字列が切り詰められたか
+	bool truncated_;
+
+	CallHistoryValue(CallHistoryValueKind kind, hsx::HspInt int_value, hsx::HspDouble double_value, std::string_view text, bool truncated)
+		: kind_(kind)
+		, int_value_(int_value)
+		, double_value_(double_value)
+		, text_(text)
+		, truncated_(truncated)
+	{
+	}
+
+public:
+	static auto from_int(hsx::HspInt value) -> CallHistoryValue {
+		return CallHistoryValue{ CallHistoryValueKind::Int, value, 0.0, std::string_view{}, false };
+	}
+
+	static auto from_double(hsx::HspDouble value) -> CallHistoryValue {
+		return CallHistoryValue{ CallHistoryValueKind::Double, 0, value, std::string_view{}, false };
+	}
+
+	static auto from_str(std::string_view text, bool truncated) -> CallHistoryValue {
+		return CallHistoryValue{ CallHistoryValueKind::Str, 0, 0.0, text, truncated };
+	}
+
+	// NULL 終端された文字列を参照する。(STR_LIMIT を超える部分は読まない。)
+	static auto from_c_str(char const* str) -> CallHistoryValue;
+
+	static auto from_label() -> CallHistoryValue {
+		return CallHistoryValue{ CallHistoryValueKind::Label, 0, 0.0, std::string_view{}, false };
+	}
+
+	static auto from_other(std::string_view type_name) -> CallHistoryValue {
+		return CallHistoryValue{ CallHistoryValueKind::Other, 0, 0.0, type_name, false };
+	}
+
+	auto kind() const -> CallHistoryValueKind {
+		return kind_;
+	}
+
+	auto int_value() const -> hsx::HspInt {
+		return int_value_;
+	}
+
+	auto double_value() const -> hsx::HspDouble {
+		return double_value_;
+	}
+
+	auto text() const -> std::string_view {
+		return text_;
+	}
+
+	auto is_truncated() const -> bool {
+		return truncated_;
+	}
+
+	// 1, 2.5, "abc", label, <var> のような表記にする。
+	auto to_string() const->Utf8String;
+};
+
+// 呼び出し履歴の1回の呼び出しの記録
+class CallHistoryEntry {
+public:
+	std::size_t call_frame_id_;
+	std::size_t cmdid_;
+	std::size_t depth_;
+
+	// 呼び出し側の実行位置
+	hsx::HspCodeUnit const* caller_code_;
+
+	// 引数と戻り値を符号化したデータのバイト数と、そのうち引数のバイト数
+	std::uint16_t data_size_;
+	std::uint16_t arg_size_;
+
+	std::uint16_t arg_count_;
+
+	bool has_args_;
+	bool has_result_;
+	bool finished_;
+
+	// 入りきらない値を省略したか
+	bool truncated_;
+
+	auto call_frame_id() const -> std::size_t {
+		return call_frame_id_;
+	}
+
+	auto cmdid() const -> std::size_t {
+		return cmdid_;
+	}
+
+	auto depth() const -> std::size_t {
+		return depth_;
+	}
+
+	auto caller_code() const -> hsx::HspCodeUnit const* {
+		return caller_code_;
+	}
+
+	auto has_args() const -> bool {
+		return has_args_;
+	}
+
+	auto has_result() const -> bool {
+		return has_result_;
+	}
+
+	auto is_truncated() const -> bool {
+		return truncated_;
+	}
+};
+
+// 終了したユーザー定義命令・関数の呼び出しを、引数と戻り値とともに記録するもの。
+//
+// 記録は一定の数のスロットからなるリングバッファーに置き、古いものから上書きする。
+// 値はスロットごとに決まった大きさの領域に符号化して書き込むので、記録のたびにメモリー確保をしない。
+// (文字列は STR_LIMIT バイトまで、1回の呼び出しは SLOT_SIZE バイトまでに切り詰める。)
+//
+// WrapCall のフックから、呼び出しの終了の直前に begin_args, add_arg で引数を受け取り、
+// 終了の直後に finish で戻り値を受け取る。
+//
+// 制限: 引数は呼び出しの開始時ではなく、return 命令の直前に引数スタックから読む。
+// ランタイムは引数スタックを作った後、フックを挟まずにそのまま本体を実行するので、引数が揃った時点で読む機会がない。
+// そのため、呼び出された側が引数を書き換えていれば、書き換えた後の値が記録される。
+class CallHistory {
+public:
+	// 1回の呼び出しの値を書き込む領域のバイト数
+	static constexpr auto SLOT_SIZE = std::size_t{ 256 };
+
+	// 戻り値のために空けておくバイト数
+	static constexpr auto RESULT_RESERVE = 2 + CallHistoryValue::STR_LIMIT;
+
+	// finish が記録を探すときに遡る記録の数
+	static constexpr auto SEARCH_LIMIT = std::size_t{ 16 };
+
+	// 呼び出し側の実行位置を表す文字列を作る関数
+	using DescribeCaller = std::function<Utf8String(hsx::HspCodeUnit const* caller_code)>;
+
+private:
+	std::vector<CallHistoryEntry> entries_;
+	std::vector<std::uint8_t> arena_;
+
+	// 次に書き込むスロット
+	std::size_t next_;
+
+	// 記録されている呼び出しの数
+	std::size_t count_;
+
+	// 引数を記録しているスロット
+	std::optional<std::size_t> current_;
+
+	std::uint64_t total_count_;
+
+public:
+	// memory_budget: 記録に使うメモリーのバイト数
+	explicit CallHistory(std::size_t memory_budget);
+
+	auto capacity() const -> std::size_t {
+		return entries_.size();
+	}
+
+	auto size() const -> std::size_t {
+		return count_;
+	}
+
+	// これまでに記録した呼び出しの数 (上書きされたものを含む)
+	auto total_count() const -> std::uint64_t {
+		return total_count_;
+	}
+
+	void clear();
+
+	// 呼び出しの引数の記録を始める。
+	void begin_args(std::size_t call_frame_id, std::size_t cmdid, std::size_t depth, hsx::HspCodeUnit const* caller_code);
+
+	void add_arg(CallHistoryValue const& value);
+
+	// 呼び出しの終了を記録する。(result: 関数の戻り値)
+	// 引数を記録していなければ、引数のない記録を作る。
+	void finish(std::size_t call_frame_id, std::size_t cmdid, std::size_t depth, hsx::HspCodeUnit const* caller_code, std::optional<CallHistoryValue> const& result);
+
+	// index 番目に新しい記録
+	auto entry_at(std::size_t index) const->CallHistoryEntry const&;
+
+	// 記録の引数。(文字列は履歴の中を参照するので、次の記録の前に使うこと。)
+	auto entry_to_args(std::size_t index) const->std::vector<CallHistoryValue>;
+
+	auto entry_to_result(std::size_t index) const->std::optional<CallHistoryValue>;
+
+	// 終了した呼び出しを新しい順に最大 limit 個、`f(1, "a") = 2  (呼び出し側)` の行の並びにする。
+	// (names: cmdid ごとの命令の名前)
+	auto to_text(std::size_t limit, std::vector<Utf8String> const& names, DescribeCaller const& describe_caller) const->Utf8String;
+
+private:
+	auto slot_of(std::size_t index) const->std::size_t;
+
+	auto allocate(std::size_t call_frame_id, std::size_t cmdid, std::size_t depth, hsx::HspCodeUnit const* caller_code) -> std::size_t;
+
+	// 値をスロットに書き込む。limit バイトを超えるなら書き込まずに false を返す。
+	auto write_value(std::size_t slot, CallHistoryValue const& value, std::size_t limit) -> bool;
+
+	auto read_values(std::size_t slot, std::size_t begin, std::size_t end) const->std::vector<CallHistoryValue>;
+};
+
+extern void call_history_tests(Tests& tests);
@@ -0,0 +1,333 @@
+#include "pch.h"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <numeric>
+#include "call_profiler.h"
+#include "string_format.h"
+#include "test_suite.h"
+
+// 根の節の番号
+static constexpr auto ROOT_NODE = std::size_t{ 0 };
+
+// 節がないことを表す番号
+static constexpr auto NO_NODE = std::size_t{ 0 };
+
+// 節があふれて記録できない経路の呼び出しをまとめる節の番号。
+// (根の直下にあるものとして出力するが、根の子の並びには入れない。)
+static constexpr auto TRUNCATED_NODE = std::size_t{ 1 };
+
+// TRUNCATED_NODE の命令の番号 (どの cmdid とも異なる)
+static constexpr auto TRUNCATED_CMDID = std::numeric_limits<std::size_t>::max();
+
+static auto name_of(std::vector<Utf8String> const& names, std::size_t cmdid) -> Utf8String {
+	if (cmdid == TRUNCATED_CMDID) {
+		return to_owned(as_utf8(u8"[truncated]"));
+	}
+	if (cmdid < names.size() && !names[cmdid].empty()) {
+		return names[cmdid];
+	}
+	return to_owned(as_utf8(strf("#%d", cmdid)));
+}
+
+CallProfiler::CallProfiler(std::size_t struct_count, Clock clock)
+	: clock_(clock)
+	, call_counts_(struct_count)
+	, inclusive_times_(struct_count)
+	, exclusive_times_(struct_count)
+	, active_counts_(struct_count)
+	, nodes_()
+	, frames_()
+	, skipped_depth_()
+	, truncated_()
+{
+	nodes_.reserve(NODE_CAPACITY);
+	nodes_.push_back(Node{ 0, ROOT_NODE, NO_NODE, NO_NODE, 0, 0 });
+	nodes_.push_back(Node{ TRUNCATED_CMDID, ROOT_NODE, NO_NODE, NO_NODE, 0, 0 });
+
+	frames_.reserve(DEPTH_CAPACITY);
+}
+
+auto CallProfiler::steady_clock_now() -> std::uint64_t {
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+void CallProfiler::will_call(std::size_t cmdid) {
+	// 記録を省略している呼び出しの中の呼び出しは、すべて省略する。
+	if (skipped_depth_ != 0 || cmdid >= struct_count() || frames_.size() >= DEPTH_CAPACITY) {
+		skipped_depth_++;
+		truncated_ = true;
+		return;
+	}
+
+	auto parent = frames_.empty() ? ROOT_NODE : frames_.back().node_;
+	auto node = child_node(parent, cmdid);
+
+	active_counts_[cmdid]++;
+	frames_.push_back(Frame{ cmdid, node, clock_(), 0 });
+}
+
+void CallProfiler::did_call() {
+	auto now = clock_();
+
+	if (skipped_depth_ != 0) {
+		skipped_depth_--;
+		return;
+	}
+
+	// 計測を始める前に始まった呼び出しの終了は無視する。
+	if (frames_.empty()) {
+		return;
+	}
+
+	auto frame = frames_.back();
+	frames_.pop_back();
+
+	auto elapsed = now >= frame.start_time_ ? now - frame.start_time_ : 0;
+	auto exclusive = elapsed >= frame.child_time_ ? elapsed - frame.child_time_ : 0;
+
+	call_counts_[frame.cmdid_]++;
+	exclusive_times_[frame.cmdid_] += exclusive;
+
+	// 再帰呼び出しの内側の時間は外側の呼び出しの包含時間に含まれるので、一番外側の呼び出しが終わったときだけ数える。
+	if (--active_counts_[frame.cmdid_] == 0) {
+		inclusive_times_[frame.cmdid_] += elapsed;
+	}
+
+	auto&& node = nodes_[frame.node_];
+	node.call_count_++;
+	node.exclusive_time_ += exclusive;
+
+	if (!frames_.empty()) {
+		frames_.back().child_time_ += elapsed;
+	}
+}
+
+auto CallProfiler::child_node(std::size_t parent, std::size_t cmdid) -> std::size_t {
+	if (parent == TRUNCATED_NODE) {
+		return TRUNCATED_NODE;
+	}
+
+	for (auto child = nodes_[parent].first_child_; child != NO_NODE; child = nodes_[child].next_sibling_) {
+		if (nodes_[child].cmdid_ == cmdid) {
+			return child;
+		}
+	}
+
+	// 親の節に数えると、呼び出し先の時間が呼び出し元の経路の排他時間に混ざるので、別の節にまとめる。
+	if (nodes_.size() >= NODE_CAPACITY) {
+		truncated_ = true;
+		return TRUNCATED_NODE;
+	}
+
+	auto child = nodes_.size();
+	nodes_.push_back(Node{ cmdid, parent, NO_NODE, nodes_[parent].first_child_, 0, 0 });
+	nodes_[parent].first_child_ = child;
+	return child;
+}
+
+auto CallProfiler::to_report(std::vector<Utf8String> const& names) const -> Utf8String {
+	auto cmdids = std::vector<std::size_t>{};
+	for (auto cmdid = std::size_t{}; cmdid < struct_count(); cmdid++) {
+		if (call_counts_[cmdid] != 0) {
+			cmdids.push_back(cmdid);
+		}
+	}
+
+	std::stable_sort(
+		cmdids.begin(), cmdids.end(),
+		[&](std::size_t l, std::size_t r) {
+			return exclusive_times_[l] > exclusive_times_[r];
+		});
+
+	auto text = to_owned(as_utf8(strf("%12s %14s %14s  %s\r\n", "calls", "inclusive(ms)", "exclusive(ms)", "name")));
+	for (auto cmdid : cmdids) {
+		text += as_utf8(strf(
+			"%12d %14.3f %14.3f  ",
+			call_counts_[cmdid],
+			inclusive_times_[cmdid] / 1e6,
+			exclusive_times_[cmdid] / 1e6));
+		text += name_of(names, cmdid);
+		text += as_utf8(u8"\r\n");
+	}
+
+	if (truncated_) {
+		text += as_utf8(u8"(呼び出しが深すぎるか経路が多すぎるため、一部の呼び出しは省略されています。)\r\n");
+	}
+	return text;
+}
+
+auto CallProfiler::to_collapsed_stacks(std::vector<Utf8String> const& names) const -> Utf8String {
+	auto text = Utf8String{};
+	auto path = std::vector<std::size_t>{};
+
+	for (auto i = ROOT_NODE + 1; i < nodes_.size(); i++) {
+		auto&& node = nodes_[i];
+		if (node.call_count_ == 0) {
+			continue;
+		}
+
+		path.clear();
+		for (auto n = i; n != ROOT_NODE; n = nodes_[n].parent_) {
+			path.push_back(nodes_[n].cmdid_);
+		}
+
+		for (auto iter = path.rbegin(); iter != path.rend(); ++iter) {
+			if (iter != path.rbegin()) {
+				text += as_utf8(u8";");
+			}
+			text += name_of(names, *iter);
+		}
+		text += as_utf8(strf(" %d\n", node.exclusive_time_));
+	}
+	return text;
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+// テスト用の時計。呼び出しのたびに決まった時間だけ進める。
+static auto s_fake_time = std::uint64_t{};
+
+static auto fake_clock() -> std::uint64_t {
+	return s_fake_time;
+}
+
+void call_profiler_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"call_profiler");
+
+	suite.test(
+		u8"包含時間と排他時間を集計する",
+		[](TestCaseContext& t) {
+			// f (0) が g (1) を2回呼ぶ。
+			auto profiler = CallProfiler{ 2, fake_clock };
+			s_fake_time = 0;
+
+			profiler.will_call(0);
+			s_fake_time += 10;
+			profiler.will_call(1);
+			s_fake_time += 100;
+			profiler.did_call();
+			s_fake_time += 20;
+			profiler.will_call(1);
+			s_fake_time += 200;
+			profiler.did_call();
+			s_fake_time += 30;
+			profiler.did_call();
+
+			return t.eq(profiler.call_count(0), std::uint64_t{ 1 })
+				&& t.eq(profiler.call_count(1), std::uint64_t{ 2 })
+				&& t.eq(profiler.inclusive_time(0), std::uint64_t{ 360 })
+				&& t.eq(profiler.exclusive_time(0), std::uint64_t{ 60 })
+				&& t.eq(profiler.inclusive_time(1), std::uint64_t{ 300 })
+				&& t.eq(profiler.exclusive_time(1), std::uint64_t{ 300 })
+				&& t.eq(profiler.is_truncated(), false);
+		});
+
+	suite.test(
+		u8"再帰呼び出しの包含時間を重複して数えない",
+		[](TestCaseContext& t) {
+			auto profiler = CallProfiler{ 1, fake_clock };
+			s_fake_time = 0;
+
+			profiler.will_call(0);
+			s_fake_time += 10;
+			profiler.will_call(0);
+			s_fake_time += 10;
+			profiler.did_call();
+			s_fake_time += 10;
+			profiler.did_call();
+
+			return t.eq(profiler.call_count(0), std::uint64_t{ 2 })
+				&& t.eq(profiler.inclusive_time(0), std::uint64_t{ 30 })
+				&& t.eq(profiler.exclusive_time(0), std::uint64_t{ 30 });
+		});
+
+	suite.test(
+		u8"経路ごとの排他時間を collapsed stack 形式で出力する",
+		[](TestCaseContext& t) {
+			auto profiler = CallProfiler{ 3, fake_clock };
+			s_fake_time = 0;
+
+			// main → f → g, main → g
+			profiler.will_call(0);
+			s_fake_time += 1;
+			profiler.will_call(1);
+			s_fake_time += 2;
+			profiler.will_call(2);
+			s_fake_time += 4;
+			profiler.did_call();
+			profiler.did_call();
+			profiler.will_call(2);
+			s_fake_time += 8;
+			profiler.did_call();
+			profiler.did_call();
+
+			auto names = std::vector<Utf8String>{
+				to_owned(as_utf8(u8"main")),
+				to_owned(as_utf8(u8"f")),
+			};
+			auto collapsed = as_native(profiler.to_collapsed_stacks(names));
+
+			return t.eq(collapsed, u8"main 1\nmain;f 2\nmain;f;#2 4\nmain;#2 8\n");
+		});
+
+	suite.test(
+		u8"計測を始める前の呼び出しや深すぎる呼び出しは記録しない",
+		[](TestCaseContext& t) {
+			auto profiler = CallProfiler{ 1, fake_clock };
+			s_fake_time = 0;
+
+			// 計測を始める前に始まった呼び出しの終了
+			profiler.did_call();
+
+			for (auto i = std::size_t{}; i < CallProfiler::DEPTH_CAPACITY + 10; i++) {
+				profiler.will_call(0);
+			}
+			for (auto i = std::size_t{}; i < CallProfiler::DEPTH_CAPACITY + 10; i++) {
+				profiler.did_call();
+			}
+
+			// 範囲外の cmdid
+			profiler.will_call(5);
+			profiler.did_call();
+
+			auto report = as_native(profiler.to_report({}));
+
+			return t.eq(profiler.call_count(0), std::uint64_t{ CallProfiler::DEPTH_CAPACITY })
+				&& t.eq(profiler.is_truncated(), true)
+				&& t.eq(report.find(u8"#0") != std::string::npos, true);
+		});
+
+	suite.test(
+		u8"節があふれた経路は [truncated] にまとめる",
+		[](TestCaseContext& t) {
+			// 根と [truncated] の節の他に、節を埋めるだけの命令を呼ぶ。
+			static constexpr auto FILL_COUNT = CallProfiler::NODE_CAPACITY - 2;
+
+			auto profiler = CallProfiler{ FILL_COUNT + 10, fake_clock };
+			s_fake_time = 0;
+
+			for (auto cmdid = std::size_t{}; cmdid < FILL_COUNT; cmdid++) {
+				profiler.will_call(cmdid);
+				profiler.did_call();
+			}
+
+			// 既存の経路 #0 から、新しい経路 #0;#(FILL_COUNT) を呼ぶ。
+			profiler.will_call(0);
+			s_fake_time += 1;
+			profiler.will_call(FILL_COUNT);
+			s_fake_time += 100;
+			profiler.did_call();
+			profiler.did_call();
+
+			// 呼び出し先の時間は呼び出し元の経路に混ざらない。
+			auto collapsed = as_native(profiler.to_collapsed_stacks({}));
+			return t.eq(profiler.is_truncated(), true)
+				&& t.eq(profiler.exclusive_time(0), std::uint64_t{ 1 })
+				&& t.eq(profiler.exclusive_time(FILL_COUNT), std::uint64_t{ 100 })
+				&& t.eq(collapsed.find(u8"[truncated] 100\n#0 1\n"), std::size_t{ 0 });
+		});
+}
@@ -0,0 +1,119 @@
+//! 呼び出しプロファイラー
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "encoding.h"
+
+class Tests;
+
+// ユーザー定義命令・関数の呼び出しを計測するもの。
+//
+// WrapCall のフックから呼び出しの開始と終了を受け取り、命令 (cmdid) ごとの呼び出し回数、
+// 包含時間 (呼び出し先を含む時間)、排他時間 (呼び出し先を除く時間) を集計する。
+// また、呼び出しの経路ごとの排他時間を呼び出し木に集計して、collapsed stack 形式で出力できる。
+//
+// 呼び出しのたびに実行されるので、集計にはメモリー確保をしない。
+// (呼び出し木と実行中の呼び出しのスタックは最初に確保して、あふれた分は記録を省略する。
+// 呼び出し木の節があふれたら、新しい経路の呼び出しは [truncated] という1つの節にまとめる。)
+class CallProfiler {
+public:
+	// 現在時刻 (ナノ秒) を返す関数
+	using Clock = std::uint64_t(*)();
+
+	// 呼び出し木の節の最大数
+	static constexpr auto NODE_CAPACITY = std::size_t{ 4096 };
+
+	// 記録する呼び出しの深さの最大
+	static constexpr auto DEPTH_CAPACITY = std::size_t{ 1024 };
+
+private:
+	// 呼び出し木の節: ある経路で呼ばれた命令
+	class Node {
+	public:
+		std::size_t cmdid_;
+		std::size_t parent_;
+		std::size_t first_child_;
+		std::size_t next_sibling_;
+		std::uint64_t call_count_;
+		std::uint64_t exclusive_time_;
+	};
+
+	// 実行中の呼び出し
+	class Frame {
+	public:
+		std::size_t cmdid_;
+		std::size_t node_;
+		std::uint64_t start_time_;
+
+		// 呼び出し先で経過した時間の合計
+		std::uint64_t child_time_;
+	};
+
+	Clock clock_;
+
+	// cmdid ごとの集計
+	std::vector<std::uint64_t> call_counts_;
+	std::vector<std::uint64_t> inclusive_times_;
+	std::vector<std::uint64_t> exclusive_times_;
+
+	// cmdid ごとの実行中の呼び出しの数 (再帰呼び出しで包含時間を重複して数えないために使う)
+	std::vector<std::uint32_t> active_counts_;
+
+	// 呼び出し木 (0 番は根)
+	std::vector<Node> nodes_;
+
+	std::vector<Frame> frames_;
+
+	// 記録を省略している呼び出しの深さ
+	std::size_t skipped_depth_;
+
+	// 記録を省略した呼び出しがあるか
+	bool truncated_;
+
+public:
+	// struct_count: 命令の個数 (cmdid の上限)
+	CallProfiler(std::size_t struct_count, Clock clock);
+
+	static auto steady_clock_now() -> std::uint64_t;
+
+	auto struct_count() const -> std::size_t {
+		return call_counts_.size();
+	}
+
+	auto call_count(std::size_t cmdid) const -> std::uint64_t {
+		return call_counts_[cmdid];
+	}
+
+	auto inclusive_time(std::size_t cmdid) const -> std::uint64_t {
+		return inclusive_times_[cmdid];
+	}
+
+	auto exclusive_time(std::size_t cmdid) const -> std::uint64_t {
+		return exclusive_times_[cmdid];
+	}
+
+	auto is_truncated() const -> bool {
+		return truncated_;
+	}
+
+	// 呼び出しの直前に呼ばれる。
+	void will_call(std::size_t cmdid);
+
+	// 呼び出しの直後に呼ばれる。
+	void did_call();
+
+	// 命令ごとの集計を排他時間の降順に並べた表にする。(names: cmdid ごとの命令の名前)
+	auto to_report(std::vector<Utf8String> const& names) const->Utf8String;
+
+	// 呼び出しの経路ごとの排他時間 (ナノ秒) を collapsed stack 形式 (`f;g;h 123` の行の並び) にする。
+	// flamegraph.pl などのフレームグラフの生成ツールが読める。
+	auto to_collapsed_stacks(std::vector<Utf8String> const& names) const->Utf8String;
+
+private:
+	// 節の子のうち、命令が cmdid のものを探す。なければ作る。(作れなければ [truncated] の節を返す。)
+	auto child_node(std::size_t parent, std::size_t cmdid) -> std::size_t;
+};
+
+extern void call_profiler_tests(Tests& tests);
@@ -0,0 +1,299 @@
+#include "pch.h"
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "content_hash.h"
+#include "hsx_test_context.h"
+#include "test_suite.h"
+
+static constexpr auto PRIME1 = std::uint64_t{ 0x9E3779B185EBCA87 };
+static constexpr auto PRIME2 = std::uint64_t{ 0xC2B2AE3D27D4EB4F };
+static constexpr auto PRIME3 = std::uint64_t{ 0x165667B19E3779F9 };
+static constexpr auto PRIME4 = std::uint64_t{ 0x85EBCA77C2B2AE63 };
+static constexpr auto PRIME5 = std::uint64_t{ 0x27D4EB2F165667C5 };
+
+static auto rotate_left(std::uint64_t x, int r) -> std::uint64_t {
+	return (x << r) | (x >> (64 - r));
+}
+
+// リトルエンディアンで読む。(アラインされていなくてもよい。)
+static auto read_u64(unsigned char const* p) -> std::uint64_t {
+	auto value = std::uint64_t{};
+	std::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static auto read_u32(unsigned char const* p) -> std::uint32_t {
+	auto value = std::uint32_t{};
+	std::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static auto round(std::uint64_t acc, std::uint64_t input) -> std::uint64_t {
+	acc += input * PRIME2;
+	acc = rotate_left(acc, 31);
+	return acc * PRIME1;
+}
+
+static auto merge_round(std::uint64_t acc, std::uint64_t lane) -> std::uint64_t {
+	acc ^= round(0, lane);
+	return acc * PRIME1 + PRIME4;
+}
+
+ContentHasher::ContentHasher(std::uint64_t seed)
+	: seed_(seed)
+	, lanes_{ seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1 }
+	, buffer_()
+	, buffer_size_()
+	, total_size_()
+{
+}
+
+void ContentHasher::update(void const* data, std::size_t size) {
+	auto p = (unsigned char const*)data;
+	total_size_ += size;
+
+	// 前回の端数を埋める。
+	if (buffer_size_ != 0) {
+		auto n = std::min(size, STRIPE_SIZE - buffer_size_);
+		std::memcpy(buffer_ + buffer_size_, p, n);
+		buffer_size_ += n;
+		p += n;
+		size -= n;
+
+		if (buffer_size_ < STRIPE_SIZE) {
+			return;
+		}
+
+		consume_stripes(buffer_, 1);
+		buffer_size_ = 0;
+	}
+
+	auto stripe_count = size / STRIPE_SIZE;
+	consume_stripes(p, stripe_count);
+	p += stripe_count * STRIPE_SIZE;
+	size -= stripe_count * STRIPE_SIZE;
+
+	std::memcpy(buffer_, p, size);
+	buffer_size_ = size;
+}
+
+void ContentHasher::consume_stripes(unsigned char const* data, std::size_t stripe_count) {
+	// レーンをローカル変数に置いて、ループの中でメモリーに書き戻さないようにする。
+	auto v0 = lanes_[0];
+	auto v1 = lanes_[1];
+	auto v2 = lanes_[2];
+	auto v3 = lanes_[3];
+
+	for (auto i = std::size_t{}; i < stripe_count; i++) {
+		auto p = data + i * STRIPE_SIZE;
+		v0 = round(v0, read_u64(p));
+		v1 = round(v1, read_u64(p + 8));
+		v2 = round(v2, read_u64(p + 16));
+		v3 = round(v3, read_u64(p + 24));
+	}
+
+	lanes_[0] = v0;
+	lanes_[1] = v1;
+	lanes_[2] = v2;
+	lanes_[3] = v3;
+}
+
+auto ContentHasher::finish() const -> std::uint64_t {
+	auto h = std::uint64_t{};
+
+	if (total_size_ >= STRIPE_SIZE) {
+		h = rotate_left(lanes_[0], 1) + rotate_left(lanes_[1], 7) + rotate_left(lanes_[2], 12) + rotate_left(lanes_[3], 18);
+		for (auto&& lane : lanes_) {
+			h = merge_round(h, lane);
+		}
+	} else {
+		h = seed_ + PRIME5;
+	}
+
+	h += total_size_;
+
+	// 端数を処理する。
+	auto p = buffer_;
+	auto rest = buffer_size_;
+
+	while (rest >= 8) {
+		h ^= round(0, read_u64(p));
+		h = rotate_left(h, 27) * PRIME1 + PRIME4;
+		p += 8;
+		rest -= 8;
+	}
+
+	if (rest >= 4) {
+		h ^= (std::uint64_t)read_u32(p) * PRIME1;
+		h = rotate_left(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+		rest -= 4;
+	}
+
+	while (rest != 0) {
+		h ^= (std::uint64_t)*p * PRIME5;
+		h = rotate_left(h, 11) * PRIME1;
+		p++;
+		rest--;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+auto content_hash(MemoryView memory) -> std::uint64_t {
+	auto hasher = ContentHasher{ 0 };
+	hasher.update(memory.data(), memory.size());
+	return hasher.finish();
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+static auto hash_of(char const* text) -> std::uint64_t {
+	return content_hash(MemoryView{ text, std::strlen(text) });
+}
+
+void content_hash_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"content_hash");
+
+	suite.test(
+		u8"xxHash64 と同じ値になる",
+		[](TestCaseContext& t) {
+			return t.eq(hash_of(""), std::uint64_t{ 0xEF46DB3751D8E999 })
+				&& t.eq(hash_of("a"), std::uint64_t{ 0xD24EC4F1A98C6E5B })
+				&& t.eq(hash_of("abc"), std::uint64_t{ 0x44BC2CF5AD770999 });
+		});
+
+	suite.test(
+		u8"32 バイト以上の入力でも xxHash64 と同じ値になる",
+		[](TestCaseContext& t) {
+			// xxHash の自己テストと同じ入力列 (sanityBuffer)
+			auto data = std::vector<unsigned char>(222);
+			auto byte_gen = std::uint64_t{ 2654435761 };
+			for (auto&& b : data) {
+				b = (unsigned char)(byte_gen >> 56);
+				byte_gen *= 11400714785074694797ull;
+			}
+
+			auto hash_with = [&](std::size_t size, std::uint64_t seed) {
+				auto hasher = ContentHasher{ seed };
+				hasher.update(data.data(), size);
+				return hasher.finish();
+			};
+
+			// 222 バイトの値は xxHash の自己テストに載っているもの。
+			// 32, 100 バイトの値は、それと一致する参照実装で求めたもの。(100 は 32 の倍数でない。)
+			return t.eq(hash_with(222, 0), std::uint64_t{ 0xB641AE8CB691C174 })
+				&& t.eq(hash_with(222, 2654435761), std::uint64_t{ 0x20CB8AB7AE10C14A })
+				&& t.eq(hash_with(32, 0), std::uint64_t{ 0x18B216492BB44B70 })
+				&& t.eq(hash_with(100, 0), std::uint64_t{ 0x4BFE019CD91D9EA4 })
+				&& t.eq(content_hash(MemoryView{ data.data(), 100 }), std::uint64_t{ 0x4BFE019CD91D9EA4 });
+		});
+
+	suite.test(
+		u8"分けて流しても同じ値になる",
+		[](TestCaseContext& t) {
+			auto data = std::vector<unsigned char>(1000);
+			for (auto i = std::size_t{}; i < data.size(); i++) {
+				data[i] = (unsigned char)(i * 31 + 7);
+			}
+
+			auto expected = content_hash(MemoryView{ data.data(), data.size() });
+
+			for (auto piece_size : { 1, 3, 31, 32, 33, 100 }) {
+				auto hasher = ContentHasher{ 0 };
+				for (auto i = std::size_t{}; i < data.size(); i += piece_size) {
+					hasher.update(data.data() + i, std::min((std::size_t)piece_size, data.size() - i));
+				}
+
+				if (!t.eq(hasher.finish(), expected)) {
+					return false;
+				}
+			}
+			return true;
+		});
+
+	suite.test(
+		u8"指紋は1バイトの変化を検出する",
+		[](TestCaseContext& t) {
+			auto data = std::vector<unsigned char>(4096, 'a');
+			auto memory = MemoryView{ data.data(), data.size() };
+
+			auto first = ContentFingerprint::from_memory_view(memory);
+			auto same = ContentFingerprint::from_memory_view(memory);
+
+			data[4000] = 'b';
+			auto changed = ContentFingerprint::from_memory_view(memory);
+
+			// 同じ内容でも、場所が違えば区別する。
+			auto copy = data;
+			auto moved = ContentFingerprint::from_memory_view(MemoryView{ copy.data(), copy.size() });
+
+			return t.eq(first == same, true)
+				&& t.eq(first == changed, false)
+				&& t.eq(changed.hash() == moved.hash(), true)
+				&& t.eq(changed == moved, false);
+		});
+
+	suite.test(
+		u8"var 引数の指紋は渡された要素の変化を検出する",
+		[](TestCaseContext& t) {
+			// #deffunc f var s を f names(3) として呼んだときの引数
+			auto context = HsxTestContext{ 1 };
+			context.sdim(0, 64, 5);
+			context.set_str(0, 0, "alice");
+			context.set_str(0, 3, "bob");
+
+			auto pval = (PVal*)*hsx::static_var_to_pval(0, context.context());
+			auto param = STRUCTPRM{ MPTYPE_SINGLEVAR, 0, 0 };
+			auto mp_var = MPVarData{ pval, 3 };
+			auto param_data = hsx::HspParamData{ &param, 0, &mp_var, true };
+
+			auto fingerprint = [&] {
+				return ContentFingerprint::from_memory_view(*hsx::param_data_to_memory_block(param_data, context.context()));
+			};
+
+			auto first = fingerprint();
+			auto same = fingerprint();
+
+			// 先頭の要素は変わらず、渡された要素だけが変わる。
+			context.set_str(0, 3, "carol");
+			auto changed = fingerprint();
+
+			return t.eq(first == same, true)
+				&& t.eq(first == changed, false);
+		});
+
+	suite.test(
+		u8"ベンチマーク: 8MB のバッファー",
+		[](TestCaseContext& t) {
+			static constexpr auto SIZE = std::size_t{ 8 * 1024 * 1024 };
+			static constexpr auto REPEAT_COUNT = 4;
+
+			auto data = std::vector<unsigned char>(SIZE);
+			for (auto i = std::size_t{}; i < data.size(); i++) {
+				data[i] = (unsigned char)(i ^ (i >> 8));
+			}
+
+			auto hash = std::uint64_t{};
+			auto start = std::chrono::steady_clock::now();
+			for (auto i = 0; i < REPEAT_COUNT; i++) {
+				hash ^= content_hash(MemoryView{ data.data(), data.size() });
+			}
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			auto sec = std::chrono::duration<double>(elapsed).count();
+
+			t.output()
+				<< u8"    " << (int)(sec > 0 ? (double)(SIZE * REPEAT_COUNT) / sec / (1024 * 1024) : 0.0) << u8" MB/s" << std::endl;
+
+			// 偶数回 xor したので 0 になる。
+			return t.eq(hash, std::uint64_t{});
+		});
+}
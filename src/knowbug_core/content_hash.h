@@ -0,0 +1,84 @@
+//! メモリーの内容のハッシュ (変化の検出用)
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "memory_view.h"
+
+class Tests;
+
+// 64ビットのストリーミングハッシュ関数。(アルゴリズムは xxHash64 と同じ。)
+//
+// 入力を32バイトずつ4つのレーンに分けて、レーンごとに独立に計算する。
+// レーンの間に依存関係がないので、コンパイラーが SIMD 命令や命令レベルの並列性で同時に計算できる。
+// 数メガバイトのバッファーでも、メモリーの帯域に近い速さで流せる。
+// 暗号学的なハッシュではない。
+class ContentHasher {
+public:
+	static constexpr auto STRIPE_SIZE = std::size_t{ 32 };
+
+private:
+	static constexpr auto LANE_COUNT = std::size_t{ 4 };
+
+	std::uint64_t seed_;
+	std::uint64_t lanes_[LANE_COUNT];
+
+	// 32バイトに満たない入力の端数
+	unsigned char buffer_[STRIPE_SIZE];
+	std::size_t buffer_size_;
+
+	std::uint64_t total_size_;
+
+public:
+	explicit ContentHasher(std::uint64_t seed);
+
+	void update(void const* data, std::size_t size);
+
+	// ここまでの入力のハッシュ値を計算する。(続けて update してもよい。)
+	auto finish() const -> std::uint64_t;
+
+private:
+	void consume_stripes(unsigned char const* data, std::size_t stripe_count);
+};
+
+// メモリーの内容のハッシュ値
+extern auto content_hash(MemoryView memory) -> std::uint64_t;
+
+// メモリーの内容の指紋。
+// 位置と大きさと内容のハッシュ値が一致すれば、内容は変わっていないとみなす。
+class ContentFingerprint {
+	void const* data_;
+	std::size_t size_;
+	std::uint64_t hash_;
+
+public:
+	ContentFingerprint(void const* data, std::size_t size, std::uint64_t hash)
+		: data_(data)
+		, size_(size)
+		, hash_(hash)
+	{
+	}
+
+	static auto from_memory_view(MemoryView memory) -> ContentFingerprint {
+		return ContentFingerprint{ memory.data(), memory.size(), content_hash(memory) };
+	}
+
+	auto hash() const -> std::uint64_t {
+		return hash_;
+	}
+
+	auto equals(ContentFingerprint const& other) const -> bool {
+		return data_ == other.data_ && size_ == other.size_ && hash_ == other.hash_;
+	}
+
+	bool operator==(ContentFingerprint const& other) const {
+		return equals(other);
+	}
+
+	bool operator!=(ContentFingerprint const& other) const {
+		return !(*this == other);
+	}
+};
+
+extern void content_hash_tests(Tests& tests);
@@ -0,0 +1,209 @@
+#include "pch.h"
+#include <cstring>
+#include "content_hash.h"
+#include "data_watch.h"
+#include "test_suite.h"
+
+static auto chunk_count(std::size_t size) -> std::size_t {
+	return (size + WatchedMemory::CHUNK_SIZE - 1) / WatchedMemory::CHUNK_SIZE;
+}
+
+static auto chunk_at(MemoryView memory, std::size_t chunk_index) -> MemoryView {
+	auto offset = chunk_index * WatchedMemory::CHUNK_SIZE;
+	auto size = std::min(WatchedMemory::CHUNK_SIZE, memory.size() - offset);
+	return MemoryView{ (unsigned char const*)memory.data() + offset, size };
+}
+
+// -----------------------------------------------
+// WatchedMemory
+// -----------------------------------------------
+
+WatchedMemory::WatchedMemory(MemoryView memory)
+	: data_()
+	, size_()
+	, copy_()
+	, chunk_hashes_()
+{
+	record(memory);
+}
+
+auto WatchedMemory::update(MemoryView memory) -> bool {
+	if (memory.data() == data_ && memory.size() == size_ && is_same_content(memory)) {
+		return false;
+	}
+
+	record(memory);
+	return true;
+}
+
+auto WatchedMemory::is_same_content(MemoryView memory) const -> bool {
+	if (memory.size() <= COPY_SIZE_LIMIT) {
+		return memory.size() == 0 || std::memcmp(memory.data(), copy_.data(), memory.size()) == 0;
+	}
+
+	for (auto i = std::size_t{}; i < chunk_hashes_.size(); i++) {
+		if (content_hash(chunk_at(memory, i)) != chunk_hashes_[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void WatchedMemory::record(MemoryView memory) {
+	data_ = memory.data();
+	size_ = memory.size();
+
+	copy_.clear();
+	chunk_hashes_.clear();
+
+	if (memory.size() <= COPY_SIZE_LIMIT) {
+		auto p = (unsigned char const*)memory.data();
+		copy_.assign(p, p + memory.size());
+		return;
+	}
+
+	chunk_hashes_.reserve(chunk_count(memory.size()));
+	for (auto i = std::size_t{}; i < chunk_count(memory.size()); i++) {
+		chunk_hashes_.push_back(content_hash(chunk_at(memory, i)));
+	}
+}
+
+// -----------------------------------------------
+// DataWatchList
+// -----------------------------------------------
+
+auto DataWatchList::add(std::shared_ptr<HspObjectPath const> path, Utf8String name, MemoryView memory) -> std::size_t {
+	auto watch_id = ++last_id_;
+	watches_.emplace_back(watch_id, std::move(path), std::move(name), memory);
+	return watch_id;
+}
+
+auto DataWatchList::remove(std::size_t watch_id) -> bool {
+	for (auto i = std::size_t{}; i < watches_.size(); i++) {
+		if (watches_[i].watch_id() == watch_id) {
+			watches_.erase(watches_.begin() + i);
+			return true;
+		}
+	}
+	return false;
+}
+
+auto DataWatchList::find(std::size_t watch_id) const -> std::optional<DataWatch const*> {
+	for (auto&& watch : watches_) {
+		if (watch.watch_id() == watch_id) {
+			return std::make_optional(&watch);
+		}
+	}
+	return std::nullopt;
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+void data_watch_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"data_watch");
+
+	suite.test(
+		u8"小さいメモリーの1バイトの変化を検出する",
+		[](TestCaseContext& t) {
+			auto data = std::vector<int>(10);
+			auto memory = MemoryView{ data.data(), data.size() * sizeof(int) };
+
+			auto watched = WatchedMemory{ memory };
+			auto unchanged = watched.update(memory);
+
+			data[9] = 1;
+			auto changed = watched.update(memory);
+			auto again = watched.update(memory);
+
+			return t.eq(unchanged, false)
+				&& t.eq(changed, true)
+				&& t.eq(again, false);
+		});
+
+	suite.test(
+		u8"大きいメモリーの変化をチャンクのハッシュ値で検出する",
+		[](TestCaseContext& t) {
+			auto data = std::vector<unsigned char>(WatchedMemory::CHUNK_SIZE * 3 + 100, 'a');
+			auto memory = MemoryView{ data.data(), data.size() };
+
+			auto watched = WatchedMemory{ memory };
+			auto unchanged = watched.update(memory);
+
+			// 端数のチャンクの変化
+			data[data.size() - 1] = 'b';
+			auto changed_tail = watched.update(memory);
+
+			data[WatchedMemory::CHUNK_SIZE] = 'b';
+			auto changed_middle = watched.update(memory);
+
+			return t.eq(unchanged, false)
+				&& t.eq(changed_tail, true)
+				&& t.eq(changed_middle, true)
+				&& t.eq(watched.update(memory), false);
+		});
+
+	suite.test(
+		u8"位置や大きさが変わったら変化したとみなす",
+		[](TestCaseContext& t) {
+			auto data = std::vector<unsigned char>(64, 'a');
+			auto copy = data;
+
+			auto watched = WatchedMemory{ MemoryView{ data.data(), data.size() } };
+			auto moved = watched.update(MemoryView{ copy.data(), copy.size() });
+			auto resized = watched.update(MemoryView{ copy.data(), copy.size() - 1 });
+
+			return t.eq(moved, true)
+				&& t.eq(resized, true);
+		});
+
+	suite.test(
+		u8"変化した監視対象の番号を返す",
+		[](TestCaseContext& t) {
+			auto a = std::vector<int>(1);
+			auto b = std::vector<int>(1);
+			auto view_of = [](std::vector<int> const& v) {
+				return MemoryView{ v.data(), v.size() * sizeof(int) };
+			};
+
+			auto list = DataWatchList{};
+			auto a_id = list.add(nullptr, to_owned(as_utf8(u8"a")), view_of(a));
+			auto b_id = list.add(nullptr, to_owned(as_utf8(u8"b")), view_of(b));
+
+			// b はメモリーが得られない (スコープ外) とする。
+			auto b_is_alive = false;
+			auto resolve = [&](DataWatch const& watch) -> std::optional<MemoryView> {
+				if (watch.watch_id() == a_id) {
+					return view_of(a);
+				}
+				if (b_is_alive) {
+					return view_of(b);
+				}
+				return std::nullopt;
+			};
+
+			a[0] = 1;
+			b[0] = 1;
+			auto fired1 = std::vector<std::size_t>{};
+			list.check(resolve, fired1);
+
+			b_is_alive = true;
+			auto fired2 = std::vector<std::size_t>{};
+			list.check(resolve, fired2);
+
+			auto removed = list.remove(b_id);
+			b[0] = 2;
+			auto fired3 = std::vector<std::size_t>{};
+			list.check(resolve, fired3);
+
+			return t.eq(fired1.size(), std::size_t{ 1 })
+				&& t.eq(fired1[0], a_id)
+				&& t.eq(fired2.size(), std::size_t{ 1 })
+				&& t.eq(fired2[0], b_id)
+				&& t.eq(removed, true)
+				&& t.eq(fired3.empty(), true)
+				&& t.eq(list.remove(b_id), false)
+				&& t.eq(list.size(), std::size_t{ 1 });
+		});
+}
@@ -0,0 +1,134 @@
+//! データブレークポイント (値の変化の監視)
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+#include "encoding.h"
+#include "hsp_object_path_fwd.h"
+#include "memory_view.h"
+
+class Tests;
+
+// 監視しているメモリーの、前回調べたときの状態。
+//
+// 位置か大きさが変わっていたら、内容を見ずに変化したとみなす。
+// 小さいメモリーは内容の写しと比べる。
+// 大きいメモリーはチャンクごとのハッシュ値と比べ、異なるチャンクが見つかった時点で比べるのをやめる。
+class WatchedMemory {
+	void const* data_;
+	std::size_t size_;
+
+	// 内容の写し (小さいメモリーのとき)
+	std::vector<unsigned char> copy_;
+
+	// チャンクごとのハッシュ値 (大きいメモリーのとき)
+	std::vector<std::uint64_t> chunk_hashes_;
+
+public:
+	// 写しを持つメモリーの大きさの上限
+	static constexpr auto COPY_SIZE_LIMIT = std::size_t{ 4096 };
+
+	static constexpr auto CHUNK_SIZE = std::size_t{ 4096 };
+
+	explicit WatchedMemory(MemoryView memory);
+
+	// 前回から内容が変化したか調べる。変化していたら、いまの状態を覚え直す。
+	auto update(MemoryView memory) -> bool;
+
+private:
+	auto is_same_content(MemoryView memory) const -> bool;
+
+	void record(MemoryView memory);
+};
+
+// 1つのデータブレークポイント
+class DataWatch {
+	std::size_t watch_id_;
+	std::shared_ptr<HspObjectPath const> path_;
+	Utf8String name_;
+	WatchedMemory memory_;
+
+public:
+	DataWatch(std::size_t watch_id, std::shared_ptr<HspObjectPath const> path, Utf8String name, MemoryView memory)
+		: watch_id_(watch_id)
+		, path_(std::move(path))
+		, name_(std::move(name))
+		, memory_(memory)
+	{
+	}
+
+	auto watch_id() const -> std::size_t {
+		return watch_id_;
+	}
+
+	auto path() const -> std::shared_ptr<HspObjectPath const> const& {
+		return path_;
+	}
+
+	auto name() const -> Utf8StringView {
+		return name_;
+	}
+
+	auto memory() -> WatchedMemory& {
+		return memory_;
+	}
+};
+
+// データブレークポイントのリスト。
+//
+// ステップごとに調べるので、監視していないときは何もしない。
+class DataWatchList {
+	std::size_t last_id_;
+
+	std::vector<DataWatch> watches_;
+
+public:
+	DataWatchList()
+		: last_id_()
+		, watches_()
+	{
+	}
+
+	auto empty() const -> bool {
+		return watches_.empty();
+	}
+
+	auto size() const -> std::size_t {
+		return watches_.size();
+	}
+
+	// 監視を始める。番号を返す。(番号は 1 から振る。)
+	auto add(std::shared_ptr<HspObjectPath const> path, Utf8String name, MemoryView memory) -> std::size_t;
+
+	// 監視をやめる。(その番号がなければ false)
+	auto remove(std::size_t watch_id) -> bool;
+
+	void clear() {
+		watches_.clear();
+	}
+
+	auto find(std::size_t watch_id) const -> std::optional<DataWatch const*>;
+
+	// すべての監視対象を調べて、変化したものの番号を fired に追加する。
+	//
+	// resolve はパスが指すいまのメモリーを返す関数。
+	// メモリーが得られないもの (変数がスコープ外にあるなど) は調べない。
+	template<typename Resolve>
+	void check(Resolve&& resolve, std::vector<std::size_t>& fired) {
+		for (auto&& watch : watches_) {
+			auto&& memory_opt = resolve(watch);
+			if (!memory_opt) {
+				continue;
+			}
+
+			if (watch.memory().update(*memory_opt)) {
+				fired.push_back(watch.watch_id());
+			}
+		}
+	}
+};
+
+extern void data_watch_tests(Tests& tests);
@@ -0,0 +1,327 @@
+#include "pch.h"
+#include <chrono>
+#include <deque>
+#include "execution_trace.h"
+#include "test_suite.h"
+
+static auto write_varint(std::uint64_t value, std::uint8_t* out) -> std::size_t {
+	auto size = std::size_t{};
+	while (value >= 0x80) {
+		out[size++] = (std::uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[size++] = (std::uint8_t)value;
+	return size;
+}
+
+static auto read_varint(std::string_view data, std::size_t& index) -> std::optional<std::uint64_t> {
+	auto value = std::uint64_t{};
+	for (auto shift = 0; shift < 64; shift += 7) {
+		if (index >= data.size()) {
+			return std::nullopt;
+		}
+
+		auto byte = (std::uint8_t)data[index++];
+		value |= (std::uint64_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return value;
+		}
+	}
+	return std::nullopt;
+}
+
+static auto zigzag_encode(std::int64_t value) -> std::uint64_t {
+	return ((std::uint64_t)value << 1) ^ (std::uint64_t)(value >> 63);
+}
+
+static auto zigzag_decode(std::uint64_t value) -> std::int64_t {
+	return (std::int64_t)(value >> 1) ^ -(std::int64_t)(value & 1);
+}
+
+// -----------------------------------------------
+// ExecutionTraceEncoder
+// -----------------------------------------------
+
+auto ExecutionTraceEncoder::encode(std::size_t file_id, std::size_t line_index, std::uint8_t* out) -> std::size_t {
+	auto delta = (std::int64_t)line_index - (std::int64_t)last_line_index_;
+	auto file_changed = file_id != last_file_id_;
+
+	auto size = write_varint(zigzag_encode(delta) << 1 | (file_changed ? 1 : 0), out);
+	if (file_changed) {
+		size += write_varint(file_id, out + size);
+	}
+
+	last_file_id_ = file_id;
+	last_line_index_ = line_index;
+	return size;
+}
+
+// -----------------------------------------------
+// ExecutionTraceReader
+// -----------------------------------------------
+
+ExecutionTraceReader::ExecutionTraceReader(std::string_view data)
+	: data_(data)
+	, index_(EXECUTION_TRACE_MAGIC.size())
+	, last_file_id_()
+	, last_line_index_()
+	, valid_(data.substr(0, EXECUTION_TRACE_MAGIC.size()) == EXECUTION_TRACE_MAGIC)
+{
+}
+
+auto ExecutionTraceReader::next() -> std::optional<ExecutionTraceRecord> {
+	if (!valid_) {
+		return std::nullopt;
+	}
+
+	auto index = index_;
+	auto&& head_opt = read_varint(data_, index);
+	if (!head_opt) {
+		return std::nullopt;
+	}
+
+	auto file_id = last_file_id_;
+	if ((*head_opt & 1) != 0) {
+		auto&& file_id_opt = read_varint(data_, index);
+		if (!file_id_opt) {
+			return std::nullopt;
+		}
+		file_id = (std::size_t)*file_id_opt;
+	}
+
+	auto line_index = (std::size_t)((std::int64_t)last_line_index_ + zigzag_decode(*head_opt >> 1));
+
+	index_ = index;
+	last_file_id_ = file_id;
+	last_line_index_ = line_index;
+	return ExecutionTraceRecord{ file_id, line_index };
+}
+
+auto execution_trace_last_lines(std::string_view data, std::size_t count) -> std::vector<ExecutionTraceRecord> {
+	auto lines = std::deque<ExecutionTraceRecord>{};
+	if (count == 0) {
+		return std::vector<ExecutionTraceRecord>{};
+	}
+
+	auto reader = ExecutionTraceReader{ data };
+	while (auto&& record_opt = reader.next()) {
+		if (lines.size() == count) {
+			lines.pop_front();
+		}
+		lines.push_back(*record_opt);
+	}
+
+	return std::vector<ExecutionTraceRecord>{ lines.begin(), lines.end() };
+}
+
+// -----------------------------------------------
+// ExecutionTraceWriter
+// -----------------------------------------------
+
+ExecutionTraceWriter::ExecutionTraceWriter(Sink sink, std::size_t buffer_size)
+	: sink_(std::move(sink))
+	, encoder_()
+	, front_(std::max(buffer_size, EXECUTION_TRACE_MAGIC.size() + EXECUTION_TRACE_RECORD_CAPACITY))
+	, front_size_()
+	, back_(front_.size())
+	, back_size_()
+	, record_count_()
+	, mutex_()
+	, cond_()
+	, back_is_pending_()
+	, stopping_()
+	, thread_()
+{
+	std::copy(EXECUTION_TRACE_MAGIC.begin(), EXECUTION_TRACE_MAGIC.end(), front_.begin());
+	front_size_ = EXECUTION_TRACE_MAGIC.size();
+}
+
+ExecutionTraceWriter::~ExecutionTraceWriter() {
+	stop();
+}
+
+void ExecutionTraceWriter::start() {
+	if (thread_.joinable()) {
+		assert(false && u8"double start");
+		return;
+	}
+
+	thread_ = std::thread{ [this] { run(); } };
+}
+
+void ExecutionTraceWriter::stop() {
+	if (!thread_.joinable()) {
+		return;
+	}
+
+	// 書きかけのバッファーも渡してから止める。
+	swap_buffers();
+
+	{
+		auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		stopping_ = true;
+	}
+	cond_.notify_all();
+
+	thread_.join();
+}
+
+void ExecutionTraceWriter::swap_buffers() {
+	{
+		auto lock = std::unique_lock<std::mutex>{ mutex_ };
+		cond_.wait(lock, [&] { return !back_is_pending_; });
+
+		std::swap(front_, back_);
+		back_size_ = front_size_;
+		front_size_ = 0;
+		back_is_pending_ = true;
+	}
+	cond_.notify_all();
+}
+
+void ExecutionTraceWriter::run() {
+	auto lock = std::unique_lock<std::mutex>{ mutex_ };
+	while (true) {
+		cond_.wait(lock, [&] { return back_is_pending_ || stopping_; });
+		if (!back_is_pending_) {
+			break;
+		}
+
+		// 出力している間は、HSP のスレッドが front_ に書き込めるようにロックを外す。
+		lock.unlock();
+		sink_(back_.data(), back_size_);
+		lock.lock();
+
+		back_is_pending_ = false;
+		cond_.notify_all();
+	}
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+void execution_trace_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"execution_trace");
+
+	suite.test(
+		u8"記録を符号化して読み戻せる",
+		[](TestCaseContext& t) {
+			auto records = std::vector<ExecutionTraceRecord>{
+				{ 0, 3 },
+				{ 0, 4 },
+				{ 0, 4 },
+				{ 2, 100000 },
+				{ 2, 1 },
+				{ 0, 5 },
+			};
+
+			auto data = std::string{ EXECUTION_TRACE_MAGIC };
+			auto encoder = ExecutionTraceEncoder{};
+			auto buffer = std::array<std::uint8_t, EXECUTION_TRACE_RECORD_CAPACITY>{};
+			auto sizes = std::vector<std::size_t>{};
+			for (auto&& record : records) {
+				auto size = encoder.encode(record.file_id(), record.line_index(), buffer.data());
+				data.append((char const*)buffer.data(), size);
+				sizes.push_back(size);
+			}
+
+			auto decoded = std::vector<ExecutionTraceRecord>{};
+			auto reader = ExecutionTraceReader{ data };
+			while (auto&& record_opt = reader.next()) {
+				decoded.push_back(*record_opt);
+			}
+
+			// 同じファイルの近くの行への移動は1バイトになる。
+			return t.eq(decoded == records, true)
+				&& t.eq(sizes[1], std::size_t{ 1 })
+				&& t.eq(sizes[2], std::size_t{ 1 });
+		});
+
+	suite.test(
+		u8"最後の記録を取り出す",
+		[](TestCaseContext& t) {
+			auto data = std::string{ EXECUTION_TRACE_MAGIC };
+			auto encoder = ExecutionTraceEncoder{};
+			auto buffer = std::array<std::uint8_t, EXECUTION_TRACE_RECORD_CAPACITY>{};
+			for (auto i = std::size_t{}; i < 10; i++) {
+				auto size = encoder.encode(i % 2, i, buffer.data());
+				data.append((char const*)buffer.data(), size);
+			}
+
+			auto last = execution_trace_last_lines(data, 3);
+
+			// 途中で切れた記録は読まない。
+			data.push_back((char)0x80);
+			auto truncated = execution_trace_last_lines(data, 1);
+
+			return t.eq(last.size(), std::size_t{ 3 })
+				&& t.eq(last[0] == ExecutionTraceRecord{ 1, 7 }, true)
+				&& t.eq(last[2] == ExecutionTraceRecord{ 1, 9 }, true)
+				&& t.eq(truncated.size(), std::size_t{ 1 })
+				&& t.eq(truncated[0] == ExecutionTraceRecord{ 1, 9 }, true)
+				&& t.eq(execution_trace_last_lines(data, 100).size(), std::size_t{ 10 })
+				&& t.eq(execution_trace_last_lines(u8"not a trace", 1).empty(), true);
+		});
+
+	suite.test(
+		u8"バッファーを入れ替えながら別のスレッドで書き出す",
+		[](TestCaseContext& t) {
+			static constexpr auto RECORD_COUNT = std::size_t{ 10000 };
+
+			// 出力先は書き出し用のスレッドからだけ使われる。
+			auto output = std::string{};
+			auto sink = [&](std::uint8_t const* data, std::size_t size) {
+				output.append((char const*)data, size);
+			};
+
+			auto writer = ExecutionTraceWriter{ sink, 64 };
+			writer.start();
+			for (auto i = std::size_t{}; i < RECORD_COUNT; i++) {
+				writer.append(i / 100 % 3, i * 7 % 1000);
+			}
+			writer.stop();
+
+			auto ok = true;
+			auto count = std::size_t{};
+			auto reader = ExecutionTraceReader{ output };
+			while (auto&& record_opt = reader.next()) {
+				ok = ok && *record_opt == ExecutionTraceRecord{ count / 100 % 3, count * 7 % 1000 };
+				count++;
+			}
+
+			return t.eq(reader.is_valid(), true)
+				&& t.eq(count, RECORD_COUNT)
+				&& t.eq(writer.record_count(), std::uint64_t{ RECORD_COUNT })
+				&& t.eq(ok, true);
+		});
+
+	suite.test(
+		u8"ベンチマーク: 文ごとの記録",
+		[](TestCaseContext& t) {
+			static constexpr auto RECORD_COUNT = std::size_t{ 10000000 };
+
+			auto total_size = std::size_t{};
+			auto sink = [&](std::uint8_t const* data, std::size_t size) {
+				total_size += size;
+			};
+
+			auto writer = ExecutionTraceWriter{ sink, ExecutionTraceWriter::DEFAULT_BUFFER_SIZE };
+			writer.start();
+
+			// 数行のループを繰り返し実行するスクリプトを模す。
+			auto start = std::chrono::steady_clock::now();
+			for (auto i = std::size_t{}; i < RECORD_COUNT; i++) {
+				writer.append(i / 1000 % 4, 100 + i % 7);
+			}
+			writer.stop();
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			auto s = std::chrono::duration<double>(elapsed).count();
+
+			t.output()
+				<< u8"    " << (int)(RECORD_COUNT / s / 1e6) << u8" M文/秒, "
+				<< (double)total_size / RECORD_COUNT << u8" バイト/文" << std::endl;
+
+			return t.eq(total_size > RECORD_COUNT, true);
+		});
+}
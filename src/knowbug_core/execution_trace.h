@@ -0,0 +1,164 @@
+//! 実行トレース
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class Tests;
+
+// 実行した文1つの記録
+class ExecutionTraceRecord {
+	std::size_t file_id_;
+	std::size_t line_index_;
+
+public:
+	ExecutionTraceRecord(std::size_t file_id, std::size_t line_index)
+		: file_id_(file_id)
+		, line_index_(line_index)
+	{
+	}
+
+	auto file_id() const -> std::size_t {
+		return file_id_;
+	}
+
+	auto line_index() const -> std::size_t {
+		return line_index_;
+	}
+
+	auto operator==(ExecutionTraceRecord const& other) const -> bool {
+		return file_id_ == other.file_id_ && line_index_ == other.line_index_;
+	}
+};
+
+// 実行トレースの形式:
+//
+// 先頭にマジックナンバー (EXECUTION_TRACE_MAGIC) を置き、その後に文ごとの記録を並べる。
+// 記録は、直前の記録からの行番号の差 d と、ファイルが変わったかを表すビット f を
+// (zigzag(d) << 1 | f) として可変長整数 (LEB128) にしたもの。f = 1 なら、続けてファイルIDを可変長整数で置く。
+// (最初の記録の直前は、ファイルID 0 の行 0 とみなす。)
+static constexpr auto EXECUTION_TRACE_MAGIC = std::string_view{ "KBTRACE1" };
+
+// 記録1つの最大のバイト数
+static constexpr auto EXECUTION_TRACE_RECORD_CAPACITY = std::size_t{ 20 };
+
+// 実行トレースの記録を符号化するもの。
+class ExecutionTraceEncoder {
+	std::size_t last_file_id_;
+	std::size_t last_line_index_;
+
+public:
+	ExecutionTraceEncoder()
+		: last_file_id_()
+		, last_line_index_()
+	{
+	}
+
+	// 記録を符号化して out に書き込み、書き込んだバイト数を返す。
+	// (out には EXECUTION_TRACE_RECORD_CAPACITY バイト以上の空きが必要。)
+	auto encode(std::size_t file_id, std::size_t line_index, std::uint8_t* out) -> std::size_t;
+};
+
+// 実行トレースを読むもの。
+class ExecutionTraceReader {
+	std::string_view data_;
+	std::size_t index_;
+
+	std::size_t last_file_id_;
+	std::size_t last_line_index_;
+
+	// マジックナンバーが正しいか
+	bool valid_;
+
+public:
+	explicit ExecutionTraceReader(std::string_view data);
+
+	auto is_valid() const -> bool {
+		return valid_;
+	}
+
+	// 次の記録を読む。(末尾か、途中で切れていたら nullopt)
+	auto next()->std::optional<ExecutionTraceRecord>;
+};
+
+// 実行トレースの最後の count 個の記録 (古い順)
+extern auto execution_trace_last_lines(std::string_view data, std::size_t count)->std::vector<ExecutionTraceRecord>;
+
+// 実行した文を実行トレースとして書き出すもの。
+//
+// 記録は HSP のスレッドでバッファーに符号化する。バッファーは2つあり、
+// 一方がいっぱいになったら入れ替えて、書き出し用のスレッドがもう一方を出力先に渡す。
+// (書き出しが追いつかないときだけ、HSP のスレッドは入れ替えを待つ。)
+class ExecutionTraceWriter {
+public:
+	// 符号化したデータを受け取る関数。(書き出し用のスレッドから呼ばれる。)
+	using Sink = std::function<void(std::uint8_t const* data, std::size_t size)>;
+
+	static constexpr auto DEFAULT_BUFFER_SIZE = std::size_t{ 1024 * 1024 };
+
+private:
+	Sink sink_;
+	ExecutionTraceEncoder encoder_;
+
+	// HSP のスレッドが書き込むバッファー
+	std::vector<std::uint8_t> front_;
+	std::size_t front_size_;
+
+	// 書き出し用のスレッドが出力するバッファー
+	std::vector<std::uint8_t> back_;
+	std::size_t back_size_;
+
+	std::uint64_t record_count_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+
+	// back_ に出力すべきデータがあるか
+	bool back_is_pending_;
+
+	bool stopping_;
+	std::thread thread_;
+
+public:
+	ExecutionTraceWriter(Sink sink, std::size_t buffer_size);
+
+	~ExecutionTraceWriter();
+
+	ExecutionTraceWriter(ExecutionTraceWriter const& other) = delete;
+
+	auto operator=(ExecutionTraceWriter const& other)->ExecutionTraceWriter & = delete;
+
+	void start();
+
+	// 残りの記録を出力して、書き出し用のスレッドを止める。
+	void stop();
+
+	auto record_count() const -> std::uint64_t {
+		return record_count_;
+	}
+
+	// 実行した文を記録する。
+	void append(std::size_t file_id, std::size_t line_index) {
+		if (front_.size() - front_size_ < EXECUTION_TRACE_RECORD_CAPACITY) {
+			swap_buffers();
+		}
+
+		front_size_ += encoder_.encode(file_id, line_index, front_.data() + front_size_);
+		record_count_++;
+	}
+
+private:
+	// 書き込んだバッファーを書き出し用のスレッドに渡す。
+	void swap_buffers();
+
+	void run();
+};
+
+extern void execution_trace_tests(Tests& tests);
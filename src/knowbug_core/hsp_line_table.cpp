@@ -0,0 +1,435 @@
+#include "pch.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <string>
+#include "hsp_line_table.h"
+#include "hsx_debug_segment.h"
+#include "hsx_test_context.h"
+#include "test_suite.h"
+
+// どの行のコードでもない範囲を表すファイルID
+static constexpr auto NO_FILE_ID = std::numeric_limits<std::uint32_t>::max();
+
+// -----------------------------------------------
+// HspLineTable
+// -----------------------------------------------
+
+HspLineTable::HspLineTable()
+	: code_offsets_()
+	, file_ids_()
+	, line_indexes_()
+	, code_end_()
+	, line_order_()
+	, line_slot_entries_()
+	, code_line_slots_()
+{
+}
+
+auto HspLineTable::line_order_lower_bound(std::size_t file_id, std::size_t line_index) const -> std::vector<std::uint32_t>::const_iterator {
+	return std::lower_bound(
+		line_order_.begin(), line_order_.end(), std::make_pair(file_id, line_index),
+		[&](std::uint32_t index, std::pair<std::size_t, std::size_t> const& key) {
+			return std::make_pair((std::size_t)file_ids_[index], (std::size_t)line_indexes_[index]) < key;
+		});
+}
+
+auto HspLineTable::code_to_line(std::size_t code_offset) const -> std::optional<HspLineTableEntry> {
+	auto&& index_opt = code_to_entry_index(code_offset);
+	if (!index_opt) {
+		return std::nullopt;
+	}
+
+	return entry_at(*index_opt);
+}
+
+auto HspLineTable::code_to_entry_index(std::size_t code_offset) const -> std::optional<std::size_t> {
+	if (code_offset >= code_end_) {
+		return std::nullopt;
+	}
+
+	// code_offset 以下の位置から始まる最後の行
+	auto iter = std::upper_bound(code_offsets_.begin(), code_offsets_.end(), code_offset);
+	if (iter == code_offsets_.begin()) {
+		return std::nullopt;
+	}
+
+	auto index = (std::size_t)(iter - code_offsets_.begin()) - 1;
+	if (file_ids_[index] == NO_FILE_ID) {
+		return std::nullopt;
+	}
+
+	return index;
+}
+
+auto HspLineTable::position_to_line(std::optional<std::size_t> position) const -> std::optional<HspLineTableEntry> {
+	auto&& code_offset_opt = position_to_code_offset(position);
+	if (!code_offset_opt) {
+		return std::nullopt;
+	}
+
+	return code_to_line(*code_offset_opt);
+}
+
+auto HspLineTable::position_to_entry_index(std::optional<std::size_t> position) const -> std::optional<std::size_t> {
+	auto&& code_offset_opt = position_to_code_offset(position);
+	if (!code_offset_opt) {
+		return std::nullopt;
+	}
+
+	return code_to_entry_index(*code_offset_opt);
+}
+
+auto HspLineTable::file_id_end() const -> std::size_t {
+	auto end = std::size_t{};
+	for (auto file_id : file_ids_) {
+		if (file_id != NO_FILE_ID) {
+			end = std::max(end, (std::size_t)file_id + 1);
+		}
+	}
+	return end;
+}
+
+auto HspLineTable::line_to_first_code(std::size_t file_id, std::size_t line_index) const -> std::optional<std::size_t> {
+	// 同じ行の項目のうち、コード位置が最も小さいものが先頭に来る。
+	auto iter = line_order_lower_bound(file_id, line_index);
+	if (iter == line_order_.end() || file_ids_[*iter] != file_id || line_indexes_[*iter] != line_index) {
+		return std::nullopt;
+	}
+
+	return (std::size_t)code_offsets_[*iter];
+}
+
+auto HspLineTable::find_code_line(std::size_t file_id, std::size_t line_index) const -> std::optional<std::size_t> {
+	auto iter = line_order_lower_bound(file_id, line_index);
+	if (iter == line_order_.end() || file_ids_[*iter] != file_id) {
+		return std::nullopt;
+	}
+
+	return (std::size_t)line_indexes_[*iter];
+}
+
+// -----------------------------------------------
+// HspLineTableBuilder
+// -----------------------------------------------
+
+HspLineTableBuilder::HspLineTableBuilder()
+	: table_()
+{
+}
+
+void HspLineTableBuilder::add(std::size_t code_offset, std::size_t code_size, std::size_t file_id, std::size_t line_index) {
+	if (code_size == 0) {
+		return;
+	}
+
+	if (code_offset < table_.code_end_) {
+		assert(false && u8"lines must be added in code order");
+		return;
+	}
+
+	// 前の行との間にすき間があれば、どの行のコードでもない範囲として埋める。
+	if (code_offset > table_.code_end_) {
+		table_.code_offsets_.push_back((std::uint32_t)table_.code_end_);
+		table_.file_ids_.push_back(NO_FILE_ID);
+		table_.line_indexes_.push_back(0);
+	}
+
+	table_.code_offsets_.push_back((std::uint32_t)code_offset);
+	table_.file_ids_.push_back((std::uint32_t)file_id);
+	table_.line_indexes_.push_back((std::uint32_t)line_index);
+	table_.code_end_ = code_offset + code_size;
+}
+
+auto HspLineTableBuilder::finish() -> HspLineTable {
+	auto&& t = table_;
+
+	t.line_order_.reserve(t.size());
+	for (auto i = std::size_t{}; i < t.size(); i++) {
+		if (t.file_ids_[i] != NO_FILE_ID) {
+			t.line_order_.push_back((std::uint32_t)i);
+		}
+	}
+
+	// 項目はコード位置の昇順に並んでいるので、安定ソートすれば同じ行の中ではコード位置の昇順になる。
+	std::stable_sort(
+		t.line_order_.begin(), t.line_order_.end(),
+		[&](std::uint32_t l, std::uint32_t r) {
+			return std::make_pair(t.file_ids_[l], t.line_indexes_[l]) < std::make_pair(t.file_ids_[r], t.line_indexes_[r]);
+		});
+
+	// 同じ行の項目は line_order で隣り合うので、同じ行の番号を振る。
+	auto entry_slots = std::vector<std::uint32_t>(t.size(), HspLineTable::NO_LINE_SLOT);
+	for (auto index : t.line_order_) {
+		auto same_line = false;
+		if (!t.line_slot_entries_.empty()) {
+			auto last = t.line_slot_entries_.back();
+			same_line = t.file_ids_[last] == t.file_ids_[index] && t.line_indexes_[last] == t.line_indexes_[index];
+		}
+
+		if (!same_line) {
+			t.line_slot_entries_.push_back(index);
+		}
+		entry_slots[index] = (std::uint32_t)(t.line_slot_entries_.size() - 1);
+	}
+
+	t.code_line_slots_.resize(t.code_end_, HspLineTable::NO_LINE_SLOT);
+	for (auto i = std::size_t{}; i < t.size(); i++) {
+		auto end = i + 1 < t.size() ? (std::size_t)t.code_offsets_[i + 1] : t.code_end_;
+		std::fill(t.code_line_slots_.begin() + t.code_offsets_[i], t.code_line_slots_.begin() + end, entry_slots[i]);
+	}
+
+	auto table = std::move(table_);
+	table_ = HspLineTable{};
+	return table;
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+// テスト用に、コンパイラーと同じ形式のデバッグセグメントを作るもの。
+// 参照: `CToken::PutDI` (hspcmp/codegen.cpp)
+class DebugSegmentEncoder {
+	std::vector<char> data_segment_;
+	std::vector<unsigned char> debug_segment_;
+
+	std::size_t code_size_;
+
+public:
+	DebugSegmentEncoder()
+		: data_segment_()
+		, debug_segment_()
+		, code_size_()
+	{
+	}
+
+	auto code_size() const -> std::size_t {
+		return code_size_;
+	}
+
+	// 以降のコードがソースファイルのこの行から始まることを記録する。
+	void source_file(char const* file_ref_name, int line_number) {
+		auto ds_index = data_segment_.size();
+		data_segment_.insert(data_segment_.end(), file_ref_name, file_ref_name + std::strlen(file_ref_name) + 1);
+
+		debug_segment_.push_back(0xFE);
+		put_int24((int)ds_index);
+		put_int16(line_number);
+	}
+
+	// 現在の行のコードの大きさを記録して、次の行に進む。
+	void line(std::size_t code_size) {
+		if (code_size <= 0xFA) {
+			debug_segment_.push_back((unsigned char)code_size);
+		} else {
+			debug_segment_.push_back(0xFC);
+			put_int24((int)code_size);
+		}
+
+		code_size_ += code_size;
+	}
+
+	void finish(HsxTestContext& context) {
+		// 識別子の文脈 (変数名、ラベル名、パラメータ名) を空のまま終える。
+		for (auto i = 0; i < 3; i++) {
+			debug_segment_.push_back(0xFF);
+		}
+
+		context.set_code_segment(std::vector<hsx::HspCodeUnit>(code_size_));
+		context.set_data_segment(data_segment_);
+		context.set_debug_segment(debug_segment_);
+	}
+
+private:
+	void put_int16(int value) {
+		debug_segment_.push_back((unsigned char)value);
+		debug_segment_.push_back((unsigned char)(value >> 8));
+	}
+
+	void put_int24(int value) {
+		debug_segment_.push_back((unsigned char)value);
+		debug_segment_.push_back((unsigned char)(value >> 8));
+		debug_segment_.push_back((unsigned char)(value >> 16));
+	}
+};
+
+// デバッグセグメントを読んで対応表を作る。(ファイルIDはファイル参照名の出現順に振る。)
+static auto read_line_table(HSPCTX const* ctx) -> HspLineTable {
+	auto file_ref_names = std::vector<std::string>{};
+	auto builder = HspLineTableBuilder{};
+
+	auto reader = hsx::DebugSegmentReader{ ctx };
+	while (auto&& item_opt = reader.next()) {
+		if (item_opt->kind() != hsx::DebugSegmentItemKind::Line) {
+			continue;
+		}
+
+		auto iter = std::find(file_ref_names.begin(), file_ref_names.end(), item_opt->str());
+		auto file_id = (std::size_t)(iter - file_ref_names.begin());
+		if (iter == file_ref_names.end()) {
+			file_ref_names.emplace_back(item_opt->str());
+		}
+
+		builder.add(item_opt->code_offset(), item_opt->code_size(), file_id, (std::size_t)item_opt->num() - 1);
+	}
+
+	return builder.finish();
+}
+
+void hsp_line_table_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"hsp_line_table");
+
+	suite.test(
+		u8"デバッグセグメントから読んだ対応表で、行とコード位置を相互に引ける",
+		[](TestCaseContext& t) {
+			auto context = HsxTestContext{ 0 };
+			auto encoder = DebugSegmentEncoder{};
+
+			// main.hsp の1～3行目 (2行目は空行)
+			encoder.source_file("main.hsp", 1);
+			encoder.line(4);
+			encoder.line(0);
+			encoder.line(300);
+
+			// 3行目の途中で mod.as の10行目に入り、main.hsp の3行目に戻る。
+			encoder.source_file("mod.as", 10);
+			encoder.line(2);
+			encoder.source_file("main.hsp", 3);
+			encoder.line(6);
+
+			encoder.finish(context);
+
+			auto table = read_line_table(context.context());
+
+			auto line_at = [&](std::size_t code_offset) {
+				auto&& entry_opt = table.code_to_line(code_offset);
+				return entry_opt ? std::make_pair(entry_opt->file_id(), entry_opt->line_index()) : std::make_pair(std::size_t{ 99 }, std::size_t{ 99 });
+			};
+
+			return t.eq(table.size(), std::size_t{ 4 })
+				&& t.eq(line_at(0) == std::make_pair(std::size_t{ 0 }, std::size_t{ 0 }), true)
+				&& t.eq(line_at(3) == std::make_pair(std::size_t{ 0 }, std::size_t{ 0 }), true)
+				&& t.eq(line_at(4) == std::make_pair(std::size_t{ 0 }, std::size_t{ 2 }), true)
+				&& t.eq(line_at(304) == std::make_pair(std::size_t{ 1 }, std::size_t{ 9 }), true)
+				&& t.eq(line_at(306) == std::make_pair(std::size_t{ 0 }, std::size_t{ 2 }), true)
+				&& t.eq(table.code_to_line(encoder.code_size()).has_value(), false)
+				&& t.eq(table.line_to_first_code(0, 0).value_or(99), std::size_t{ 0 })
+				&& t.eq(table.line_to_first_code(0, 1).has_value(), false)
+				&& t.eq(table.line_to_first_code(0, 2).value_or(99), std::size_t{ 4 })
+				&& t.eq(table.line_to_first_code(1, 9).value_or(99), std::size_t{ 304 })
+				&& t.eq(table.line_to_first_code(2, 0).has_value(), false)
+				&& t.eq(table.find_code_line(0, 1).value_or(99), std::size_t{ 2 })
+				&& t.eq(table.find_code_line(0, 2).value_or(99), std::size_t{ 2 })
+				&& t.eq(table.find_code_line(0, 3).has_value(), false)
+				&& t.eq(table.find_code_line(1, 0).value_or(99), std::size_t{ 9 });
+		});
+
+	suite.test(
+		u8"多数の行を往復できる",
+		[](TestCaseContext& t) {
+			static constexpr auto LINE_COUNT = std::size_t{ 10000 };
+
+			auto context = HsxTestContext{ 0 };
+			auto encoder = DebugSegmentEncoder{};
+
+			encoder.source_file("main.hsp", 1);
+
+			auto code_offsets = std::vector<std::size_t>{};
+			for (auto i = std::size_t{}; i < LINE_COUNT; i++) {
+				code_offsets.push_back(encoder.code_size());
+				encoder.line(1 + i % 7);
+			}
+
+			encoder.finish(context);
+
+			auto table = read_line_table(context.context());
+			if (!t.eq(table.size(), LINE_COUNT)) {
+				return false;
+			}
+
+			for (auto i = std::size_t{}; i < LINE_COUNT; i++) {
+				auto&& entry_opt = table.code_to_line(code_offsets[i] + i % 7);
+				if (!t.eq(entry_opt.has_value(), true)
+					|| !t.eq(entry_opt->line_index(), i)
+					|| !t.eq(table.line_to_first_code(0, i).value_or(0), code_offsets[i])) {
+					return false;
+				}
+			}
+			return true;
+		});
+
+	suite.test(
+		u8"行の間のすき間はどの行にも対応しない",
+		[](TestCaseContext& t) {
+			auto builder = HspLineTableBuilder{};
+			builder.add(2, 3, 0, 0);
+			builder.add(10, 2, 0, 1);
+			auto table = builder.finish();
+
+			return t.eq(table.code_to_line(0).has_value(), false)
+				&& t.eq(table.code_to_line(2).has_value(), true)
+				&& t.eq(table.code_to_line(5).has_value(), false)
+				&& t.eq(table.code_to_line(11).has_value(), true)
+				&& t.eq(table.code_to_line(12).has_value(), false);
+		});
+
+	suite.test(
+		u8"コード位置から行の番号を引ける",
+		[](TestCaseContext& t) {
+			// ファイル 0 の行 0 は2つの範囲に分かれている。
+			auto builder = HspLineTableBuilder{};
+			builder.add(0, 10, 0, 0);
+			builder.add(10, 10, 1, 3);
+			builder.add(20, 10, 0, 0);
+			builder.add(40, 10, 0, 2);
+			auto table = builder.finish();
+
+			auto slot_line = [&](std::size_t code_offset) {
+				auto slot = table.code_to_line_slot(code_offset);
+				if (slot == HspLineTable::NO_LINE_SLOT) {
+					return std::make_pair(std::size_t{ 99 }, std::size_t{ 99 });
+				}
+
+				auto&& entry = table.line_slot_to_entry(slot);
+				return std::make_pair(entry.file_id(), entry.line_index());
+			};
+
+			return t.eq(table.line_slot_count(), std::size_t{ 3 })
+				&& t.eq(table.code_to_line_slot(5), table.code_to_line_slot(25))
+				&& t.eq(slot_line(5) == std::make_pair(std::size_t{ 0 }, std::size_t{ 0 }), true)
+				&& t.eq(slot_line(15) == std::make_pair(std::size_t{ 1 }, std::size_t{ 3 }), true)
+				&& t.eq(slot_line(35) == std::make_pair(std::size_t{ 99 }, std::size_t{ 99 }), true)
+				&& t.eq(slot_line(49) == std::make_pair(std::size_t{ 0 }, std::size_t{ 2 }), true)
+				&& t.eq(table.code_to_line_slot(50), HspLineTable::NO_LINE_SLOT)
+				&& t.eq(table.line_slot_to_entry(table.code_to_line_slot(25)).code_offset(), std::size_t{ 0 });
+		});
+
+	suite.test(
+		u8"実行位置は直前に実行したコードの行を指す",
+		[](TestCaseContext& t) {
+			auto builder = HspLineTableBuilder{};
+			builder.add(0, 10, 0, 0);
+			builder.add(10, 10, 0, 1);
+			auto table = builder.finish();
+
+			auto line_index_at = [&](std::optional<std::size_t> position) {
+				auto&& entry_opt = table.position_to_line(position);
+				return entry_opt ? entry_opt->line_index() : std::size_t{ 99 };
+			};
+
+			return t.eq(line_index_at(1), std::size_t{ 0 })
+				&& t.eq(line_index_at(10), std::size_t{ 0 })
+				&& t.eq(line_index_at(11), std::size_t{ 1 })
+				&& t.eq(line_index_at(20), std::size_t{ 1 })
+				&& t.eq(line_index_at(21), std::size_t{ 99 })
+				&& t.eq(line_index_at(0), std::size_t{ 99 })
+				&& t.eq(line_index_at(std::nullopt), std::size_t{ 99 })
+				&& t.eq(table.position_to_entry_index(11).value_or(99), std::size_t{ 1 })
+				&& t.eq(table.position_to_entry_index(0).has_value(), false)
+				&& t.eq(table.position_to_line_slot(10), table.code_to_line_slot(9))
+				&& t.eq(table.position_to_line_slot(20), table.code_to_line_slot(19))
+				&& t.eq(table.position_to_line_slot(0), HspLineTable::NO_LINE_SLOT)
+				&& t.eq(table.position_to_line_slot(std::nullopt), HspLineTable::NO_LINE_SLOT);
+		});
+}
@@ -0,0 +1,160 @@
+//! コード位置とソースファイルの行の対応表
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+class Tests;
+
+// 対応表の1項目: ソースファイルの行と、その行のコードの先頭位置
+class HspLineTableEntry {
+	std::size_t code_offset_;
+	std::size_t file_id_;
+	std::size_t line_index_;
+
+public:
+	HspLineTableEntry(std::size_t code_offset, std::size_t file_id, std::size_t line_index)
+		: code_offset_(code_offset)
+		, file_id_(file_id)
+		, line_index_(line_index)
+	{
+	}
+
+	// コードセグメント上の位置 (HspCodeUnit 単位)
+	auto code_offset() const -> std::size_t {
+		return code_offset_;
+	}
+
+	// ソースファイルID (SourceFileId)
+	auto file_id() const -> std::size_t {
+		return file_id_;
+	}
+
+	// 行番号 (0-indexed)
+	auto line_index() const -> std::size_t {
+		return line_index_;
+	}
+};
+
+// コード位置とソースファイルの行の対応表。
+//
+// デバッグセグメントから作る。(HspObjectsBuilder を参照。)
+// 項目はコード位置の昇順に並べて、列ごとの配列に詰めて持つ。(1項目あたり12バイトと、行からの索引の4バイト。)
+// コード位置から行、行から最初のコード位置のどちらも二分探索で引く。
+//
+// 命令ごとに行を引く処理 (行カバレッジやブレークポイントの判定) のために、(ファイル, 行) ごとに番号 (行番号とは別) を振り、
+// コード位置からその番号への表も持つ。(コード1単位あたり4バイト。) こちらは探索せずに表を1回引くだけで済む。
+class HspLineTable {
+public:
+	// 行の番号がないことを表す値
+	static constexpr auto NO_LINE_SLOT = std::uint32_t(-1);
+
+private:
+	std::vector<std::uint32_t> code_offsets_;
+	std::vector<std::uint32_t> file_ids_;
+	std::vector<std::uint32_t> line_indexes_;
+
+	// 最後の行のコードの終端
+	std::size_t code_end_;
+
+	// (ファイル, 行, コード位置) の順に並べた項目の番号
+	std::vector<std::uint32_t> line_order_;
+
+	// 行の番号 → その行の最初の項目の番号 (行の番号は (ファイル, 行) の順に振る)
+	std::vector<std::uint32_t> line_slot_entries_;
+
+	// コード位置 → その位置を含む行の番号
+	std::vector<std::uint32_t> code_line_slots_;
+
+public:
+	HspLineTable();
+
+	auto size() const -> std::size_t {
+		return code_offsets_.size();
+	}
+
+	auto entry_at(std::size_t index) const -> HspLineTableEntry {
+		return HspLineTableEntry{ code_offsets_[index], file_ids_[index], line_indexes_[index] };
+	}
+
+	// コード位置を含む行を探す。(どの行のコードでもなければ nullopt)
+	auto code_to_line(std::size_t code_offset) const->std::optional<HspLineTableEntry>;
+
+	// コード位置を含む行の項目の番号を探す。(どの行のコードでもなければ nullopt)
+	auto code_to_entry_index(std::size_t code_offset) const->std::optional<std::size_t>;
+
+	// ソースファイルIDの上限 (どの項目のファイルIDよりも大きい値)
+	auto file_id_end() const->std::size_t;
+
+	// 行のコードの最初の位置を探す。(その行にコードがなければ nullopt)
+	auto line_to_first_code(std::size_t file_id, std::size_t line_index) const->std::optional<std::size_t>;
+
+	// 指定した行か、同じファイルでそれより後にあって、コードがある最初の行を探す。
+	auto find_code_line(std::size_t file_id, std::size_t line_index) const->std::optional<std::size_t>;
+
+	// 行のある項目の番号を (ファイル, 行, コード位置) の順に並べたもの
+	auto line_order() const -> std::vector<std::uint32_t> const& {
+		return line_order_;
+	}
+
+	// コードがある (ファイル, 行) の個数 (行の番号の上限)
+	auto line_slot_count() const -> std::size_t {
+		return line_slot_entries_.size();
+	}
+
+	// 行の番号が指す行の最初の項目
+	auto line_slot_to_entry(std::size_t line_slot) const -> HspLineTableEntry {
+		return entry_at(line_slot_entries_[line_slot]);
+	}
+
+	// コード位置を含む行の番号。(どの行のコードでもなければ NO_LINE_SLOT)
+	auto code_to_line_slot(std::size_t code_offset) const -> std::uint32_t {
+		return code_offset < code_line_slots_.size() ? code_line_slots_[code_offset] : NO_LINE_SLOT;
+	}
+
+	// 実行位置 (mcs などのコード位置) が指す行を探す。(分からなければ nullopt)
+	auto position_to_line(std::optional<std::size_t> position) const->std::optional<HspLineTableEntry>;
+
+	// 実行位置が指す行の項目の番号を探す。(分からなければ nullopt)
+	auto position_to_entry_index(std::optional<std::size_t> position) const->std::optional<std::size_t>;
+
+	// 実行位置が指す行の番号。(分からなければ NO_LINE_SLOT)
+	// 命令ごとに呼ぶので、探索せずに表を引く。
+	auto position_to_line_slot(std::optional<std::size_t> position) const -> std::uint32_t {
+		auto&& code_offset_opt = position_to_code_offset(position);
+		return code_offset_opt ? code_to_line_slot(*code_offset_opt) : NO_LINE_SLOT;
+	}
+
+private:
+	friend class HspLineTableBuilder;
+
+	// 実行位置を、行を引くためのコード位置に変換する。
+	// ランタイムが行番号を求めるときと同じく、実行位置は直前に実行したコードの末尾を指しているとみなす。
+	// (つまり行の範囲は先頭を含まず末尾を含む。)
+	static auto position_to_code_offset(std::optional<std::size_t> position) -> std::optional<std::size_t> {
+		if (!position || *position == 0) {
+			return std::nullopt;
+		}
+		return *position - 1;
+	}
+
+	// (ファイル, 行) 以上の最初の項目の番号の位置
+	auto line_order_lower_bound(std::size_t file_id, std::size_t line_index) const->std::vector<std::uint32_t>::const_iterator;
+};
+
+// コード位置とソースファイルの行の対応表を作るもの。
+class HspLineTableBuilder {
+	HspLineTable table_;
+
+public:
+	HspLineTableBuilder();
+
+	// 行のコードの範囲を追加する。(コード位置の昇順に追加すること。)
+	void add(std::size_t code_offset, std::size_t code_size, std::size_t file_id, std::size_t line_index);
+
+	auto finish()->HspLineTable;
+};
+
+extern void hsp_line_table_tests(Tests& tests);
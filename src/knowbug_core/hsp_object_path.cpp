@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "hsp_objects.h"
 #include "hsp_object_path.h"
+#include "hsp_object_path_table.h"
 
 static bool kind_can_have_value(HspObjectKind kind) {
 	return kind == HspObjectKind::StaticVar
@@ -11,6 +12,9 @@ static bool kind_can_have_value(HspObjectKind kind) {
 }
 
 HspObjectPath::~HspObjectPath() {
+	if (table_ != nullptr) {
+		table_->forget(*this);
+	}
 }
 
 auto HspObjectPath::self() const -> std::shared_ptr<HspObjectPath const> {
@@ -18,9 +22,22 @@ auto HspObjectPath::self() const -> std::shared_ptr<HspObjectPath const> {
 }
 
 auto HspObjectPath::hash() const -> std::size_t {
+	if (table_ != nullptr) {
+		return hash_;
+	}
+
 	return HashCode::from(parent().hash()).combine(kind()).combine(do_hash()).value();
 }
 
+template<typename P, typename... Args>
+auto HspObjectPath::new_path(Args&&... args) const -> std::shared_ptr<HspObjectPath const> {
+	if (table_ == nullptr) {
+		return std::make_shared<P>(self(), std::forward<Args>(args)...);
+	}
+
+	return table_->intern<P>(self(), std::forward<Args>(args)...);
+}
+
 auto HspObjectPath::visual_child_count(HspObjects& objects) const -> std::size_t {
 	return objects.path_to_visual_child_count(*this);
 }
@@ -82,7 +99,7 @@ auto HspObjectPath::Root::child_at(std::size_t child_index, HspObjects& objects)
 // -----------------------------------------------
 
 auto HspObjectPath::new_group(std::size_t offset) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::Group>(self(), offset);
+	return new_path<HspObjectPath::Group>(offset);
 }
 
 auto HspObjectPath::as_group() const -> HspObjectPath::Group const& {
@@ -132,7 +149,7 @@ auto HspObjectPath::Group::name(HspObjects& objects) const->Utf8String {
 // -----------------------------------------------
 
 auto HspObjectPath::new_ellipsis(std::size_t total_count) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::Ellipsis>(self(), total_count);
+	return new_path<HspObjectPath::Ellipsis>(total_count);
 }
 
 auto HspObjectPath::as_ellipsis() const -> HspObjectPath::Ellipsis const& {
@@ -188,7 +205,7 @@ auto HspObjectPath::Module::child_at(std::size_t child_index, HspObjects& object
 }
 
 auto HspObjectPath::new_module(std::size_t module_id) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::Module>(self(), module_id);
+	return new_path<HspObjectPath::Module>(module_id);
 }
 
 auto HspObjectPath::as_module() const -> HspObjectPath::Module const& {
@@ -204,7 +221,7 @@ auto HspObjectPath::as_module() const -> HspObjectPath::Module const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_static_var(std::size_t static_var_id) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::StaticVar>(self(), static_var_id);
+	return new_path<HspObjectPath::StaticVar>(static_var_id);
 }
 
 auto HspObjectPath::as_static_var() const -> HspObjectPath::StaticVar const& {
@@ -220,7 +237,7 @@ auto HspObjectPath::as_static_var() const -> HspObjectPath::StaticVar const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_element(hsx::HspDimIndex const& indexes) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::Element>(self(), indexes);
+	return new_path<HspObjectPath::Element>(indexes);
 }
 
 auto HspObjectPath::as_element() const -> HspObjectPath::Element const& {
@@ -236,7 +253,7 @@ auto HspObjectPath::as_element() const -> HspObjectPath::Element const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_param(hsx::HspParamType param_type, std::size_t param_index) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::Param>(self(), param_type, param_index);
+	return new_path<HspObjectPath::Param>(param_type, param_index);
 }
 
 auto HspObjectPath::as_param() const -> HspObjectPath::Param const& {
@@ -253,7 +270,7 @@ auto HspObjectPath::as_param() const -> HspObjectPath::Param const& {
 
 auto HspObjectPath::new_label() const -> std::shared_ptr<HspObjectPath const> {
 	assert(kind_can_have_value(kind()));
-	return std::make_shared<HspObjectPath::Label>(self());
+	return new_path<HspObjectPath::Label>();
 }
 
 auto HspObjectPath::as_label() const -> HspObjectPath::Label const& {
@@ -270,7 +287,7 @@ auto HspObjectPath::as_label() const -> HspObjectPath::Label const& {
 
 auto HspObjectPath::new_str() const -> std::shared_ptr<HspObjectPath const> {
 	assert(kind_can_have_value(kind()));
-	return std::make_shared<HspObjectPath::Str>(self());
+	return new_path<HspObjectPath::Str>();
 }
 
 auto HspObjectPath::as_str() const -> HspObjectPath::Str const& {
@@ -287,7 +304,7 @@ auto HspObjectPath::as_str() const -> HspObjectPath::Str const& {
 
 auto HspObjectPath::new_double() const -> std::shared_ptr<HspObjectPath const> {
 	assert(kind_can_have_value(kind()));
-	return std::make_shared<HspObjectPath::Double>(self());
+	return new_path<HspObjectPath::Double>();
 }
 
 auto HspObjectPath::as_double() const -> HspObjectPath::Double const& {
@@ -304,7 +321,7 @@ auto HspObjectPath::as_double() const -> HspObjectPath::Double const& {
 
 auto HspObjectPath::new_int() const -> std::shared_ptr<HspObjectPath const> {
 	assert(kind_can_have_value(kind()));
-	return std::make_shared<HspObjectPath::Int>(self());
+	return new_path<HspObjectPath::Int>();
 }
 
 auto HspObjectPath::as_int() const -> HspObjectPath::Int const& {
@@ -321,7 +338,7 @@ auto HspObjectPath::as_int() const -> HspObjectPath::Int const& {
 
 auto HspObjectPath::new_flex() const -> std::shared_ptr<HspObjectPath const> {
 	assert(kind_can_have_value(kind()));
-	return std::make_shared<HspObjectPath::Flex>(self());
+	return new_path<HspObjectPath::Flex>();
 }
 
 auto HspObjectPath::as_flex() const -> HspObjectPath::Flex const& {
@@ -338,7 +355,7 @@ auto HspObjectPath::as_flex() const -> HspObjectPath::Flex const& {
 
 auto HspObjectPath::new_unknown() const -> std::shared_ptr<HspObjectPath const> {
 	assert(kind_can_have_value(kind()));
-	return std::make_shared<HspObjectPath::Unknown>(self());
+	return new_path<HspObjectPath::Unknown>();
 }
 
 auto HspObjectPath::as_unknown() const -> HspObjectPath::Unknown const& {
@@ -369,7 +386,7 @@ static auto const s_system_var_list = std::array<hsx::HspSystemVarKind, 12>{ {
 }};
 
 auto HspObjectPath::new_system_var_list() const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::SystemVarList>(self());
+	return new_path<HspObjectPath::SystemVarList>();
 }
 
 auto HspObjectPath::as_system_var_list() const -> HspObjectPath::SystemVarList const& {
@@ -397,7 +414,7 @@ auto HspObjectPath::SystemVarList::child_at(std::size_t child_index, HspObjects&
 // -----------------------------------------------
 
 auto HspObjectPath::new_system_var(hsx::HspSystemVarKind system_var_kind) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::SystemVar>(self(), system_var_kind);
+	return new_path<HspObjectPath::SystemVar>(system_var_kind);
 }
 
 auto HspObjectPath::as_system_var() const -> HspObjectPath::SystemVar const& {
@@ -413,7 +430,7 @@ auto HspObjectPath::as_system_var() const -> HspObjectPath::SystemVar const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_call_stack() const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::CallStack>(self());
+	return new_path<HspObjectPath::CallStack>();
 }
 
 auto HspObjectPath::as_call_stack() const -> HspObjectPath::CallStack const& {
@@ -429,7 +446,7 @@ auto HspObjectPath::as_call_stack() const -> HspObjectPath::CallStack const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_call_frame(WcCallFrameKey const& key) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::CallFrame>(self(), key);
+	return new_path<HspObjectPath::CallFrame>(key);
 }
 
 auto HspObjectPath::as_call_frame() const -> HspObjectPath::CallFrame const& {
@@ -445,7 +462,7 @@ auto HspObjectPath::as_call_frame() const -> HspObjectPath::CallFrame const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_general() const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::General>(self());
+	return new_path<HspObjectPath::General>();
 }
 
 auto HspObjectPath::as_general() const -> HspObjectPath::General const& {
@@ -461,7 +478,7 @@ auto HspObjectPath::as_general() const -> HspObjectPath::General const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_log() const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::Log>(self());
+	return new_path<HspObjectPath::Log>();
 }
 
 auto HspObjectPath::as_log() const -> HspObjectPath::Log const& {
@@ -477,7 +494,7 @@ auto HspObjectPath::as_log() const -> HspObjectPath::Log const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_script() const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::Script>(self());
+	return new_path<HspObjectPath::Script>();
 }
 
 auto HspObjectPath::as_script() const -> HspObjectPath::Script const& {
@@ -493,7 +510,7 @@ auto HspObjectPath::as_script() const -> HspObjectPath::Script const& {
 // -----------------------------------------------
 
 auto HspObjectPath::new_unavailable(Utf8String&& reason) const -> std::shared_ptr<HspObjectPath const> {
-	return std::make_shared<HspObjectPath::Unavailable>(self(), std::move(reason));
+	return new_path<HspObjectPath::Unavailable>(std::move(reason));
 }
 
 auto HspObjectPath::as_unavailable() const -> HspObjectPath::Unavailable const& {
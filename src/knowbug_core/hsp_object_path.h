@@ -1182,12 +1182,13 @@ public:
 		return HspObjectKind::Unavailable;
 	}
 
+	// 理由が異なるものは別のパスとみなす。(インターン表が古い理由のパスを返さないように。)
 	bool does_equal(HspObjectPath const& other) const override {
-		return true;
+		return reason() == other.as_unavailable().reason();
 	}
 
 	auto do_hash() const -> std::size_t override {
-		return 0;
+		return std::hash<std::string_view>{}(as_native(reason()));
 	}
 
 	auto parent() const -> HspObjectPath const& override {
@@ -0,0 +1,113 @@
+#include "pch.h"
+#include "hsp_object_path.h"
+#include "hsp_object_path_cache.h"
+#include "hsp_object_path_table.h"
+#include "test_suite.h"
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+void hsp_object_path_cache_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"hsp_object_path_cache");
+
+	suite.test(
+		u8"同じパスは1回だけ解決する",
+		[](TestCaseContext& t) {
+			auto table = HspObjectPathTable{};
+			auto root = table.new_root();
+			auto cache = HspObjectPathCache<int>{};
+			auto resolve_count = 0;
+
+			auto resolve = [&](HspObjectPath const& path) {
+				return cache.get_or_resolve(path, true, [&] {
+					resolve_count++;
+					return std::make_optional(42);
+				});
+			};
+
+			auto first = resolve(*root->new_call_stack());
+			auto second = resolve(*root->new_call_stack());
+			auto other = resolve(*root->new_unavailable(to_owned(as_utf8(u8"other"))));
+
+			return t.eq(first.value_or(0), 42)
+				&& t.eq(second.value_or(0), 42)
+				&& t.eq(other.value_or(0), 42)
+				&& t.eq(resolve_count, 2)
+				&& t.eq(cache.hit_count(), 1)
+				&& t.eq(cache.size(), 2);
+		});
+
+	suite.test(
+		u8"解決できなかった結果は覚えない",
+		[](TestCaseContext& t) {
+			auto table = HspObjectPathTable{};
+			auto root = table.new_root();
+			auto cache = HspObjectPathCache<int>{};
+			auto resolve_count = 0;
+
+			auto resolve = [&](HspObjectPath const& path) {
+				return cache.get_or_resolve(path, true, [&] {
+					resolve_count++;
+					return std::optional<int>{};
+				});
+			};
+
+			resolve(*root);
+			auto second = resolve(*root);
+
+			return t.eq(second.has_value(), false)
+				&& t.eq(resolve_count, 2)
+				&& t.eq(cache.size(), 0);
+		});
+
+	suite.test(
+		u8"覚えている間はパスを生かしておく",
+		[](TestCaseContext& t) {
+			auto table = HspObjectPathTable{};
+			auto root = table.new_root();
+			auto cache = HspObjectPathCache<int>{};
+
+			cache.get_or_resolve(*root->new_call_stack(), true, [] { return std::make_optional(1); });
+			auto size_while_cached = table.size();
+
+			cache.clear();
+
+			return t.eq(size_while_cached, 2)
+				&& t.eq(table.size(), 1);
+		});
+
+	suite.test(
+		u8"実行中は覚えず、再開すると停止エポックが進む",
+		[](TestCaseContext& t) {
+			auto table = HspObjectPathTable{};
+			auto root = table.new_root();
+			auto cache = HspPathResolutionCache{};
+			auto pval = PVal{};
+
+			auto resolve = [&] {
+				return cache.pvals().get_or_resolve(*root, cache.is_enabled(), [&] {
+					return std::make_optional<PVal const*>(&pval);
+				});
+			};
+
+			// 停止する前
+			resolve();
+			auto size_running = cache.pvals().size();
+
+			cache.debuggee_did_stop();
+			resolve();
+			resolve();
+			auto size_stopped = cache.pvals().size();
+			auto epoch_stopped = cache.stop_epoch();
+
+			cache.debuggee_did_resume();
+
+			return t.eq(size_running, 0)
+				&& t.eq(size_stopped, 1)
+				&& t.eq(cache.pvals().hit_count(), 1)
+				&& t.eq(cache.pvals().size(), 0)
+				&& t.eq(cache.stop_epoch(), epoch_stopped + 1)
+				&& t.eq(cache.is_enabled(), false);
+		});
+}
@@ -0,0 +1,146 @@
+//! オブジェクトパスの解決結果のキャッシュ
+
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include "hsp_object_path_fwd.h"
+#include "hsx.h"
+
+class Tests;
+
+// パスごとに、パスを解決した結果を覚えておくもの。
+//
+// インターンされたパスはアドレスで区別できるので、アドレスをキーにする。
+// 覚えている間はパスを所有して、同じアドレスが別のパスに再利用されないようにする。
+template<typename T>
+class HspObjectPathCache {
+	class Entry {
+	public:
+		std::shared_ptr<HspObjectPath const> path_;
+		T value_;
+	};
+
+	std::unordered_map<HspObjectPath const*, Entry> entries_;
+
+	std::size_t hit_count_;
+	std::size_t miss_count_;
+
+public:
+	HspObjectPathCache()
+		: entries_()
+		, hit_count_()
+		, miss_count_()
+	{
+	}
+
+	// パスの解決結果を返す。
+	// 覚えていなければ resolve で解決する。解決できたときだけ結果を覚える。
+	// (深さの制限などで解決できなかった結果は、呼び出し元によって変わりうるので覚えない。)
+	template<typename F>
+	auto get_or_resolve(HspObjectPath const& path, bool enabled, F resolve) -> std::optional<T> {
+		if (!enabled) {
+			return resolve();
+		}
+
+		auto iter = entries_.find(&path);
+		if (iter != entries_.end()) {
+			hit_count_++;
+			return iter->second.value_;
+		}
+
+		miss_count_++;
+		auto value_opt = resolve();
+		if (value_opt) {
+			entries_.emplace(&path, Entry{ path.self(), *value_opt });
+		}
+		return value_opt;
+	}
+
+	auto size() const -> std::size_t {
+		return entries_.size();
+	}
+
+	auto hit_count() const -> std::size_t {
+		return hit_count_;
+	}
+
+	auto miss_count() const -> std::size_t {
+		return miss_count_;
+	}
+
+	void clear() {
+		entries_.clear();
+	}
+};
+
+// デバッギが停止している間の、パスの解決結果のキャッシュ。
+//
+// パスを解決して得られるポインターは、デバッギが実行を再開すると無効になりうる。
+// そのため、停止してから再開するまでを1つの「停止エポック」として、エポックが変わるたびにすべて捨てる。
+// 実行中は何も覚えない。
+class HspPathResolutionCache {
+	// 再開するたびに1つ進む番号
+	std::size_t stop_epoch_;
+
+	bool stopped_;
+
+	HspObjectPathCache<PVal const*> pvals_;
+	HspObjectPathCache<hsx::HspData> datas_;
+	HspObjectPathCache<hsx::Slice<char>> strs_;
+	HspObjectPathCache<hsx::HspParamStack> param_stacks_;
+
+public:
+	HspPathResolutionCache()
+		: stop_epoch_()
+		, stopped_(false)
+		, pvals_()
+		, datas_()
+		, strs_()
+		, param_stacks_()
+	{
+	}
+
+	auto stop_epoch() const -> std::size_t {
+		return stop_epoch_;
+	}
+
+	auto is_enabled() const -> bool {
+		return stopped_;
+	}
+
+	// デバッギが停止した。次に再開するまで、解決結果を覚える。
+	void debuggee_did_stop() {
+		stopped_ = true;
+	}
+
+	// デバッギが再開した。エポックを進めて、覚えている結果をすべて捨てる。
+	void debuggee_did_resume() {
+		stop_epoch_++;
+		stopped_ = false;
+
+		pvals_.clear();
+		datas_.clear();
+		strs_.clear();
+		param_stacks_.clear();
+	}
+
+	auto pvals() -> HspObjectPathCache<PVal const*>& {
+		return pvals_;
+	}
+
+	auto datas() -> HspObjectPathCache<hsx::HspData>& {
+		return datas_;
+	}
+
+	auto strs() -> HspObjectPathCache<hsx::Slice<char>>& {
+		return strs_;
+	}
+
+	auto param_stacks() -> HspObjectPathCache<hsx::HspParamStack>& {
+		return param_stacks_;
+	}
+};
+
+extern void hsp_object_path_cache_tests(Tests& tests);
@@ -8,6 +8,7 @@
 #include "memory_view.h"
 
 class HspObjects;
+class HspObjectPathTable;
 
 // HSP のオブジェクトの種類
 enum class HspObjectKind {
@@ -96,9 +97,23 @@ public:
 	class Script;
 	class Unavailable;
 
+private:
+	friend class HspObjectPathTable;
+
+	// このパスを作ったインターン表 (表から作られていなければ nullptr)
+	// 表が先に破棄されたときは、表によって nullptr に戻される。
+	mutable HspObjectPathTable* table_;
+
+	// ハッシュ値 (表から作られたときに計算しておく)
+	std::size_t hash_;
+
+public:
 	virtual	~HspObjectPath();
 
-	HspObjectPath() {
+	HspObjectPath()
+		: table_()
+		, hash_()
+	{
 	}
 
 	// shared_ptr で管理されていないインスタンスを作れてしまうと shared_from_this が壊れるので、コピーやムーブを禁止する。
@@ -143,9 +158,16 @@ public:
 		if (this == &other) {
 			return true;
 		}
+
+		// 同じインターン表から作られたパスは、等しければ同じインスタンスになる。
+		if (table_ != nullptr && table_ == other.table_) {
+			return false;
+		}
+
 		return kind() == other.kind() && does_equal(other) && parent().equals(other.parent());
 	}
 
+	// ハッシュ値。インターン表から作られたパスなら、計算済みの値を返す。
 	virtual auto hash() const->std::size_t;
 
 	// パスが生存しているかを判定する。
@@ -258,6 +280,11 @@ protected:
 
 public:
 	auto new_unavailable(Utf8String&& reason) const->std::shared_ptr<HspObjectPath const>;
+
+private:
+	// 子要素のパスを作る。インターン表から作られたパスなら、表に既存のものがあればそれを返す。
+	template<typename P, typename... Args>
+	auto new_path(Args&&... args) const->std::shared_ptr<HspObjectPath const>;
 };
 
 static auto operator ==(HspObjectPath const& first, HspObjectPath const& second) -> bool {
@@ -0,0 +1,196 @@
+#include "pch.h"
+#include <chrono>
+#include "hsp_object_path_table.h"
+#include "test_suite.h"
+
+HspObjectPathTable::HspObjectPathTable()
+	: paths_()
+	, created_count_()
+	, found_count_()
+{
+}
+
+HspObjectPathTable::~HspObjectPathTable() {
+	for (auto&& pair : paths_) {
+		pair.second->table_ = nullptr;
+	}
+}
+
+auto HspObjectPathTable::new_root() -> std::shared_ptr<HspObjectPath const> {
+	auto path = std::make_shared<HspObjectPath::Root>();
+	add(*path, path->hash());
+	created_count_++;
+	return path;
+}
+
+void HspObjectPathTable::forget(HspObjectPath const& path) {
+	assert(path.table_ == this);
+
+	auto range = paths_.equal_range(path.hash_);
+	for (auto iter = range.first; iter != range.second; ++iter) {
+		if (iter->second == &path) {
+			paths_.erase(iter);
+			return;
+		}
+	}
+
+	assert(false && u8"path not found in table");
+}
+
+auto HspObjectPathTable::find(HspObjectPath const& key, std::size_t hash) const -> HspObjectPath const* {
+	auto range = paths_.equal_range(hash);
+	for (auto iter = range.first; iter != range.second; ++iter) {
+		auto&& path = *iter->second;
+
+		// 親は表の中で一意なので、アドレスで比較できる。
+		if (path.kind() == key.kind() && &path.parent() == &key.parent() && path.does_equal(key)) {
+			return &path;
+		}
+	}
+	return nullptr;
+}
+
+void HspObjectPathTable::add(HspObjectPath const& path, std::size_t hash) {
+	path.table_ = this;
+	const_cast<HspObjectPath&>(path).hash_ = hash;
+	paths_.emplace(hash, &path);
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+static auto new_element_path(HspObjectPath const& parent, std::size_t index) -> std::shared_ptr<HspObjectPath const> {
+	return parent.new_element(hsx::HspDimIndex{ 1, { index, 0, 0, 0 } });
+}
+
+void hsp_object_path_table_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"hsp_object_path_table");
+
+	suite.test(
+		u8"等しいパスは同じインスタンスになる",
+		[](TestCaseContext& t) {
+			auto table = HspObjectPathTable{};
+			auto root = table.new_root();
+			auto call_stack = root->new_call_stack();
+
+			auto first = new_element_path(*call_stack, 1);
+			auto second = new_element_path(*root->new_call_stack(), 1);
+			auto other = new_element_path(*call_stack, 2);
+
+			return t.eq(first.get() == second.get(), true)
+				&& t.eq(first == second, true)
+				&& t.eq(first == other, false)
+				&& t.eq(first->hash() == second->hash(), true)
+				&& t.eq(table.size(), 4)
+				&& t.eq(table.created_count(), 4)
+				&& t.eq(table.found_count(), 2);
+		});
+
+	suite.test(
+		u8"破棄されたパスは表から取り除かれる",
+		[](TestCaseContext& t) {
+			auto table = HspObjectPathTable{};
+			auto root = table.new_root();
+			auto call_stack = root->new_call_stack();
+			{
+				auto element = new_element_path(*call_stack, 1);
+				auto unavailable = element->new_unavailable(to_owned(as_utf8(u8"out of range")));
+			}
+			auto size_after_release = table.size();
+
+			// 作り直すと、新しいインスタンスが確保される。
+			auto element = new_element_path(*call_stack, 1);
+
+			return t.eq(size_after_release, 2)
+				&& t.eq(table.size(), 3)
+				&& t.eq(table.created_count(), 5);
+		});
+
+	suite.test(
+		u8"理由の異なる利用不能パスは区別する",
+		[](TestCaseContext& t) {
+			auto table = HspObjectPathTable{};
+			auto root = table.new_root();
+			auto first = root->new_unavailable(to_owned(as_utf8(u8"a")));
+			auto second = root->new_unavailable(to_owned(as_utf8(u8"b")));
+			auto third = root->new_unavailable(to_owned(as_utf8(u8"a")));
+
+			return t.eq(first == second, false)
+				&& t.eq(first.get() == third.get(), true)
+				&& t.eq(third->as_unavailable().reason(), as_utf8(u8"a"));
+		});
+
+	suite.test(
+		u8"表が先に破棄されても、残ったパスは使える",
+		[](TestCaseContext& t) {
+			auto root = std::shared_ptr<HspObjectPath const>{};
+			auto first = std::shared_ptr<HspObjectPath const>{};
+			auto hash = std::size_t{};
+			{
+				auto table = HspObjectPathTable{};
+				root = table.new_root();
+				first = new_element_path(*root->new_call_stack(), 3);
+				hash = first->hash();
+			}
+
+			auto second = new_element_path(*root->new_call_stack(), 3);
+			return t.eq(first.get() == second.get(), false)
+				&& t.eq(first == second, true)
+				&& t.eq(second->hash(), hash);
+		});
+
+	suite.test(
+		u8"ベンチマーク: 10000個の要素パスからなるリストの再構築",
+		[](TestCaseContext& t) {
+			static constexpr auto ELEMENT_COUNT = std::size_t{ 10000 };
+			static constexpr auto REBUILD_COUNT = 10;
+
+			// オブジェクトリストの再構築と同様に、子要素のパスを作って ID の表を引く。
+			auto rebuild = [&](HspObjectPath const& root, std::unordered_map<std::shared_ptr<HspObjectPath const>, std::size_t>& ids) {
+				auto parent = root.new_call_stack();
+				auto found = std::size_t{};
+				for (auto i = std::size_t{}; i < ELEMENT_COUNT; i++) {
+					auto path = new_element_path(*parent, i);
+					if (ids.count(path) != 0) {
+						found++;
+						continue;
+					}
+					ids.emplace(std::move(path), ids.size());
+				}
+				return found;
+			};
+
+			auto measure = [&](std::shared_ptr<HspObjectPath const> const& root, std::size_t& found) {
+				auto ids = std::unordered_map<std::shared_ptr<HspObjectPath const>, std::size_t>{};
+				rebuild(*root, ids);
+
+				auto start = std::chrono::steady_clock::now();
+				for (auto i = 0; i < REBUILD_COUNT; i++) {
+					found += rebuild(*root, ids);
+				}
+				auto elapsed = std::chrono::steady_clock::now() - start;
+				return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / REBUILD_COUNT;
+			};
+
+			// 以前の方法: 表を使わず、パスを毎回確保する。
+			auto old_found = std::size_t{};
+			auto old_root = std::shared_ptr<HspObjectPath const>{ std::make_shared<HspObjectPath::Root>() };
+			auto old_us = measure(old_root, old_found);
+
+			auto table = HspObjectPathTable{};
+			auto new_found = std::size_t{};
+			auto new_root = table.new_root();
+			auto created_before = table.created_count();
+			auto new_us = measure(new_root, new_found);
+			auto new_allocations = (table.created_count() - created_before) - (ELEMENT_COUNT + 1);
+
+			t.output()
+				<< u8"    以前の方法 " << old_us << u8" us (確保 " << (ELEMENT_COUNT + 1) << u8" 回)"
+				<< u8" / インターン表 " << new_us << u8" us (確保 " << new_allocations / REBUILD_COUNT << u8" 回)" << std::endl;
+
+			return t.eq(old_found, ELEMENT_COUNT * REBUILD_COUNT)
+				&& t.eq(new_found, ELEMENT_COUNT * REBUILD_COUNT)
+				&& t.eq(new_allocations, 0);
+		});
+}
@@ -0,0 +1,86 @@
+//! オブジェクトパスのインターン表
+
+#pragma once
+
+#include <cassert>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include "hsp_object_path.h"
+
+class Tests;
+
+// オブジェクトパスのインターン表 (ハッシュコンシング)
+//
+// 親と種類とキーが等しいパスは、生存している間は常に同じインスタンスになる。
+// そのため、この表から作られたパスの比較はポインターの比較で済み、既存のパスを作り直すときはメモリーを確保しない。
+// ハッシュ値はパスを作るときに1回だけ計算して、パスに持たせる。
+//
+// 表はパスを所有しない。パスは破棄されるときに表から取り除かれる。
+// 表が先に破棄されたときは、残っているパスを表から切り離す。(以降は通常のパスとして振る舞う。)
+class HspObjectPathTable {
+	// ハッシュ値から生存しているパスへの表
+	std::unordered_multimap<std::size_t, HspObjectPath const*> paths_;
+
+	// 新しく作ったパスの数
+	std::size_t created_count_;
+
+	// 既存のパスを返した回数
+	std::size_t found_count_;
+
+public:
+	HspObjectPathTable();
+
+	~HspObjectPathTable();
+
+	HspObjectPathTable(HspObjectPathTable const& other) = delete;
+
+	auto operator=(HspObjectPathTable const& other) -> HspObjectPathTable& = delete;
+
+	// この表に属するルートパスを作る。
+	auto new_root() -> std::shared_ptr<HspObjectPath const>;
+
+	// parent の子要素で、P{ parent, args... } に等しいパスを返す。
+	template<typename P, typename... Args>
+	auto intern(std::shared_ptr<HspObjectPath const> parent, Args&&... args) -> std::shared_ptr<HspObjectPath const> {
+		assert(parent->table_ == this);
+
+		// 探すために一時的なパスを作る。
+		// ヒープに確保せず、親の参照カウントも増やさないように、親を所有しない shared_ptr を持たせる。
+		auto const key = P{ std::shared_ptr<HspObjectPath const>{ std::shared_ptr<HspObjectPath const>{}, parent.get() }, std::decay_t<Args>{ args }... };
+		auto hash = key.hash();
+
+		if (auto path = find(key, hash)) {
+			found_count_++;
+			return path->self();
+		}
+
+		auto path = std::make_shared<P>(std::move(parent), std::forward<Args>(args)...);
+		add(*path, hash);
+		created_count_++;
+		return path;
+	}
+
+	// 生存しているパスの数
+	auto size() const -> std::size_t {
+		return paths_.size();
+	}
+
+	auto created_count() const -> std::size_t {
+		return created_count_;
+	}
+
+	auto found_count() const -> std::size_t {
+		return found_count_;
+	}
+
+	// パスを表から取り除く。(パスのデストラクタから呼ばれる。)
+	void forget(HspObjectPath const& path);
+
+private:
+	auto find(HspObjectPath const& key, std::size_t hash) const -> HspObjectPath const*;
+
+	void add(HspObjectPath const& path, std::size_t hash);
+};
+
+extern void hsp_object_path_table_tests(Tests& tests);
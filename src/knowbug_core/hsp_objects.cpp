@@ -1,12 +1,15 @@
 #include "pch.h"
+#include <chrono>
 #include <sstream>
 #include "hsp_wrap_call.h"
 #include "hsp_objects_module_tree.h"
 #include "hsp_object_path.h"
+#include "hsp_object_path_table.h"
 #include "hsp_objects.h"
 #include "hsx.h"
 #include "hsx_debug_segment.h"
 #include "source_files.h"
+#include "string_format.h"
 #include "string_split.h"
 
 // 再帰深度の初期値
@@ -18,7 +21,12 @@ static auto const MAX_DEPTH = std::size_t{ 32 };
 // ビジュアルツリーの子要素数の最大値
 static constexpr auto MAX_VISUAL_CHILD_COUNT = HspObjectPath::Group::MAX_CHILD_COUNT;
 
-static auto param_path_to_param_data(HspObjectPath::Param const& path, std::size_t depth, HSPCTX const* ctx) -> std::optional<hsx::HspParamData>;
+// 呼び出し履歴に使うメモリーのバイト数
+static constexpr auto CALL_HISTORY_MEMORY_BUDGET = std::size_t{ 1024 * 1024 };
+
+static auto path_to_pval(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<PVal const*>;
+
+static auto param_path_to_param_data(HspObjectPath::Param const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspParamData>;
 
 static auto const GLOBAL_MODULE_ID = std::size_t{ 0 };
 
@@ -167,7 +175,7 @@ static auto path_to_visual_child_at_default(HspObjectPath const& path, std::size
 	return path.child_at(child_index, objects);
 }
 
-static auto path_to_pval(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx) -> std::optional<PVal const*> {
+static auto resolve_pval(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<PVal const*> {
 	if (depth >= MAX_DEPTH) {
 		return std::nullopt;
 	}
@@ -181,11 +189,11 @@ static auto path_to_pval(HspObjectPath const& path, std::size_t depth, HSPCTX co
 		}
 
 	case HspObjectKind::Element:
-		return path_to_pval(path.parent(), depth, ctx);
+		return path_to_pval(path.parent(), depth, ctx, cache);
 
 	case HspObjectKind::Param:
 		{
-			auto&& param_data_opt = param_path_to_param_data(path.as_param(), depth, ctx);
+			auto&& param_data_opt = param_path_to_param_data(path.as_param(), depth, ctx, cache);
 			if (!param_data_opt) {
 				return std::nullopt;
 			}
@@ -223,7 +231,14 @@ static auto path_to_pval(HspObjectPath const& path, std::size_t depth, HSPCTX co
 	}
 }
 
-static auto path_to_data(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx) -> std::optional<hsx::HspData> {
+// パスを解決して pval を得る。(停止中はキャッシュする。)
+static auto path_to_pval(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<PVal const*> {
+	return cache.pvals().get_or_resolve(path, cache.is_enabled(), [&] {
+		return resolve_pval(path, depth, ctx, cache);
+	});
+}
+
+static auto resolve_data(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspData> {
 	if (depth >= MAX_DEPTH) {
 		return std::nullopt;
 	}
@@ -242,7 +257,7 @@ static auto path_to_data(HspObjectPath const& path, std::size_t depth, HSPCTX co
 	}
 	case HspObjectKind::Element:
 		{
-			auto&& pval_opt = path_to_pval(path.parent(), depth, ctx);
+			auto&& pval_opt = path_to_pval(path.parent(), depth, ctx, cache);
 			if (!pval_opt) {
 				return std::nullopt;
 			}
@@ -256,7 +271,7 @@ static auto path_to_data(HspObjectPath const& path, std::size_t depth, HSPCTX co
 		}
 	case HspObjectKind::Param:
 	{
-		auto&& param_data_opt = param_path_to_param_data(path.as_param(), depth, ctx);
+		auto&& param_data_opt = param_path_to_param_data(path.as_param(), depth, ctx, cache);
 		if (!param_data_opt) {
 			return std::nullopt;
 		}
@@ -283,7 +298,14 @@ static auto path_to_data(HspObjectPath const& path, std::size_t depth, HSPCTX co
 	}
 }
 
-static auto path_to_str(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx) -> std::optional<hsx::Slice<char>> {
+// パスを解決して data を得る。(停止中はキャッシュする。)
+static auto path_to_data(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspData> {
+	return cache.datas().get_or_resolve(path, cache.is_enabled(), [&] {
+		return resolve_data(path, depth, ctx, cache);
+	});
+}
+
+static auto resolve_str(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::Slice<char>> {
 	if (depth >= MAX_DEPTH) {
 		return std::nullopt;
 	}
@@ -300,7 +322,7 @@ static auto path_to_str(HspObjectPath const& path, std::size_t depth, HSPCTX con
 		return hsx::pval_to_str(*pval_opt, ctx);
 	}
 	case HspObjectKind::Element: {
-		auto&& pval_opt = path_to_pval(path.parent(), depth, ctx);
+		auto&& pval_opt = path_to_pval(path.parent(), depth, ctx, cache);
 		if (!pval_opt) {
 			return std::nullopt;
 		}
@@ -313,7 +335,7 @@ static auto path_to_str(HspObjectPath const& path, std::size_t depth, HSPCTX con
 		return hsx::element_to_str(*pval_opt, *aptr_opt, ctx);
 	}
 	case HspObjectKind::Param: {
-		auto&& param_data_opt = param_path_to_param_data(path.as_param(), depth, ctx);
+		auto&& param_data_opt = param_path_to_param_data(path.as_param(), depth, ctx, cache);
 		if (!param_data_opt) {
 			return std::nullopt;
 		}
@@ -342,8 +364,15 @@ static auto path_to_str(HspObjectPath const& path, std::size_t depth, HSPCTX con
 	}
 }
 
-static auto var_path_to_child_count(HspObjectPath const& path, HSPCTX const* ctx) -> std::size_t {
-	auto&& pval_opt = path_to_pval(path, MIN_DEPTH, ctx);
+// パスを解決して str を得る。(停止中はキャッシュする。)
+static auto path_to_str(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::Slice<char>> {
+	return cache.strs().get_or_resolve(path, cache.is_enabled(), [&] {
+		return resolve_str(path, depth, ctx, cache);
+	});
+}
+
+static auto var_path_to_child_count(HspObjectPath const& path, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::size_t {
+	auto&& pval_opt = path_to_pval(path, MIN_DEPTH, ctx, cache);
 	if (!pval_opt) {
 		return 0;
 	}
@@ -352,9 +381,9 @@ static auto var_path_to_child_count(HspObjectPath const& path, HSPCTX const* ctx
 	return hsx::pval_to_element_count(pval);
 }
 
-static auto var_path_to_child_at(HspObjectPath const& path, std::size_t child_index, HSPCTX const* ctx) -> std::shared_ptr<HspObjectPath const> {
-	auto pval_opt = path_to_pval(path, MIN_DEPTH, ctx);
-	if (!pval_opt || child_index >= var_path_to_child_count(path, ctx)) {
+static auto var_path_to_child_at(HspObjectPath const& path, std::size_t child_index, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::shared_ptr<HspObjectPath const> {
+	auto pval_opt = path_to_pval(path, MIN_DEPTH, ctx, cache);
+	if (!pval_opt || child_index >= var_path_to_child_count(path, ctx, cache)) {
 		assert(false && u8"Invalid var path child index");
 		throw new std::out_of_range{ u8"child_index" };
 	}
@@ -369,46 +398,46 @@ static auto var_path_to_child_at(HspObjectPath const& path, std::size_t child_in
 	return path.new_element(*indexes_opt);
 }
 
-static auto var_path_to_visual_child_count(HspObjectPath const& path, HSPCTX const* ctx, HspObjects& objects) -> std::size_t {
-	auto&& pval_opt = path_to_pval(path, MIN_DEPTH, ctx);
+static auto var_path_to_visual_child_count(HspObjectPath const& path, HSPCTX const* ctx, HspPathResolutionCache& cache, HspObjects& objects) -> std::size_t {
+	auto&& pval_opt = path_to_pval(path, MIN_DEPTH, ctx, cache);
 	if (!pval_opt) {
 		return 0;
 	}
 
 	// 配列でなければ要素の子要素を直接配置する。
 	if (!hsx::pval_is_standard_array(*pval_opt, ctx)) {
-		if (var_path_to_child_count(path, ctx) == 0) {
+		if (var_path_to_child_count(path, ctx, cache) == 0) {
 			return 0;
 		}
 
-		auto child_path = var_path_to_child_at(path, 0, ctx);
+		auto child_path = var_path_to_child_at(path, 0, ctx, cache);
 		return child_path->visual_child_count(objects);
 	}
 
 	return path_to_visual_child_count_default(path, objects);
 }
 
-static auto var_path_to_visual_child_at(HspObjectPath const& path, std::size_t child_index, HSPCTX const* ctx, HspObjects& objects) -> std::optional<std::shared_ptr<HspObjectPath const>> {
-	auto pval_opt = path_to_pval(path, MIN_DEPTH, ctx);
+static auto var_path_to_visual_child_at(HspObjectPath const& path, std::size_t child_index, HSPCTX const* ctx, HspPathResolutionCache& cache, HspObjects& objects) -> std::optional<std::shared_ptr<HspObjectPath const>> {
+	auto pval_opt = path_to_pval(path, MIN_DEPTH, ctx, cache);
 	if (!pval_opt) {
 		assert(false && u8"Invalid var path child index");
 		return std::nullopt;
 	}
 
 	if (!hsx::pval_is_standard_array(*pval_opt, ctx)) {
-		if (var_path_to_child_count(path, ctx) == 0) {
+		if (var_path_to_child_count(path, ctx, cache) == 0) {
 			return std::nullopt;
 		}
 
-		auto child_path = var_path_to_child_at(path, 0, ctx);
+		auto child_path = var_path_to_child_at(path, 0, ctx, cache);
 		return child_path->visual_child_at(child_index, objects);
 	}
 
 	return path_to_visual_child_at_default(path, child_index, objects);
 }
 
-static auto var_path_to_metadata(HspObjectPath const& path, HSPCTX const* ctx) -> std::optional<hsx::HspVarMetadata> {
-	auto&& pval_opt = path_to_pval(path, MIN_DEPTH, ctx);
+static auto var_path_to_metadata(HspObjectPath const& path, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspVarMetadata> {
+	auto&& pval_opt = path_to_pval(path, MIN_DEPTH, ctx, cache);
 	if (!pval_opt) {
 		return std::nullopt;
 	}
@@ -429,8 +458,8 @@ static auto var_path_to_metadata(HspObjectPath const& path, HSPCTX const* ctx) -
 	return metadata;
 }
 
-static auto label_path_to_value(HspObjectPath::Label const& path, HSPCTX const* ctx) -> std::optional<hsx::HspLabel> {
-	auto&& data_opt = path_to_data(path.parent(), MIN_DEPTH, ctx);
+static auto label_path_to_value(HspObjectPath::Label const& path, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspLabel> {
+	auto&& data_opt = path_to_data(path.parent(), MIN_DEPTH, ctx, cache);
 	if (!data_opt) {
 		assert(false && u8"label の親は data を生成できるはず");
 		return std::nullopt;
@@ -439,12 +468,12 @@ static auto label_path_to_value(HspObjectPath::Label const& path, HSPCTX const*
 	return hsx::data_to_label(*data_opt);
 }
 
-static auto str_path_to_value(HspObjectPath::Str const& path, HSPCTX const* ctx) -> std::optional<hsx::HspStr> {
-	return path_to_str(path.parent(), MIN_DEPTH, ctx);
+static auto str_path_to_value(HspObjectPath::Str const& path, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspStr> {
+	return path_to_str(path.parent(), MIN_DEPTH, ctx, cache);
 }
 
-static auto double_path_to_value(HspObjectPath::Double const& path, HSPCTX const* ctx) -> std::optional<hsx::HspDouble> {
-	auto&& data_opt = path_to_data(path.parent(), MIN_DEPTH, ctx);
+static auto double_path_to_value(HspObjectPath::Double const& path, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspDouble> {
+	auto&& data_opt = path_to_data(path.parent(), MIN_DEPTH, ctx, cache);
 	if (!data_opt) {
 		assert(false && u8"double の親は data を生成できるはず");
 		return std::nullopt;
@@ -453,8 +482,8 @@ static auto double_path_to_value(HspObjectPath::Double const& path, HSPCTX const
 	return hsx::data_to_double(*data_opt);
 }
 
-static auto int_path_to_value(HspObjectPath::Int const& path, HSPCTX const* ctx) -> std::optional<hsx::HspInt> {
-	auto&& data_opt = path_to_data(path.parent(), MIN_DEPTH, ctx);
+static auto int_path_to_value(HspObjectPath::Int const& path, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspInt> {
+	auto&& data_opt = path_to_data(path.parent(), MIN_DEPTH, ctx, cache);
 	if (!data_opt) {
 		assert(false && u8"int の親は data を生成できるはず");
 		return std::nullopt;
@@ -463,13 +492,13 @@ static auto int_path_to_value(HspObjectPath::Int const& path, HSPCTX const* ctx)
 	return hsx::data_to_int(*data_opt);
 }
 
-static auto flex_path_to_value(HspObjectPath::Flex const& path, std::size_t depth, HSPCTX const* ctx) -> std::optional<FlexValue const*> {
+static auto flex_path_to_value(HspObjectPath::Flex const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<FlexValue const*> {
 	if (depth >= MAX_DEPTH) {
 		return std::nullopt;
 	}
 	depth++;
 
-	auto&& data_opt = path_to_data(path.parent(), depth, ctx);
+	auto&& data_opt = path_to_data(path.parent(), depth, ctx, cache);
 	if (!data_opt) {
 		return std::nullopt;
 	}
@@ -477,7 +506,7 @@ static auto flex_path_to_value(HspObjectPath::Flex const& path, std::size_t dept
 	return hsx::data_to_flex(*data_opt);
 }
 
-static auto path_to_param_stack(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx) -> std::optional<hsx::HspParamStack> {
+static auto resolve_param_stack(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspParamStack> {
 	if (depth >= MAX_DEPTH) {
 		return std::nullopt;
 	}
@@ -486,7 +515,7 @@ static auto path_to_param_stack(HspObjectPath const& path, std::size_t depth, HS
 	switch (path.kind()) {
 	case HspObjectKind::Flex:
 		{
-			auto&& flex_opt = flex_path_to_value(path.as_flex(), depth, ctx);
+			auto&& flex_opt = flex_path_to_value(path.as_flex(), depth, ctx, cache);
 			if (!flex_opt) {
 				return std::nullopt;
 			}
@@ -501,7 +530,14 @@ static auto path_to_param_stack(HspObjectPath const& path, std::size_t depth, HS
 	}
 }
 
-static auto param_path_to_param_data(HspObjectPath::Param const& path, std::size_t depth, HSPCTX const* ctx) -> std::optional<hsx::HspParamData> {
+// パスを解決して param_stack を得る。(停止中はキャッシュする。)
+static auto path_to_param_stack(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspParamStack> {
+	return cache.param_stacks().get_or_resolve(path, cache.is_enabled(), [&] {
+		return resolve_param_stack(path, depth, ctx, cache);
+	});
+}
+
+static auto param_path_to_param_data(HspObjectPath::Param const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<hsx::HspParamData> {
 	if (depth >= MAX_DEPTH) {
 		return std::nullopt;
 	}
@@ -509,7 +545,7 @@ static auto param_path_to_param_data(HspObjectPath::Param const& path, std::size
 
 	auto&& parent = path.parent();
 
-	auto&& param_stack_opt = path_to_param_stack(parent, depth, ctx);
+	auto&& param_stack_opt = path_to_param_stack(parent, depth, ctx, cache);
 	if (!param_stack_opt) {
 		return std::nullopt;
 	}
@@ -521,7 +557,7 @@ static auto param_stack_to_memory_view(hsx::HspParamStack const& param_stack) ->
 	return MemoryView{ param_stack.ptr(), param_stack.size() };
 }
 
-static auto path_to_memory_view(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx) -> std::optional<MemoryView> {
+static auto path_to_memory_view(HspObjectPath const& path, std::size_t depth, HSPCTX const* ctx, HspPathResolutionCache& cache) -> std::optional<MemoryView> {
 	if (depth >= MAX_DEPTH) {
 		return std::nullopt;
 	}
@@ -529,11 +565,8 @@ static auto path_to_memory_view(HspObjectPath const& path, std::size_t depth, HS
 
 	switch (path.kind()) {
 	case HspObjectKind::StaticVar:
-	case HspObjectKind::Param:
 	{
-		// FIXME: str 引数のメモリビューに対応
-
-		auto&& pval_opt = path_to_pval(path, depth, ctx);
+		auto&& pval_opt = path_to_pval(path, depth, ctx, cache);
 		if (!pval_opt) {
 			return std::nullopt;
 		}
@@ -543,9 +576,21 @@ static auto path_to_memory_view(HspObjectPath const& path, std::size_t depth, HS
 		auto memory_view = MemoryView{ block_memory.data(), block_memory.size() };
 		return std::make_optional(memory_view);
 	}
+	case HspObjectKind::Param:
+	{
+		// FIXME: str 引数のメモリビューに対応
+
+		// var 引数は配列の先頭でなく、渡された要素を指す。
+		auto&& param_data_opt = param_path_to_param_data(path.as_param(), depth, ctx, cache);
+		if (!param_data_opt) {
+			return std::nullopt;
+		}
+
+		return hsx::param_data_to_memory_block(*param_data_opt, ctx);
+	}
 	case HspObjectKind::Element:
 	{
-		auto&& pval_opt = path_to_pval(path.parent(), depth, ctx);
+		auto&& pval_opt = path_to_pval(path.parent(), depth, ctx, cache);
 		if (!pval_opt) {
 			return std::nullopt;
 		}
@@ -561,7 +606,7 @@ static auto path_to_memory_view(HspObjectPath const& path, std::size_t depth, HS
 	}
 	case HspObjectKind::CallFrame:
 	{
-		auto&& param_stack_opt = path_to_param_stack(path, MIN_DEPTH, ctx);
+		auto&& param_stack_opt = path_to_param_stack(path, MIN_DEPTH, ctx, cache);
 		if (!param_stack_opt || !param_stack_opt->safety()) {
 			return std::nullopt;
 		}
@@ -574,65 +619,398 @@ static auto path_to_memory_view(HspObjectPath const& path, std::size_t depth, HS
 }
 
 // -----------------------------------------------
-// WcDebugger
+// HspObjects
 // -----------------------------------------------
 
-class WcDebuggerImpl
-	: public WcDebugger
+HspObjects::HspObjects(HSP3DEBUG* debug, std::vector<Utf8String>&& var_names, std::vector<HspObjects::Module>&& modules, std::unordered_map<hsx::HspLabel, Utf8String>&& label_names, std::unordered_map<STRUCTPRM const*, Utf8String>&& param_names, std::unique_ptr<SourceFileRepository>&& source_file_repository, HspLineTable&& line_table)
+	: debug_(debug)
+	, source_file_repository_(std::move(source_file_repository))
+	, line_table_(std::move(line_table))
+	, path_table_(std::make_unique<HspObjectPathTable>())
+	, root_path_(path_table_->new_root())
+	, resolution_cache_()
+	, snapshots_(0)
+	, snapshot_diff_()
+	, data_watches_()
+	, breakpoints_()
+	, breakpoint_enter_()
+	, profiler_()
+	, profiler_is_running_()
+	, sampler_()
+	, sampler_is_running_()
+	, coverage_(line_table_)
+	, coverage_is_running_()
+	, execution_trace_()
+	, call_history_()
+	, call_history_is_running_()
+	, call_graph_()
+	, call_graph_is_running_()
+	, var_names_(std::move(var_names))
+	, modules_(std::move(modules))
+	, types_(create_type_datas())
+	, label_names_(std::move(label_names))
+	, param_names_(std::move(param_names))
+	, log_()
 {
-	HSP3DEBUG* debug_;
+}
+
+void HspObjects::initialize() {
+	wc_initialize();
+}
 
-	SourceFileRepository& source_file_repository_;
+void HspObjects::debuggee_did_stop() {
+	// 停止した行のブレークポイントでは、再開してすぐに止まらないようにする。
+	// (停止中にブレークポイントが置かれることがあるので、ブレークポイントがなくても記録する。)
+	breakpoint_enter_.did_stop(script_to_line_slot());
 
-public:
-	WcDebuggerImpl(HSP3DEBUG* debug, SourceFileRepository& source_file_repository)
-		: debug_(debug)
-		, source_file_repository_(source_file_repository)
-	{
+	if (sampler_) {
+		sampler_->set_paused(true);
 	}
 
-	auto current_file_id_opt() const -> std::optional<std::size_t> {
-		auto&& file_ref_name_opt = hsx::debug_to_file_ref_name(debug_);
-		if (!file_ref_name_opt) {
+	resolution_cache_.debuggee_did_stop();
+	snapshots_.capture(context());
+	snapshot_diff_ = HspSnapshotDiff{ snapshots_.previous(), snapshots_.current() };
+}
+
+void HspObjects::debuggee_did_resume() {
+	resolution_cache_.debuggee_did_resume();
+	snapshot_diff_ = HspSnapshotDiff{};
+
+	if (sampler_) {
+		sampler_->set_paused(false);
+	}
+}
+
+auto HspObjects::stop_epoch() const -> std::size_t {
+	return resolution_cache_.stop_epoch();
+}
+
+auto HspObjects::debuggee_is_stopped() const -> bool {
+	return resolution_cache_.is_enabled();
+}
+
+auto HspObjects::snapshots() const -> HspSnapshotEngine const& {
+	return snapshots_;
+}
+
+void HspObjects::snapshot_do_set_memory_limit(std::size_t memory_limit) {
+	snapshot_diff_ = HspSnapshotDiff{};
+	snapshots_.set_memory_limit(memory_limit);
+}
+
+auto HspObjects::static_var_to_snapshot_diff(std::size_t static_var_id) -> std::optional<HspSnapshotVarDiff const*> {
+	if (!debuggee_is_stopped()) {
+		return std::nullopt;
+	}
+
+	return snapshot_diff_.static_var_diff(static_var_id);
+}
+
+auto HspObjects::path_is_changed_since_last_stop(HspObjectPath const& path) -> std::optional<bool> {
+	switch (path.kind()) {
+	case HspObjectKind::StaticVar: {
+		auto&& diff_opt = static_var_to_snapshot_diff(path.as_static_var().static_var_id());
+		if (!diff_opt) {
 			return std::nullopt;
 		}
 
-		auto&& id_opt = source_file_repository_.file_ref_name_to_file_id(*file_ref_name_opt);
-		if (!id_opt) {
+		return (**diff_opt).is_changed();
+	}
+	case HspObjectKind::Element: {
+		auto&& parent = path.parent();
+		if (parent.kind() != HspObjectKind::StaticVar) {
 			return std::nullopt;
 		}
 
-		return id_opt->id();
+		auto static_var_id = parent.as_static_var().static_var_id();
+		auto&& diff_opt = static_var_to_snapshot_diff(static_var_id);
+		if (!diff_opt) {
+			return std::nullopt;
+		}
+
+		auto&& pval_opt = hsx::static_var_to_pval(static_var_id, context());
+		if (!pval_opt) {
+			return std::nullopt;
+		}
+
+		auto&& aptr_opt = hsx::element_to_aptr(*pval_opt, path.as_element().indexes());
+		if (!aptr_opt) {
+			return std::nullopt;
+		}
+
+		return (**diff_opt).is_element_changed(*aptr_opt);
 	}
+	default:
+		return std::nullopt;
+	}
+}
 
-	void get_current_location(std::optional<std::size_t>& file_id_opt, std::size_t& line_index) override {
-		hsx::debug_do_update_location(debug_);
+auto HspObjects::data_watch_do_add(std::shared_ptr<HspObjectPath const> path) -> std::optional<std::size_t> {
+	auto&& memory_opt = path_to_memory_view(*path);
+	if (!memory_opt) {
+		return std::nullopt;
+	}
+
+	auto name = path->name(*this);
+	return data_watches_.add(std::move(path), std::move(name), *memory_opt);
+}
+
+auto HspObjects::data_watch_do_remove(std::size_t watch_id) -> bool {
+	return data_watches_.remove(watch_id);
+}
+
+void HspObjects::data_watch_do_clear() {
+	data_watches_.clear();
+}
+
+auto HspObjects::data_watch_is_empty() const -> bool {
+	return data_watches_.empty();
+}
 
-		file_id_opt = current_file_id_opt();
-		line_index = hsx::debug_to_line_index(debug_);
+auto HspObjects::data_watch_to_name(std::size_t watch_id) const -> std::optional<Utf8StringView> {
+	auto&& watch_opt = data_watches_.find(watch_id);
+	if (!watch_opt) {
+		return std::nullopt;
 	}
-};
 
-// -----------------------------------------------
-// HspObjects
-// -----------------------------------------------
+	return (**watch_opt).name();
+}
 
-HspObjects::HspObjects(HSP3DEBUG* debug, std::vector<Utf8String>&& var_names, std::vector<HspObjects::Module>&& modules, std::unordered_map<hsx::HspLabel, Utf8String>&& label_names, std::unordered_map<STRUCTPRM const*, Utf8String>&& param_names, std::unique_ptr<SourceFileRepository>&& source_file_repository, std::shared_ptr<WcDebugger> wc_debugger)
-	: debug_(debug)
-	, source_file_repository_(std::move(source_file_repository))
-	, root_path_(std::make_shared<HspObjectPath::Root>())
-	, var_names_(std::move(var_names))
-	, modules_(std::move(modules))
-	, types_(create_type_datas())
-	, label_names_(std::move(label_names))
-	, param_names_(std::move(param_names))
-	, wc_debugger_(std::move(wc_debugger))
-	, log_()
-{
+auto HspObjects::data_watch_check() -> std::vector<std::size_t> {
+	auto fired = std::vector<std::size_t>{};
+	data_watches_.check(
+		[&](DataWatch const& watch) {
+			return path_to_memory_view(*watch.path());
+		},
+		fired
+	);
+	return fired;
 }
 
-void HspObjects::initialize() {
-	wc_initialize(wc_debugger_);
+void HspObjects::breakpoint_do_set(std::size_t source_file_id, std::size_t line_index, bool enabled) {
+	breakpoints_.set(source_file_id, line_index, enabled);
+}
+
+void HspObjects::breakpoint_do_clear() {
+	breakpoints_.clear();
+}
+
+auto HspObjects::breakpoint_is_empty() const -> bool {
+	return breakpoints_.empty();
+}
+
+auto HspObjects::breakpoint_to_lines(std::size_t source_file_id) const -> std::vector<std::size_t> {
+	return breakpoints_.lines(source_file_id);
+}
+
+auto HspObjects::breakpoint_check() -> std::optional<HspLineTableEntry> {
+	auto line_slot = script_to_line_slot();
+	if (!breakpoint_enter_.enter(line_slot)) {
+		return std::nullopt;
+	}
+
+	auto&& line = line_table_.line_slot_to_entry(line_slot);
+	if (!breakpoints_.contains(line.file_id(), line.line_index())) {
+		return std::nullopt;
+	}
+	return line;
+}
+
+void HspObjects::profiler_do_start() {
+	profiler_ = std::make_unique<CallProfiler>(hsx::structs(context()).size(), CallProfiler::steady_clock_now);
+	profiler_is_running_ = true;
+	wc_set_profiler(profiler_.get());
+}
+
+void HspObjects::profiler_do_stop() {
+	wc_set_profiler(nullptr);
+	profiler_is_running_ = false;
+}
+
+auto HspObjects::profiler_is_running() const -> bool {
+	return profiler_is_running_;
+}
+
+auto HspObjects::profiler_to_report() const -> std::optional<Utf8String> {
+	if (!profiler_) {
+		return std::nullopt;
+	}
+
+	return profiler_->to_report(struct_names());
+}
+
+auto HspObjects::profiler_to_collapsed_stacks() const -> std::optional<Utf8String> {
+	if (!profiler_) {
+		return std::nullopt;
+	}
+
+	return profiler_->to_collapsed_stacks(struct_names());
+}
+
+void HspObjects::sampler_do_start(std::size_t interval_ms) {
+	sampler_do_stop();
+
+	// サンプリングのスレッドから、実行中のデバッギの実行位置を読む。
+	// ランタイムは ctx->mcs を排他せずに書き換えるので、ポインタを1回だけ読んで、コード領域の範囲内か確かめてから使う。
+	auto ctx = context();
+	auto source = [ctx]() -> std::optional<std::size_t> {
+		auto mcs = *(hsx::HspCodeUnit const* volatile const*)&ctx->mcs;
+		return hsx::code_to_offset(mcs, ctx);
+	};
+
+	sampler_ = std::make_unique<SamplingProfiler>(line_table_, source, std::chrono::milliseconds{ std::max(interval_ms, std::size_t{ 1 }) });
+	sampler_->set_paused(debuggee_is_stopped());
+	sampler_->start();
+	sampler_is_running_ = true;
+}
+
+void HspObjects::sampler_do_stop() {
+	if (sampler_) {
+		sampler_->stop();
+	}
+	sampler_is_running_ = false;
+}
+
+auto HspObjects::sampler_is_running() const -> bool {
+	return sampler_is_running_;
+}
+
+auto HspObjects::sampler_to_sample_count() const -> std::uint64_t {
+	if (!sampler_) {
+		return 0;
+	}
+
+	return sampler_->sample_count();
+}
+
+auto HspObjects::sampler_to_report(std::size_t limit) const -> std::optional<Utf8String> {
+	if (!sampler_) {
+		return std::nullopt;
+	}
+
+	return sampler_->to_report(limit, source_file_full_paths());
+}
+
+void HspObjects::coverage_do_start() {
+	coverage_is_running_ = true;
+}
+
+auto HspObjects::coverage_is_running() const -> bool {
+	return coverage_is_running_;
+}
+
+void HspObjects::coverage_record() {
+	coverage_.record(hsx::code_to_offset(context()->mcs, context()));
+}
+
+auto HspObjects::coverage_to_lcov() const -> Utf8String {
+	return coverage_.to_lcov(source_file_full_paths());
+}
+
+void HspObjects::execution_trace_do_start(ExecutionTraceWriter::Sink sink) {
+	execution_trace_do_stop();
+
+	execution_trace_ = std::make_unique<ExecutionTraceWriter>(std::move(sink), ExecutionTraceWriter::DEFAULT_BUFFER_SIZE);
+	execution_trace_->start();
+}
+
+void HspObjects::execution_trace_do_stop() {
+	if (execution_trace_) {
+		execution_trace_->stop();
+		execution_trace_.reset();
+	}
+}
+
+auto HspObjects::execution_trace_is_running() const -> bool {
+	return execution_trace_ != nullptr;
+}
+
+void HspObjects::execution_trace_record() {
+	if (auto&& line_opt = script_to_code_line()) {
+		execution_trace_->append(line_opt->file_id(), line_opt->line_index());
+	}
+}
+
+auto HspObjects::execution_trace_to_record_count() const -> std::uint64_t {
+	return execution_trace_ ? execution_trace_->record_count() : 0;
+}
+
+void HspObjects::call_history_do_start() {
+	call_history_ = std::make_unique<CallHistory>(CALL_HISTORY_MEMORY_BUDGET);
+	call_history_is_running_ = true;
+	wc_set_call_history(call_history_.get());
+}
+
+void HspObjects::call_history_do_stop() {
+	wc_set_call_history(nullptr);
+	call_history_is_running_ = false;
+}
+
+auto HspObjects::call_history_is_running() const -> bool {
+	return call_history_is_running_;
+}
+
+auto HspObjects::call_history_to_text(std::size_t limit) const -> std::optional<Utf8String> {
+	if (!call_history_) {
+		return std::nullopt;
+	}
+
+	auto&& full_paths = source_file_full_paths();
+	auto describe_caller = [&](hsx::HspCodeUnit const* caller_code) {
+		auto&& line_opt = code_to_line(caller_code);
+		if (!line_opt) {
+			return to_owned(as_utf8(u8"?"));
+		}
+
+		auto text = line_opt->file_id() < full_paths.size() ? full_paths[line_opt->file_id()] : Utf8String{};
+		text += as_utf8(strf(":%d", line_opt->line_index() + 1));
+		return text;
+	};
+
+	return call_history_->to_text(limit, struct_names(), describe_caller);
+}
+
+void HspObjects::call_graph_do_start() {
+	call_graph_ = std::make_unique<CallGraph>();
+	call_graph_is_running_ = true;
+	wc_set_call_graph(call_graph_.get());
+}
+
+void HspObjects::call_graph_do_stop() {
+	wc_set_call_graph(nullptr);
+	call_graph_is_running_ = false;
+}
+
+auto HspObjects::call_graph_is_running() const -> bool {
+	return call_graph_is_running_;
+}
+
+auto HspObjects::call_graph_to_dot() const -> std::optional<Utf8String> {
+	if (!call_graph_) {
+		return std::nullopt;
+	}
+
+	return call_graph_->to_dot(struct_names());
+}
+
+auto HspObjects::call_graph_to_json() const -> std::optional<Utf8String> {
+	if (!call_graph_) {
+		return std::nullopt;
+	}
+
+	return call_graph_->to_json(struct_names());
+}
+
+auto HspObjects::struct_names() const -> std::vector<Utf8String> {
+	auto&& structs = hsx::structs(context());
+
+	auto names = std::vector<Utf8String>{};
+	names.reserve(structs.size());
+	for (auto i = std::size_t{}; i < structs.size(); i++) {
+		auto&& name_opt = hsx::struct_to_name(structs.get_unchecked(i), context());
+		names.push_back(name_opt ? to_utf8(as_hsp(*name_opt)) : Utf8String{});
+	}
+	return names;
 }
 
 auto HspObjects::root_path() const->HspObjectPath::Root const& {
@@ -648,7 +1026,7 @@ auto HspObjects::path_to_visual_child_at(HspObjectPath const& path, std::size_t
 }
 
 auto HspObjects::path_to_memory_view(HspObjectPath const& path) const->std::optional<MemoryView> {
-	return (::path_to_memory_view(path, MIN_DEPTH, context()));
+	return (::path_to_memory_view(path, MIN_DEPTH, context(), resolution_cache_));
 }
 
 auto HspObjects::type_to_name(hsx::HspType type) const->Utf8StringView {
@@ -713,27 +1091,27 @@ auto HspObjects::static_var_path_to_type(HspObjectPath::StaticVar const& path)->
 }
 
 auto HspObjects::static_var_path_to_child_count(HspObjectPath::StaticVar const& path) const->std::size_t {
-	return var_path_to_child_count(path, context());
+	return var_path_to_child_count(path, context(), resolution_cache_);
 }
 
 auto HspObjects::static_var_path_to_child_at(HspObjectPath::StaticVar const& path, std::size_t child_index) const->std::shared_ptr<HspObjectPath const> {
-	return var_path_to_child_at(path, child_index, context());
+	return var_path_to_child_at(path, child_index, context(), resolution_cache_);
 }
 
 auto HspObjects::static_var_path_to_visual_child_count(HspObjectPath::StaticVar const& path)->std::size_t {
-	return var_path_to_visual_child_count(path, context(), *this);
+	return var_path_to_visual_child_count(path, context(), resolution_cache_, *this);
 }
 
 auto HspObjects::static_var_path_to_visual_child_at(HspObjectPath::StaticVar const& path, std::size_t child_index)->std::optional<std::shared_ptr<HspObjectPath const>> {
-	return var_path_to_visual_child_at(path, child_index, context(), *this);
+	return var_path_to_visual_child_at(path, child_index, context(), resolution_cache_, *this);
 }
 
 auto HspObjects::static_var_path_to_metadata(HspObjectPath::StaticVar const& path) -> hsx::HspVarMetadata {
-	return var_path_to_metadata(path, context()).value_or(hsx::HspVarMetadata::none());
+	return var_path_to_metadata(path, context(), resolution_cache_).value_or(hsx::HspVarMetadata::none());
 }
 
 auto HspObjects::element_path_is_alive(HspObjectPath::Element const& path) const -> bool {
-	auto pval_opt = path_to_pval(path.parent(), MIN_DEPTH, context());
+	auto pval_opt = path_to_pval(path.parent(), MIN_DEPTH, context(), resolution_cache_);
 	if (!pval_opt) {
 		return false;
 	}
@@ -754,7 +1132,7 @@ auto HspObjects::element_path_to_child_count(HspObjectPath::Element const& path)
 auto HspObjects::element_path_to_child_at(HspObjectPath::Element const& path, std::size_t child_index) const -> std::shared_ptr<HspObjectPath const> {
 	assert(child_index < element_path_to_child_count(path));
 
-	auto&& pval_opt = path_to_pval(path, MIN_DEPTH, context());
+	auto&& pval_opt = path_to_pval(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!pval_opt) {
 		assert(false && u8"Invalid element path");
 		return path.new_unavailable(to_owned(as_utf8(u8"変数を取得できません")));
@@ -790,7 +1168,7 @@ auto HspObjects::param_path_to_child_count(HspObjectPath::Param const& path) con
 	switch (path.param_type()) {
 	case MPTYPE_LOCALVAR:
 	case MPTYPE_ARRAYVAR:
-		return var_path_to_child_count(path, context());
+		return var_path_to_child_count(path, context(), resolution_cache_);
 
 	case MPTYPE_SINGLEVAR:
 	case MPTYPE_MODULEVAR:
@@ -813,11 +1191,11 @@ auto HspObjects::param_path_to_child_at(HspObjectPath::Param const& path, std::s
 	switch (path.param_type()) {
 	case MPTYPE_LOCALVAR:
 	case MPTYPE_ARRAYVAR:
-		return var_path_to_child_at(path, child_index, context());
+		return var_path_to_child_at(path, child_index, context(), resolution_cache_);
 
 	case MPTYPE_SINGLEVAR:
 		{
-			auto&& param_data_opt = param_path_to_param_data(path, MIN_DEPTH, context());
+			auto&& param_data_opt = param_path_to_param_data(path, MIN_DEPTH, context(), resolution_cache_);
 			if (!param_data_opt) {
 				return path.new_unavailable(to_owned(as_utf8(u8"引数データを取得できません")));
 			}
@@ -836,7 +1214,7 @@ auto HspObjects::param_path_to_child_at(HspObjectPath::Param const& path, std::s
 	case MPTYPE_MODULEVAR:
 	case MPTYPE_IMODULEVAR:
 	case MPTYPE_TMODULEVAR: {
-		auto&& param_data_opt = param_path_to_param_data(path, MIN_DEPTH, context());
+		auto&& param_data_opt = param_path_to_param_data(path, MIN_DEPTH, context(), resolution_cache_);
 		if (!param_data_opt) {
 			return path.new_unavailable(to_owned(as_utf8(u8"引数データを取得できません")));
 		}
@@ -875,7 +1253,7 @@ auto HspObjects::param_path_to_child_at(HspObjectPath::Param const& path, std::s
 }
 
 auto HspObjects::param_path_to_name(HspObjectPath::Param const& path) const -> Utf8String {
-	auto&& param_data_opt = param_path_to_param_data(path, MIN_DEPTH, context());
+	auto&& param_data_opt = param_path_to_param_data(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!param_data_opt) {
 		return to_owned(as_utf8(u8"<unavailable>"));
 	}
@@ -895,11 +1273,11 @@ auto HspObjects::param_path_to_name(HspObjectPath::Param const& path) const -> U
 
 auto HspObjects::param_path_to_var_metadata(HspObjectPath::Param const& path) const->std::optional<hsx::HspVarMetadata> {
 	// FIXME: var/modvar 引数なら指定された要素に関するメモリダンプを表示したい (要素数 1、メモリダンプはその要素の範囲のみ)
-	return var_path_to_metadata(path, context());
+	return var_path_to_metadata(path, context(), resolution_cache_);
 }
 
 bool HspObjects::label_path_is_null(HspObjectPath::Label const& path) const {
-	auto&& label_opt = label_path_to_value(path, context());
+	auto&& label_opt = label_path_to_value(path, context(), resolution_cache_);
 	if (!label_opt) {
 		return true;
 	}
@@ -908,7 +1286,7 @@ bool HspObjects::label_path_is_null(HspObjectPath::Label const& path) const {
 }
 
 auto HspObjects::label_path_to_static_label_name(HspObjectPath::Label const& path) const -> std::optional<Utf8String> {
-	auto&& label_opt = label_path_to_value(path, context());
+	auto&& label_opt = label_path_to_value(path, context(), resolution_cache_);
 	if (!label_opt) {
 		return std::nullopt;
 	}
@@ -922,7 +1300,7 @@ auto HspObjects::label_path_to_static_label_name(HspObjectPath::Label const& pat
 }
 
 auto HspObjects::label_path_to_static_label_id(HspObjectPath::Label const& path) const -> std::optional<std::size_t> {
-	auto&& label_opt = label_path_to_value(path, context());
+	auto&& label_opt = label_path_to_value(path, context(), resolution_cache_);
 	if (!label_opt) {
 		return std::nullopt;
 	}
@@ -944,19 +1322,19 @@ auto HspObjects::label_path_to_static_label_id(HspObjectPath::Label const& path)
 }
 
 auto HspObjects::str_path_to_value(HspObjectPath::Str const& path) const -> hsx::HspStr {
-	return (::str_path_to_value(path, context())).value_or(hsx::Slice<char>{});
+	return (::str_path_to_value(path, context(), resolution_cache_)).value_or(hsx::Slice<char>{});
 }
 
 auto HspObjects::double_path_to_value(HspObjectPath::Double const& path) const->hsx::HspDouble {
-	return (::double_path_to_value(path, context())).value_or(hsx::HspDouble{});
+	return (::double_path_to_value(path, context(), resolution_cache_)).value_or(hsx::HspDouble{});
 }
 
 auto HspObjects::int_path_to_value(HspObjectPath::Int const& path) const -> hsx::HspInt {
-	return (::int_path_to_value(path, context())).value_or(hsx::HspInt{});
+	return (::int_path_to_value(path, context(), resolution_cache_)).value_or(hsx::HspInt{});
 }
 
 auto HspObjects::flex_path_to_child_count(HspObjectPath::Flex const& path)->std::size_t {
-	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context());
+	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!flex_opt || hsx::flex_is_nullmod(*flex_opt)) {
 		return 0;
 	}
@@ -965,7 +1343,7 @@ auto HspObjects::flex_path_to_child_count(HspObjectPath::Flex const& path)->std:
 }
 
 auto HspObjects::flex_path_to_child_at(HspObjectPath::Flex const& path, std::size_t index)->std::shared_ptr<HspObjectPath const> {
-	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context());
+	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!flex_opt || hsx::flex_is_nullmod(*flex_opt)) {
 		assert(false && u8"Invalid flex path child index");
 		throw new std::out_of_range{ u8"child_index" };
@@ -982,7 +1360,7 @@ auto HspObjects::flex_path_to_child_at(HspObjectPath::Flex const& path, std::siz
 }
 
 auto HspObjects::flex_path_is_nullmod(HspObjectPath::Flex const& path) -> std::optional<bool> {
-	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context());
+	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!flex_opt) {
 		return std::nullopt;
 	}
@@ -991,7 +1369,7 @@ auto HspObjects::flex_path_is_nullmod(HspObjectPath::Flex const& path) -> std::o
 }
 
 auto HspObjects::flex_path_is_clone(HspObjectPath::Flex const& path) -> std::optional<bool> {
-	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context());
+	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!flex_opt) {
 		return std::nullopt;
 	}
@@ -1000,7 +1378,7 @@ auto HspObjects::flex_path_is_clone(HspObjectPath::Flex const& path) -> std::opt
 }
 
 auto HspObjects::flex_path_to_module_name(HspObjectPath::Flex const& path) -> Utf8String {
-	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context());
+	auto&& flex_opt = flex_path_to_value(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!flex_opt || hsx::flex_is_nullmod(*flex_opt)) {
 		return to_owned(as_utf8(u8"null"));
 	}
@@ -1139,7 +1517,7 @@ auto HspObjects::call_frame_path_is_alive(HspObjectPath::CallFrame const& path)
 }
 
 auto HspObjects::call_frame_path_to_child_count(HspObjectPath::CallFrame const& path) const -> std::size_t {
-	auto&& param_stack_opt = path_to_param_stack(path, MIN_DEPTH, context());
+	auto&& param_stack_opt = path_to_param_stack(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!param_stack_opt) {
 		return 0;
 	}
@@ -1148,7 +1526,7 @@ auto HspObjects::call_frame_path_to_child_count(HspObjectPath::CallFrame const&
 }
 
 auto HspObjects::call_frame_path_to_child_at(HspObjectPath::CallFrame const& path, std::size_t child_index) const -> std::optional<std::shared_ptr<HspObjectPath const>> {
-	auto&& param_stack_opt = path_to_param_stack(path, MIN_DEPTH, context());
+	auto&& param_stack_opt = path_to_param_stack(path, MIN_DEPTH, context(), resolution_cache_);
 	if (!param_stack_opt) {
 		return std::nullopt;
 	}
@@ -1185,11 +1563,11 @@ auto HspObjects::call_frame_path_to_full_path(HspObjectPath::CallFrame const& pa
 		return std::nullopt;
 	}
 
-	auto&& file_id_opt = call_frame_opt->get().file_id_opt();
-	if (!file_id_opt) {
+	auto&& line_opt = code_to_line(call_frame_opt->get().caller_code());
+	if (!line_opt) {
 		return std::nullopt;
 	}
-	auto file_id = SourceFileId{ *file_id_opt };
+	auto file_id = SourceFileId{ line_opt->file_id() };
 
 	auto&& full_path_opt = source_file_repository_->file_to_full_path_as_utf8(file_id);
 	if (!full_path_opt) {
@@ -1205,7 +1583,12 @@ auto HspObjects::call_frame_path_to_line_index(HspObjectPath::CallFrame const& p
 		return std::nullopt;
 	}
 
-	return std::make_optional(call_frame_opt->get().line_index());
+	auto&& line_opt = code_to_line(call_frame_opt->get().caller_code());
+	if (!line_opt) {
+		return std::nullopt;
+	}
+
+	return std::make_optional(line_opt->line_index());
 }
 
 auto HspObjects::general_to_content() -> Utf8String {
@@ -1252,6 +1635,10 @@ auto HspObjects::script_to_current_line() const -> std::size_t {
 	return hsx::debug_to_line_index(debug());
 }
 
+auto HspObjects::script_to_code_line() const -> std::optional<HspLineTableEntry> {
+	return code_to_line(context()->mcs);
+}
+
 auto HspObjects::script_to_current_location_summary() const -> Utf8String {
 	// FIXME: 長すぎるときは切る
 	auto file_ref_name = hsx::debug_to_file_ref_name(debug()).value_or(u8"hsptmp");
@@ -1276,6 +1663,27 @@ auto HspObjects::source_file_to_content(std::size_t source_file_id) const->std::
 	return source_file_repository_->file_to_content(SourceFileId{ source_file_id });
 }
 
+auto HspObjects::source_file_full_paths() const -> std::vector<Utf8String> {
+	auto full_paths = std::vector<Utf8String>{};
+	for (auto file_id = std::size_t{}; file_id < line_table_.file_id_end(); file_id++) {
+		auto&& path_opt = source_file_to_full_path(file_id);
+		full_paths.push_back(path_opt ? Utf8String{ *path_opt } : Utf8String{});
+	}
+	return full_paths;
+}
+
+auto HspObjects::line_table() const -> HspLineTable const& {
+	return line_table_;
+}
+
+auto HspObjects::code_to_line(hsx::HspCodeUnit const* code) const -> std::optional<HspLineTableEntry> {
+	return line_table_.position_to_line(hsx::code_to_offset(code, context()));
+}
+
+auto HspObjects::script_to_line_slot() const -> std::uint32_t {
+	return line_table_.position_to_line_slot(hsx::code_to_offset(context()->mcs, context()));
+}
+
 auto HspObjects::context() const -> HSPCTX const* {
 	return hsx::debug_to_context(debug());
 }
@@ -1332,6 +1740,10 @@ static void read_debug_segment(HspObjectsBuilder& builder, SourceFileResolver& r
 			builder.add_param_name(item_opt->num(), item_opt->str(), ctx);
 			continue;
 
+		case hsx::DebugSegmentItemKind::Line:
+			builder.add_line(item_opt->str(), item_opt->num(), item_opt->code_offset(), item_opt->code_size());
+			continue;
+
 		default:
 			continue;
 		}
@@ -1365,12 +1777,39 @@ void HspObjectsBuilder::add_param_name(int param_index, char const* param_name,
 	param_names_.emplace(*param_opt, std::move(name));
 }
 
+void HspObjectsBuilder::add_line(char const* file_ref_name, int line_number, std::size_t code_offset, std::size_t code_size) {
+	lines_.push_back(Line{ file_ref_name, (std::size_t)std::max(0, line_number - 1), code_offset, code_size });
+}
+
 void HspObjectsBuilder::read_debug_segment(SourceFileResolver& resolver, HSPCTX const* ctx) {
 	(::read_debug_segment)(*this, resolver, ctx);
 }
 
+auto HspObjectsBuilder::build_line_table(SourceFileRepository const& source_file_repository) const -> HspLineTable {
+	auto builder = HspLineTableBuilder{};
+
+	// 同じファイルの行が続くので、直前のファイルIDを使い回す。
+	auto last_file_ref_name = (char const*)nullptr;
+	auto file_id_opt = std::optional<SourceFileId>{};
+
+	for (auto&& line : lines_) {
+		if (line.file_ref_name_ != last_file_ref_name) {
+			last_file_ref_name = line.file_ref_name_;
+			file_id_opt = source_file_repository.file_ref_name_to_file_id(line.file_ref_name_);
+		}
+
+		if (!file_id_opt) {
+			continue;
+		}
+
+		builder.add(line.code_offset_, line.code_size_, file_id_opt->id(), line.line_index_);
+	}
+
+	return builder.finish();
+}
+
 auto HspObjectsBuilder::finish(HSP3DEBUG* debug, std::unique_ptr<SourceFileRepository>&& source_file_repository)->HspObjects {
 	auto modules = group_vars_by_module(var_names_);
-	auto wc_debugger = std::shared_ptr<WcDebugger>{ std::make_shared<WcDebuggerImpl>(debug, *source_file_repository) };
-	return HspObjects{ debug, std::move(var_names_), std::move(modules), std::move(label_names_), std::move(param_names_), std::move(source_file_repository), std::move(wc_debugger) };
+	auto line_table = build_line_table(*source_file_repository);
+	return HspObjects{ debug, std::move(var_names_), std::move(modules), std::move(label_names_), std::move(param_names_), std::move(source_file_repository), std::move(line_table) };
 }
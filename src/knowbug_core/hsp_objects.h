@@ -5,11 +5,23 @@
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include "call_graph.h"
+#include "call_history.h"
+#include "call_profiler.h"
+#include "data_watch.h"
+#include "execution_trace.h"
 #include "encoding.h"
 #include "hsx.h"
+#include "hsp_line_table.h"
+#include "hsp_object_path_cache.h"
 #include "hsp_object_path_fwd.h"
+#include "hsp_snapshot_diff.h"
+#include "line_breakpoint.h"
+#include "line_coverage.h"
+#include "sampling_profiler.h"
 #include "hsp_wrap_call.h"
 
+class HspObjectPathTable;
 class SourceFileId;
 class SourceFileRepository;
 class SourceFileResolver;
@@ -29,23 +41,190 @@ private:
 
 	std::unique_ptr<SourceFileRepository> source_file_repository_;
 
+	// コード位置とソースファイルの行の対応表
+	HspLineTable line_table_;
+
+	// パスのインターン表 (パスより先に作り、後に破棄する。)
+	std::unique_ptr<HspObjectPathTable> path_table_;
+
 	std::shared_ptr<HspObjectPath const> root_path_;
 
+	// パスの解決結果のキャッシュ (停止中だけ使う。)
+	mutable HspPathResolutionCache resolution_cache_;
+
+	// 停止するたびに取る静的変数のスナップショット
+	HspSnapshotEngine snapshots_;
+
+	// 前回の停止時と今回の停止時のスナップショットの差分 (停止中だけ使う。)
+	HspSnapshotDiff snapshot_diff_;
+
+	// データブレークポイント
+	DataWatchList data_watches_;
+
+	// 行ブレークポイント
+	LineBreakpointSet breakpoints_;
+
+	// 行ブレークポイントを判定する行に入ったか (同じ行の中を実行している間は、繰り返し停止しない。)
+	LineEnterDetector breakpoint_enter_;
+
+	// 呼び出しプロファイラー (計測を始めるまでは null。終えた後も結果を出力するために残しておく。)
+	std::unique_ptr<CallProfiler> profiler_;
+	bool profiler_is_running_;
+
+	// サンプリングプロファイラー (呼び出しプロファイラーと同様に、終えた後も結果を残しておく。)
+	std::unique_ptr<SamplingProfiler> sampler_;
+	bool sampler_is_running_;
+
+	// 行カバレッジ (命令ごとに記録するので、ビットの配列は最初に確保しておく。)
+	LineCoverage coverage_;
+	bool coverage_is_running_;
+
+	// 実行トレース (記録していなければ null)
+	std::unique_ptr<ExecutionTraceWriter> execution_trace_;
+
+	// 呼び出し履歴 (呼び出しプロファイラーと同様に、終えた後も記録を残しておく。)
+	std::unique_ptr<CallHistory> call_history_;
+	bool call_history_is_running_;
+
+	// 呼び出しグラフ (呼び出しプロファイラーと同様に、終えた後も結果を出力するために残しておく。)
+	std::unique_ptr<CallGraph> call_graph_;
+	bool call_graph_is_running_;
+
 	std::vector<Utf8String> var_names_;
 	std::vector<Module> modules_;
 	std::vector<TypeData> types_;
 	std::unordered_map<hsx::HspLabel, Utf8String> label_names_;
 	std::unordered_map<STRUCTPRM const*, Utf8String> param_names_;
 
-	std::shared_ptr<WcDebugger> wc_debugger_;
-
 	Utf8String log_;
 
 public:
-	HspObjects(HSP3DEBUG* debug, std::vector<Utf8String>&& var_names, std::vector<Module>&& modules, std::unordered_map<hsx::HspLabel, Utf8String>&& label_names, std::unordered_map<STRUCTPRM const*, Utf8String>&& param_names, std::unique_ptr<SourceFileRepository>&& source_file_repository, std::shared_ptr<WcDebugger> wc_debugger);
+	HspObjects(HSP3DEBUG* debug, std::vector<Utf8String>&& var_names, std::vector<Module>&& modules, std::unordered_map<hsx::HspLabel, Utf8String>&& label_names, std::unordered_map<STRUCTPRM const*, Utf8String>&& param_names, std::unique_ptr<SourceFileRepository>&& source_file_repository, HspLineTable&& line_table);
 
 	void initialize();
 
+	// デバッギが停止した。(再開するまで、パスの解決結果をキャッシュする。スナップショットを取る。)
+	void debuggee_did_stop();
+
+	// デバッギが実行を再開した。(停止エポックを進めて、キャッシュを捨てる。)
+	void debuggee_did_resume();
+
+	// 停止エポック: デバッギが再開するたびに1つ進む番号
+	auto stop_epoch() const->std::size_t;
+
+	auto debuggee_is_stopped() const->bool;
+
+	auto snapshots() const->HspSnapshotEngine const&;
+
+	// スナップショットが使うメモリーの上限を設定する。(0 ならスナップショットを取らない。)
+	void snapshot_do_set_memory_limit(std::size_t memory_limit);
+
+	// 静的変数の、前回の停止時からの差分 (停止中でないか、スナップショットがなくて分からないときは nullopt)
+	auto static_var_to_snapshot_diff(std::size_t static_var_id)->std::optional<HspSnapshotVarDiff const*>;
+
+	// パスが指す値が前回の停止時から変化したか。
+	// 静的変数とその要素についてだけ分かる。(分からないときは nullopt)
+	auto path_is_changed_since_last_stop(HspObjectPath const& path)->std::optional<bool>;
+
+	// パスが指すメモリーの監視を始める。(メモリーが得られないときは nullopt)
+	auto data_watch_do_add(std::shared_ptr<HspObjectPath const> path)->std::optional<std::size_t>;
+
+	auto data_watch_do_remove(std::size_t watch_id)->bool;
+
+	void data_watch_do_clear();
+
+	auto data_watch_is_empty() const->bool;
+
+	auto data_watch_to_name(std::size_t watch_id) const->std::optional<Utf8StringView>;
+
+	// 監視しているメモリーを調べて、前回調べたときから変化したものの番号を返す。
+	auto data_watch_check()->std::vector<std::size_t>;
+
+	void breakpoint_do_set(std::size_t source_file_id, std::size_t line_index, bool enabled);
+
+	void breakpoint_do_clear();
+
+	auto breakpoint_is_empty() const->bool;
+
+	auto breakpoint_to_lines(std::size_t source_file_id) const->std::vector<std::size_t>;
+
+	// 実行位置がブレークポイントのある行に入ったか判定する。入ったらその行を返す。
+	auto breakpoint_check()->std::optional<HspLineTableEntry>;
+
+	// ユーザー定義命令・関数の呼び出しの計測を始める。(前回の結果は捨てる。)
+	void profiler_do_start();
+
+	void profiler_do_stop();
+
+	auto profiler_is_running() const->bool;
+
+	// 命令ごとの集計の表 (計測していなければ nullopt)
+	auto profiler_to_report() const->std::optional<Utf8String>;
+
+	// 呼び出しの経路ごとの集計 (collapsed stack 形式。計測していなければ nullopt)
+	auto profiler_to_collapsed_stacks() const->std::optional<Utf8String>;
+
+	// 実行位置のサンプリングを始める。(前回の結果は捨てる。)
+	void sampler_do_start(std::size_t interval_ms);
+
+	void sampler_do_stop();
+
+	auto sampler_is_running() const->bool;
+
+	// サンプル数の合計 (サンプリングしていなければ 0)
+	auto sampler_to_sample_count() const->std::uint64_t;
+
+	// サンプル数の多い行を最大 limit 個と、ファイルごとのサンプル数の表 (サンプリングしていなければ nullopt)
+	auto sampler_to_report(std::size_t limit) const->std::optional<Utf8String>;
+
+	// 実行された行の記録を始める。(記録はトレースモードで命令ごとに行う。)
+	void coverage_do_start();
+
+	auto coverage_is_running() const->bool;
+
+	// 現在の実行位置の行を、実行されたものとして記録する。
+	void coverage_record();
+
+	// 記録した行カバレッジ (lcov のトレースファイルの形式)
+	auto coverage_to_lcov() const->Utf8String;
+
+	// 実行した文の行を実行トレースとして sink に書き出し始める。(記録はトレースモードで命令ごとに行う。)
+	void execution_trace_do_start(ExecutionTraceWriter::Sink sink);
+
+	// 残りの記録を書き出して、実行トレースの記録を終える。
+	void execution_trace_do_stop();
+
+	auto execution_trace_is_running() const->bool;
+
+	// 現在の実行位置の行を実行トレースに記録する。
+	void execution_trace_record();
+
+	// 記録した文の個数
+	auto execution_trace_to_record_count() const->std::uint64_t;
+
+	// ユーザー定義命令・関数の呼び出しを、引数と戻り値とともに記録し始める。(前回の記録は捨てる。)
+	void call_history_do_start();
+
+	void call_history_do_stop();
+
+	auto call_history_is_running() const->bool;
+
+	// 終了した呼び出しを新しい順に最大 limit 個並べたもの (記録していなければ nullopt)
+	auto call_history_to_text(std::size_t limit) const->std::optional<Utf8String>;
+
+	// 呼び出し元から呼び出し先への辺ごとに、呼び出し回数を数え始める。(前回の結果は捨てる。)
+	void call_graph_do_start();
+
+	void call_graph_do_stop();
+
+	auto call_graph_is_running() const->bool;
+
+	// 呼び出しグラフ (DOT 形式。数えていなければ nullopt)
+	auto call_graph_to_dot() const->std::optional<Utf8String>;
+
+	// 呼び出しグラフ (JSON 形式。数えていなければ nullopt)
+	auto call_graph_to_json() const->std::optional<Utf8String>;
+
 	auto root_path() const->HspObjectPath::Root const&;
 
 	auto path_to_visual_child_count(HspObjectPath const& path)->std::size_t;
@@ -161,6 +340,9 @@ public:
 
 	auto script_to_current_line() const -> std::size_t;
 
+	// 実行位置が指す行を、コード位置と行の対応表から引く。
+	auto script_to_code_line() const->std::optional<HspLineTableEntry>;
+
 	auto script_to_current_location_summary() const->Utf8String;
 
 	// :thinking_face:
@@ -170,7 +352,22 @@ public:
 
 	auto source_file_to_content(std::size_t source_file_id) const->std::optional<Utf8StringView>;
 
+	auto line_table() const->HspLineTable const&;
+
 private:
+	// cmdid ごとのユーザー定義命令・関数の名前
+	auto struct_names() const->std::vector<Utf8String>;
+
+	// ファイルIDごとのソースファイルの絶対パス (分からなければ空)
+	auto source_file_full_paths() const->std::vector<Utf8String>;
+
+	// コード上のポインタを実行位置とみなして、その行を引く。(HspLineTable::position_to_line)
+	auto code_to_line(hsx::HspCodeUnit const* code) const->std::optional<HspLineTableEntry>;
+
+	// 実行位置が指す行の番号を引く。(なければ HspLineTable::NO_LINE_SLOT)
+	// 命令ごとに呼ぶので、探索せずに表を引く。
+	auto script_to_line_slot() const->std::uint32_t;
+
 	auto debug() -> HSP3DEBUG* {
 		return debug_;
 	}
@@ -215,12 +412,24 @@ public:
 };
 
 class HspObjectsBuilder {
+	// デバッグセグメントから読んだ、行のコードの範囲。
+	// (ファイルIDはソースファイルのリポジトリができてから決まる。)
+	class Line {
+	public:
+		char const* file_ref_name_;
+		std::size_t line_index_;
+		std::size_t code_offset_;
+		std::size_t code_size_;
+	};
+
 	std::vector<Utf8String> var_names_;
 
 	std::unordered_map<hsx::HspLabel, Utf8String> label_names_;
 
 	std::unordered_map<STRUCTPRM const*, Utf8String> param_names_;
 
+	std::vector<Line> lines_;
+
 public:
 	void add_var_name(char const* var_name);
 
@@ -228,9 +437,14 @@ public:
 
 	void add_param_name(int param_index, char const* param_name, HSPCTX const* ctx);
 
+	void add_line(char const* file_ref_name, int line_number, std::size_t code_offset, std::size_t code_size);
+
 	void read_debug_segment(SourceFileResolver& resolver, HSPCTX const* ctx);
 
 	auto finish(HSP3DEBUG* debug, std::unique_ptr<SourceFileRepository>&& source_file_repository)->HspObjects;
+
+private:
+	auto build_line_table(SourceFileRepository const& source_file_repository) const->HspLineTable;
 };
 
 // 迷子
@@ -0,0 +1,582 @@
+#include "pch.h"
+#include <algorithm>
+#include <cstring>
+#include "hsp_snapshot.h"
+#include "hsx_test_context.h"
+#include "test_suite.h"
+
+// モジュール型のメンバーをたどる深さの上限
+static constexpr auto MAX_MEMBER_DEPTH = std::size_t{ 8 };
+
+static auto align_up(std::size_t size) -> std::size_t {
+	return (size + SnapshotArena::ALIGNMENT - 1) / SnapshotArena::ALIGNMENT * SnapshotArena::ALIGNMENT;
+}
+
+// -----------------------------------------------
+// SnapshotArena
+// -----------------------------------------------
+
+SnapshotArena::SnapshotArena()
+	: chunks_()
+	, size_()
+{
+}
+
+auto SnapshotArena::allocate(std::size_t size) -> unsigned char* {
+	size = align_up(size);
+
+	if (chunks_.empty() || chunks_.back().capacity_ - chunks_.back().used_ < size) {
+		auto capacity = std::max(CHUNK_SIZE, size);
+		chunks_.push_back(Chunk{ std::make_unique<unsigned char[]>(capacity), capacity, 0 });
+	}
+
+	auto&& chunk = chunks_.back();
+	auto p = chunk.data_.get() + chunk.used_;
+	chunk.used_ += size;
+	size_ += size;
+	return p;
+}
+
+auto SnapshotArena::copy(MemoryView memory) -> unsigned char const* {
+	auto p = allocate(memory.size());
+	std::memcpy(p, memory.data(), memory.size());
+	return p;
+}
+
+// -----------------------------------------------
+// HspSnapshotVar
+// -----------------------------------------------
+
+HspSnapshotVar::HspSnapshotVar(hsx::HspType type, hsx::HspVarMode mode, hsx::HspDimIndex lengths)
+	: type_(type)
+	, mode_(mode)
+	, lengths_(lengths)
+	, blocks_()
+	, members_()
+{
+}
+
+// メンバーは要素番号とメンバー番号の順に並んでいる。
+auto HspSnapshotVar::find_member(std::size_t element_index, std::size_t member_index) const -> HspSnapshotVar const* {
+	auto iter = std::lower_bound(
+		members_.begin(), members_.end(), std::make_pair(element_index, member_index),
+		[](HspSnapshotMember const& member, std::pair<std::size_t, std::size_t> const& key) {
+			return std::make_pair(member.element_index(), member.member_index()) < key;
+		});
+	if (iter == members_.end() || iter->element_index() != element_index || iter->member_index() != member_index) {
+		return nullptr;
+	}
+
+	return &iter->var();
+}
+
+void HspSnapshotVar::add_member(std::size_t element_index, std::size_t member_index, HspSnapshotVar var) {
+	members_.emplace_back(element_index, member_index, std::move(var));
+}
+
+void HspSnapshotVar::for_each_block(std::function<void(HspSnapshotBlock&)> const& f) {
+	for (auto&& block : blocks_) {
+		f(block);
+	}
+
+	for (auto&& member : members_) {
+		member.var().for_each_block(f);
+	}
+}
+
+// -----------------------------------------------
+// HspSnapshot
+// -----------------------------------------------
+
+// スナップショットを作る処理
+class HspSnapshot::Builder {
+	HSPCTX const* ctx_;
+	HspSnapshot const* previous_;
+	std::size_t memory_limit_;
+
+	std::shared_ptr<SnapshotArena> arena_;
+	std::shared_ptr<HspSnapshot> snapshot_;
+
+public:
+	Builder(std::size_t id, HSPCTX const* ctx, HspSnapshot const* previous, std::size_t memory_limit)
+		: ctx_(ctx)
+		, previous_(previous)
+		, memory_limit_(memory_limit)
+		, arena_(std::make_shared<SnapshotArena>())
+		, snapshot_(std::make_shared<HspSnapshot>(id, arena_))
+	{
+	}
+
+	auto build() -> std::shared_ptr<HspSnapshot const> {
+		auto count = hsx::static_var_count(ctx_);
+		snapshot_->static_vars_.reserve(count);
+
+		for (auto i = std::size_t{}; i < count; i++) {
+			auto&& pval_opt = hsx::static_var_to_pval(i, ctx_);
+			if (!pval_opt) {
+				assert(false && u8"static var should exist");
+				break;
+			}
+
+			auto prev = previous_ != nullptr && i < previous_->static_var_count()
+				? &previous_->static_var_at(i)
+				: nullptr;
+			snapshot_->static_vars_.push_back(capture_var(*pval_opt, prev, 0));
+		}
+
+		compact();
+		return snapshot_;
+	}
+
+private:
+	auto capture_var(PVal const* pval, HspSnapshotVar const* prev, std::size_t depth) -> HspSnapshotVar {
+		auto var = HspSnapshotVar{ hsx::pval_to_type(pval), hsx::pval_to_varmode(pval), hsx::pval_to_lengths(pval) };
+
+		if (var.mode() == hsx::HspVarMode::None) {
+			return var;
+		}
+
+		// 形が変わったら、前回のブロックとは対応しない。
+		if (prev != nullptr && !var.has_same_shape(*prev)) {
+			prev = nullptr;
+		}
+
+		switch (var.type()) {
+		case hsx::HspType::Str: {
+			auto count = hsx::pval_to_element_count(pval);
+			for (auto aptr = std::size_t{}; aptr < count; aptr++) {
+				var.add_block(capture_block(hsx::element_to_memory_block(pval, aptr, ctx_), prev, var.blocks().size()));
+			}
+			break;
+		}
+		case hsx::HspType::Struct: {
+			auto count = hsx::pval_to_element_count(pval);
+			for (auto aptr = std::size_t{}; aptr < count; aptr++) {
+				capture_flex_element(pval, aptr, var, prev, depth);
+			}
+			break;
+		}
+		default:
+			var.add_block(capture_block(hsx::pval_to_memory_block(pval, ctx_), prev, 0));
+			break;
+		}
+
+		return var;
+	}
+
+	void capture_flex_element(PVal const* pval, std::size_t aptr, HspSnapshotVar& var, HspSnapshotVar const* prev, std::size_t depth) {
+		auto block_index = var.blocks().size();
+
+		auto&& data_opt = hsx::element_to_data(pval, aptr, ctx_);
+		auto&& flex_opt = data_opt ? hsx::data_to_flex(*data_opt) : std::nullopt;
+		if (!flex_opt || hsx::flex_is_nullmod(*flex_opt)) {
+			var.add_block(capture_block(MemoryView{}, prev, block_index));
+			return;
+		}
+
+		auto&& param_stack_opt = hsx::flex_to_param_stack(*flex_opt, ctx_);
+		if (!param_stack_opt) {
+			var.add_block(capture_block(MemoryView{}, prev, block_index));
+			return;
+		}
+
+		var.add_block(capture_block(MemoryView{ param_stack_opt->ptr(), param_stack_opt->size() }, prev, block_index));
+
+		// クローンは他の変数のメンバーを指しているので、たどらない。
+		if (depth >= MAX_MEMBER_DEPTH || hsx::flex_is_clone(*flex_opt)) {
+			return;
+		}
+
+		auto member_count = hsx::flex_to_member_count(*flex_opt, ctx_);
+		for (auto member_index = std::size_t{}; member_index < member_count; member_index++) {
+			auto&& param_data_opt = hsx::flex_to_member(*flex_opt, member_index, ctx_);
+			if (!param_data_opt || hsx::param_data_to_type(*param_data_opt) != MPTYPE_LOCALVAR) {
+				continue;
+			}
+
+			auto&& member_pval_opt = hsx::param_data_to_pval(*param_data_opt);
+			if (!member_pval_opt) {
+				continue;
+			}
+
+			auto prev_member = prev != nullptr ? prev->find_member(aptr, member_index) : nullptr;
+			var.add_member(aptr, member_index, capture_var(*member_pval_opt, prev_member, depth + 1));
+		}
+	}
+
+	auto capture_block(MemoryView memory, HspSnapshotVar const* prev, std::size_t block_index) -> HspSnapshotBlock {
+		auto size = memory.size();
+		if (size == 0) {
+			return HspSnapshotBlock{ memory.data(), nullptr, 0, nullptr, false };
+		}
+
+		// 前回と同じ位置・大きさ・内容なら、前回の写しを参照する。
+		if (prev != nullptr && block_index < prev->blocks().size()) {
+			auto&& prev_block = prev->blocks()[block_index];
+			auto prev_view = prev_block.view();
+			if (prev_block.source() == memory.data()
+				&& prev_block.size() == size
+				&& prev_view.data() != nullptr
+				&& std::memcmp(prev_view.data(), memory.data(), size) == 0
+				) {
+				retain(prev_block.arena());
+				snapshot_->shared_size_ += size;
+				return HspSnapshotBlock{ memory.data(), (unsigned char const*)prev_view.data(), size, prev_block.arena(), true };
+			}
+		}
+
+		if (arena_->size() + align_up(size) > memory_limit_) {
+			snapshot_->truncated_ = true;
+			return HspSnapshotBlock{ memory.data(), nullptr, size, nullptr, false };
+		}
+
+		snapshot_->copied_size_ += size;
+		return HspSnapshotBlock{ memory.data(), arena_->copy(memory), size, arena_.get(), false };
+	}
+
+	// 前回のスナップショットの領域を、このスナップショットからも参照する。
+	void retain(SnapshotArena const* arena) {
+		auto&& arenas = snapshot_->arenas_;
+		auto found = std::any_of(arenas.begin(), arenas.end(), [&](auto&& a) { return a.get() == arena; });
+		if (found) {
+			return;
+		}
+
+		for (auto&& a : previous_->arenas()) {
+			if (a.get() == arena) {
+				arenas.push_back(a);
+				return;
+			}
+		}
+
+		assert(false && u8"previous snapshot should own the arena");
+	}
+
+	// 前回までの領域のうち、このスナップショットから参照しているバイト数より、参照していないバイト数のほうが大きいものは、
+	// 参照しているブロックをこのスナップショットの領域に写し直して、手放す。
+	// これにより、上限に数えられるのはほぼ生きている写しだけになる。
+	void compact() {
+		auto&& arenas = snapshot_->arenas_;
+		if (arenas.size() <= 1) {
+			return;
+		}
+
+		auto index_of = [&](SnapshotArena const* arena) {
+			auto iter = std::find_if(arenas.begin(), arenas.end(), [&](auto&& a) { return a.get() == arena; });
+			assert(iter != arenas.end());
+			return (std::size_t)(iter - arenas.begin());
+		};
+
+		auto for_each_shared_block = [&](auto&& f) {
+			for (auto&& var : snapshot_->static_vars_) {
+				var.for_each_block([&](HspSnapshotBlock& block) {
+					if (block.is_shared()) {
+						f(block, index_of(block.arena()));
+					}
+				});
+			}
+		};
+
+		// 領域ごとに、参照しているバイト数を数える。(先頭は自身の領域)
+		auto live_sizes = std::vector<std::size_t>(arenas.size());
+		for_each_shared_block([&](HspSnapshotBlock& block, std::size_t arena_index) {
+			live_sizes[arena_index] += align_up(block.size());
+		});
+
+		auto released = std::vector<bool>(arenas.size());
+		auto any_released = false;
+		for (auto i = std::size_t{ 1 }; i < arenas.size(); i++) {
+			released[i] = arenas[i]->size() - live_sizes[i] > live_sizes[i];
+			any_released = any_released || released[i];
+		}
+		if (!any_released) {
+			return;
+		}
+
+		for_each_shared_block([&](HspSnapshotBlock& block, std::size_t arena_index) {
+			if (!released[arena_index]) {
+				return;
+			}
+
+			// 写し直す余裕がなければ、その領域は手放さない。
+			if (arena_->size() + align_up(block.size()) > memory_limit_) {
+				released[arena_index] = false;
+				return;
+			}
+
+			snapshot_->shared_size_ -= block.size();
+			snapshot_->copied_size_ += block.size();
+			block = HspSnapshotBlock{ block.source(), arena_->copy(block.view()), block.size(), arena_.get(), false };
+		});
+
+		auto kept = std::vector<std::shared_ptr<SnapshotArena const>>{};
+		for (auto i = std::size_t{}; i < arenas.size(); i++) {
+			if (!released[i]) {
+				kept.push_back(std::move(arenas[i]));
+			}
+		}
+		arenas = std::move(kept);
+	}
+};
+
+HspSnapshot::HspSnapshot(std::size_t id, std::shared_ptr<SnapshotArena> arena)
+	: id_(id)
+	, arena_(arena)
+	, arenas_{ arena }
+	, static_vars_()
+	, truncated_()
+	, copied_size_()
+	, shared_size_()
+{
+}
+
+auto HspSnapshot::capture(std::size_t id, HSPCTX const* ctx, HspSnapshot const* previous, std::size_t memory_limit) -> std::shared_ptr<HspSnapshot const> {
+	return Builder{ id, ctx, previous, memory_limit }.build();
+}
+
+auto HspSnapshot::memory_size() const -> std::size_t {
+	auto size = std::size_t{};
+	for (auto&& arena : arenas_) {
+		size += arena->size();
+	}
+	return size;
+}
+
+// -----------------------------------------------
+// HspSnapshotEngine
+// -----------------------------------------------
+
+HspSnapshotEngine::HspSnapshotEngine(std::size_t memory_limit)
+	: memory_limit_(memory_limit)
+	, capture_count_()
+	, current_()
+	, previous_()
+{
+}
+
+void HspSnapshotEngine::set_memory_limit(std::size_t memory_limit) {
+	memory_limit_ = memory_limit;
+
+	if (memory_limit_ == 0) {
+		clear();
+	}
+}
+
+void HspSnapshotEngine::capture(HSPCTX const* ctx) {
+	if (memory_limit_ == 0) {
+		return;
+	}
+
+	// 2つ前のスナップショットを捨てる。
+	// 新しいスナップショットが参照する領域は、自身の領域と、最新のスナップショットが参照している領域の一部だけなので、
+	// 自身の領域が上限の残りに収まればよい。
+	// (最新のスナップショットは、それより前の領域を参照していることがある。ただし、大半が使われなくなった領域は写し直して手放しているので、
+	// 上限に数えられるのはほぼ生きている写しだけになる。)
+	previous_ = std::move(current_);
+
+	auto used = previous_ ? previous_->memory_size() : std::size_t{};
+	auto budget = memory_limit_ - std::min(memory_limit_, used);
+
+	capture_count_++;
+	current_ = HspSnapshot::capture(capture_count_, ctx, previous_.get(), budget);
+}
+
+auto HspSnapshotEngine::memory_size() const -> std::size_t {
+	auto arenas = std::vector<SnapshotArena const*>{};
+
+	for (auto&& snapshot : { current_.get(), previous_.get() }) {
+		if (snapshot == nullptr) {
+			continue;
+		}
+
+		for (auto&& arena : snapshot->arenas()) {
+			if (std::find(arenas.begin(), arenas.end(), arena.get()) == arenas.end()) {
+				arenas.push_back(arena.get());
+			}
+		}
+	}
+
+	auto size = std::size_t{};
+	for (auto arena : arenas) {
+		size += arena->size();
+	}
+	return size;
+}
+
+void HspSnapshotEngine::clear() {
+	current_.reset();
+	previous_.reset();
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+static auto block_to_string(HspSnapshotBlock const& block) -> std::string {
+	auto view = block.view();
+	return std::string{ (char const*)view.data() };
+}
+
+static auto block_to_int(HspSnapshotBlock const& block, std::size_t index) -> int {
+	auto value = int{};
+	std::memcpy(&value, (unsigned char const*)block.view().data() + index * sizeof(int), sizeof(int));
+	return value;
+}
+
+void hsp_snapshot_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"hsp_snapshot");
+
+	suite.test(
+		u8"int 型と str 型の変数を写せる",
+		[](TestCaseContext& t) {
+			auto context = HsxTestContext{ 2 };
+			context.dim_int(0, 3);
+			context.set_int(0, 0, 1);
+			context.set_int(0, 2, 3);
+			context.sdim(1, 16, 2);
+			context.set_str(1, 0, "hello");
+			context.set_str(1, 1, "world");
+
+			auto snapshot = HspSnapshot::capture(1, context.context(), nullptr, 1024 * 1024);
+			auto&& int_var = snapshot->static_var_at(0);
+			auto&& str_var = snapshot->static_var_at(1);
+
+			// 写した後で元の変数を書き換えても、写しは変わらない。
+			context.set_int(0, 0, 100);
+			context.set_str(1, 0, "bye");
+
+			return t.eq(snapshot->static_var_count(), std::size_t{ 2 })
+				&& t.eq(int_var.blocks().size(), std::size_t{ 1 })
+				&& t.eq(int_var.blocks()[0].size(), 3 * sizeof(int))
+				&& t.eq(block_to_int(int_var.blocks()[0], 0), 1)
+				&& t.eq(block_to_int(int_var.blocks()[0], 2), 3)
+				&& t.eq(str_var.blocks().size(), std::size_t{ 2 })
+				&& t.eq(block_to_string(str_var.blocks()[0]), std::string{ "hello" })
+				&& t.eq(block_to_string(str_var.blocks()[1]), std::string{ "world" })
+				&& t.eq(snapshot->is_truncated(), false);
+		});
+
+	suite.test(
+		u8"変化していないブロックは前回の写しを参照する",
+		[](TestCaseContext& t) {
+			auto context = HsxTestContext{ 2 };
+			context.dim_int(0, 4);
+			context.sdim(1, 16, 2);
+			context.set_str(1, 0, "a");
+			context.set_str(1, 1, "b");
+
+			auto first = HspSnapshot::capture(1, context.context(), nullptr, 1024 * 1024);
+
+			context.set_str(1, 1, "c");
+			auto second = HspSnapshot::capture(2, context.context(), first.get(), 1024 * 1024);
+
+			auto&& int_block = second->static_var_at(0).blocks()[0];
+			auto&& str_blocks = second->static_var_at(1).blocks();
+
+			return t.eq(int_block.is_shared(), true)
+				&& t.eq(int_block.view().data() == first->static_var_at(0).blocks()[0].view().data(), true)
+				&& t.eq(str_blocks[0].is_shared(), true)
+				&& t.eq(str_blocks[1].is_shared(), false)
+				&& t.eq(block_to_string(str_blocks[1]), std::string{ "c" })
+				&& t.eq(second->copied_size(), std::size_t{ 16 })
+				&& t.eq(second->arenas().size(), std::size_t{ 2 });
+		});
+
+	suite.test(
+		u8"確保し直した変数は新しく写す",
+		[](TestCaseContext& t) {
+			auto context = HsxTestContext{ 1 };
+			context.dim_int(0, 2);
+
+			auto first = HspSnapshot::capture(1, context.context(), nullptr, 1024 * 1024);
+
+			context.dim_int(0, 5);
+			auto second = HspSnapshot::capture(2, context.context(), first.get(), 1024 * 1024);
+
+			auto&& block = second->static_var_at(0).blocks()[0];
+			return t.eq(block.is_shared(), false)
+				&& t.eq(block.size(), 5 * sizeof(int))
+				&& t.eq(second->shared_size(), std::size_t{})
+				&& t.eq(second->arenas().size(), std::size_t{ 1 });
+		});
+
+	suite.test(
+		u8"上限を超える分は写さない",
+		[](TestCaseContext& t) {
+			auto context = HsxTestContext{ 1 };
+			context.sdim(0, 64, 4);
+
+			auto snapshot = HspSnapshot::capture(1, context.context(), nullptr, 150);
+			auto&& blocks = snapshot->static_var_at(0).blocks();
+
+			return t.eq(snapshot->is_truncated(), true)
+				&& t.eq(blocks[0].is_captured(), true)
+				&& t.eq(blocks[1].is_captured(), true)
+				&& t.eq(blocks[2].is_captured(), false)
+				&& t.eq(blocks[2].size(), std::size_t{ 64 })
+				&& t.eq(snapshot->memory_size() <= 150, true);
+		});
+
+	suite.test(
+		u8"エンジンは上限の中で2つのスナップショットを持つ",
+		[](TestCaseContext& t) {
+			static constexpr auto LIMIT = std::size_t{ 1000 };
+
+			auto context = HsxTestContext{ 2 };
+			context.dim_int(0, 50);
+			context.sdim(1, 64, 4);
+
+			auto engine = HspSnapshotEngine{ LIMIT };
+			for (auto i = 0; i < 10; i++) {
+				context.set_int(0, i, i);
+				context.set_str(1, i % 4, i % 2 == 0 ? "even" : "odd");
+				engine.capture(context.context());
+
+				if (!t.eq(engine.memory_size() <= LIMIT, true)) {
+					return false;
+				}
+			}
+
+			auto current_id = engine.current()->id();
+			auto previous_id = engine.previous()->id();
+
+			engine.set_memory_limit(0);
+			engine.capture(context.context());
+
+			return t.eq(current_id, std::size_t{ 10 })
+				&& t.eq(previous_id, std::size_t{ 9 })
+				&& t.eq(engine.current() == nullptr, true)
+				&& t.eq(engine.memory_size(), std::size_t{});
+		});
+
+	suite.test(
+		u8"変化しない小さなブロックのために古い写しを持ち続けない",
+		[](TestCaseContext& t) {
+			// 大きな配列は上限の 4 割ほどで、停止するたびに変化する。小さな配列は変化しない。
+			static constexpr auto LIMIT = std::size_t{ 100000 };
+			static constexpr auto LARGE_LENGTH = std::size_t{ 10000 };
+
+			auto context = HsxTestContext{ 2 };
+			context.dim_int(0, LARGE_LENGTH);
+			context.dim_int(1, 4);
+			context.set_int(1, 0, 42);
+
+			auto engine = HspSnapshotEngine{ LIMIT };
+			for (auto i = 0; i < 8; i++) {
+				context.set_int(0, 0, i);
+				engine.capture(context.context());
+
+				auto&& current = *engine.current();
+				auto&& small_block = current.static_var_at(1).blocks()[0];
+				if (!t.eq(current.is_truncated(), false)
+					|| !t.eq(current.static_var_at(0).blocks()[0].is_captured(), true)
+					|| !t.eq(block_to_int(small_block, 0), 42)
+					|| !t.eq(current.arenas().size(), std::size_t{ 1 })
+					|| !t.eq(engine.memory_size() <= LIMIT, true)
+					) {
+					return false;
+				}
+			}
+			return true;
+		});
+}
@@ -0,0 +1,301 @@
+//! 変数の状態のスナップショット
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+#include "hsx.h"
+#include "memory_view.h"
+
+class Tests;
+
+// スナップショットのデータを置く領域。
+//
+// 確保は先頭から順に切り出すだけで、個別には解放しない。(領域ごとまとめて解放する。)
+// 大きな確保はそれだけのチャンクを作る。
+class SnapshotArena {
+	class Chunk {
+	public:
+		std::unique_ptr<unsigned char[]> data_;
+		std::size_t capacity_;
+		std::size_t used_;
+	};
+
+	std::vector<Chunk> chunks_;
+
+	// 切り出したバイト数の合計
+	std::size_t size_;
+
+public:
+	static constexpr auto CHUNK_SIZE = std::size_t{ 64 * 1024 };
+
+	static constexpr auto ALIGNMENT = std::size_t{ 16 };
+
+	SnapshotArena();
+
+	SnapshotArena(SnapshotArena const& other) = delete;
+
+	auto operator=(SnapshotArena const& other) -> SnapshotArena& = delete;
+
+	auto allocate(std::size_t size) -> unsigned char*;
+
+	// メモリーの内容を写して、写しを返す。
+	auto copy(MemoryView memory) -> unsigned char const*;
+
+	auto size() const -> std::size_t {
+		return size_;
+	}
+};
+
+// スナップショットに含まれるメモリーブロック
+class HspSnapshotBlock {
+	// 実行時のメモリー上の位置
+	void const* source_;
+
+	// 写し (メモリーの上限に達して写せなかったときは nullptr)
+	unsigned char const* data_;
+
+	std::size_t size_;
+
+	// 写しを置いている領域
+	SnapshotArena const* arena_;
+
+	// 前回のスナップショットの写しを参照しているか
+	bool shared_;
+
+public:
+	HspSnapshotBlock(void const* source, unsigned char const* data, std::size_t size, SnapshotArena const* arena, bool shared)
+		: source_(source)
+		, data_(data)
+		, size_(size)
+		, arena_(arena)
+		, shared_(shared)
+	{
+	}
+
+	auto source() const -> void const* {
+		return source_;
+	}
+
+	auto size() const -> std::size_t {
+		return size_;
+	}
+
+	auto is_captured() const -> bool {
+		return data_ != nullptr || size_ == 0;
+	}
+
+	auto arena() const -> SnapshotArena const* {
+		return arena_;
+	}
+
+	auto is_shared() const -> bool {
+		return shared_;
+	}
+
+	auto view() const -> MemoryView {
+		return data_ != nullptr ? MemoryView{ data_, size_ } : MemoryView{};
+	}
+};
+
+class HspSnapshotMember;
+
+// 変数 (PVal) のスナップショット。
+//
+// メモリーブロックの分け方は変数の型による:
+// - str 型: 要素ごとのバッファー
+// - モジュール型: 要素ごとのメンバーの領域 (引数スタック)
+// - その他の型: すべての要素を含むブロック1つ
+class HspSnapshotVar {
+	hsx::HspType type_;
+	hsx::HspVarMode mode_;
+	hsx::HspDimIndex lengths_;
+
+	std::vector<HspSnapshotBlock> blocks_;
+
+	// モジュール型の要素が持つメンバー変数
+	std::vector<HspSnapshotMember> members_;
+
+public:
+	HspSnapshotVar(hsx::HspType type, hsx::HspVarMode mode, hsx::HspDimIndex lengths);
+
+	auto type() const -> hsx::HspType {
+		return type_;
+	}
+
+	auto mode() const -> hsx::HspVarMode {
+		return mode_;
+	}
+
+	auto lengths() const -> hsx::HspDimIndex const& {
+		return lengths_;
+	}
+
+	auto blocks() const -> std::vector<HspSnapshotBlock> const& {
+		return blocks_;
+	}
+
+	auto members() const -> std::vector<HspSnapshotMember> const& {
+		return members_;
+	}
+
+	// 変数の形 (型と要素数) が other と同じか
+	auto has_same_shape(HspSnapshotVar const& other) const -> bool {
+		return type_ == other.type_ && lengths_ == other.lengths_;
+	}
+
+	// 要素が持つメンバー変数を探す。(見つからなければ nullptr)
+	auto find_member(std::size_t element_index, std::size_t member_index) const->HspSnapshotVar const*;
+
+	void add_block(HspSnapshotBlock block) {
+		blocks_.push_back(block);
+	}
+
+	void add_member(std::size_t element_index, std::size_t member_index, HspSnapshotVar var);
+
+	// メンバー変数のものを含めて、すべてのブロックを順に渡す。(ブロックを書き換えてもよい。)
+	void for_each_block(std::function<void(HspSnapshotBlock&)> const& f);
+};
+
+// モジュール型の変数の要素が持つメンバー変数のスナップショット
+class HspSnapshotMember {
+	std::size_t element_index_;
+	std::size_t member_index_;
+	HspSnapshotVar var_;
+
+public:
+	HspSnapshotMember(std::size_t element_index, std::size_t member_index, HspSnapshotVar var)
+		: element_index_(element_index)
+		, member_index_(member_index)
+		, var_(std::move(var))
+	{
+	}
+
+	auto element_index() const -> std::size_t {
+		return element_index_;
+	}
+
+	auto member_index() const -> std::size_t {
+		return member_index_;
+	}
+
+	auto var() const -> HspSnapshotVar const& {
+		return var_;
+	}
+
+	auto var() -> HspSnapshotVar& {
+		return var_;
+	}
+};
+
+// ある停止時点での、すべての静的変数のスナップショット。
+//
+// 写しは1つの領域にまとめて置く。
+// 前回のスナップショットから変化していないブロックは写さず、前回の写しを参照する。(そのため前回までの領域を所有する。)
+// ただし、参照している部分より使われなくなった部分のほうが大きい領域は、参照しているブロックを自身の領域に写し直して手放す。
+// (小さなブロックのために、変化した大きな変数の古い写しを持ち続けないようにする。)
+class HspSnapshot {
+	// 取得した順に振る番号
+	std::size_t id_;
+
+	std::shared_ptr<SnapshotArena> arena_;
+
+	// このスナップショットが参照している領域 (自身の領域を含む)
+	std::vector<std::shared_ptr<SnapshotArena const>> arenas_;
+
+	std::vector<HspSnapshotVar> static_vars_;
+
+	// メモリーの上限に達して写せなかったブロックがあるか
+	bool truncated_;
+
+	// 新しく写したバイト数と、前回の写しを参照したバイト数
+	std::size_t copied_size_;
+	std::size_t shared_size_;
+
+public:
+	// ctx の静的変数を写す。
+	// previous が指定されたら、変化していないブロックは previous の写しを参照する。
+	// 新しく写すのは memory_limit バイトまで。
+	static auto capture(std::size_t id, HSPCTX const* ctx, HspSnapshot const* previous, std::size_t memory_limit) -> std::shared_ptr<HspSnapshot const>;
+
+	HspSnapshot(std::size_t id, std::shared_ptr<SnapshotArena> arena);
+
+	auto id() const -> std::size_t {
+		return id_;
+	}
+
+	auto static_var_count() const -> std::size_t {
+		return static_vars_.size();
+	}
+
+	auto static_var_at(std::size_t static_var_index) const -> HspSnapshotVar const& {
+		return static_vars_.at(static_var_index);
+	}
+
+	auto is_truncated() const -> bool {
+		return truncated_;
+	}
+
+	auto copied_size() const -> std::size_t {
+		return copied_size_;
+	}
+
+	auto shared_size() const -> std::size_t {
+		return shared_size_;
+	}
+
+	auto arenas() const -> std::vector<std::shared_ptr<SnapshotArena const>> const& {
+		return arenas_;
+	}
+
+	// 参照している領域の大きさの合計
+	auto memory_size() const -> std::size_t;
+
+private:
+	class Builder;
+};
+
+// デバッギが停止するたびにスナップショットを取るもの。
+//
+// 最新のスナップショットと、その1つ前のものを持つ。
+// 2つが参照する領域の合計が memory_limit を超えないように、新しく写す量を制限する。
+class HspSnapshotEngine {
+	std::size_t memory_limit_;
+
+	std::size_t capture_count_;
+
+	std::shared_ptr<HspSnapshot const> current_;
+	std::shared_ptr<HspSnapshot const> previous_;
+
+public:
+	// memory_limit が 0 ならスナップショットを取らない。
+	explicit HspSnapshotEngine(std::size_t memory_limit);
+
+	auto memory_limit() const -> std::size_t {
+		return memory_limit_;
+	}
+
+	void set_memory_limit(std::size_t memory_limit);
+
+	// 静的変数のスナップショットを取る。
+	void capture(HSPCTX const* ctx);
+
+	// 最新のスナップショット
+	auto current() const -> HspSnapshot const* {
+		return current_.get();
+	}
+
+	// 1つ前のスナップショット
+	auto previous() const -> HspSnapshot const* {
+		return previous_.get();
+	}
+
+	// 持っているスナップショットが参照している領域の大きさの合計
+	auto memory_size() const -> std::size_t;
+
+	void clear();
+};
+
+extern void hsp_snapshot_tests(Tests& tests);
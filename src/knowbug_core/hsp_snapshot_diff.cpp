@@ -0,0 +1,409 @@
+#include "pch.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "hsp_snapshot_diff.h"
+#include "hsx_test_context.h"
+#include "test_suite.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KNOWBUG_SNAPSHOT_DIFF_SSE2
+#include <emmintrin.h>
+#endif
+
+// 一度に比べるバイト数
+static constexpr auto WORD_SIZE = std::size_t{ 16 };
+
+// 変化がないことを確かめるときに、まとめて比べるバイト数
+static constexpr auto STRIDE_SIZE = WORD_SIZE * 4;
+
+// 16バイトが等しいか
+static auto words_equal(unsigned char const* a, unsigned char const* b) -> bool {
+#ifdef KNOWBUG_SNAPSHOT_DIFF_SSE2
+	auto x = _mm_loadu_si128((__m128i const*)a);
+	auto y = _mm_loadu_si128((__m128i const*)b);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+#else
+	std::uint64_t x[2], y[2];
+	std::memcpy(x, a, WORD_SIZE);
+	std::memcpy(y, b, WORD_SIZE);
+	return ((x[0] ^ y[0]) | (x[1] ^ y[1])) == 0;
+#endif
+}
+
+// 64バイトが等しいか
+static auto strides_equal(unsigned char const* a, unsigned char const* b) -> bool {
+#ifdef KNOWBUG_SNAPSHOT_DIFF_SSE2
+	auto e0 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*)a), _mm_loadu_si128((__m128i const*)b));
+	auto e1 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*)(a + 16)), _mm_loadu_si128((__m128i const*)(b + 16)));
+	auto e2 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*)(a + 32)), _mm_loadu_si128((__m128i const*)(b + 32)));
+	auto e3 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*)(a + 48)), _mm_loadu_si128((__m128i const*)(b + 48)));
+	auto e = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+	return _mm_movemask_epi8(e) == 0xFFFF;
+#else
+	return words_equal(a, b)
+		&& words_equal(a + 16, b + 16)
+		&& words_equal(a + 32, b + 32)
+		&& words_equal(a + 48, b + 48);
+#endif
+}
+
+// [first, last) の範囲にかかる単位のうち、内容が異なるものを追加する。
+// (changed_units の base 番目以降に追加済みの単位は調べない。)
+static void diff_units_in_range(unsigned char const* a, unsigned char const* b, std::size_t size, std::size_t first, std::size_t last, std::size_t unit_size, std::size_t base, std::vector<std::size_t>& changed_units) {
+	for (auto unit = first / unit_size; unit * unit_size < last; unit++) {
+		if (changed_units.size() > base && changed_units.back() >= unit) {
+			continue;
+		}
+
+		auto offset = unit * unit_size;
+		auto n = std::min(unit_size, size - offset);
+		if (std::memcmp(a + offset, b + offset, n) != 0) {
+			changed_units.push_back(unit);
+		}
+	}
+}
+
+void memory_diff_units(MemoryView before, MemoryView after, std::size_t unit_size, std::vector<std::size_t>& changed_units) {
+	if (unit_size == 0) {
+		assert(false && u8"unit_size must be positive");
+		return;
+	}
+
+	auto a = (unsigned char const*)before.data();
+	auto b = (unsigned char const*)after.data();
+	auto size = std::min(before.size(), after.size());
+
+	// 追加する前の末尾
+	auto base = changed_units.size();
+
+	auto offset = std::size_t{};
+	while (offset + STRIDE_SIZE <= size) {
+		if (strides_equal(a + offset, b + offset)) {
+			offset += STRIDE_SIZE;
+			continue;
+		}
+
+		for (auto end = offset + STRIDE_SIZE; offset < end; offset += WORD_SIZE) {
+			if (!words_equal(a + offset, b + offset)) {
+				diff_units_in_range(a, b, size, offset, offset + WORD_SIZE, unit_size, base, changed_units);
+			}
+		}
+	}
+
+	while (offset + WORD_SIZE <= size) {
+		if (!words_equal(a + offset, b + offset)) {
+			diff_units_in_range(a, b, size, offset, offset + WORD_SIZE, unit_size, base, changed_units);
+		}
+		offset += WORD_SIZE;
+	}
+
+	if (offset < size) {
+		diff_units_in_range(a, b, size, offset, size, unit_size, base, changed_units);
+	}
+
+	// 長いほうにだけある単位
+	auto total_size = std::max(before.size(), after.size());
+	for (auto unit = size / unit_size; unit * unit_size < total_size; unit++) {
+		if (std::min(unit * unit_size + unit_size, total_size) <= size) {
+			continue;
+		}
+
+		if (changed_units.size() == base || changed_units.back() < unit) {
+			changed_units.push_back(unit);
+		}
+	}
+}
+
+// -----------------------------------------------
+// HspSnapshotVarDiff
+// -----------------------------------------------
+
+auto HspSnapshotVarDiff::is_element_changed(std::size_t aptr) const -> bool {
+	return all_changed_ || std::binary_search(changed_elements_.begin(), changed_elements_.end(), aptr);
+}
+
+// 2つのブロックの内容が等しいか。(写しがなくて分からなければ nullopt)
+static auto blocks_equal(HspSnapshotBlock const& previous, HspSnapshotBlock const& current) -> std::optional<bool> {
+	if (current.is_shared()) {
+		return true;
+	}
+
+	if (previous.size() != current.size()) {
+		return false;
+	}
+
+	if (!previous.is_captured() || !current.is_captured()) {
+		return std::nullopt;
+	}
+
+	return current.size() == 0 || std::memcmp(previous.view().data(), current.view().data(), current.size()) == 0;
+}
+
+auto snapshot_var_diff(HspSnapshotVar const& previous, HspSnapshotVar const& current) -> std::optional<HspSnapshotVarDiff> {
+	auto&& previous_blocks = previous.blocks();
+	auto&& current_blocks = current.blocks();
+
+	if (!current.has_same_shape(previous) || current.mode() != previous.mode() || previous_blocks.size() != current_blocks.size()) {
+		return HspSnapshotVarDiff{ true, std::vector<std::size_t>{} };
+	}
+
+	auto changed = std::vector<std::size_t>{};
+
+	switch (current.type()) {
+	case hsx::HspType::Str:
+	case hsx::HspType::Struct: {
+		// ブロックは要素ごとにある。
+		for (auto i = std::size_t{}; i < current_blocks.size(); i++) {
+			auto equal_opt = blocks_equal(previous_blocks[i], current_blocks[i]);
+			if (!equal_opt) {
+				return std::nullopt;
+			}
+
+			if (!*equal_opt) {
+				changed.push_back(i);
+			}
+		}
+
+		// メンバー変数が変化した要素も変化したとみなす。
+		for (auto&& member : current.members()) {
+			auto previous_member = previous.find_member(member.element_index(), member.member_index());
+			if (previous_member == nullptr) {
+				changed.push_back(member.element_index());
+				continue;
+			}
+
+			auto member_diff_opt = snapshot_var_diff(*previous_member, member.var());
+			if (!member_diff_opt) {
+				return std::nullopt;
+			}
+
+			if (member_diff_opt->is_changed()) {
+				changed.push_back(member.element_index());
+			}
+		}
+
+		std::sort(changed.begin(), changed.end());
+		changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+		break;
+	}
+	default: {
+		// すべての要素を含むブロックが1つある。(メモリーがなければ0個)
+		if (current_blocks.empty() || current_blocks[0].is_shared()) {
+			break;
+		}
+
+		auto&& previous_block = previous_blocks[0];
+		auto&& current_block = current_blocks[0];
+		if (!previous_block.is_captured() || !current_block.is_captured()) {
+			return std::nullopt;
+		}
+
+		auto element_count = current.lengths().size();
+		if (element_count == 0 || current_block.size() % element_count != 0) {
+			auto equal_opt = blocks_equal(previous_block, current_block);
+			return HspSnapshotVarDiff{ !equal_opt.value_or(false), std::vector<std::size_t>{} };
+		}
+
+		memory_diff_units(previous_block.view(), current_block.view(), current_block.size() / element_count, changed);
+		break;
+	}
+	}
+
+	return HspSnapshotVarDiff{ false, std::move(changed) };
+}
+
+// -----------------------------------------------
+// HspSnapshotDiff
+// -----------------------------------------------
+
+HspSnapshotDiff::HspSnapshotDiff()
+	: HspSnapshotDiff(nullptr, nullptr)
+{
+}
+
+HspSnapshotDiff::HspSnapshotDiff(HspSnapshot const* previous, HspSnapshot const* current)
+	: previous_(previous)
+	, current_(current)
+	, computed_()
+	, static_vars_()
+{
+	if (previous_ != nullptr && current_ != nullptr) {
+		computed_.resize(current_->static_var_count());
+		static_vars_.resize(current_->static_var_count());
+	}
+}
+
+auto HspSnapshotDiff::static_var_diff(std::size_t static_var_index) -> std::optional<HspSnapshotVarDiff const*> {
+	if (static_var_index >= static_vars_.size() || static_var_index >= previous_->static_var_count()) {
+		return std::nullopt;
+	}
+
+	if (!computed_[static_var_index]) {
+		auto diff_opt = snapshot_var_diff(previous_->static_var_at(static_var_index), current_->static_var_at(static_var_index));
+		if (diff_opt) {
+			static_vars_[static_var_index] = std::make_unique<HspSnapshotVarDiff const>(std::move(*diff_opt));
+		}
+		computed_[static_var_index] = true;
+	}
+
+	auto&& diff = static_vars_[static_var_index];
+	if (!diff) {
+		return std::nullopt;
+	}
+
+	return diff.get();
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+// memory_diff_units の結果と比べるための、単純な実装
+static auto naive_diff_units(std::vector<unsigned char> const& a, std::vector<unsigned char> const& b, std::size_t unit_size) -> std::vector<std::size_t> {
+	auto changed = std::vector<std::size_t>{};
+	auto size = std::max(a.size(), b.size());
+
+	for (auto unit = std::size_t{}; unit * unit_size < size; unit++) {
+		for (auto i = unit * unit_size; i < std::min(size, unit * unit_size + unit_size); i++) {
+			if (i >= a.size() || i >= b.size() || a[i] != b[i]) {
+				changed.push_back(unit);
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+static auto diff_units(std::vector<unsigned char> const& a, std::vector<unsigned char> const& b, std::size_t unit_size) -> std::vector<std::size_t> {
+	auto changed = std::vector<std::size_t>{};
+	memory_diff_units(MemoryView{ a.data(), a.size() }, MemoryView{ b.data(), b.size() }, unit_size, changed);
+	return changed;
+}
+
+void hsp_snapshot_diff_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"hsp_snapshot_diff");
+
+	suite.test(
+		u8"変化した単位だけを列挙する",
+		[](TestCaseContext& t) {
+			auto a = std::vector<unsigned char>(1000 * sizeof(int));
+			auto b = a;
+			for (auto i : { 0, 5, 249, 999 }) {
+				b[i * sizeof(int) + 1] = 1;
+			}
+
+			auto expected = std::vector<std::size_t>{ 0, 5, 249, 999 };
+			return t.eq(diff_units(a, b, sizeof(int)) == expected, true)
+				&& t.eq(diff_units(a, a, sizeof(int)).empty(), true);
+		});
+
+	suite.test(
+		u8"単純な実装と結果が一致する",
+		[](TestCaseContext& t) {
+			auto seed = 1u;
+			auto next = [&] {
+				seed = seed * 1103515245 + 12345;
+				return (std::size_t)(seed >> 16);
+			};
+
+			for (auto round = 0; round < 200; round++) {
+				auto size = next() % 300;
+				auto a = std::vector<unsigned char>(size);
+				for (auto&& x : a) {
+					x = (unsigned char)next();
+				}
+
+				auto b = a;
+				b.resize(round % 5 == 0 ? size + next() % 40 : size);
+				for (auto i = next() % 6; i > 0 && !b.empty(); i--) {
+					b[next() % b.size()] ^= 0x80;
+				}
+
+				for (auto unit_size : { 1, 3, 4, 8, 24, 100 }) {
+					if (!t.eq(diff_units(a, b, unit_size) == naive_diff_units(a, b, unit_size), true)) {
+						return false;
+					}
+				}
+			}
+			return true;
+		});
+
+	suite.test(
+		u8"配列の変数の、変化した要素を求める",
+		[](TestCaseContext& t) {
+			auto context = HsxTestContext{ 3 };
+			context.dim_int(0, 100);
+			context.sdim(1, 16, 3);
+			context.dim_int(2, 4);
+
+			auto first = HspSnapshot::capture(1, context.context(), nullptr, 1024 * 1024);
+
+			context.set_int(0, 3, 30);
+			context.set_int(0, 70, 700);
+			context.set_str(1, 1, "x");
+			context.dim_int(2, 8);
+
+			auto second = HspSnapshot::capture(2, context.context(), first.get(), 1024 * 1024);
+			auto diff = HspSnapshotDiff{ first.get(), second.get() };
+
+			auto int_diff = diff.static_var_diff(0);
+			auto str_diff = diff.static_var_diff(1);
+			auto redim_diff = diff.static_var_diff(2);
+
+			return t.eq(int_diff && (**int_diff).changed_elements() == std::vector<std::size_t>{ 3, 70 }, true)
+				&& t.eq((**int_diff).is_element_changed(70), true)
+				&& t.eq((**int_diff).is_element_changed(71), false)
+				&& t.eq(str_diff && (**str_diff).changed_elements() == std::vector<std::size_t>{ 1 }, true)
+				&& t.eq(redim_diff && (**redim_diff).is_all_changed(), true)
+				&& t.eq(diff.static_var_diff(0) == int_diff, true);
+		});
+
+	suite.test(
+		u8"比べられないときは差分を返さない",
+		[](TestCaseContext& t) {
+			auto context = HsxTestContext{ 1 };
+			context.sdim(0, 64, 2);
+
+			auto first = HspSnapshot::capture(1, context.context(), nullptr, 1024 * 1024);
+			context.set_str(0, 0, "a");
+			context.set_str(0, 1, "b");
+
+			// 上限が小さいので、2つ目の要素は写せない。
+			auto second = HspSnapshot::capture(2, context.context(), first.get(), 64);
+
+			auto no_previous = HspSnapshotDiff{ nullptr, second.get() };
+			auto truncated = HspSnapshotDiff{ first.get(), second.get() };
+
+			return t.eq(no_previous.static_var_diff(0).has_value(), false)
+				&& t.eq(truncated.static_var_diff(0).has_value(), false);
+		});
+
+	suite.test(
+		u8"ベンチマーク: 16MB の配列",
+		[](TestCaseContext& t) {
+			static constexpr auto SIZE = std::size_t{ 16 * 1024 * 1024 };
+			static constexpr auto REPEAT_COUNT = 4;
+
+			auto a = std::vector<unsigned char>(SIZE);
+			for (auto i = std::size_t{}; i < a.size(); i++) {
+				a[i] = (unsigned char)(i ^ (i >> 8));
+			}
+			auto b = a;
+			b[SIZE / 2] ^= 1;
+
+			auto changed = std::vector<std::size_t>{};
+			auto start = std::chrono::steady_clock::now();
+			for (auto i = 0; i < REPEAT_COUNT; i++) {
+				changed.clear();
+				memory_diff_units(MemoryView{ a.data(), a.size() }, MemoryView{ b.data(), b.size() }, sizeof(int), changed);
+			}
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			auto sec = std::chrono::duration<double>(elapsed).count();
+
+			t.output()
+				<< u8"    " << (int)(sec > 0 ? (double)(SIZE * REPEAT_COUNT) / sec / (1024 * 1024) : 0.0) << u8" MB/s" << std::endl;
+
+			return t.eq(changed == std::vector<std::size_t>{ SIZE / 2 / sizeof(int) }, true);
+		});
+}
@@ -0,0 +1,71 @@
+//! スナップショットの差分 (前回の停止時から変化した要素)
+
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <vector>
+#include "hsp_snapshot.h"
+#include "memory_view.h"
+
+class Tests;
+
+// before と after を unit_size バイトずつの単位に分けて比べ、内容が異なる単位の番号を changed_units に昇順で追加する。
+//
+// 16バイトずつまとめて比べ (SSE2 が使えるときはベクトル命令で比べる)、異なる16バイトの中だけを単位ごとに調べる。
+// 大きさが異なるときは、短いほうにない単位を変化したとみなす。
+extern void memory_diff_units(MemoryView before, MemoryView after, std::size_t unit_size, std::vector<std::size_t>& changed_units);
+
+// 静的変数の、前回のスナップショットからの差分
+class HspSnapshotVarDiff {
+	// 要素ごとに比べられないほど変化した (型や要素数が変わった) か
+	bool all_changed_;
+
+	// 変化した要素の番号 (昇順)
+	std::vector<std::size_t> changed_elements_;
+
+public:
+	HspSnapshotVarDiff(bool all_changed, std::vector<std::size_t> changed_elements)
+		: all_changed_(all_changed)
+		, changed_elements_(std::move(changed_elements))
+	{
+	}
+
+	auto is_changed() const -> bool {
+		return all_changed_ || !changed_elements_.empty();
+	}
+
+	auto is_all_changed() const -> bool {
+		return all_changed_;
+	}
+
+	auto is_element_changed(std::size_t aptr) const -> bool;
+
+	auto changed_elements() const -> std::vector<std::size_t> const& {
+		return changed_elements_;
+	}
+};
+
+// 2つのスナップショットの、変数の差分を計算する。
+// 写しがなくて比べられないときは nullopt を返す。
+extern auto snapshot_var_diff(HspSnapshotVar const& previous, HspSnapshotVar const& current) -> std::optional<HspSnapshotVarDiff>;
+
+// 前回と今回のスナップショットの差分。
+// 静的変数ごとに、最初に必要になったときに計算して覚えておく。
+class HspSnapshotDiff {
+	HspSnapshot const* previous_;
+	HspSnapshot const* current_;
+
+	std::vector<bool> computed_;
+	std::vector<std::unique_ptr<HspSnapshotVarDiff const>> static_vars_;
+
+public:
+	HspSnapshotDiff();
+
+	HspSnapshotDiff(HspSnapshot const* previous, HspSnapshot const* current);
+
+	// 静的変数の差分を得る。(スナップショットがないか、比べられないときは nullopt)
+	auto static_var_diff(std::size_t static_var_index) -> std::optional<HspSnapshotVarDiff const*>;
+};
+
+extern void hsp_snapshot_diff_tests(Tests& tests);
@@ -1,10 +1,24 @@
 #include "pch.h"
+#include <chrono>
 #include <vector>
+#include "call_graph.h"
+#include "call_history.h"
+#include "call_profiler.h"
 #include "hsp_wrap_call.h"
 #include "hsx.h"
 #include "platform.h"
+#include "test_suite.h"
 
-static auto s_debugger = std::weak_ptr<WcDebugger>{};
+// コールスタックの初期の容量。(呼び出しのたびにメモリを確保しないように、あらかじめ確保しておく。)
+static constexpr auto CALL_STACK_CAPACITY = std::size_t{ 1024 };
+
+static auto s_enabled = false;
+
+static auto s_profiler = static_cast<CallProfiler*>(nullptr);
+
+static auto s_call_history = static_cast<CallHistory*>(nullptr);
+
+static auto s_call_graph = static_cast<CallGraph*>(nullptr);
 
 static auto s_last_id = std::size_t{};
 
@@ -14,24 +28,113 @@ static auto s_modcmd_cmdfunc_impl = static_cast<decltype(HSP3TYPEINFO::cmdfunc)>
 
 static auto s_modcmd_reffunc_impl = static_cast<decltype(HSP3TYPEINFO::reffunc)>(nullptr);
 
+// return 命令の番号 (TYPE_PROGCMD の cmdid)
+static constexpr auto PROGCMD_RETURN = 0x02;
+
+static auto s_progcmd_info = static_cast<HSP3TYPEINFO*>(nullptr);
+
+static auto s_progcmd_cmdfunc_impl = static_cast<decltype(HSP3TYPEINFO::cmdfunc)>(nullptr);
+
 static auto modcmd_cmdfunc(int cmdid) -> int;
 
 static auto modcmd_reffunc(int* type_res, int cmdid) -> void*;
 
-void wc_initialize(std::shared_ptr<WcDebugger> const& debugger) {
-	s_debugger = debugger;
+static auto progcmd_cmdfunc(int cmdid) -> int;
+
+void wc_initialize() {
+	s_enabled = true;
+}
+
+static auto struct_to_cmdid(STRUCTDAT const* struct_dat) -> std::size_t {
+	return struct_dat ? (std::size_t)(struct_dat - ctx->mem_finfo) : 0;
+}
+
+void wc_set_profiler(CallProfiler* profiler) {
+	s_profiler = profiler;
+}
+
+void wc_set_call_history(CallHistory* call_history) {
+	s_call_history = call_history;
+
+	// 記録しない間は return 命令の処理を元に戻して、フックの負荷をなくす。
+	if (s_progcmd_info) {
+		s_progcmd_info->cmdfunc = call_history ? progcmd_cmdfunc : s_progcmd_cmdfunc_impl;
+	}
+}
+
+void wc_set_call_graph(CallGraph* call_graph) {
+	s_call_graph = call_graph;
+}
+
+// 引数を呼び出し履歴に記録する値にする。(ローカル変数なら nullopt)
+static auto param_data_to_history_value(hsx::HspParamData const& param_data) -> std::optional<CallHistoryValue> {
+	auto param_type = hsx::param_data_to_type(param_data);
+	if (param_type == MPTYPE_LOCALVAR) {
+		return std::nullopt;
+	}
+
+	if (auto&& data_opt = hsx::param_data_to_data(param_data)) {
+		switch (data_opt->type()) {
+		case hsx::HspType::Int:
+			return CallHistoryValue::from_int(*hsx::data_to_int(*data_opt));
+
+		case hsx::HspType::Double:
+			return CallHistoryValue::from_double(*hsx::data_to_double(*data_opt));
+
+		case hsx::HspType::Str:
+			return CallHistoryValue::from_c_str(*hsx::data_to_str(*data_opt));
+
+		case hsx::HspType::Label:
+			return CallHistoryValue::from_label();
+
+		default:
+			break;
+		}
+	}
+
+	// 変数などの参照は、呼び出しの終了後に中身が変わりうるので型だけを記録する。
+	auto&& name_opt = hsx::param_type_to_name(param_type);
+	return CallHistoryValue::from_other(name_opt ? *name_opt : u8"?");
+}
+
+// 戻り値を呼び出し履歴に記録する値にする。
+static auto result_to_history_value(PDAT const* p, int vt) -> std::optional<CallHistoryValue> {
+	if (!p) {
+		return std::nullopt;
+	}
+
+	switch (vt) {
+	case HSPVAR_FLAG_INT:
+		return CallHistoryValue::from_int(*(hsx::HspInt const*)p);
+
+	case HSPVAR_FLAG_DOUBLE:
+		return CallHistoryValue::from_double(*(hsx::HspDouble const*)p);
+
+	case HSPVAR_FLAG_STR:
+		return CallHistoryValue::from_c_str((char const*)p);
+
+	case HSPVAR_FLAG_LABEL:
+		return CallHistoryValue::from_label();
+
+	default:
+		return std::nullopt;
+	}
 }
 
 // ユーザ定義コマンドの呼び出し直前に呼ばれる
-static void wc_will_call(STRUCTDAT const* struct_dat) {
-	auto debugger = s_debugger.lock();
-	if (!debugger) {
+// NOTE: すべての呼び出しで実行されるので、ここでは実行位置の解決などの重い処理はしない。
+static void wc_will_call(STRUCTDAT const* struct_dat, int cmdid) {
+	if (!s_enabled) {
 		return;
 	}
 
-	std::optional<std::size_t> file_id_opt;
-	std::size_t line_index;
-	debugger->get_current_location(file_id_opt, line_index);
+	// 呼び出し元は、コールスタックの一番上にあるフレームの命令
+	if (s_call_graph) {
+		auto caller = s_call_stack.empty()
+			? CallGraph::ROOT
+			: struct_to_cmdid(s_call_stack.back().struct_dat());
+		s_call_graph->add_call(caller, (std::size_t)cmdid);
+	}
 
 	auto depth = s_call_stack.size();
 	s_call_stack.emplace_back(
@@ -41,13 +144,31 @@ static void wc_will_call(STRUCTDAT const* struct_dat) {
 		ctx->prmstack,
 		ctx->sublev,
 		ctx->looplev,
-		std::move(file_id_opt),
-		line_index
+		ctx->mcs
 	);
+
+	if (s_profiler) {
+		s_profiler->will_call((std::size_t)cmdid);
+	}
 }
 
 // ユーザ定義命令の呼び出し直後に呼ばれる
 static void wc_did_call(PDAT* p, int vt) {
+	if (s_profiler && s_enabled) {
+		s_profiler->did_call();
+	}
+
+	if (s_call_history && s_enabled && !s_call_stack.empty()) {
+		auto&& call_frame = s_call_stack.back();
+		s_call_history->finish(
+			call_frame.call_frame_id(),
+			struct_to_cmdid(call_frame.struct_dat()),
+			call_frame.depth(),
+			call_frame.caller_code(),
+			result_to_history_value(p, vt)
+		);
+	}
+
 	// FIXME: 警告表示機能を戻す
 	// // 警告
 	// if ( ctx->looplev != callinfo->looplev ) {
@@ -67,6 +188,41 @@ void wc_did_call() {
 	return wc_did_call(nullptr, HSPVAR_FLAG_NONE);
 }
 
+// return 命令の実行直前に呼ばれる
+// NOTE: 呼び出しの終了後には引数スタックが解放されているので、ここで引数を記録しておく。
+// (呼び出しの開始時にはまだ引数スタックがないので、呼び出された側が書き換えた引数は書き換えた後の値になる。)
+static void wc_will_return() {
+	if (!s_call_history || !s_enabled || s_call_stack.empty()) {
+		return;
+	}
+
+	// サブルーチンからの return なら、引数スタックが真正でないので記録しない。
+	auto&& call_frame = s_call_stack.back();
+	auto&& param_stack_opt = wc_call_frame_to_param_stack(call_frame.key());
+	if (!param_stack_opt || !param_stack_opt->safety()) {
+		return;
+	}
+
+	s_call_history->begin_args(
+		call_frame.call_frame_id(),
+		struct_to_cmdid(call_frame.struct_dat()),
+		call_frame.depth(),
+		call_frame.caller_code()
+	);
+
+	auto param_count = hsx::param_stack_to_param_data_count(*param_stack_opt);
+	for (auto i = std::size_t{}; i < param_count; i++) {
+		auto&& param_data_opt = hsx::param_stack_to_param_data(*param_stack_opt, i, ctx);
+		if (!param_data_opt) {
+			break;
+		}
+
+		if (auto&& value_opt = param_data_to_history_value(*param_data_opt)) {
+			s_call_history->add_arg(*value_opt);
+		}
+	}
+}
+
 auto wc_call_frame_count() -> std::size_t {
 	return s_call_stack.size();
 }
@@ -146,11 +302,21 @@ static void modcmd_init(HSP3TYPEINFO* info) {
 	info->reffunc = modcmd_reffunc;
 }
 
+// return 命令を含む命令の処理を覚えておく。(置き換えるのは呼び出し履歴を記録している間だけ。)
+static void progcmd_init(HSP3TYPEINFO* info) {
+	if (s_progcmd_info) {
+		return;
+	}
+
+	s_progcmd_info = info;
+	s_progcmd_cmdfunc_impl = info->cmdfunc;
+}
+
 // ユーザ定義命令の呼び出し処理のラッパー
 static auto modcmd_cmdfunc(int cmdid) -> int {
 	auto struct_dat = hsx::structs(ctx).get_unchecked((std::size_t)cmdid);
 
-	wc_will_call(struct_dat);
+	wc_will_call(struct_dat, cmdid);
 	auto runmode = s_modcmd_cmdfunc_impl(cmdid);
 	wc_did_call();
 	return runmode;
@@ -160,12 +326,20 @@ static auto modcmd_cmdfunc(int cmdid) -> int {
 static auto modcmd_reffunc(int* type_res, int cmdid) -> void* {
 	auto struct_dat = hsx::structs(ctx).get_unchecked((std::size_t)cmdid);
 
-	wc_will_call(struct_dat);
+	wc_will_call(struct_dat, cmdid);
 	auto result = s_modcmd_reffunc_impl(type_res, cmdid);
 	wc_did_call((PDAT*)result, *type_res);
 	return result;
 }
 
+// プログラム制御命令の処理のラッパー
+static auto progcmd_cmdfunc(int cmdid) -> int {
+	if (cmdid == PROGCMD_RETURN) {
+		wc_will_return();
+	}
+	return s_progcmd_cmdfunc_impl(cmdid);
+}
+
 // プラグイン初期化関数
 EXPORT void WINAPI hsp3hpi_init_wrapcall(HSP3TYPEINFO* info) {
 	hsp3sdk_init(info);
@@ -173,6 +347,314 @@ EXPORT void WINAPI hsp3hpi_init_wrapcall(HSP3TYPEINFO* info) {
 	// 初期化 (HSP ランタイムの実装に依存している)
 	auto const typeinfo = &info[- info->type];
 	modcmd_init(&typeinfo[TYPE_MODCMD]);
+	progcmd_init(&typeinfo[TYPE_PROGCMD]);
+
+	s_call_stack.reserve(CALL_STACK_CAPACITY);
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+static auto s_fake_time = std::uint64_t{};
+
+static auto fake_clock() -> std::uint64_t {
+	return s_fake_time;
+}
 
-	s_call_stack.reserve(128);
+// テスト用のランタイムの命令の処理。
+// どの命令も時間を 10 だけ進める。命令 0 は命令 1 を2回呼ぶ。
+static auto fake_modcmd_cmdfunc(int cmdid) -> int {
+	s_fake_time += 10;
+
+	if (cmdid == 0) {
+		modcmd_cmdfunc(1);
+		modcmd_cmdfunc(1);
+	}
+	return RUNMODE_RUN;
+}
+
+static auto s_fake_param_stack = static_cast<void*>(nullptr);
+
+static auto s_fake_result = hsx::HspInt{};
+
+// 設定されていれば、テスト用の関数の本体が最初の引数をこの値に書き換える。
+static auto s_fake_modified_arg = std::optional<hsx::HspInt>{};
+
+static auto fake_progcmd_cmdfunc(int cmdid) -> int {
+	return RUNMODE_RETURN;
+}
+
+// テスト用のランタイムの関数の処理。
+// 引数スタックを作って return 命令を実行し、42 を返す。
+static auto fake_modcmd_reffunc(int* type_res, int cmdid) -> void* {
+	ctx->sublev++;
+	ctx->prmstack = s_fake_param_stack;
+
+	if (s_fake_modified_arg) {
+		*(hsx::HspInt*)ctx->prmstack = *s_fake_modified_arg;
+	}
+
+	progcmd_cmdfunc(PROGCMD_RETURN);
+	ctx->sublev--;
+
+	s_fake_result = 42;
+	*type_res = HSPVAR_FLAG_INT;
+	return &s_fake_result;
+}
+
+// テスト用のランタイム。
+// ユーザー定義命令の情報とコードセグメントを持つ HSPCTX を作って ctx に設定し、フックを初期化する。
+// 破棄するときに、ctx と、テストが差し替えたランタイムの関数を元に戻す。
+class FakeRuntime {
+	std::vector<STRUCTPRM> params_;
+	std::vector<STRUCTDAT> structs_;
+	HSPHED header_;
+	std::vector<hsx::HspCodeUnit> code_;
+	HSPCTX context_;
+
+	HSPCTX* saved_ctx_;
+	decltype(s_modcmd_cmdfunc_impl) saved_modcmd_cmdfunc_impl_;
+	decltype(s_modcmd_reffunc_impl) saved_modcmd_reffunc_impl_;
+	HSP3TYPEINFO* saved_progcmd_info_;
+	decltype(s_progcmd_cmdfunc_impl) saved_progcmd_cmdfunc_impl_;
+
+public:
+	explicit FakeRuntime(std::vector<STRUCTDAT> structs = std::vector<STRUCTDAT>{}, std::vector<STRUCTPRM> params = std::vector<STRUCTPRM>{})
+		: params_(std::move(params))
+		, structs_(std::move(structs))
+		, header_()
+		, code_(16)
+		, context_()
+		, saved_ctx_(ctx)
+		, saved_modcmd_cmdfunc_impl_(s_modcmd_cmdfunc_impl)
+		, saved_modcmd_reffunc_impl_(s_modcmd_reffunc_impl)
+		, saved_progcmd_info_(s_progcmd_info)
+		, saved_progcmd_cmdfunc_impl_(s_progcmd_cmdfunc_impl)
+	{
+		header_.max_finfo = (int)(structs_.size() * sizeof(STRUCTDAT));
+		header_.max_minfo = (int)(params_.size() * sizeof(STRUCTPRM));
+
+		context_.hsphed = &header_;
+		context_.mem_finfo = structs_.data();
+		context_.mem_minfo = params_.data();
+		context_.mem_mcs = code_.data();
+		context_.mcs = code_.data();
+
+		ctx = &context_;
+		wc_initialize();
+	}
+
+	FakeRuntime(FakeRuntime const& other) = delete;
+
+	auto operator=(FakeRuntime const& other) -> FakeRuntime& = delete;
+
+	~FakeRuntime() {
+		s_progcmd_info = saved_progcmd_info_;
+		s_progcmd_cmdfunc_impl = saved_progcmd_cmdfunc_impl_;
+		s_modcmd_reffunc_impl = saved_modcmd_reffunc_impl_;
+		s_modcmd_cmdfunc_impl = saved_modcmd_cmdfunc_impl_;
+		ctx = saved_ctx_;
+	}
+
+	auto context() -> HSPCTX& {
+		return context_;
+	}
+
+	auto code() -> hsx::HspCodeUnit* {
+		return code_.data();
+	}
+};
+
+void hsp_wrap_call_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"hsp_wrap_call");
+
+	suite.test(
+		u8"呼び出しごとに実行位置をポインタのまま記録する",
+		[](TestCaseContext& t) {
+			auto runtime = FakeRuntime{};
+			auto&& test_ctx = runtime.context();
+			auto code = runtime.code();
+
+			test_ctx.mcs = code + 3;
+			test_ctx.sublev = 0;
+			wc_will_call(nullptr, 0);
+
+			test_ctx.mcs = code + 10;
+			test_ctx.sublev = 1;
+			wc_will_call(nullptr, 0);
+
+			auto count = wc_call_frame_count();
+			auto&& inner_opt = wc_call_frame_get(*wc_call_frame_key_at(1));
+			auto inner_offset = inner_opt ? hsx::code_to_offset(inner_opt->get().caller_code(), ctx) : std::nullopt;
+			auto inner_sublev = inner_opt ? inner_opt->get().prev_sublev() : -1;
+			auto outer_key = *wc_call_frame_key_at(0);
+
+			wc_did_call();
+			auto inner_is_dead = !wc_call_frame_key_at(1).has_value();
+			wc_did_call();
+
+			return t.eq(count, std::size_t{ 2 })
+				&& t.eq(inner_offset.value_or(0), std::size_t{ 10 })
+				&& t.eq(inner_sublev, 1)
+				&& t.eq(outer_key.depth(), std::size_t{ 0 })
+				&& t.eq(inner_is_dead, true)
+				&& t.eq(wc_call_frame_count(), std::size_t{ 0 })
+				&& t.eq(wc_call_frame_get(outer_key).has_value(), false);
+		});
+
+	suite.test(
+		u8"ベンチマーク: 呼び出しのフック",
+		[](TestCaseContext& t) {
+			static constexpr auto CALL_COUNT = std::size_t{ 1000000 };
+			static constexpr auto DEPTH = std::size_t{ 8 };
+
+			auto runtime = FakeRuntime{};
+			auto&& test_ctx = runtime.context();
+			auto code = runtime.code();
+			s_call_stack.reserve(CALL_STACK_CAPACITY);
+
+			// 深さ DEPTH までの呼び出しと復帰を繰り返して、1回あたりの時間を測る。
+			auto measure = [&] {
+				auto start = std::chrono::steady_clock::now();
+				for (auto i = std::size_t{}; i < CALL_COUNT / DEPTH; i++) {
+					for (auto d = std::size_t{}; d < DEPTH; d++) {
+						test_ctx.mcs = code + d;
+						wc_will_call(nullptr, (int)d);
+					}
+					for (auto d = std::size_t{}; d < DEPTH; d++) {
+						wc_did_call();
+					}
+				}
+				auto elapsed = std::chrono::steady_clock::now() - start;
+				return std::chrono::duration<double, std::nano>(elapsed).count() / CALL_COUNT;
+			};
+
+			auto hook_ns = measure();
+
+			auto profiler = CallProfiler{ DEPTH, CallProfiler::steady_clock_now };
+			wc_set_profiler(&profiler);
+			auto profiled_ns = measure();
+			wc_set_profiler(nullptr);
+
+			t.output()
+				<< u8"    フックのみ " << (int)(hook_ns * 10) / 10.0 << u8" ns/呼び出し"
+				<< u8" / プロファイラーあり " << (int)(profiled_ns * 10) / 10.0 << u8" ns/呼び出し" << std::endl;
+
+			return t.eq(profiler.call_count(0), std::uint64_t{ CALL_COUNT / DEPTH })
+				&& t.eq(wc_call_frame_count(), std::size_t{ 0 });
+		});
+
+	suite.test(
+		u8"プロファイラーに呼び出しが記録される",
+		[](TestCaseContext& t) {
+			auto runtime = FakeRuntime{ std::vector<STRUCTDAT>(2) };
+			s_modcmd_cmdfunc_impl = fake_modcmd_cmdfunc;
+
+			auto profiler = CallProfiler{ 2, fake_clock };
+			wc_set_profiler(&profiler);
+			s_fake_time = 0;
+
+			modcmd_cmdfunc(0);
+
+			wc_set_profiler(nullptr);
+
+			return t.eq(profiler.call_count(0), std::uint64_t{ 1 })
+				&& t.eq(profiler.call_count(1), std::uint64_t{ 2 })
+				&& t.eq(profiler.inclusive_time(0), std::uint64_t{ 30 })
+				&& t.eq(profiler.exclusive_time(0), std::uint64_t{ 10 })
+				&& t.eq(profiler.inclusive_time(1), std::uint64_t{ 20 })
+				&& t.eq(wc_call_frame_count(), std::size_t{ 0 });
+		});
+
+	suite.test(
+		u8"呼び出しグラフに呼び出し元からの辺が数えられる",
+		[](TestCaseContext& t) {
+			auto runtime = FakeRuntime{ std::vector<STRUCTDAT>(2) };
+			s_modcmd_cmdfunc_impl = fake_modcmd_cmdfunc;
+
+			auto graph = CallGraph{};
+			wc_set_call_graph(&graph);
+
+			// 命令 0 は命令 1 を2回呼ぶ。
+			modcmd_cmdfunc(0);
+			modcmd_cmdfunc(0);
+			modcmd_cmdfunc(1);
+
+			wc_set_call_graph(nullptr);
+
+			return t.eq(graph.size(), std::size_t{ 3 })
+				&& t.eq(graph.call_count(CallGraph::ROOT, 0), std::uint64_t{ 2 })
+				&& t.eq(graph.call_count(0, 1), std::uint64_t{ 4 })
+				&& t.eq(graph.call_count(CallGraph::ROOT, 1), std::uint64_t{ 1 })
+				&& t.eq(graph.total_count(), std::uint64_t{ 7 })
+				&& t.eq(wc_call_frame_count(), std::size_t{ 0 });
+		});
+
+	suite.test(
+		u8"呼び出し履歴に引数と戻り値が記録される (引数は return の直前の値)",
+		[](TestCaseContext& t) {
+			// f(int, str, var, local)
+			auto params = std::vector<STRUCTPRM>{
+				STRUCTPRM{ MPTYPE_INUM, 0, 0 },
+				STRUCTPRM{ MPTYPE_LOCALSTRING, 0, 8 },
+				STRUCTPRM{ MPTYPE_SINGLEVAR, 0, 16 },
+				STRUCTPRM{ MPTYPE_LOCALVAR, 0, 32 },
+			};
+			auto structs = std::vector<STRUCTDAT>(1);
+			structs[0].prmindex = 0;
+			structs[0].prmmax = (int)params.size();
+			structs[0].size = 64;
+
+			auto str = std::string{ u8"abc" };
+			auto param_stack = std::vector<std::uint64_t>(8);
+			auto param_stack_ptr = (char*)param_stack.data();
+			*(hsx::HspInt*)param_stack_ptr = 7;
+			*(char const**)(param_stack_ptr + 8) = str.c_str();
+
+			auto runtime = FakeRuntime{ std::move(structs), std::move(params) };
+			auto code = runtime.code();
+			runtime.context().mcs = code + 5;
+
+			auto progcmd_info = HSP3TYPEINFO{};
+			progcmd_info.cmdfunc = fake_progcmd_cmdfunc;
+
+			s_modcmd_reffunc_impl = fake_modcmd_reffunc;
+			s_progcmd_info = nullptr;
+			progcmd_init(&progcmd_info);
+			s_fake_param_stack = param_stack_ptr;
+
+			auto history = CallHistory{ 64 * 1024 };
+			wc_set_call_history(&history);
+			auto is_hooked = progcmd_info.cmdfunc == progcmd_cmdfunc;
+
+			auto type_res = 0;
+			modcmd_reffunc(&type_res, 0);
+
+			// 本体が引数を書き換えたら、書き換えた後の値が記録される。(引数は return の直前に読むため。)
+			s_fake_modified_arg = 8;
+			modcmd_reffunc(&type_res, 0);
+			s_fake_modified_arg = std::nullopt;
+
+			wc_set_call_history(nullptr);
+			auto is_unhooked = progcmd_info.cmdfunc == fake_progcmd_cmdfunc;
+
+			auto names = std::vector<Utf8String>{ to_owned(as_utf8(u8"f")) };
+			auto describe = [](hsx::HspCodeUnit const* caller_code) {
+				return Utf8String{};
+			};
+			auto offset_opt = history.size() == 2
+				? std::make_optional(history.entry_at(1).caller_code() - code)
+				: std::nullopt;
+
+			return t.eq(is_hooked, true)
+				&& t.eq(is_unhooked, true)
+				&& t.eq(history.size(), std::size_t{ 2 })
+				&& t.eq(offset_opt.value_or(0), std::ptrdiff_t{ 5 })
+				&& t.eq(
+					as_native(history.to_text(10, names, describe)),
+					u8"f(8, \"abc\", <var>) = 42  ()\r\n"
+					u8"f(7, \"abc\", <var>) = 42  ()\r\n")
+				&& t.eq(wc_call_frame_count(), std::size_t{ 0 });
+		});
 }
@@ -6,12 +6,25 @@
 #include "../hspsdk/hsp3struct.h"
 #include "hsx.h"
 
+class CallGraph;
+class CallHistory;
+class CallProfiler;
+class Tests;
 class WcCallFrameKey;
 class WcCallFrame;
-class WcDebugger;
 
 // WrapCall を初期化する。デバッガーの起動時に必ず呼び出すこと。
-extern void wc_initialize(std::shared_ptr<WcDebugger> const& debugger);
+extern void wc_initialize();
+
+// 呼び出しを計測するプロファイラーを設定する。(nullptr なら計測しない。)
+extern void wc_set_profiler(CallProfiler* profiler);
+
+// 呼び出しの引数と戻り値を記録する履歴を設定する。(nullptr なら記録しない。)
+// 記録している間は、引数を読むために return 命令もフックする。
+extern void wc_set_call_history(CallHistory* call_history);
+
+// 呼び出し元から呼び出し先への辺を数える呼び出しグラフを設定する。(nullptr なら数えない。)
+extern void wc_set_call_graph(CallGraph* call_graph);
 
 extern auto wc_call_frame_count() -> std::size_t;
 
@@ -65,10 +78,10 @@ class WcCallFrame {
 	int prev_sublev_;
 	int prev_looplev_;
 
-	// 呼び出し側の位置
-	std::optional<std::size_t> file_id_opt_;
-
-	std::size_t line_index_;
+	// 呼び出し側の実行位置 (ctx->mcs)
+	// NOTE: 呼び出しのたびに行番号を求めると遅いので、ポインタだけ記録しておいて、
+	//       表示するときに行に変換する。(HspObjects::call_frame_path_to_line_index などを参照。)
+	hsx::HspCodeUnit const* caller_code_;
 
 public:
 	WcCallFrame(
@@ -78,8 +91,7 @@ public:
 		void const* prev_param_stack,
 		int prev_sublev,
 		int prev_looplev,
-		std::optional<std::size_t>&& file_id_opt,
-		std::size_t line_index
+		hsx::HspCodeUnit const* caller_code
 	)
 		: call_frame_id_(call_frame_id)
 		, depth_(depth)
@@ -87,8 +99,7 @@ public:
 		, prev_param_stack_(prev_param_stack)
 		, prev_sublev_(prev_sublev)
 		, prev_looplev_(prev_looplev)
-		, file_id_opt_(std::move(file_id_opt))
-		, line_index_(line_index)
+		, caller_code_(caller_code)
 	{
 	}
 
@@ -120,20 +131,9 @@ public:
 		return prev_looplev_;
 	}
 
-	auto file_id_opt() const -> std::optional<std::size_t> {
-		return file_id_opt_;
-	}
-
-	auto line_index() const -> std::size_t {
-		return line_index_;
+	auto caller_code() const -> hsx::HspCodeUnit const* {
+		return caller_code_;
 	}
 };
 
-// WrapCall からデバッガーにアクセスするためのもの
-class WcDebugger {
-public:
-	virtual ~WcDebugger() {
-	}
-
-	virtual void get_current_location(std::optional<std::size_t>& file_id_opt, std::size_t& line_index) = 0;
-};
+extern void hsp_wrap_call_tests(Tests& tests);
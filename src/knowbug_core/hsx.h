@@ -136,6 +136,10 @@ namespace hsx {
 	// 引数データが指している文字列データを得る。
 	extern auto param_data_to_str(HspParamData const& param_data)->std::optional<HspStr>;
 
+	// 引数データが指している変数の要素のメモリブロックを得る。
+	// var/array/thismod 引数なら、渡された配列要素 (APTR の位置) のものを得る。
+	extern auto param_data_to_memory_block(HspParamData const& param_data, HSPCTX const* ctx)->std::optional<MemoryView>;
+
 	// 引数スタックに含まれる引数データの個数を得る。
 	extern auto param_stack_to_param_data_count(HspParamStack const& param_stack)->std::size_t;
 
@@ -237,6 +241,10 @@ namespace hsx {
 	// 実行位置の行番号 (0-indexed) を取得する。
 	extern auto debug_to_line_index(HSP3DEBUG const* debug)->std::size_t;
 
+	// コードセグメント上のポインタ (ctx->mcs など) を位置 (HspCodeUnit 単位) に変換する。
+	// `debug_do_update_location` と違って、ランタイムに問い合わせないので速い。
+	extern auto code_to_offset(HspCodeUnit const* code, HSPCTX const* ctx)->std::optional<std::size_t>;
+
 	// 全般の情報。
 	// フォーマット: `key1\nvalue1\nkey2\nvalue2\n...\n` (キーと値が改行区切りで交互に出現する。)
 	extern auto debug_to_general_info(HSP3DEBUG* debug)->std::unique_ptr<char, void(*)(char*)>;
@@ -30,6 +30,14 @@ namespace hsx {
 		return (std::size_t)std::max(0, line_number - 1);
 	}
 
+	auto code_to_offset(HspCodeUnit const* code, HSPCTX const* ctx) -> std::optional<std::size_t> {
+		if (code == nullptr || ctx->mem_mcs == nullptr || code < ctx->mem_mcs) {
+			return std::nullopt;
+		}
+
+		return (std::size_t)(code - ctx->mem_mcs);
+	}
+
 	auto debug_to_general_info(HSP3DEBUG* debug) -> std::unique_ptr<char, void(*)(char*)> {
 		return std::unique_ptr<char, void(*)(char*)>{ debug->get_value(DEBUGINFO_GENERAL), debug->dbg_close };
 	}
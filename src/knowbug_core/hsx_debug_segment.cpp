@@ -13,10 +13,6 @@ namespace hsx {
 		return (int)*p | ((int)p[1] << 8) | ((int)p[2] << 16);
 	}
 
-	static auto code_segment_data(HSPCTX const* ctx) -> HspCodeUnit const* {
-		return ctx->mem_mcs;
-	}
-
 	static auto debug_segment_data(HSPCTX const* ctx) -> unsigned char const* {
 		return ctx->mem_di;
 	}
@@ -71,15 +67,17 @@ namespace hsx {
 		: ctx_(ctx)
 		, di_()
 		, ident_kind_(DebugSegmentIdentKind::VarName)
-		, cs_(code_segment_data(ctx))
+		, cs_()
+		, file_ref_name_()
+		, line_number_()
 	{
 	}
 
 	auto DebugSegmentReader::next() -> std::optional<DebugSegmentItem> {
-		auto d = debug_segment_data(ctx);
+		auto d = debug_segment_data(ctx_);
 
 		while (true) {
-			if (di_ >= debug_segment_size(ctx)) {
+			if (di_ >= debug_segment_size(ctx_)) {
 				return std::nullopt;
 			}
 
@@ -94,7 +92,7 @@ namespace hsx {
 			case 0xFE: {
 				// ソースファイル指定: コードセグメントの現在位置に対応するソースファイルの位置が書かれている。
 
-				if (di_ + 6 > debug_segment_size(ctx)) {
+				if (di_ + 6 > debug_segment_size(ctx_)) {
 					return std::nullopt;
 				}
 
@@ -107,6 +105,9 @@ namespace hsx {
 				di_ += 2;
 
 				auto&& file_ref_name_opt = data_segment_to_str(ds_index, ctx_);
+				file_ref_name_ = file_ref_name_opt.value_or(nullptr);
+				line_number_ = line_number;
+
 				if (!file_ref_name_opt) {
 					continue;
 				}
@@ -116,7 +117,7 @@ namespace hsx {
 			case 0xFB: {
 				// 識別子指定: 現在の文脈で指定された種類の識別子が書かれている。
 
-				if (di_ + 6 > debug_segment_size(ctx)) {
+				if (di_ + 6 > debug_segment_size(ctx_)) {
 					return std::nullopt;
 				}
 
@@ -138,7 +139,7 @@ namespace hsx {
 			case 0xFC: {
 				// 次の命令までのCSオフセット値 (3バイト)
 
-				if (di_ + 4 > debug_segment_size(ctx)) {
+				if (di_ + 4 > debug_segment_size(ctx_)) {
 					return std::nullopt;
 				}
 
@@ -147,7 +148,9 @@ namespace hsx {
 				auto offset = read_int24(d + di_);
 				di_ += 3;
 
-				cs_ += offset;
+				if (auto&& item_opt = advance_line((std::size_t)offset)) {
+					return item_opt;
+				}
 				continue;
 			}
 			default: {
@@ -156,10 +159,25 @@ namespace hsx {
 				auto offset = (int)d[di_];
 				di_++;
 
-				cs_ += offset;
+				if (auto&& item_opt = advance_line((std::size_t)offset)) {
+					return item_opt;
+				}
 				continue;
 			}
 			}
 		}
 	}
-}
+
+	auto DebugSegmentReader::advance_line(std::size_t offset) -> std::optional<DebugSegmentItem> {
+		auto code_offset = cs_;
+		auto line_number = line_number_;
+
+		cs_ += offset;
+		line_number_++;
+
+		if (file_ref_name_ == nullptr || offset == 0) {
+			return std::nullopt;
+		}
+		return DebugSegmentItem{ DebugSegmentItemKind::Line, file_ref_name_, line_number, code_offset, offset };
+	}
+}
\ No newline at end of file
@@ -10,6 +10,9 @@ namespace hsx {
 		VarName,
 		LabelName,
 		ParamName,
+
+		// ソースファイルの1行に対応するコードの範囲
+		Line,
 	};
 
 	// デバッグセグメントに埋め込まれた情報
@@ -20,11 +23,22 @@ namespace hsx {
 
 		int num_;
 
+		std::size_t code_offset_;
+
+		std::size_t code_size_;
+
 	public:
 		DebugSegmentItem(DebugSegmentItemKind kind, char const* str, int num)
+			: DebugSegmentItem(kind, str, num, 0, 0)
+		{
+		}
+
+		DebugSegmentItem(DebugSegmentItemKind kind, char const* str, int num, std::size_t code_offset, std::size_t code_size)
 			: kind_(kind)
 			, str_(str)
 			, num_(num)
+			, code_offset_(code_offset)
+			, code_size_(code_size)
 		{
 		}
 
@@ -41,6 +55,16 @@ namespace hsx {
 		auto num() const -> int {
 			return num_;
 		}
+
+		// (Line のとき) 行のコードの、コードセグメント上の位置 (HspCodeUnit 単位)
+		auto code_offset() const -> std::size_t {
+			return code_offset_;
+		}
+
+		// (Line のとき) 行のコードの大きさ (HspCodeUnit 単位)
+		auto code_size() const -> std::size_t {
+			return code_size_;
+		}
 	};
 
 	// デバッグセグメントに記録された識別子の種類。
@@ -64,9 +88,14 @@ namespace hsx {
 		// 次に出現した識別子の種類がどれかを表す。
 		DebugSegmentIdentKind ident_kind_;
 
-		// コードセグメント上の位置。
+		// コードセグメント上の位置 (HspCodeUnit 単位)。
 		// ソースファイル位置とコード位置の対応を取るために使う。
-		HspCodeUnit const* cs_;
+		std::size_t cs_;
+
+		// 現在のソースファイルのファイル参照名と行番号 (1-indexed)。
+		// 次に出現したコードの範囲がどの行に対応するかを表す。
+		char const* file_ref_name_;
+		int line_number_;
 
 	public:
 		explicit DebugSegmentReader(HSPCTX const* ctx);
@@ -75,5 +104,10 @@ namespace hsx {
 		// 次に何らかの情報を発見したら停止して、その情報を返す。
 		// 終端に達したら nullopt を返す。
 		auto next()->std::optional<DebugSegmentItem>;
+
+	private:
+		// 現在の行のコードを offset だけ読み進めて、次の行に進む。
+		// 行にコードがあれば、その範囲を返す。
+		auto advance_line(std::size_t offset)->std::optional<DebugSegmentItem>;
 	};
 }
@@ -122,4 +122,43 @@ namespace hsx {
 			return std::nullopt;
 		}
 	}
+
+	auto param_data_to_memory_block(HspParamData const& param_data, HSPCTX const* ctx) -> std::optional<MemoryView> {
+		auto element_memory_block = [&](PVal const* pval, std::size_t aptr) -> std::optional<MemoryView> {
+			// 配列が dim などでリセットされて、範囲外を指しているかもしれない。
+			if (aptr >= pval_to_element_count(pval)) {
+				return std::nullopt;
+			}
+			return std::make_optional(element_to_memory_block(pval, aptr, ctx));
+		};
+
+		switch (param_data_to_type(param_data)) {
+		case MPTYPE_LOCALVAR: {
+			auto pval_opt = param_data_to_pval(param_data);
+			if (!pval_opt) {
+				return std::nullopt;
+			}
+			return std::make_optional(pval_to_memory_block(*pval_opt, ctx));
+		}
+		case MPTYPE_SINGLEVAR:
+		case MPTYPE_ARRAYVAR: {
+			auto mp_var_opt = param_data_to_mp_var(param_data);
+			if (!mp_var_opt) {
+				return std::nullopt;
+			}
+			return element_memory_block(mp_var_to_pval(*mp_var_opt), mp_var_to_aptr(*mp_var_opt));
+		}
+		case MPTYPE_MODULEVAR:
+		case MPTYPE_IMODULEVAR:
+		case MPTYPE_TMODULEVAR: {
+			auto mp_mod_var_opt = param_data_to_mp_mod_var(param_data);
+			if (!mp_mod_var_opt) {
+				return std::nullopt;
+			}
+			return element_memory_block(mp_mod_var_to_pval(*mp_mod_var_opt), mp_mod_var_to_aptr(*mp_mod_var_opt));
+		}
+		default:
+			return std::nullopt;
+		}
+	}
 }
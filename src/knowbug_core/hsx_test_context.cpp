@@ -0,0 +1,162 @@
+#include "pch.h"
+#include <cstring>
+#include "hsx_test_context.h"
+
+// -----------------------------------------------
+// int 型
+// -----------------------------------------------
+
+static auto int_get_ptr(PVal* pval) -> PDAT* {
+	return (PDAT*)((int*)pval->pt + pval->offset);
+}
+
+// 固定長の型は、要素から配列の末尾までを返す。
+static auto int_get_block_size(PVal* pval, PDAT* pdat, int* size) -> void* {
+	*size = pval->size - (int)((char*)pdat - (char*)pval->pt);
+	return pdat;
+}
+
+// -----------------------------------------------
+// str 型
+// -----------------------------------------------
+
+static auto str_get_ptr(PVal* pval) -> PDAT* {
+	return (PDAT*)((char**)pval->master)[pval->offset];
+}
+
+// 可変長の型は、その要素のバッファーだけを返す。
+static auto str_get_block_size(PVal* pval, PDAT* pdat, int* size) -> void* {
+	std::memcpy(size, (char*)pdat - sizeof(int), sizeof(int));
+	return pdat;
+}
+
+static auto get_proc(int type) -> HspVarProc* {
+	static auto s_procs = [] {
+		auto procs = std::vector<HspVarProc>(HSPVAR_FLAG_INT + 1);
+
+		auto&& str_proc = procs[HSPVAR_FLAG_STR];
+		str_proc.flag = HSPVAR_FLAG_STR;
+		str_proc.support = HSPVAR_SUPPORT_FLEXSTORAGE | HSPVAR_SUPPORT_FLEXARRAY;
+		str_proc.basesize = -1;
+		str_proc.GetPtr = str_get_ptr;
+		str_proc.GetBlockSize = str_get_block_size;
+
+		auto&& int_proc = procs[HSPVAR_FLAG_INT];
+		int_proc.flag = HSPVAR_FLAG_INT;
+		int_proc.support = HSPVAR_SUPPORT_STORAGE | HSPVAR_SUPPORT_FLEXARRAY;
+		int_proc.basesize = sizeof(int);
+		int_proc.GetPtr = int_get_ptr;
+		int_proc.GetBlockSize = int_get_block_size;
+
+		return procs;
+	}();
+
+	if (type != HSPVAR_FLAG_STR && type != HSPVAR_FLAG_INT) {
+		assert(false && u8"unsupported type in HsxTestContext");
+		return nullptr;
+	}
+
+	return &s_procs[type];
+}
+
+// -----------------------------------------------
+// HsxTestContext
+// -----------------------------------------------
+
+HsxTestContext::HsxTestContext(std::size_t var_count)
+	: header_()
+	, exinfo_()
+	, context_()
+	, pvals_(var_count)
+	, vars_(var_count)
+	, code_segment_()
+	, data_segment_()
+	, debug_segment_()
+{
+	header_.max_val = (int)var_count;
+	exinfo_.HspFunc_getproc = get_proc;
+
+	context_.hsphed = &header_;
+	context_.mem_var = pvals_.data();
+	context_.exinfo2 = &exinfo_;
+
+	for (auto i = std::size_t{}; i < var_count; i++) {
+		dim_int(i, 1);
+	}
+}
+
+void HsxTestContext::dim_int(std::size_t var_index, std::size_t length) {
+	auto&& var = vars_.at(var_index);
+	var = Var{};
+	var.ints_ = std::make_unique<int[]>(length);
+
+	auto&& pval = pvals_.at(var_index);
+	pval = PVal{};
+	pval.flag = HSPVAR_FLAG_INT;
+	pval.mode = HSPVAR_MODE_MALLOC;
+	pval.len[0] = sizeof(int);
+	pval.len[1] = (int)length;
+	pval.size = (int)(length * sizeof(int));
+	pval.pt = (PDAT*)var.ints_.get();
+}
+
+void HsxTestContext::sdim(std::size_t var_index, std::size_t buffer_size, std::size_t length) {
+	auto&& var = vars_.at(var_index);
+	var = Var{};
+	var.str_ptrs_ = std::make_unique<char*[]>(length);
+
+	for (auto i = std::size_t{}; i < length; i++) {
+		auto buffer = StrBuffer{ std::make_unique<char[]>(sizeof(int) + buffer_size), buffer_size };
+		auto size = (int)buffer_size;
+		std::memcpy(buffer.memory_.get(), &size, sizeof(int));
+
+		var.str_ptrs_[i] = buffer.memory_.get() + sizeof(int);
+		var.strs_.push_back(std::move(buffer));
+	}
+
+	auto&& pval = pvals_.at(var_index);
+	pval = PVal{};
+	pval.flag = HSPVAR_FLAG_STR;
+	pval.mode = HSPVAR_MODE_MALLOC;
+	pval.len[0] = 1;
+	pval.len[1] = (int)length;
+	pval.size = (int)buffer_size;
+	pval.pt = (PDAT*)var.str_ptrs_[0];
+	pval.master = var.str_ptrs_.get();
+}
+
+void HsxTestContext::set_int(std::size_t var_index, std::size_t element_index, int value) {
+	auto&& pval = pvals_.at(var_index);
+	assert(pval.flag == HSPVAR_FLAG_INT && element_index < (std::size_t)pval.len[1]);
+
+	vars_.at(var_index).ints_[element_index] = value;
+}
+
+void HsxTestContext::set_str(std::size_t var_index, std::size_t element_index, char const* value) {
+	auto&& pval = pvals_.at(var_index);
+	assert(pval.flag == HSPVAR_FLAG_STR && element_index < (std::size_t)pval.len[1]);
+
+	auto&& var = vars_.at(var_index);
+	auto&& buffer = var.strs_.at(element_index);
+	auto size = std::min(std::strlen(value), buffer.size_ - 1);
+	std::memcpy(var.str_ptrs_[element_index], value, size);
+	var.str_ptrs_[element_index][size] = '\0';
+}
+
+void HsxTestContext::set_code_segment(std::vector<hsx::HspCodeUnit> code_segment) {
+	code_segment_ = std::move(code_segment);
+	header_.max_cs = (int)(code_segment_.size() * sizeof(hsx::HspCodeUnit));
+	context_.mem_mcs = code_segment_.data();
+}
+
+void HsxTestContext::set_data_segment(std::vector<char> data_segment) {
+	data_segment_ = std::move(data_segment);
+	header_.max_ds = (int)data_segment_.size();
+	context_.mem_mds = data_segment_.data();
+}
+
+void HsxTestContext::set_debug_segment(std::vector<unsigned char> debug_segment) {
+	debug_segment_ = std::move(debug_segment);
+	header_.max_dinfo = (int)debug_segment_.size();
+	context_.mem_di = debug_segment_.data();
+}
@@ -0,0 +1,67 @@
+//! テスト用の HSP のコンテキスト
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "hsx.h"
+
+// HSP のランタイムなしで hsx の関数を試すための、最小限の HSPCTX。
+//
+// int 型と str 型の静的変数だけを持つ。
+// 変数のメモリーはランタイムと同じ形で確保する。(int 型は要素を連続して置き、str 型は要素ごとにバッファーを持つ。)
+// 変数を確保し直すとポインターが変わる。(実行中に dim や sdim をしたときと同じ。)
+class HsxTestContext {
+	// str 型の要素のバッファー。先頭にバッファーの大きさを置く。
+	class StrBuffer {
+	public:
+		std::unique_ptr<char[]> memory_;
+		std::size_t size_;
+	};
+
+	class Var {
+	public:
+		std::unique_ptr<int[]> ints_;
+		std::vector<StrBuffer> strs_;
+		std::unique_ptr<char*[]> str_ptrs_;
+	};
+
+	HSPHED header_;
+	HSPEXINFO exinfo_;
+	HSPCTX context_;
+
+	std::vector<PVal> pvals_;
+	std::vector<Var> vars_;
+
+	std::vector<hsx::HspCodeUnit> code_segment_;
+	std::vector<char> data_segment_;
+	std::vector<unsigned char> debug_segment_;
+
+public:
+	explicit HsxTestContext(std::size_t var_count);
+
+	HsxTestContext(HsxTestContext const& other) = delete;
+
+	auto operator=(HsxTestContext const& other) -> HsxTestContext& = delete;
+
+	auto context() const -> HSPCTX const* {
+		return &context_;
+	}
+
+	// 静的変数を int 型の配列として確保する。
+	void dim_int(std::size_t var_index, std::size_t length);
+
+	// 静的変数を str 型の配列として確保する。
+	void sdim(std::size_t var_index, std::size_t buffer_size, std::size_t length);
+
+	void set_int(std::size_t var_index, std::size_t element_index, int value);
+
+	void set_str(std::size_t var_index, std::size_t element_index, char const* value);
+
+	// コードセグメント、データセグメント、デバッグセグメントを置き換える。
+	void set_code_segment(std::vector<hsx::HspCodeUnit> code_segment);
+
+	void set_data_segment(std::vector<char> data_segment);
+
+	void set_debug_segment(std::vector<unsigned char> debug_segment);
+};
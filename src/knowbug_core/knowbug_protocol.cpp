@@ -1,4 +1,6 @@
 #include "pch.h"
+#include <chrono>
+#include <climits>
 #include "encoding.h"
 #include "knowbug_protocol.h"
 #include "string_format.h"
@@ -100,13 +102,179 @@ static auto unescape(Utf8StringView str) -> Utf8String {
 	return output;
 }
 
-auto knowbug_protocol_parse(Utf8String& buffer)->std::optional<KnowbugMessage> {
+// -----------------------------------------------
+// バイナリ形式
+// -----------------------------------------------
+
+// バイナリ形式のボディー部の先頭に置くバイト。
+// テキスト形式では NUL 文字がエスケープされるので、テキスト形式のボディー部と区別できる。
+static constexpr auto BINARY_BODY_MARKER = Utf8Char{ u8'\0' };
+
+// バイナリ形式のフィールドの型タグ
+static constexpr auto BINARY_TAG_STR = 0x01;
+static constexpr auto BINARY_TAG_INT = 0x02;
+static constexpr auto BINARY_TAG_BOOL = 0x03;
+
+// 符号なし整数を LEB128 形式で書き込む。
+static void write_varint(Utf8String& output, std::uint64_t value) {
+	while (value >= 0x80) {
+		output.push_back((Utf8Char)(unsigned char)((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	output.push_back((Utf8Char)(unsigned char)value);
+}
+
+// LEB128 形式の符号なし整数を読む。成功したら index を進める。
+static auto read_varint(Utf8StringView input, std::size_t& index) -> std::optional<std::uint64_t> {
+	auto value = std::uint64_t{};
+	auto shift = 0;
+
+	while (index < input.size() && shift < 64) {
+		auto b = (unsigned char)input[index];
+		index++;
+
+		value |= (std::uint64_t)(b & 0x7F) << shift;
+		if ((b & 0x80) == 0) {
+			return value;
+		}
+		shift += 7;
+	}
+
+	return std::nullopt;
+}
+
+// 符号付き整数を符号なし整数に変換する。(絶対値が小さいほど短く書けるようにする。)
+static auto zigzag_encode(int value) -> std::uint64_t {
+	auto v = (std::int64_t)value;
+	return (std::uint64_t)((v << 1) ^ (v >> 63));
+}
+
+static auto zigzag_decode(std::uint64_t value) -> std::int64_t {
+	return (std::int64_t)(value >> 1) ^ -(std::int64_t)(value & 1);
+}
+
+static void write_bytes(Utf8String& output, Utf8StringView bytes) {
+	write_varint(output, bytes.size());
+	output += bytes;
+}
+
+static auto read_bytes(Utf8StringView input, std::size_t& index) -> std::optional<Utf8StringView> {
+	auto size_opt = read_varint(input, index);
+	if (!size_opt || *size_opt > input.size() - index) {
+		return std::nullopt;
+	}
+
+	auto bytes = input.substr(index, (std::size_t)*size_opt);
+	index += bytes.size();
+	return bytes;
+}
+
+static auto serialize_binary_body(KnowbugMessage const& message) -> Utf8String {
 	auto body = Utf8String{};
+	body.push_back(BINARY_BODY_MARKER);
+
+	for (auto&& entry : message) {
+		switch (entry.kind()) {
+		case KnowbugValueKind::Str:
+			body.push_back((Utf8Char)BINARY_TAG_STR);
+			write_bytes(body, entry.key());
+			write_bytes(body, entry.value());
+			break;
+
+		case KnowbugValueKind::Int:
+			body.push_back((Utf8Char)BINARY_TAG_INT);
+			write_bytes(body, entry.key());
+			write_varint(body, zigzag_encode(entry.int_value()));
+			break;
+
+		case KnowbugValueKind::Bool:
+			body.push_back((Utf8Char)BINARY_TAG_BOOL);
+			write_bytes(body, entry.key());
+			body.push_back((Utf8Char)(entry.int_value() != 0 ? 1 : 0));
+			break;
+
+		default:
+			assert(false && u8"Unknown KnowbugValueKind");
+			break;
+		}
+	}
 
-	if (!transfer_protocol_parse(body, buffer)) {
+	return body;
+}
+
+static auto parse_binary_body(Utf8StringView body) -> std::optional<KnowbugMessage> {
+	assert(!body.empty() && body[0] == BINARY_BODY_MARKER);
+
+	auto message = KnowbugMessage{};
+	auto index = std::size_t{ 1 };
+
+	while (index < body.size()) {
+		auto tag = (int)(unsigned char)body[index];
+		index++;
+
+		auto key_opt = read_bytes(body, index);
+		if (!key_opt) {
+			assert(false && u8"broken binary body");
+			return std::nullopt;
+		}
+		auto key = Utf8String{ *key_opt };
+
+		switch (tag) {
+		case BINARY_TAG_STR: {
+			auto value_opt = read_bytes(body, index);
+			if (!value_opt) {
+				assert(false && u8"broken binary body");
+				return std::nullopt;
+			}
+
+			message.insert(std::move(key), Utf8String{ *value_opt });
+			break;
+		}
+		case BINARY_TAG_INT: {
+			auto value_opt = read_varint(body, index);
+			if (!value_opt) {
+				assert(false && u8"broken binary body");
+				return std::nullopt;
+			}
+
+			auto value = zigzag_decode(*value_opt);
+			if (value < INT_MIN || value > INT_MAX) {
+				assert(false && u8"int out of range");
+				return std::nullopt;
+			}
+
+			message.insert_int(std::move(key), (int)value);
+			break;
+		}
+		case BINARY_TAG_BOOL: {
+			if (index >= body.size()) {
+				assert(false && u8"broken binary body");
+				return std::nullopt;
+			}
+
+			message.insert_bool(std::move(key), body[index] != Utf8Char{});
+			index++;
+			break;
+		}
+		default:
+			assert(false && u8"unknown field tag");
+			return std::nullopt;
+		}
+	}
+
+	if (message.size() == 0 || !message.get(as_utf8(u8"method"))) {
+		assert(false && u8"missing method key");
 		return std::nullopt;
 	}
 
+	return message;
+}
+
+// -----------------------------------------------
+// テキスト形式
+// -----------------------------------------------
+
+static auto parse_text_body(Utf8StringView body) -> std::optional<KnowbugMessage> {
 	auto message = KnowbugMessage{};
 
 	for (auto&& line : StringLines<Utf8Char>{ body }) {
@@ -135,14 +303,51 @@ auto knowbug_protocol_parse(Utf8String& buffer)->std::optional<KnowbugMessage> {
 	return message;
 }
 
-auto knowbug_protocol_serialize(KnowbugMessage const& message) -> Utf8String {
+static auto serialize_text_body(KnowbugMessage const& message) -> Utf8String {
 	auto body = Utf8String{};
-	for (auto&& pair : message) {
-		body += escape(pair.first);
+	for (auto&& entry : message) {
+		body += escape(entry.key());
 		body += as_utf8(u8" = ");
-		body += escape(pair.second);
+		body += escape(entry.value());
 		body += as_utf8(u8"\r\n");
 	}
+	return body;
+}
+
+// -----------------------------------------------
+// メッセージ
+// -----------------------------------------------
+
+auto knowbug_protocol_parse(Utf8String& buffer)->std::optional<KnowbugMessage> {
+	auto body = Utf8String{};
+
+	if (!transfer_protocol_parse(body, buffer)) {
+		return std::nullopt;
+	}
+
+	return knowbug_protocol_parse_body(body);
+}
+
+auto knowbug_protocol_parse_body(Utf8StringView body) -> std::optional<KnowbugMessage> {
+	return knowbug_protocol_parse_body(body, KnowbugBodyFormat::Text);
+}
+
+auto knowbug_protocol_parse_body(Utf8StringView body, KnowbugBodyFormat format) -> std::optional<KnowbugMessage> {
+	if (format == KnowbugBodyFormat::Binary && !body.empty() && body[0] == BINARY_BODY_MARKER) {
+		return parse_binary_body(body);
+	}
+
+	return parse_text_body(body);
+}
+
+auto knowbug_protocol_serialize(KnowbugMessage const& message) -> Utf8String {
+	return knowbug_protocol_serialize(message, KnowbugBodyFormat::Text);
+}
+
+auto knowbug_protocol_serialize(KnowbugMessage const& message, KnowbugBodyFormat format) -> Utf8String {
+	auto body = format == KnowbugBodyFormat::Binary
+		? serialize_binary_body(message)
+		: serialize_text_body(message);
 
 	auto output = Utf8String{};
 	output += as_utf8(u8"Content-Length: ");
@@ -152,6 +357,18 @@ auto knowbug_protocol_serialize(KnowbugMessage const& message) -> Utf8String {
 	return output;
 }
 
+auto knowbug_body_format_from_name(Utf8StringView name) -> std::optional<KnowbugBodyFormat> {
+	if (name == as_utf8(u8"text")) {
+		return KnowbugBodyFormat::Text;
+	}
+
+	if (name == as_utf8(u8"binary")) {
+		return KnowbugBodyFormat::Binary;
+	}
+
+	return std::nullopt;
+}
+
 void knowbug_protocol_tests(Tests& tests) {
 	auto&& suite = tests.suite(u8"knowbug_protocol");
 
@@ -198,4 +415,118 @@ void knowbug_protocol_tests(Tests& tests) {
 				&& t.eq(*message_opt->get(as_utf8(u8"assignment")), as_utf8(u8"yen = \"\\\""))
 				&& t.eq(*message_opt->get(as_utf8(u8"crlf")), as_utf8(u8"\r\n"));
 		});
+
+	suite.test(
+		u8"バイナリ形式の往復",
+		[](TestCaseContext& t) {
+			auto large = Utf8String{};
+			for (auto i = 0; i < 100000; i++) {
+				large.push_back((Utf8Char)(unsigned char)(i % 256));
+			}
+
+			auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"foo_event") });
+			message.insert(Utf8String{ as_utf8(u8"special") }, Utf8String{ as_utf8(std::string_view{ u8"a = \"\\\"\r\n\0b", 11 }) });
+			message.insert(Utf8String{ as_utf8(u8"large") }, Utf8String{ large });
+			message.insert(Utf8String{}, Utf8String{});
+			message.insert_int(Utf8String{ as_utf8(u8"zero") }, 0);
+			message.insert_int(Utf8String{ as_utf8(u8"negative") }, -42);
+			message.insert_int(Utf8String{ as_utf8(u8"min") }, INT_MIN);
+			message.insert_int(Utf8String{ as_utf8(u8"max") }, INT_MAX);
+			message.insert_bool(Utf8String{ as_utf8(u8"yes") }, true);
+			message.insert_bool(Utf8String{ as_utf8(u8"no") }, false);
+
+			auto buffer = knowbug_protocol_serialize(message, KnowbugBodyFormat::Binary);
+			auto body = Utf8String{};
+			if (!t.eq(transfer_protocol_parse(body, buffer), true)) {
+				return false;
+			}
+
+			auto parsed_opt = knowbug_protocol_parse_body(body, KnowbugBodyFormat::Binary);
+			if (!t.eq(parsed_opt.has_value(), true)) {
+				return false;
+			}
+
+			auto&& parsed = *parsed_opt;
+			return t.eq(parsed.size(), message.size())
+				&& t.eq(parsed.method(), as_utf8(u8"foo_event"))
+				&& t.eq(*parsed.get(as_utf8(u8"special")), as_utf8(std::string_view{ u8"a = \"\\\"\r\n\0b", 11 }))
+				&& t.eq(*parsed.get(as_utf8(u8"large")) == large, true)
+				&& t.eq(*parsed.get(Utf8StringView{}), Utf8StringView{})
+				&& t.eq(*parsed.get_int(as_utf8(u8"zero")), 0)
+				&& t.eq(*parsed.get_int(as_utf8(u8"negative")), -42)
+				&& t.eq(*parsed.get_int(as_utf8(u8"min")), INT_MIN)
+				&& t.eq(*parsed.get_int(as_utf8(u8"max")), INT_MAX)
+				&& t.eq(*parsed.get(as_utf8(u8"negative")), as_utf8(u8"-42"))
+				&& t.eq(*parsed.get_bool(as_utf8(u8"yes")), true)
+				&& t.eq(*parsed.get_bool(as_utf8(u8"no")), false);
+		});
+
+	suite.test(
+		u8"バイナリ形式を指定してもテキスト形式のボディー部を解析できる",
+		[](TestCaseContext& t) {
+			auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"initialize_notification") });
+			message.insert_int(Utf8String{ as_utf8(u8"count") }, -7);
+
+			auto buffer = knowbug_protocol_serialize(message, KnowbugBodyFormat::Text);
+			auto body = Utf8String{};
+			transfer_protocol_parse(body, buffer);
+
+			auto parsed_opt = knowbug_protocol_parse_body(body, KnowbugBodyFormat::Binary);
+			return t.eq(parsed_opt.has_value(), true)
+				&& t.eq(parsed_opt->method(), as_utf8(u8"initialize_notification"))
+				&& t.eq(*parsed_opt->get_int(as_utf8(u8"count")), -7);
+		});
+
+	suite.test(
+		u8"knowbug_body_format_from_name",
+		[](TestCaseContext& t) {
+			return t.eq(knowbug_body_format_from_name(as_utf8(u8"text")) == KnowbugBodyFormat::Text, true)
+				&& t.eq(knowbug_body_format_from_name(as_utf8(u8"binary")) == KnowbugBodyFormat::Binary, true)
+				&& t.eq(knowbug_body_format_from_name(as_utf8(u8"json")).has_value(), false);
+		});
+
+	suite.test(
+		u8"ベンチマーク: テキスト形式とバイナリ形式",
+		[](TestCaseContext& t) {
+			static constexpr auto MESSAGE_COUNT = 2000;
+
+			// リストの更新イベントを模したメッセージ
+			auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"list_updated_event") });
+			message.insert(Utf8String{ as_utf8(u8"kind") }, Utf8String{ as_utf8(u8"update") });
+			message.insert_int(Utf8String{ as_utf8(u8"object_id") }, 123456);
+			message.insert_int(Utf8String{ as_utf8(u8"index") }, 789);
+			message.insert_int(Utf8String{ as_utf8(u8"depth") }, 2);
+			message.insert(Utf8String{ as_utf8(u8"name") }, Utf8String{ as_utf8(u8"配列変数(12, 34)") });
+			message.insert(Utf8String{ as_utf8(u8"value") }, Utf8String{ as_utf8(u8"\"Hello, world!\" (文字列 = \\x0d\\x0a)") });
+
+			auto success = true;
+
+			for (auto format : { KnowbugBodyFormat::Text, KnowbugBodyFormat::Binary }) {
+				auto total_size = std::size_t{};
+				auto count = 0;
+				auto start = std::chrono::steady_clock::now();
+
+				for (auto i = 0; i < MESSAGE_COUNT; i++) {
+					auto buffer = knowbug_protocol_serialize(message, format);
+					total_size += buffer.size();
+
+					auto body = Utf8String{};
+					transfer_protocol_parse(body, buffer);
+					if (knowbug_protocol_parse_body(body, format)) {
+						count++;
+					}
+				}
+
+				auto elapsed = std::chrono::steady_clock::now() - start;
+				auto usec = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+				t.output()
+					<< (format == KnowbugBodyFormat::Text ? u8"    テキスト形式" : u8"    バイナリ形式")
+					<< u8": " << total_size / MESSAGE_COUNT << u8" バイト/メッセージ"
+					<< u8", 往復 " << usec << u8" us (" << MESSAGE_COUNT << u8" 件)" << std::endl;
+
+				success = success && t.eq(count, MESSAGE_COUNT);
+			}
+			return success;
+		});
 }
@@ -8,9 +8,67 @@
 
 class Tests;
 
+// メッセージに含まれる値の種類。
+// テキスト形式では区別されないが、バイナリ形式では値の表現が変わる。
+enum class KnowbugValueKind {
+	Str,
+	Int,
+	Bool,
+};
+
+// メッセージのボディー部の形式。
+// クライアントが initialize_notification で要求したときだけバイナリ形式を使う。
+enum class KnowbugBodyFormat {
+	// key = value\r\n の形式 (既定)
+	Text,
+
+	// 型付きのフィールドを並べた形式。(knowbug-protocol.md を参照。)
+	Binary,
+};
+
+// メッセージのキーと値のペア
+class KnowbugMessageEntry {
+	Utf8String key_;
+	KnowbugValueKind kind_;
+
+	// 値の文字列表現。(真偽値もテキスト形式と同じ表現で持つ。)
+	// 整数の文字列表現は、バイナリ形式では使わないので、value が最初に呼ばれたときに作る。
+	mutable Utf8String value_;
+
+	int int_value_;
+
+public:
+	KnowbugMessageEntry(Utf8String key, KnowbugValueKind kind, Utf8String value, int int_value)
+		: key_(std::move(key))
+		, kind_(kind)
+		, value_(std::move(value))
+		, int_value_(int_value)
+	{
+	}
+
+	auto key() const -> Utf8StringView {
+		return key_;
+	}
+
+	auto kind() const -> KnowbugValueKind {
+		return kind_;
+	}
+
+	auto value() const -> Utf8StringView {
+		if (kind_ == KnowbugValueKind::Int && value_.empty()) {
+			value_ = as_utf8(std::to_string(int_value_));
+		}
+		return value_;
+	}
+
+	// 整数値 (Int のときは値、Bool のときは 0 か 1)
+	auto int_value() const -> int {
+		return int_value_;
+	}
+};
+
 class KnowbugMessage {
-	using Pair = std::pair<Utf8String, Utf8String>;
-	using Assoc = std::vector<Pair>;
+	using Assoc = std::vector<KnowbugMessageEntry>;
 
 	Assoc assoc_;
 
@@ -31,26 +89,39 @@ public:
 			return as_utf8(u8"NO_METHOD");
 		}
 
-		return assoc_[0].second;
+		return assoc_[0].value();
 	}
 
-	auto get(Utf8StringView key) const->std::optional<Utf8StringView> {
-		for (auto&& pair : assoc_) {
-			if (pair.first == key) {
-				return pair.second;
+	auto find(Utf8StringView key) const->KnowbugMessageEntry const* {
+		for (auto&& entry : assoc_) {
+			if (entry.key() == key) {
+				return &entry;
 			}
 		}
 
-		return std::nullopt;
+		return nullptr;
+	}
+
+	auto get(Utf8StringView key) const->std::optional<Utf8StringView> {
+		auto entry = find(key);
+		if (!entry) {
+			return std::nullopt;
+		}
+
+		return entry->value();
 	}
 
 	auto get_int(Utf8StringView key) const->std::optional<int> {
-		auto value_opt = get(key);
-		if (!value_opt) {
+		auto entry = find(key);
+		if (!entry) {
 			return std::nullopt;
 		}
 
-		return std::atol(as_native(*value_opt).data());
+		if (entry->kind() != KnowbugValueKind::Str) {
+			return entry->int_value();
+		}
+
+		return std::atol(as_native(Utf8String{ entry->value() }).data());
 	}
 
 	auto get_bool(Utf8StringView key) const->std::optional<bool> {
@@ -65,15 +136,15 @@ public:
 	}
 
 	void insert(Utf8String key, Utf8String value) {
-		assoc_.push_back(Pair{ std::move(key),std::move(value) });
+		assoc_.emplace_back(std::move(key), KnowbugValueKind::Str, std::move(value), 0);
 	}
 
 	void insert_int(Utf8String key, int value) {
-		insert(std::move(key), as_utf8(std::to_string(value)));
+		assoc_.emplace_back(std::move(key), KnowbugValueKind::Int, Utf8String{}, value);
 	}
 
 	void insert_bool(Utf8String key, bool value) {
-		insert(std::move(key), Utf8String{ as_utf8(value ? u8"true" : u8"false") });
+		assoc_.emplace_back(std::move(key), KnowbugValueKind::Bool, Utf8String{ as_utf8(value ? u8"true" : u8"false") }, value ? 1 : 0);
 	}
 
 	auto begin() const -> Assoc::const_iterator {
@@ -89,7 +160,20 @@ public:
 // 取り出したら true を返し、バッファーからメッセージを取り除き、ボディー部分を解析したデータを body にコピーする。
 extern auto knowbug_protocol_parse(Utf8String& buffer) -> std::optional<KnowbugMessage>;
 
+// メッセージのボディー部を解析する。
+extern auto knowbug_protocol_parse_body(Utf8StringView body) -> std::optional<KnowbugMessage>;
+
+// 指定された形式のボディー部を解析する。
+// バイナリ形式が指定されても、ボディー部がテキスト形式ならテキスト形式として解析する。
+extern auto knowbug_protocol_parse_body(Utf8StringView body, KnowbugBodyFormat format) -> std::optional<KnowbugMessage>;
+
 // メッセージを構築する。
 extern auto knowbug_protocol_serialize(KnowbugMessage const& message)->Utf8String;
 
+// 指定された形式でメッセージを構築する。
+extern auto knowbug_protocol_serialize(KnowbugMessage const& message, KnowbugBodyFormat format)->Utf8String;
+
+// ボディー部の形式の名前 ("text" または "binary") を解釈する。
+extern auto knowbug_body_format_from_name(Utf8StringView name) -> std::optional<KnowbugBodyFormat>;
+
 extern void knowbug_protocol_tests(Tests& tests);
@@ -0,0 +1,109 @@
+#include "pch.h"
+#include <cmath>
+#include "latency_histogram.h"
+#include "test_suite.h"
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration elapsed) {
+	auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+	record_microseconds(microseconds > 0 ? (std::uint64_t)microseconds : 0);
+}
+
+void LatencyHistogram::record_microseconds(std::uint64_t microseconds) {
+	buckets_[bucket_index(microseconds)]++;
+	count_++;
+	total_microseconds_ += microseconds;
+	max_microseconds_ = std::max(max_microseconds_, microseconds);
+}
+
+auto LatencyHistogram::percentile_microseconds(double p) const -> std::uint64_t {
+	if (count_ == 0) {
+		return 0;
+	}
+
+	auto threshold = (std::uint64_t)std::ceil(p * (double)count_);
+	auto sum = std::uint64_t{};
+
+	for (auto i = std::size_t{}; i < BUCKET_COUNT; i++) {
+		sum += buckets_[i];
+		if (sum >= threshold && sum != 0) {
+			// バケツの上端 (ただし最大値を超えない)
+			auto upper = i == 0 ? std::uint64_t{ 0 } : (std::uint64_t{ 1 } << i) - 1;
+			return std::min(upper, max_microseconds_);
+		}
+	}
+	return max_microseconds_;
+}
+
+auto LatencyHistogram::to_summary(Utf8StringView title) const -> Utf8String {
+	auto text = Utf8String{ title };
+	text += as_utf8(u8": count=");
+	text += as_utf8(std::to_string(count()));
+	text += as_utf8(u8", mean=");
+	text += as_utf8(std::to_string(mean_microseconds()));
+	text += as_utf8(u8"us, p50<=");
+	text += as_utf8(std::to_string(percentile_microseconds(0.5)));
+	text += as_utf8(u8"us, p99<=");
+	text += as_utf8(std::to_string(percentile_microseconds(0.99)));
+	text += as_utf8(u8"us, max=");
+	text += as_utf8(std::to_string(max_microseconds()));
+	text += as_utf8(u8"us");
+	return text;
+}
+
+auto LatencyHistogram::bucket_index(std::uint64_t microseconds) -> std::size_t {
+	auto index = std::size_t{};
+	while (microseconds != 0 && index + 1 < BUCKET_COUNT) {
+		microseconds >>= 1;
+		index++;
+	}
+	return index;
+}
+
+void latency_histogram_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"latency_histogram");
+
+	suite.test(
+		u8"バケツの位置",
+		[](TestCaseContext& t) {
+			return t.eq(LatencyHistogram::bucket_index(0), 0)
+				&& t.eq(LatencyHistogram::bucket_index(1), 1)
+				&& t.eq(LatencyHistogram::bucket_index(2), 2)
+				&& t.eq(LatencyHistogram::bucket_index(3), 2)
+				&& t.eq(LatencyHistogram::bucket_index(4), 3)
+				&& t.eq(LatencyHistogram::bucket_index(16000), 14)
+				&& t.eq(LatencyHistogram::bucket_index(~std::uint64_t{}), LatencyHistogram::BUCKET_COUNT - 1);
+		});
+
+	suite.test(
+		u8"統計値",
+		[](TestCaseContext& t) {
+			auto histogram = LatencyHistogram{};
+
+			// 99件は 100us 付近、1件だけ 16ms
+			for (auto i = 0; i < 99; i++) {
+				histogram.record_microseconds(100);
+			}
+			histogram.record(std::chrono::milliseconds{ 16 });
+
+			return t.eq(histogram.count(), 100)
+				&& t.eq(histogram.max_microseconds(), 16000)
+				&& t.eq(histogram.mean_microseconds(), (99 * 100 + 16000) / 100)
+				&& t.eq(histogram.bucket(7), 99)
+				&& t.eq(histogram.percentile_microseconds(0.5), 127)
+				&& t.eq(histogram.percentile_microseconds(0.99), 127)
+				&& t.eq(histogram.percentile_microseconds(1.0), 16000)
+				&& t.eq(
+					histogram.to_summary(as_utf8(u8"wait")),
+					as_utf8(u8"wait: count=100, mean=259us, p50<=127us, p99<=127us, max=16000us")
+				);
+		});
+
+	suite.test(
+		u8"空のとき",
+		[](TestCaseContext& t) {
+			auto histogram = LatencyHistogram{};
+			return t.eq(histogram.count(), 0)
+				&& t.eq(histogram.mean_microseconds(), 0)
+				&& t.eq(histogram.percentile_microseconds(0.99), 0);
+		});
+}
@@ -0,0 +1,65 @@
+//! 処理時間のヒストグラム
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include "encoding.h"
+
+class Tests;
+
+// 処理時間の分布を記録するもの。
+//
+// マイクロ秒単位の時間を 2 の累乗ごとのバケツに数える。(k 番目のバケツは [2^(k-1), 2^k) マイクロ秒)
+// 記録は O(1) で、メモリー確保もしない。
+class LatencyHistogram {
+public:
+	static constexpr auto BUCKET_COUNT = std::size_t{ 32 };
+
+private:
+	std::array<std::uint64_t, BUCKET_COUNT> buckets_;
+	std::uint64_t count_;
+	std::uint64_t total_microseconds_;
+	std::uint64_t max_microseconds_;
+
+public:
+	LatencyHistogram()
+		: buckets_()
+		, count_()
+		, total_microseconds_()
+		, max_microseconds_()
+	{
+	}
+
+	void record(std::chrono::steady_clock::duration elapsed);
+
+	void record_microseconds(std::uint64_t microseconds);
+
+	auto count() const -> std::uint64_t {
+		return count_;
+	}
+
+	auto max_microseconds() const -> std::uint64_t {
+		return max_microseconds_;
+	}
+
+	auto mean_microseconds() const -> std::uint64_t {
+		return count_ != 0 ? total_microseconds_ / count_ : 0;
+	}
+
+	auto bucket(std::size_t index) const -> std::uint64_t {
+		return buckets_.at(index);
+	}
+
+	// 全体の割合 p (0〜1) がこの時間以下に収まる、という値の上限。(バケツの上端で近似する。)
+	auto percentile_microseconds(double p) const -> std::uint64_t;
+
+	// 「タイトル: 件数, 平均, p50, p99, 最大」の形式の1行にする。
+	auto to_summary(Utf8StringView title) const -> Utf8String;
+
+	// バケツの位置を計算する。
+	static auto bucket_index(std::uint64_t microseconds) -> std::size_t;
+};
+
+extern void latency_histogram_tests(Tests& tests);
@@ -0,0 +1,167 @@
+#include "pch.h"
+#include <chrono>
+#include "hsp_line_table.h"
+#include "line_breakpoint.h"
+#include "test_suite.h"
+
+void LineBreakpointSet::set(std::size_t file_id, std::size_t line_index, bool enabled) {
+	if (contains(file_id, line_index) == enabled) {
+		return;
+	}
+
+	if (file_id >= files_.size()) {
+		files_.resize(file_id + 1);
+	}
+
+	auto&& bits = files_[file_id];
+	auto word = line_index / 64;
+	if (word >= bits.size()) {
+		bits.resize(word + 1);
+	}
+
+	auto mask = std::uint64_t{ 1 } << (line_index % 64);
+	if (enabled) {
+		bits[word] |= mask;
+		count_++;
+	} else {
+		bits[word] &= ~mask;
+		count_--;
+	}
+}
+
+void LineBreakpointSet::clear() {
+	files_.clear();
+	count_ = 0;
+}
+
+auto LineBreakpointSet::lines(std::size_t file_id) const -> std::vector<std::size_t> {
+	auto lines = std::vector<std::size_t>{};
+	if (file_id >= files_.size()) {
+		return lines;
+	}
+
+	auto&& bits = files_[file_id];
+	for (auto word = std::size_t{}; word < bits.size(); word++) {
+		for (auto bit = std::size_t{}; bit < 64; bit++) {
+			if ((bits[word] >> bit & 1) != 0) {
+				lines.push_back(word * 64 + bit);
+			}
+		}
+	}
+	return lines;
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+void line_breakpoint_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"line_breakpoint");
+
+	suite.test(
+		u8"設定した行だけが含まれる",
+		[](TestCaseContext& t) {
+			auto set = LineBreakpointSet{};
+			set.set(1, 0, true);
+			set.set(1, 63, true);
+			set.set(1, 64, true);
+			set.set(3, 1000, true);
+
+			// 重複した設定や、ない行の解除は無視される。
+			set.set(1, 64, true);
+			set.set(2, 5, false);
+
+			return t.eq(set.size(), std::size_t{ 4 })
+				&& t.eq(set.contains(1, 0), true)
+				&& t.eq(set.contains(1, 1), false)
+				&& t.eq(set.contains(1, 63), true)
+				&& t.eq(set.contains(1, 64), true)
+				&& t.eq(set.contains(0, 0), false)
+				&& t.eq(set.contains(3, 1000), true)
+				&& t.eq(set.contains(3, 100000), false)
+				&& t.eq(set.contains(9, 0), false)
+				&& t.eq(set.lines(1) == std::vector<std::size_t>{ 0, 63, 64 }, true);
+		});
+
+	suite.test(
+		u8"解除すると空になる",
+		[](TestCaseContext& t) {
+			auto set = LineBreakpointSet{};
+			set.set(0, 10, true);
+			set.set(0, 20, true);
+			set.set(0, 10, false);
+
+			auto one_left = set.size() == 1 && !set.contains(0, 10) && set.contains(0, 20);
+
+			set.set(0, 20, false);
+			auto empty = set.empty();
+
+			set.set(0, 30, true);
+			set.clear();
+
+			return t.eq(one_left, true)
+				&& t.eq(empty, true)
+				&& t.eq(set.empty(), true)
+				&& t.eq(set.contains(0, 30), false);
+		});
+
+	suite.test(
+		u8"停止した行では、再開してすぐに止まらない",
+		[](TestCaseContext& t) {
+			auto detector = LineEnterDetector{};
+			auto first = detector.enter(3);
+			auto same = detector.enter(3);
+
+			// ブレークポイントがない状態で行 7 で停止し、行 7 にブレークポイントを置いて再開する。
+			// (停止中は命令ごとの判定が行われないので、停止した行を記録しなければ前の行 3 が残る。)
+			detector.did_stop(7);
+			auto resumed = detector.enter(7);
+			auto next = detector.enter(8);
+			auto back = detector.enter(7);
+
+			auto unknown = detector.enter(HspLineTable::NO_LINE_SLOT);
+
+			return t.eq(first, true)
+				&& t.eq(same, false)
+				&& t.eq(resumed, false)
+				&& t.eq(next, true)
+				&& t.eq(back, true)
+				&& t.eq(unknown, false);
+		});
+
+	suite.test(
+		u8"ベンチマーク: 命令ごとの判定 (コード位置から行を引いて判定する)",
+		[](TestCaseContext& t) {
+			static constexpr auto LINE_COUNT = std::size_t{ 100000 };
+			static constexpr auto STEP_COUNT = std::size_t{ 10000000 };
+
+			// 1行あたり4ワードのコードを持つスクリプト
+			auto builder = HspLineTableBuilder{};
+			for (auto i = std::size_t{}; i < LINE_COUNT; i++) {
+				builder.add(i * 4, 4, i % 4, i);
+			}
+			auto table = builder.finish();
+
+			auto set = LineBreakpointSet{};
+			for (auto i = std::size_t{}; i < 100; i++) {
+				auto line_index = i * 997 % LINE_COUNT;
+				set.set(line_index % 4, line_index, true);
+			}
+
+			auto hit_count = std::size_t{};
+			auto start = std::chrono::steady_clock::now();
+			for (auto i = std::size_t{}; i < STEP_COUNT; i++) {
+				auto&& entry_opt = table.code_to_line(i * 13 % (LINE_COUNT * 4));
+				if (entry_opt && set.contains(entry_opt->file_id(), entry_opt->line_index())) {
+					hit_count++;
+				}
+			}
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+
+			t.output()
+				<< u8"    " << (int)(ns / STEP_COUNT) << u8" ns/命令 (停止 " << hit_count << u8" 回)" << std::endl;
+
+			return t.eq(hit_count != 0, true);
+		});
+}
@@ -0,0 +1,85 @@
+//! 行ブレークポイント
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "hsp_line_table.h"
+
+class Tests;
+
+// 行ブレークポイントの集合。
+//
+// ソースファイルごとに、行番号をビット位置とするビット列で持つ。
+// 停止するかの判定は命令ごとに行うので、O(1) で済むようにする。
+class LineBreakpointSet {
+	// ファイルIDごとのビット列
+	std::vector<std::vector<std::uint64_t>> files_;
+
+	std::size_t count_;
+
+public:
+	LineBreakpointSet()
+		: files_()
+		, count_()
+	{
+	}
+
+	auto empty() const -> bool {
+		return count_ == 0;
+	}
+
+	auto size() const -> std::size_t {
+		return count_;
+	}
+
+	auto contains(std::size_t file_id, std::size_t line_index) const -> bool {
+		if (file_id >= files_.size()) {
+			return false;
+		}
+
+		auto&& bits = files_[file_id];
+		auto word = line_index / 64;
+		return word < bits.size() && (bits[word] >> (line_index % 64) & 1) != 0;
+	}
+
+	// ブレークポイントを設定または解除する。
+	void set(std::size_t file_id, std::size_t line_index, bool enabled);
+
+	void clear();
+
+	// ファイルに設定されているブレークポイントの行番号 (昇順)
+	auto lines(std::size_t file_id) const->std::vector<std::size_t>;
+};
+
+// 別の行に入ったことを検出するもの。(同じ行の中を実行している間は、繰り返し停止しないために使う。)
+//
+// 行は HspLineTable の line slot で表す。line slot は (ファイル, 行) ごとに1つなので、番号が変わったら別の行に入ったことになる。
+class LineEnterDetector {
+	std::uint32_t last_line_slot_;
+
+public:
+	LineEnterDetector()
+		: last_line_slot_(HspLineTable::NO_LINE_SLOT)
+	{
+	}
+
+	// 停止した行を記録する。(再開してすぐに同じ行で止まらないようにする。)
+	// ブレークポイントの有無にかかわらず、停止するたびに呼ぶ。
+	void did_stop(std::uint32_t line_slot) {
+		last_line_slot_ = line_slot;
+	}
+
+	// 命令ごとに呼ぶ。別の行に入ったら true を返す。
+	auto enter(std::uint32_t line_slot) -> bool {
+		if (line_slot == HspLineTable::NO_LINE_SLOT) {
+			return false;
+		}
+
+		auto entered = line_slot != last_line_slot_;
+		last_line_slot_ = line_slot;
+		return entered;
+	}
+};
+
+extern void line_breakpoint_tests(Tests& tests);
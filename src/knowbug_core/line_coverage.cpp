@@ -0,0 +1,186 @@
+#include "pch.h"
+#include <chrono>
+#include "hsp_line_table.h"
+#include "line_coverage.h"
+#include "string_format.h"
+#include "test_suite.h"
+
+LineCoverage::LineCoverage(HspLineTable const& table)
+	: table_(table)
+	, bits_((table.line_slot_count() + 63) / 64)
+{
+}
+
+auto LineCoverage::line_count() const -> std::size_t {
+	return table_.line_slot_count();
+}
+
+auto LineCoverage::covered_count() const -> std::size_t {
+	auto count = std::size_t{};
+	for (auto word : bits_) {
+		for (; word != 0; word &= word - 1) {
+			count++;
+		}
+	}
+	return count;
+}
+
+void LineCoverage::record(std::optional<std::size_t> code_offset) {
+	auto slot = table_.position_to_line_slot(code_offset);
+	if (slot == HspLineTable::NO_LINE_SLOT) {
+		return;
+	}
+
+	bits_[slot / 64] |= std::uint64_t{ 1 } << (slot % 64);
+}
+
+auto LineCoverage::is_covered(std::size_t file_id, std::size_t line_index) const -> bool {
+	auto&& code_opt = table_.line_to_first_code(file_id, line_index);
+	if (!code_opt) {
+		return false;
+	}
+
+	auto slot = table_.code_to_line_slot(*code_opt);
+	return slot != HspLineTable::NO_LINE_SLOT && (bits_[slot / 64] >> (slot % 64) & 1) != 0;
+}
+
+void LineCoverage::clear() {
+	std::fill(bits_.begin(), bits_.end(), std::uint64_t{});
+}
+
+auto LineCoverage::to_lcov(std::vector<Utf8String> const& file_names) const -> Utf8String {
+	auto text = Utf8String{};
+
+	// ビットは (ファイル, 行) の順に並んでいるので、ファイルごとに1つのレコードにまとめて出力する。
+	auto slot = std::size_t{};
+	while (slot < line_count()) {
+		auto file_id = table_.line_slot_to_entry(slot).file_id();
+
+		// ファイル名の分からないファイルは出力しない。
+		auto has_name = file_id < file_names.size() && !file_names[file_id].empty();
+		if (has_name) {
+			text += as_utf8(u8"TN:\nSF:");
+			text += file_names[file_id];
+			text += as_utf8(u8"\n");
+		}
+
+		auto found = std::size_t{};
+		auto hit = std::size_t{};
+		for (; slot < line_count(); slot++) {
+			auto&& entry = table_.line_slot_to_entry(slot);
+			if (entry.file_id() != file_id) {
+				break;
+			}
+
+			auto covered = (bits_[slot / 64] >> (slot % 64) & 1) != 0;
+			found++;
+			if (covered) {
+				hit++;
+			}
+
+			if (has_name) {
+				text += as_utf8(strf("DA:%d,%d\n", entry.line_index() + 1, covered ? 1 : 0));
+			}
+		}
+
+		if (has_name) {
+			text += as_utf8(strf("LF:%d\nLH:%d\nend_of_record\n", found, hit));
+		}
+	}
+	return text;
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+void line_coverage_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"line_coverage");
+
+	suite.test(
+		u8"実行した行だけが記録される",
+		[](TestCaseContext& t) {
+			// ファイル 0 の行 0, 2 とファイル 1 の行 3。ファイル 0 の行 0 は2つの範囲に分かれている。
+			auto builder = HspLineTableBuilder{};
+			builder.add(0, 10, 0, 0);
+			builder.add(10, 10, 1, 3);
+			builder.add(20, 10, 0, 0);
+			builder.add(40, 10, 0, 2);
+			auto table = builder.finish();
+
+			auto coverage = LineCoverage{ table };
+			auto initial_count = coverage.covered_count();
+
+			coverage.record(25);
+			coverage.record(35);
+			coverage.record(0);
+			coverage.record(std::nullopt);
+
+			return t.eq(initial_count, std::size_t{ 0 })
+				&& t.eq(coverage.line_count(), std::size_t{ 3 })
+				&& t.eq(coverage.covered_count(), std::size_t{ 1 })
+				&& t.eq(coverage.is_covered(0, 0), true)
+				&& t.eq(coverage.is_covered(0, 2), false)
+				&& t.eq(coverage.is_covered(1, 3), false)
+				&& t.eq(coverage.is_covered(0, 1), false);
+		});
+
+	suite.test(
+		u8"lcov の形式で出力する",
+		[](TestCaseContext& t) {
+			auto builder = HspLineTableBuilder{};
+			builder.add(0, 10, 0, 0);
+			builder.add(10, 10, 1, 3);
+			builder.add(20, 10, 0, 2);
+			auto table = builder.finish();
+
+			auto coverage = LineCoverage{ table };
+			coverage.record(5);
+			coverage.record(15);
+
+			auto file_names = std::vector<Utf8String>{
+				to_owned(as_utf8(u8"C:/a.hsp")),
+				to_owned(as_utf8(u8"C:/b.hsp")),
+			};
+			auto lcov = as_native(coverage.to_lcov(file_names));
+
+			auto no_name_lcov = as_native(coverage.to_lcov({}));
+
+			coverage.clear();
+			auto cleared_count = coverage.covered_count();
+
+			return t.eq(
+				lcov,
+				u8"TN:\nSF:C:/a.hsp\nDA:1,1\nDA:3,0\nLF:2\nLH:1\nend_of_record\n"
+				u8"TN:\nSF:C:/b.hsp\nDA:4,1\nLF:1\nLH:1\nend_of_record\n")
+				&& t.eq(no_name_lcov, u8"")
+				&& t.eq(cleared_count, std::size_t{ 0 });
+		});
+
+	suite.test(
+		u8"ベンチマーク: 命令ごとの記録",
+		[](TestCaseContext& t) {
+			static constexpr auto LINE_COUNT = std::size_t{ 100000 };
+			static constexpr auto STEP_COUNT = std::size_t{ 10000000 };
+
+			auto builder = HspLineTableBuilder{};
+			for (auto i = std::size_t{}; i < LINE_COUNT; i++) {
+				builder.add(i * 4, 4, i % 4, i);
+			}
+			auto table = builder.finish();
+
+			auto coverage = LineCoverage{ table };
+
+			auto start = std::chrono::steady_clock::now();
+			for (auto i = std::size_t{}; i < STEP_COUNT; i++) {
+				coverage.record(i * 13 % (LINE_COUNT * 4));
+			}
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+
+			t.output()
+				<< u8"    " << (int)(ns / STEP_COUNT) << u8" ns/命令 (" << coverage.covered_count() << u8"/" << coverage.line_count() << u8" 行)" << std::endl;
+
+			return t.eq(coverage.covered_count() != 0, true);
+		});
+}
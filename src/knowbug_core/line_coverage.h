@@ -0,0 +1,42 @@
+//! 行カバレッジ
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include "encoding.h"
+
+class HspLineTable;
+class Tests;
+
+// スクリプトのどの行が実行されたかを記録するもの。
+//
+// デバッグセグメントが参照する (ファイル, 行) ごとに1ビットを持つ。ビットの番号は対応表の行の番号と同じ。
+// 命令ごとの記録は、対応表のコード位置から行の番号への表を1回引いて、ビットを立てるだけにする。(探索はしない。)
+class LineCoverage {
+	HspLineTable const& table_;
+
+	std::vector<std::uint64_t> bits_;
+
+public:
+	explicit LineCoverage(HspLineTable const& table);
+
+	// 記録できる行の個数
+	auto line_count() const->std::size_t;
+
+	// 実行された行の個数
+	auto covered_count() const->std::size_t;
+
+	// 実行位置 (ctx->mcs のコード位置) を含む行を、実行されたものとして記録する。
+	void record(std::optional<std::size_t> code_offset);
+
+	auto is_covered(std::size_t file_id, std::size_t line_index) const->bool;
+
+	void clear();
+
+	// lcov のトレースファイルの形式にする。(file_names: ファイルIDごとのファイルの絶対パス)
+	auto to_lcov(std::vector<Utf8String> const& file_names) const->Utf8String;
+};
+
+extern void line_coverage_tests(Tests& tests);
@@ -0,0 +1,319 @@
+#include "pch.h"
+#include <deque>
+#include "message_receiver.h"
+#include "test_suite.h"
+#include "transfer_protocol.h"
+
+static constexpr auto READ_BUFFER_SIZE = std::size_t{ 64 * 1024 };
+
+// stop が read の中断を再試行する間隔
+static constexpr auto CANCEL_RETRY_INTERVAL = std::chrono::milliseconds{ 10 };
+
+MessageReceiver::MessageReceiver(std::unique_ptr<MessageSource> source, std::function<void()> wake)
+	: source_(std::move(source))
+	, wake_(std::move(wake))
+	, mutex_()
+	, queue_()
+	, wake_pending_(false)
+	, finished_cond_()
+	, finished_(false)
+	, thread_()
+{
+	assert(source_ != nullptr);
+}
+
+MessageReceiver::~MessageReceiver() {
+	stop();
+}
+
+void MessageReceiver::start() {
+	if (thread_.joinable()) {
+		assert(false && u8"double start");
+		return;
+	}
+
+	thread_ = std::thread{ [this] { run(); } };
+}
+
+void MessageReceiver::stop() {
+	if (!thread_.joinable()) {
+		return;
+	}
+
+	// read を始める前に cancel しても効かないことがあるので、終了するまで繰り返す。
+	{
+		auto lock = std::unique_lock<std::mutex>{ mutex_ };
+		while (!finished_) {
+			lock.unlock();
+			source_->cancel();
+			lock.lock();
+
+			finished_cond_.wait_for(lock, CANCEL_RETRY_INTERVAL);
+		}
+	}
+
+	thread_.join();
+}
+
+void MessageReceiver::take(std::vector<ReceivedMessage>& messages) {
+	// 取り出した後に届いたメッセージについて、再び wake が呼ばれるように先に下ろす。
+	wake_pending_.store(false);
+
+	auto lock = std::lock_guard<std::mutex>{ mutex_ };
+	for (auto&& message : queue_) {
+		messages.push_back(std::move(message));
+	}
+	queue_.clear();
+}
+
+void MessageReceiver::run() {
+	auto buffer = std::vector<Utf8Char>(READ_BUFFER_SIZE);
+	auto framer = TransferProtocolFramer{};
+	auto reassembler = TransferProtocolReassembler{};
+	auto messages = std::vector<ReceivedMessage>{};
+
+	while (true) {
+		auto read_size = source_->read(buffer.data(), buffer.size());
+		if (read_size == 0) {
+			break;
+		}
+
+		framer.push(Utf8StringView{ buffer.data(), read_size });
+
+		auto received_at = std::chrono::steady_clock::now();
+		while (auto body_opt = framer.next()) {
+			// 断片なら、揃うまで溜めておく。
+			auto complete_opt = std::optional<Utf8String>{};
+			if (auto&& chunk_opt = framer.last_chunk()) {
+				complete_opt = reassembler.push(*chunk_opt, *body_opt);
+				if (!complete_opt) {
+					continue;
+				}
+				body_opt = Utf8StringView{ *complete_opt };
+			}
+
+			// テキスト形式のボディー部は NUL 文字で始まらないので、バイナリ形式を指定すれば両方受理できる。
+			auto message_opt = knowbug_protocol_parse_body(*body_opt, KnowbugBodyFormat::Binary);
+			if (!message_opt) {
+				continue;
+			}
+
+			messages.emplace_back(std::move(*message_opt), received_at);
+		}
+
+		if (!messages.empty()) {
+			did_receive(messages);
+		}
+	}
+
+	{
+		auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		finished_ = true;
+	}
+	finished_cond_.notify_all();
+}
+
+void MessageReceiver::did_receive(std::vector<ReceivedMessage>& messages) {
+	{
+		auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		for (auto&& message : messages) {
+			queue_.push_back(std::move(message));
+		}
+	}
+	messages.clear();
+
+	if (!wake_pending_.exchange(true)) {
+		wake_();
+	}
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+// 与えられたデータを少しずつ返すもの
+class MemoryMessageSource
+	: public MessageSource
+{
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::deque<Utf8String> chunks_;
+	bool closed_;
+	bool cancelled_;
+
+public:
+	MemoryMessageSource()
+		: mutex_()
+		, cond_()
+		, chunks_()
+		, closed_(false)
+		, cancelled_(false)
+	{
+	}
+
+	void push(Utf8String chunk) {
+		{
+			auto lock = std::lock_guard<std::mutex>{ mutex_ };
+			chunks_.push_back(std::move(chunk));
+		}
+		cond_.notify_all();
+	}
+
+	void close() {
+		{
+			auto lock = std::lock_guard<std::mutex>{ mutex_ };
+			closed_ = true;
+		}
+		cond_.notify_all();
+	}
+
+	auto read(Utf8Char* buffer, std::size_t buffer_size) -> std::size_t override {
+		auto lock = std::unique_lock<std::mutex>{ mutex_ };
+		cond_.wait(lock, [&] { return !chunks_.empty() || closed_ || cancelled_; });
+
+		if (chunks_.empty()) {
+			return 0;
+		}
+
+		auto&& chunk = chunks_.front();
+		auto size = std::min(buffer_size, chunk.size());
+		std::copy(chunk.begin(), chunk.begin() + size, buffer);
+
+		chunk.erase(0, size);
+		if (chunk.empty()) {
+			chunks_.pop_front();
+		}
+		return size;
+	}
+
+	void cancel() override {
+		{
+			auto lock = std::lock_guard<std::mutex>{ mutex_ };
+			cancelled_ = true;
+		}
+		cond_.notify_all();
+	}
+};
+
+void message_receiver_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"message_receiver");
+
+	suite.test(
+		u8"届いたメッセージを取り出す",
+		[](TestCaseContext& t) {
+			auto source = std::make_unique<MemoryMessageSource>();
+			auto&& source_ref = *source;
+
+			auto mutex = std::mutex{};
+			auto cond = std::condition_variable{};
+			auto wake_count = 0;
+
+			auto receiver = MessageReceiver{
+				std::move(source),
+				[&] {
+					{
+						auto lock = std::lock_guard<std::mutex>{ mutex };
+						wake_count++;
+					}
+					cond.notify_all();
+				}
+			};
+			receiver.start();
+
+			// 2つのメッセージを、途中で区切って送る。
+			auto data = knowbug_protocol_serialize(KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"step_in_notification") }));
+			data += knowbug_protocol_serialize(KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"step_over_notification") }), KnowbugBodyFormat::Binary);
+			source_ref.push(data.substr(0, 10));
+			source_ref.push(data.substr(10));
+
+			auto messages = std::vector<ReceivedMessage>{};
+			{
+				auto lock = std::unique_lock<std::mutex>{ mutex };
+				cond.wait_for(lock, std::chrono::seconds{ 5 }, [&] { return wake_count >= 1; });
+			}
+
+			// メッセージが揃うまで取り出す。
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ 5 };
+			while (messages.size() < 2 && std::chrono::steady_clock::now() < deadline) {
+				receiver.take(messages);
+				std::this_thread::yield();
+			}
+
+			source_ref.close();
+			receiver.stop();
+
+			return t.eq(messages.size(), 2)
+				&& t.eq(messages[0].message().method(), as_utf8(u8"step_in_notification"))
+				&& t.eq(messages[1].message().method(), as_utf8(u8"step_over_notification"))
+				&& t.eq(wake_count >= 1, true);
+		});
+
+	suite.test(
+		u8"取り出すまで wake は1回だけ呼ばれる",
+		[](TestCaseContext& t) {
+			auto source = std::make_unique<MemoryMessageSource>();
+			auto&& source_ref = *source;
+
+			auto wake_count = std::atomic<int>{};
+			auto receiver = MessageReceiver{ std::move(source), [&] { wake_count++; } };
+			receiver.start();
+
+			auto message = knowbug_protocol_serialize(KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"pause_notification") }));
+			for (auto i = 0; i < 10; i++) {
+				source_ref.push(message);
+			}
+			source_ref.close();
+
+			// 受信スレッドは終端に達すると終了する。
+			receiver.stop();
+
+			auto first_count = wake_count.load();
+
+			auto messages = std::vector<ReceivedMessage>{};
+			receiver.take(messages);
+
+			return t.eq(first_count, 1)
+				&& t.eq(messages.size(), 10);
+		});
+
+	suite.test(
+		u8"分割されたメッセージを組み立てる",
+		[](TestCaseContext& t) {
+			auto source = std::make_unique<MemoryMessageSource>();
+			auto&& source_ref = *source;
+			auto receiver = MessageReceiver{ std::move(source), [] {} };
+			receiver.start();
+
+			auto large = knowbug_protocol_serialize(KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"step_in_notification") }));
+			auto large_body = Utf8StringView{ large }.substr(large.find(as_utf8(u8"\r\n\r\n")) + 4);
+			auto small = knowbug_protocol_serialize(KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"pause_notification") }));
+
+			// 断片の間に小さなメッセージを挟む。
+			auto data = Utf8String{};
+			transfer_protocol_write_chunk(data, TransferProtocolChunk{ 1, 0, large_body.size() }, large_body.substr(0, 5));
+			data += small;
+			transfer_protocol_write_chunk(data, TransferProtocolChunk{ 1, 5, large_body.size() }, large_body.substr(5));
+			source_ref.push(data);
+			source_ref.close();
+
+			receiver.stop();
+
+			auto messages = std::vector<ReceivedMessage>{};
+			receiver.take(messages);
+			return t.eq(messages.size(), 2)
+				&& t.eq(messages[0].message().method(), as_utf8(u8"pause_notification"))
+				&& t.eq(messages[1].message().method(), as_utf8(u8"step_in_notification"));
+		});
+
+	suite.test(
+		u8"ブロックしている受信スレッドを止める",
+		[](TestCaseContext& t) {
+			auto receiver = MessageReceiver{ std::make_unique<MemoryMessageSource>(), [] {} };
+			receiver.start();
+			receiver.stop();
+
+			auto messages = std::vector<ReceivedMessage>{};
+			receiver.take(messages);
+			return t.eq(messages.size(), 0);
+		});
+}
@@ -0,0 +1,101 @@
+//! メッセージの受信
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "encoding.h"
+#include "knowbug_protocol.h"
+
+class Tests;
+
+// メッセージの受信元
+class MessageSource {
+public:
+	virtual ~MessageSource() {
+	}
+
+	// データが届くまでブロックして、読み取ったバイト数を返す。
+	// 終端に達したり、失敗したり、cancel されたときは 0 を返す。
+	virtual auto read(Utf8Char* buffer, std::size_t buffer_size) -> std::size_t = 0;
+
+	// 他のスレッドでブロックしている read を中断させる。(何度呼ばれてもよい。)
+	virtual void cancel() = 0;
+};
+
+// 受信したメッセージ
+class ReceivedMessage {
+	KnowbugMessage message_;
+
+	// 受信スレッドがメッセージを取り出した時刻
+	std::chrono::steady_clock::time_point received_at_;
+
+public:
+	ReceivedMessage(KnowbugMessage message, std::chrono::steady_clock::time_point received_at)
+		: message_(std::move(message))
+		, received_at_(received_at)
+	{
+	}
+
+	auto message() const -> KnowbugMessage const& {
+		return message_;
+	}
+
+	auto received_at() const -> std::chrono::steady_clock::time_point {
+		return received_at_;
+	}
+};
+
+// メッセージを受信専用のスレッドで受信するもの。
+//
+// 受信スレッドは read でブロックして待ち、届いたデータからメッセージを取り出してキューに入れる。
+// キューが空でなくなったときだけ wake を呼ぶので、処理する側はそれを合図に take を呼べばいい。
+// (wake は受信スレッドから呼ばれる。)
+// ボディー部はテキスト形式とバイナリ形式のどちらでも受理する。
+class MessageReceiver {
+	std::unique_ptr<MessageSource> source_;
+
+	std::function<void()> wake_;
+
+	std::mutex mutex_;
+	std::vector<ReceivedMessage> queue_;
+
+	// wake を呼んでから take されるまでの間 true
+	std::atomic<bool> wake_pending_;
+
+	std::condition_variable finished_cond_;
+	bool finished_;
+
+	std::thread thread_;
+
+public:
+	MessageReceiver(std::unique_ptr<MessageSource> source, std::function<void()> wake);
+
+	~MessageReceiver();
+
+	MessageReceiver(MessageReceiver const& other) = delete;
+
+	auto operator=(MessageReceiver const& other) -> MessageReceiver& = delete;
+
+	// 受信スレッドを開始する。
+	void start();
+
+	// 受信スレッドを終了させる。
+	void stop();
+
+	// 受信したメッセージをすべて取り出して、messages の末尾に追加する。
+	void take(std::vector<ReceivedMessage>& messages);
+
+private:
+	void run();
+
+	void did_receive(std::vector<ReceivedMessage>& messages);
+};
+
+extern void message_receiver_tests(Tests& tests);
@@ -0,0 +1,629 @@
+#include "pch.h"
+#include <chrono>
+#include "message_sender.h"
+#include "test_suite.h"
+#include "transfer_protocol.h"
+
+MessageSender::MessageSender(std::unique_ptr<MessageSink> sink, MessageSenderOptions options)
+	: sink_(std::move(sink))
+	, options_(options)
+	, queue_(options.queue_capacity())
+	, backlog_()
+	, mutex_()
+	, not_empty_()
+	, not_full_()
+	, consumer_waiting_(false)
+	, producer_waiting_(false)
+	, stopping_(false)
+	, thread_()
+	, pending_()
+	, last_stream_id_()
+	, chunk_buffer_()
+	, sent_count_(0)
+	, write_error_count_(0)
+	, chunk_count_(0)
+	, max_queue_depth_()
+	, stall_count_()
+	, stall_microseconds_()
+	, dropped_log_count_()
+	, coalesced_count_()
+{
+	assert(sink_ != nullptr);
+}
+
+MessageSender::~MessageSender() {
+	stop();
+}
+
+void MessageSender::start() {
+	if (thread_.joinable()) {
+		assert(false && u8"double start");
+		return;
+	}
+
+	stopping_.store(false);
+	thread_ = std::thread{ [this] { run(); } };
+}
+
+void MessageSender::stop() {
+	if (!thread_.joinable()) {
+		pump();
+		return;
+	}
+
+	while (!flush_backlog()) {
+		wait_not_full();
+	}
+
+	{
+		auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		stopping_.store(true);
+	}
+	not_empty_.notify_one();
+
+	thread_.join();
+}
+
+void MessageSender::send(MessageFrame frame) {
+	if (flush_backlog() && queue_.try_push(frame)) {
+		update_max_queue_depth();
+		notify_consumer();
+		return;
+	}
+
+	// キューが満杯なので、呼び出し側に溜めておく。
+	if (options_.coalesce_list_updates()
+		&& frame.kind() == MessageFrameKind::ListUpdate
+		&& !backlog_.empty()
+		&& backlog_.back().kind() == MessageFrameKind::ListUpdate
+		) {
+		backlog_.back().append(frame);
+		coalesced_count_++;
+	} else {
+		backlog_.push_back(std::move(frame));
+	}
+	update_max_queue_depth();
+
+	while (backlog_.size() > options_.backlog_limit()) {
+		if (options_.drop_oldest_log()) {
+			auto iter = std::find_if(
+				backlog_.begin(),
+				backlog_.end(),
+				[](MessageFrame const& frame) { return frame.kind() == MessageFrameKind::Log; }
+			);
+			if (iter != backlog_.end()) {
+				backlog_.erase(iter);
+				dropped_log_count_++;
+				continue;
+			}
+		}
+
+		wait_not_full();
+		flush_backlog();
+	}
+}
+
+void MessageSender::pump() {
+	assert(!thread_.joinable());
+
+	while (true) {
+		flush_backlog();
+
+		if (!consume()) {
+			break;
+		}
+	}
+}
+
+auto MessageSender::stats() const -> MessageSenderStats {
+	auto stats = MessageSenderStats{};
+	stats.sent_count = sent_count_.load();
+	stats.queue_depth = queue_.size() + backlog_.size();
+	stats.max_queue_depth = max_queue_depth_;
+	stats.stall_count = stall_count_;
+	stats.stall_microseconds = stall_microseconds_;
+	stats.dropped_log_count = dropped_log_count_;
+	stats.coalesced_count = coalesced_count_;
+	stats.write_error_count = write_error_count_.load();
+	stats.chunk_count = chunk_count_.load();
+	return stats;
+}
+
+void MessageSender::run() {
+	while (true) {
+		if (consume()) {
+			continue;
+		}
+
+		auto lock = std::unique_lock<std::mutex>{ mutex_ };
+		consumer_waiting_.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		not_empty_.wait(lock, [&] { return !queue_.empty() || stopping_.load(); });
+		consumer_waiting_.store(false);
+
+		if (queue_.empty() && stopping_.load()) {
+			break;
+		}
+	}
+}
+
+auto MessageSender::consume() -> bool {
+	auto frame = MessageFrame{};
+	if (queue_.try_pop(frame)) {
+		notify_producer();
+		accept_frame(std::move(frame));
+		return true;
+	}
+
+	if (!pending_.empty()) {
+		write_pending();
+		return true;
+	}
+
+	return false;
+}
+
+void MessageSender::accept_frame(MessageFrame frame) {
+	auto body_start_opt = std::optional<std::size_t>{};
+
+	auto chunk_size = options_.chunk_size();
+	if (chunk_size != 0 && frame.data().size() > chunk_size && frame.message_count() >= 2) {
+		// 連結したメッセージは、ボディー部の区切りが1つではないので、メッセージごとに扱う。
+		for (auto&& message : frame.split()) {
+			accept_frame(std::move(message));
+		}
+		return;
+	}
+
+	if (chunk_size != 0 && frame.data().size() > chunk_size) {
+		auto header_end = frame.data().find(as_utf8(u8"\r\n\r\n"));
+		if (header_end != Utf8StringView::npos) {
+			body_start_opt = header_end + 4;
+		}
+	}
+
+	if (!body_start_opt && frame.kind() == MessageFrameKind::Control) {
+		// 制御メッセージは分割して送るフレームを追い越すが、分割しないフレームは追い越さない。
+		auto iter = std::find_if(
+			pending_.rbegin(),
+			pending_.rend(),
+			[](PendingFrame const& pending) { return !pending.body_start_opt; }
+		);
+		if (iter == pending_.rend()) {
+			write_frame(frame);
+			return;
+		}
+
+		pending_.insert(iter.base(), PendingFrame{ std::move(frame), std::nullopt, 0, 0 });
+		return;
+	}
+
+	if (!body_start_opt && pending_.empty()) {
+		write_frame(frame);
+		return;
+	}
+
+	auto stream_id = std::uint64_t{};
+	if (body_start_opt) {
+		last_stream_id_++;
+		stream_id = last_stream_id_;
+	}
+
+	pending_.push_back(PendingFrame{ std::move(frame), body_start_opt, 0, stream_id });
+}
+
+void MessageSender::write_pending() {
+	assert(!pending_.empty());
+	auto&& pending = pending_.front();
+
+	if (!pending.body_start_opt) {
+		write_frame(pending.frame);
+		pending_.pop_front();
+		return;
+	}
+
+	auto body = pending.frame.data().substr(*pending.body_start_opt);
+	auto data = body.substr(pending.sent_size, options_.chunk_size());
+
+	chunk_buffer_.clear();
+	transfer_protocol_write_chunk(chunk_buffer_, TransferProtocolChunk{ pending.stream_id, pending.sent_size, body.size() }, data);
+
+	if (!sink_->write(chunk_buffer_)) {
+		// 残りの断片は送っても組み立てられないので捨てる。
+		write_error_count_++;
+		pending_.pop_front();
+		return;
+	}
+	chunk_count_++;
+
+	pending.sent_size += data.size();
+	if (pending.sent_size == body.size()) {
+		sent_count_++;
+		pending_.pop_front();
+	}
+}
+
+auto MessageSender::flush_backlog() -> bool {
+	while (!backlog_.empty()) {
+		if (!queue_.try_push(backlog_.front())) {
+			return false;
+		}
+
+		backlog_.pop_front();
+		notify_consumer();
+	}
+	return true;
+}
+
+void MessageSender::wait_not_full() {
+	// 送信スレッドがなければ、ここで送信する。
+	if (!thread_.joinable()) {
+		pump();
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	{
+		auto lock = std::unique_lock<std::mutex>{ mutex_ };
+		producer_waiting_.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		not_full_.wait(lock, [&] { return queue_.size() < queue_.capacity(); });
+		producer_waiting_.store(false);
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	stall_count_++;
+	stall_microseconds_ += (std::uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void MessageSender::notify_consumer() {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (consumer_waiting_.load()) {
+		{
+			auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		}
+		not_empty_.notify_one();
+	}
+}
+
+void MessageSender::notify_producer() {
+	// 生産者がキューの空きを待っていたら起こす。
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (producer_waiting_.load()) {
+		{
+			auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		}
+		not_full_.notify_one();
+	}
+}
+
+void MessageSender::write_frame(MessageFrame const& frame) {
+	if (sink_->write(frame.data())) {
+		sent_count_++;
+	} else {
+		write_error_count_++;
+	}
+}
+
+void MessageSender::update_max_queue_depth() {
+	max_queue_depth_ = std::max(max_queue_depth_, queue_.size() + backlog_.size());
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+// 書き込まれたデータをメモリーに溜めるもの
+class MemoryMessageSink
+	: public MessageSink
+{
+	Utf8String data_;
+
+	std::mutex mutex_;
+	std::condition_variable opened_;
+
+	// false の間は write がブロックする。
+	bool open_;
+
+public:
+	explicit MemoryMessageSink(bool open)
+		: data_()
+		, mutex_()
+		, opened_()
+		, open_(open)
+	{
+	}
+
+	auto data() const -> Utf8StringView {
+		return data_;
+	}
+
+	void open() {
+		{
+			auto lock = std::lock_guard<std::mutex>{ mutex_ };
+			open_ = true;
+		}
+		opened_.notify_all();
+	}
+
+	auto write(Utf8StringView data) -> bool override {
+		auto lock = std::unique_lock<std::mutex>{ mutex_ };
+		opened_.wait(lock, [&] { return open_; });
+
+		data_ += data;
+		return true;
+	}
+};
+
+static auto new_frame(MessageFrameKind kind, char const* data) -> MessageFrame {
+	return MessageFrame{ kind, Utf8String{ as_utf8(data) } };
+}
+
+// ボディー部を Content-Length ヘッダー付きのフレームにする。
+static auto new_message_frame(MessageFrameKind kind, Utf8StringView body) -> MessageFrame {
+	auto data = Utf8String{ as_utf8(u8"Content-Length: ") };
+	data += as_utf8(std::to_string(body.size()));
+	data += as_utf8(u8"\r\n\r\n");
+	data += body;
+	return MessageFrame{ kind, std::move(data) };
+}
+
+// 書き込まれたデータから、組み立て終わった順にボディー部を取り出す。
+static auto receive_bodies(Utf8StringView data) -> std::vector<Utf8String> {
+	auto framer = TransferProtocolFramer{};
+	auto reassembler = TransferProtocolReassembler{};
+	auto bodies = std::vector<Utf8String>{};
+
+	framer.push(data);
+	while (auto body_opt = framer.next()) {
+		if (auto&& chunk_opt = framer.last_chunk()) {
+			if (auto complete_opt = reassembler.push(*chunk_opt, *body_opt)) {
+				bodies.push_back(std::move(*complete_opt));
+			}
+			continue;
+		}
+
+		bodies.emplace_back(*body_opt);
+	}
+	return bodies;
+}
+
+void message_sender_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"message_sender");
+
+	suite.test(
+		u8"キューに空きがあればそのまま送る",
+		[](TestCaseContext& t) {
+			auto sink = std::make_unique<MemoryMessageSink>(true);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions::new_block(4) };
+
+			sender.send(new_frame(MessageFrameKind::Control, u8"a"));
+			sender.send(new_frame(MessageFrameKind::Log, u8"b"));
+			sender.send(new_frame(MessageFrameKind::ListUpdate, u8"c"));
+			auto depth = sender.stats().queue_depth;
+
+			sender.pump();
+
+			auto stats = sender.stats();
+			return t.eq(depth, 3)
+				&& t.eq(sink_ref.data(), as_utf8(u8"abc"))
+				&& t.eq(stats.sent_count, 3)
+				&& t.eq(stats.queue_depth, 0)
+				&& t.eq(stats.max_queue_depth, 3);
+		});
+
+	suite.test(
+		u8"溜まったログを古いものから捨てる",
+		[](TestCaseContext& t) {
+			auto sink = std::make_unique<MemoryMessageSink>(true);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions{ 2, 2, true, false, 0 } };
+
+			// A, L1 はキューに入り、それ以降は溜まる。
+			sender.send(new_frame(MessageFrameKind::Control, u8"A"));
+			sender.send(new_frame(MessageFrameKind::Log, u8"1"));
+			sender.send(new_frame(MessageFrameKind::Log, u8"2"));
+			sender.send(new_frame(MessageFrameKind::Log, u8"3"));
+			sender.send(new_frame(MessageFrameKind::Control, u8"B"));
+			sender.send(new_frame(MessageFrameKind::Log, u8"4"));
+
+			sender.pump();
+
+			auto stats = sender.stats();
+			return t.eq(sink_ref.data(), as_utf8(u8"A1B4"))
+				&& t.eq(stats.dropped_log_count, 2)
+				&& t.eq(stats.sent_count, 4);
+		});
+
+	suite.test(
+		u8"溜まったリストの更新を連結する",
+		[](TestCaseContext& t) {
+			auto sink = std::make_unique<MemoryMessageSink>(true);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions{ 1, 1, false, true, 0 } };
+
+			sender.send(new_frame(MessageFrameKind::ListUpdate, u8"1"));
+			sender.send(new_frame(MessageFrameKind::ListUpdate, u8"2"));
+			sender.send(new_frame(MessageFrameKind::ListUpdate, u8"3"));
+			sender.send(new_frame(MessageFrameKind::Control, u8"C"));
+
+			sender.pump();
+
+			auto stats = sender.stats();
+			return t.eq(sink_ref.data(), as_utf8(u8"123C"))
+				&& t.eq(stats.coalesced_count, 1)
+				&& t.eq(stats.sent_count, 3)
+				&& t.eq(stats.dropped_log_count, 0);
+		});
+
+	suite.test(
+		u8"送信先が詰まっているとブロックする",
+		[](TestCaseContext& t) {
+			auto sink = std::make_unique<MemoryMessageSink>(false);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions::new_block(2) };
+			sender.start();
+
+			// 少し待ってから書き込めるようにする。
+			auto opener = std::thread{ [&] {
+				std::this_thread::sleep_for(std::chrono::milliseconds{ 20 });
+				sink_ref.open();
+			} };
+
+			// 送信中の1つとキューの2つを超えた分はブロックする。
+			for (auto data : { u8"0", u8"1", u8"2", u8"3" }) {
+				sender.send(new_frame(MessageFrameKind::Control, data));
+			}
+
+			sender.stop();
+			opener.join();
+
+			auto stats = sender.stats();
+			return t.eq(sink_ref.data(), as_utf8(u8"0123"))
+				&& t.eq(stats.stall_count >= 1, true)
+				&& t.eq(stats.stall_microseconds > 0, true)
+				&& t.eq(stats.sent_count, 4);
+		});
+
+	suite.test(
+		u8"送信スレッドを使っても順番が保たれる",
+		[](TestCaseContext& t) {
+			static constexpr auto FRAME_COUNT = 10000;
+
+			auto sink = std::make_unique<MemoryMessageSink>(true);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions{ 16, 64, true, true, 0 } };
+			sender.start();
+
+			auto expected = Utf8String{};
+			for (auto i = 0; i < FRAME_COUNT; i++) {
+				auto data = as_utf8(std::to_string(i) + ",");
+				expected += data;
+
+				sender.send(MessageFrame{ MessageFrameKind::Control, std::move(data) });
+			}
+
+			sender.stop();
+
+			auto stats = sender.stats();
+			return t.eq(sink_ref.data() == expected, true)
+				&& t.eq(stats.sent_count, FRAME_COUNT)
+				&& t.eq(stats.dropped_log_count, 0)
+				&& t.eq(stats.queue_depth, 0);
+		});
+	suite.test(
+		u8"大きなフレームを分割して送り、制御メッセージに追い越させる",
+		[](TestCaseContext& t) {
+			auto sink = std::make_unique<MemoryMessageSink>(true);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions{ 8, 8, false, false, 32 } };
+
+			auto large_body = Utf8String(100, Utf8Char{ u8'x' });
+			sender.send(new_message_frame(MessageFrameKind::Control, large_body));
+			sender.send(new_message_frame(MessageFrameKind::Control, as_utf8(u8"stop")));
+			sender.send(new_message_frame(MessageFrameKind::Log, as_utf8(u8"log")));
+
+			sender.pump();
+
+			// 制御メッセージは先に届き、ログは大きなフレームの後ろに並ぶ。
+			auto bodies = receive_bodies(sink_ref.data());
+			auto stats = sender.stats();
+			return t.eq(bodies.size(), 3)
+				&& t.eq(bodies[0], as_utf8(u8"stop"))
+				&& t.eq(bodies[1], large_body)
+				&& t.eq(bodies[2], as_utf8(u8"log"))
+				&& t.eq(stats.chunk_count, 4)
+				&& t.eq(stats.sent_count, 3);
+		});
+
+	suite.test(
+		u8"制御メッセージは先に並んでいるリストの更新を追い越さない",
+		[](TestCaseContext& t) {
+			auto sink = std::make_unique<MemoryMessageSink>(true);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions{ 8, 8, false, false, 32 } };
+
+			auto large_body = Utf8String(100, Utf8Char{ u8'x' });
+			sender.send(new_message_frame(MessageFrameKind::ListUpdate, large_body));
+			sender.send(new_message_frame(MessageFrameKind::ListUpdate, as_utf8(u8"list 1")));
+			sender.send(new_message_frame(MessageFrameKind::Control, as_utf8(u8"details")));
+			sender.send(new_message_frame(MessageFrameKind::ListUpdate, as_utf8(u8"list 2")));
+
+			sender.pump();
+
+			// 制御メッセージは、大きなフレームの後ろに並んだリストの更新の後に届く。
+			auto bodies = receive_bodies(sink_ref.data());
+			auto stats = sender.stats();
+			return t.eq(bodies.size(), 4)
+				&& t.eq(bodies[0], large_body)
+				&& t.eq(bodies[1], as_utf8(u8"list 1"))
+				&& t.eq(bodies[2], as_utf8(u8"details"))
+				&& t.eq(bodies[3], as_utf8(u8"list 2"))
+				&& t.eq(stats.chunk_count, 4)
+				&& t.eq(stats.sent_count, 4);
+		});
+
+	suite.test(
+		u8"連結したリストの更新を分割して送っても、それぞれ組み立てられる",
+		[](TestCaseContext& t) {
+			auto sink = std::make_unique<MemoryMessageSink>(true);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions{ 1, 1024, true, true, 64 } };
+
+			// 1つ目はキューに入り、残りは溜まって1つのフレームに連結される。
+			auto body1 = Utf8String(30, Utf8Char{ u8'a' });
+			auto body2 = Utf8String(30, Utf8Char{ u8'b' });
+			auto body3 = Utf8String(100, Utf8Char{ u8'c' });
+			auto body4 = Utf8String(30, Utf8Char{ u8'd' });
+			sender.send(new_message_frame(MessageFrameKind::ListUpdate, body1));
+			sender.send(new_message_frame(MessageFrameKind::ListUpdate, body2));
+			sender.send(new_message_frame(MessageFrameKind::ListUpdate, body3));
+			sender.send(new_message_frame(MessageFrameKind::ListUpdate, body4));
+
+			sender.pump();
+
+			auto bodies = receive_bodies(sink_ref.data());
+			auto stats = sender.stats();
+			return t.eq(stats.coalesced_count, 2)
+				&& t.eq(bodies.size(), 4)
+				&& t.eq(bodies[0], body1)
+				&& t.eq(bodies[1], body2)
+				&& t.eq(bodies[2], body3)
+				&& t.eq(bodies[3], body4)
+				&& t.eq(stats.chunk_count, 2);
+		});
+
+	suite.test(
+		u8"送信スレッドが大きなフレームを送っている間も制御メッセージは待たされない",
+		[](TestCaseContext& t) {
+			static constexpr auto LARGE_SIZE = std::size_t{ 10 * 1024 * 1024 };
+			static constexpr auto CHUNK_SIZE = std::size_t{ 64 * 1024 };
+
+			// 最初の断片を書き込もうとしたところで止めておく。
+			auto sink = std::make_unique<MemoryMessageSink>(false);
+			auto&& sink_ref = *sink;
+			auto sender = MessageSender{ std::move(sink), MessageSenderOptions{ 16, 64, true, true, CHUNK_SIZE } };
+			sender.start();
+
+			auto large_body = Utf8String(LARGE_SIZE, Utf8Char{ u8'x' });
+			sender.send(new_message_frame(MessageFrameKind::Control, large_body));
+			sender.send(new_message_frame(MessageFrameKind::Control, as_utf8(u8"stopped_event")));
+
+			sink_ref.open();
+			sender.stop();
+
+			// 制御メッセージは最初の断片の直後に書き込まれる。
+			auto data = sink_ref.data();
+			auto stop_position = data.find(as_utf8(u8"stopped_event"));
+
+			auto bodies = receive_bodies(data);
+			return t.eq(bodies.size(), 2)
+				&& t.eq(bodies[0], as_utf8(u8"stopped_event"))
+				&& t.eq(bodies[1] == large_body, true)
+				&& t.eq(stop_position < CHUNK_SIZE * 2, true)
+				&& t.eq(sender.stats().chunk_count, LARGE_SIZE / CHUNK_SIZE);
+		});
+}
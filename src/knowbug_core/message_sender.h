@@ -0,0 +1,303 @@
+//! メッセージの非同期送信
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "encoding.h"
+#include "spsc_queue.h"
+
+class Tests;
+
+// 送信するメッセージの種類。キューが満杯のときの扱いを決めるのに使う。
+enum class MessageFrameKind {
+	// 捨てたりまとめたりしてはいけないもの
+	Control,
+
+	// ログ出力 (output_event)
+	Log,
+
+	// オブジェクトリストの更新 (list_updated_event など)
+	ListUpdate,
+};
+
+// 送信するメッセージ。(シリアライズ済みのデータを持つ。)
+// append で連結したときは、複数のメッセージを順に並べたものになる。
+class MessageFrame {
+	MessageFrameKind kind_;
+	Utf8String data_;
+
+	// 連結した2つ目以降のメッセージの開始位置
+	std::vector<std::size_t> message_starts_;
+
+public:
+	MessageFrame()
+		: kind_(MessageFrameKind::Control)
+		, data_()
+		, message_starts_()
+	{
+	}
+
+	MessageFrame(MessageFrameKind kind, Utf8String data)
+		: kind_(kind)
+		, data_(std::move(data))
+		, message_starts_()
+	{
+	}
+
+	auto kind() const -> MessageFrameKind {
+		return kind_;
+	}
+
+	auto data() const -> Utf8StringView {
+		return data_;
+	}
+
+	// 連結したメッセージの個数
+	auto message_count() const -> std::size_t {
+		return 1 + message_starts_.size();
+	}
+
+	// 同じ種類のメッセージを後ろに連結する。
+	void append(MessageFrame const& other) {
+		assert(kind_ == other.kind_);
+		auto offset = data_.size();
+		message_starts_.push_back(offset);
+		for (auto start : other.message_starts_) {
+			message_starts_.push_back(offset + start);
+		}
+		data_ += other.data_;
+	}
+
+	// 連結したメッセージを1つずつのフレームに分ける。
+	auto split() const -> std::vector<MessageFrame> {
+		auto frames = std::vector<MessageFrame>{};
+		auto start = std::size_t{};
+		for (auto i = std::size_t{}; i <= message_starts_.size(); i++) {
+			auto end = i < message_starts_.size() ? message_starts_[i] : data_.size();
+			frames.emplace_back(kind_, Utf8String{ data_.substr(start, end - start) });
+			start = end;
+		}
+		return frames;
+	}
+};
+
+// メッセージの送信先
+class MessageSink {
+public:
+	virtual ~MessageSink() {
+	}
+
+	// データをすべて書き込むまでブロックする。失敗したら false を返す。
+	virtual auto write(Utf8StringView data) -> bool = 0;
+};
+
+// キューが満杯のときの振る舞いの設定
+class MessageSenderOptions {
+	// 送信スレッドに渡すキューの容量 (フレーム数)
+	std::size_t queue_capacity_;
+
+	// キューが満杯のとき、呼び出し側で溜めておくフレーム数の上限
+	// これを超えると、ログを捨てるか、キューが空くまでブロックする。
+	std::size_t backlog_limit_;
+
+	// 溜まっているログのうち古いものを捨てるか
+	bool drop_oldest_log_;
+
+	// 溜まっているオブジェクトリストの更新を1つのフレームに連結するか
+	bool coalesce_list_updates_;
+
+	// これより大きなフレームは、この大きさの断片に分けて送る。(0 なら分けない。)
+	std::size_t chunk_size_;
+
+public:
+	MessageSenderOptions(std::size_t queue_capacity, std::size_t backlog_limit, bool drop_oldest_log, bool coalesce_list_updates, std::size_t chunk_size)
+		: queue_capacity_(queue_capacity)
+		, backlog_limit_(backlog_limit)
+		, drop_oldest_log_(drop_oldest_log)
+		, coalesce_list_updates_(coalesce_list_updates)
+		, chunk_size_(chunk_size)
+	{
+	}
+
+	// キューが空くまで常にブロックする。
+	static auto new_block(std::size_t queue_capacity) -> MessageSenderOptions {
+		return MessageSenderOptions{ queue_capacity, 0, false, false, 0 };
+	}
+
+	auto queue_capacity() const -> std::size_t {
+		return queue_capacity_;
+	}
+
+	auto backlog_limit() const -> std::size_t {
+		return backlog_limit_;
+	}
+
+	auto drop_oldest_log() const -> bool {
+		return drop_oldest_log_;
+	}
+
+	auto coalesce_list_updates() const -> bool {
+		return coalesce_list_updates_;
+	}
+
+	auto chunk_size() const -> std::size_t {
+		return chunk_size_;
+	}
+};
+
+// 送信の統計
+class MessageSenderStats {
+public:
+	// 送信したフレームの数
+	std::size_t sent_count;
+
+	// キューと呼び出し側に溜まっているフレームの数
+	std::size_t queue_depth;
+
+	// queue_depth の最大値
+	std::size_t max_queue_depth;
+
+	// 呼び出し側がブロックした回数と合計時間
+	std::size_t stall_count;
+	std::uint64_t stall_microseconds;
+
+	// 捨てたログの数
+	std::size_t dropped_log_count;
+
+	// 他のフレームに連結したフレームの数
+	std::size_t coalesced_count;
+
+	// 書き込みに失敗した回数
+	std::size_t write_error_count;
+
+	// 分割して送った断片の数
+	std::size_t chunk_count;
+};
+
+// メッセージを送信専用のスレッドから送信するもの。
+//
+// send は生産者スレッド (HSP のランタイムのスレッド) だけが呼ぶ。
+// フレームは SPSC キューを介して送信スレッドに渡る。
+// キューが満杯のときは呼び出し側にフレームを溜めておき、設定に応じてログを捨てたりリストの更新を連結したりする。
+// start を呼ばない場合は、pump で同じスレッドから送信できる。(テスト用)
+//
+// chunk_size を超えるフレームは Chunk ヘッダー付きの断片に分けて、1つずつ書き込む。
+// 連結したフレームは、連結する前のメッセージごとに分けるかどうかを決める。
+// 断片の合間にキューを確認して、小さな制御メッセージは先に書き込む。(大きなフレームの後ろで待たせない。)
+// ログやリストの更新は、順番を保つために、送信中のフレームの後ろに並べる。
+// 制御メッセージが追い越すのは分割して送るフレームだけで、先に並んでいる分割しないフレームは追い越さない。
+class MessageSender {
+	// 送信スレッドが送り終えていないフレーム
+	class PendingFrame {
+	public:
+		MessageFrame frame;
+
+		// 分割して送るとき、ボディー部の開始位置
+		std::optional<std::size_t> body_start_opt;
+
+		// ボディー部のうち送り終わった大きさ
+		std::size_t sent_size;
+
+		std::uint64_t stream_id;
+	};
+
+	std::unique_ptr<MessageSink> sink_;
+	MessageSenderOptions options_;
+	SpscQueue<MessageFrame> queue_;
+
+	// キューに入りきらなかったフレーム (生産者スレッドだけが触る)
+	std::deque<MessageFrame> backlog_;
+
+	std::mutex mutex_;
+
+	// キューにフレームが入ったことを送信スレッドに知らせる。
+	std::condition_variable not_empty_;
+
+	// キューが空いたことを生産者スレッドに知らせる。
+	std::condition_variable not_full_;
+
+	std::atomic<bool> consumer_waiting_;
+	std::atomic<bool> producer_waiting_;
+	std::atomic<bool> stopping_;
+
+	std::thread thread_;
+
+	// 送信スレッドだけが触るもの
+	std::deque<PendingFrame> pending_;
+	std::uint64_t last_stream_id_;
+	Utf8String chunk_buffer_;
+
+	// 送信スレッドが更新するもの
+	std::atomic<std::size_t> sent_count_;
+	std::atomic<std::size_t> write_error_count_;
+	std::atomic<std::size_t> chunk_count_;
+
+	// 生産者スレッドが更新するもの
+	std::size_t max_queue_depth_;
+	std::size_t stall_count_;
+	std::uint64_t stall_microseconds_;
+	std::size_t dropped_log_count_;
+	std::size_t coalesced_count_;
+
+public:
+	MessageSender(std::unique_ptr<MessageSink> sink, MessageSenderOptions options);
+
+	~MessageSender();
+
+	MessageSender(MessageSender const& other) = delete;
+
+	auto operator=(MessageSender const& other) -> MessageSender& = delete;
+
+	// 送信スレッドを開始する。
+	void start();
+
+	// 溜まっているフレームをすべて送信してから、送信スレッドを終了する。
+	void stop();
+
+	// フレームを送信する。(生産者スレッドから呼ぶ。)
+	void send(MessageFrame frame);
+
+	// キューに入っているフレームをすべて書き込む。(送信スレッドがないとき、生産者スレッドから呼ぶ。)
+	void pump();
+
+	// 統計を取得する。(生産者スレッドから呼ぶ。)
+	auto stats() const -> MessageSenderStats;
+
+private:
+	void run();
+
+	// キューからフレームを1つ取り出して処理するか、送信中のフレームを少し送る。
+	// することがなければ false を返す。(送信スレッドから呼ぶ。)
+	auto consume() -> bool;
+
+	// キューから取り出したフレームを、すぐに書き込むか、送信中のフレームの後ろに並べる。
+	void accept_frame(MessageFrame frame);
+
+	// 先頭の送信中のフレームを書き込む。分割して送るときは、断片を1つだけ書き込む。
+	void write_pending();
+
+	// 溜まっているフレームをキューに移す。すべて移せたら true を返す。
+	auto flush_backlog() -> bool;
+
+	// キューに空きができるまでブロックする。
+	void wait_not_full();
+
+	void notify_consumer();
+
+	void notify_producer();
+
+	void write_frame(MessageFrame const& frame);
+
+	void update_max_queue_depth();
+};
+
+extern void message_sender_tests(Tests& tests);
@@ -0,0 +1,498 @@
+#include "pch.h"
+#include <chrono>
+#include <limits>
+#include <random>
+#include "object_list_diff.h"
+#include "test_suite.h"
+
+static constexpr auto NO_INDEX = std::numeric_limits<std::size_t>::max();
+
+// 存在する要素の個数を数えるためのフェニック木
+class PresenceTree {
+	std::vector<std::size_t> tree_;
+
+public:
+	explicit PresenceTree(std::size_t size)
+		: tree_(size + 1)
+	{
+	}
+
+	void add(std::size_t index, std::size_t value) {
+		for (auto i = index + 1; i < tree_.size(); i += i & (~i + 1)) {
+			tree_[i] += value;
+		}
+	}
+
+	void remove(std::size_t index) {
+		for (auto i = index + 1; i < tree_.size(); i += i & (~i + 1)) {
+			tree_[i]--;
+		}
+	}
+
+	// 位置 index より前に存在する要素の個数
+	auto count_before(std::size_t index) const -> std::size_t {
+		auto sum = std::size_t{};
+		for (auto i = index; i > 0; i -= i & (~i + 1)) {
+			sum += tree_[i];
+		}
+		return sum;
+	}
+};
+
+// 数列の最長増加部分列に含まれる要素に印をつける。
+static void mark_longest_increasing_subsequence(std::vector<std::size_t> const& values, std::vector<bool>& marks) {
+	// tails[k]: 長さ k + 1 の増加部分列の末尾になりうる要素のうち、値が最小のものの位置
+	auto tails = std::vector<std::size_t>{};
+	auto prev = std::vector<std::size_t>(values.size(), NO_INDEX);
+
+	for (auto i = std::size_t{}; i < values.size(); i++) {
+		auto iter = std::lower_bound(
+			tails.begin(), tails.end(), values[i],
+			[&](std::size_t tail, std::size_t value) { return values[tail] < value; }
+		);
+
+		if (iter != tails.begin()) {
+			prev[i] = *(iter - 1);
+		}
+
+		if (iter == tails.end()) {
+			tails.push_back(i);
+		} else {
+			*iter = i;
+		}
+	}
+
+	marks.assign(values.size(), false);
+	if (tails.empty()) {
+		return;
+	}
+
+	for (auto i = tails.back(); i != NO_INDEX; i = prev[i]) {
+		marks[i] = true;
+	}
+}
+
+void object_list_diff(
+	std::vector<std::size_t> const& source_ids,
+	std::vector<std::size_t> const& target_ids,
+	ObjectListEqualsFn const& equals,
+	std::vector<ObjectListDiff>& diff
+) {
+	auto source_size = source_ids.size();
+	auto target_size = target_ids.size();
+
+	// オブジェクトIDから新しいリスト上の位置を引く。
+	auto target_index_map = std::unordered_map<std::size_t, std::size_t>{};
+	target_index_map.reserve(target_size);
+	for (auto ti = std::size_t{}; ti < target_size; ti++) {
+		target_index_map.emplace(target_ids[ti], ti);
+	}
+
+	auto source_to_target = std::vector<std::size_t>(source_size, NO_INDEX);
+	auto target_to_source = std::vector<std::size_t>(target_size, NO_INDEX);
+
+	// 両方のリストに含まれる要素の、新しいリスト上の位置を元のリストの順に並べたもの
+	auto matched_sources = std::vector<std::size_t>{};
+	auto matched_targets = std::vector<std::size_t>{};
+
+	for (auto si = std::size_t{}; si < source_size; si++) {
+		auto iter = target_index_map.find(source_ids[si]);
+		if (iter == target_index_map.end()) {
+			continue;
+		}
+
+		auto ti = iter->second;
+		source_to_target[si] = ti;
+		target_to_source[ti] = si;
+		matched_sources.push_back(si);
+		matched_targets.push_back(ti);
+	}
+
+	// 最長増加部分列に含まれる要素は動かさない。
+	auto stable = std::vector<bool>(source_size, false);
+	{
+		auto marks = std::vector<bool>{};
+		mark_longest_increasing_subsequence(matched_targets, marks);
+
+		for (auto k = std::size_t{}; k < matched_sources.size(); k++) {
+			stable[matched_sources[k]] = marks[k];
+		}
+	}
+
+	// 新しいリストにない要素を先に取り除く。
+	{
+		auto removed_count = std::size_t{};
+		for (auto si = std::size_t{}; si < source_size; si++) {
+			if (source_to_target[si] != NO_INDEX) {
+				continue;
+			}
+
+			diff.emplace_back(ObjectListDiffKind::Remove, si, NO_INDEX, si - removed_count, NO_INDEX);
+			removed_count++;
+		}
+	}
+
+	// 各要素の並び順を表すキーを (グループ, グループ内の順位) の形で決める。
+	//
+	// グループ g は、元のリスト上の位置 g にある動かない要素の直前を表す。(g = source_size は末尾。)
+	// 移動・挿入される要素は、新しいリスト上で次にある要素と同じグループに入り、その要素の直前に置かれる。
+	// 元のリストにある要素は、グループ内の最後の位置を占める。
+	auto target_group = std::vector<std::size_t>(target_size, NO_INDEX);
+	auto group_size = std::vector<std::size_t>(source_size + 1, 0);
+
+	for (auto si : matched_sources) {
+		group_size[si]++;
+	}
+
+	{
+		auto group = source_size;
+		for (auto ti = target_size; ti >= 1; ti--) {
+			auto si = target_to_source[ti - 1];
+			if (si != NO_INDEX && stable[si]) {
+				group = si;
+				continue;
+			}
+
+			target_group[ti - 1] = group;
+			group_size[group]++;
+		}
+	}
+
+	// キーをフェニック木上の位置に変換する。
+	auto group_start = std::vector<std::size_t>(source_size + 2, 0);
+	for (auto g = std::size_t{}; g <= source_size; g++) {
+		group_start[g + 1] = group_start[g] + group_size[g];
+	}
+
+	auto source_rank = [&](std::size_t si) {
+		return group_start[si + 1] - 1;
+	};
+
+	auto tree = PresenceTree{ group_start[source_size + 1] };
+	for (auto si : matched_sources) {
+		tree.add(source_rank(si), 1);
+	}
+
+	auto group_used = std::vector<std::size_t>(source_size + 1, 0);
+
+	for (auto ti = std::size_t{}; ti < target_size; ti++) {
+		auto si = target_to_source[ti];
+
+		if (si != NO_INDEX && stable[si]) {
+			if (!equals(si, ti)) {
+				auto index = tree.count_before(source_rank(si));
+				diff.emplace_back(ObjectListDiffKind::Update, si, ti, index, NO_INDEX);
+			}
+			continue;
+		}
+
+		auto group = target_group[ti];
+		auto rank = group_start[group] + group_used[group]++;
+
+		if (si == NO_INDEX) {
+			auto index = tree.count_before(rank);
+			tree.add(rank, 1);
+			diff.emplace_back(ObjectListDiffKind::Insert, NO_INDEX, ti, index, NO_INDEX);
+			continue;
+		}
+
+		auto from_index = tree.count_before(source_rank(si));
+		tree.remove(source_rank(si));
+
+		auto index = tree.count_before(rank);
+		tree.add(rank, 1);
+		diff.emplace_back(ObjectListDiffKind::Move, si, ti, index, from_index);
+	}
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+// 以前の実装 (比較用)。
+// 順番が入れ替わるケースでは失敗して、空の差分を返す。
+static void object_list_diff_naive(
+	std::vector<std::size_t> const& source_ids,
+	std::vector<std::size_t> const& target_ids,
+	ObjectListEqualsFn const& equals,
+	std::vector<ObjectListDiff>& diff
+) {
+	auto source_done = std::vector<bool>(source_ids.size());
+	auto target_done = std::vector<bool>(target_ids.size());
+
+	for (auto si = std::size_t{}; si < source_ids.size(); si++) {
+		for (auto ti = std::size_t{}; ti < target_ids.size(); ti++) {
+			if (target_done[ti]) {
+				continue;
+			}
+
+			if (source_ids[si] == target_ids[ti]) {
+				source_done[si] = true;
+				target_done[ti] = true;
+				break;
+			}
+		}
+	}
+
+	auto si = std::size_t{};
+	auto ti = std::size_t{};
+
+	while (si < source_ids.size() || ti < target_ids.size()) {
+		if (ti == target_ids.size() || (si < source_ids.size() && !source_done[si])) {
+			diff.emplace_back(ObjectListDiffKind::Remove, si, NO_INDEX, ti, NO_INDEX);
+			si++;
+			continue;
+		}
+
+		if (si == source_ids.size() || (ti < target_ids.size() && !target_done[ti])) {
+			diff.emplace_back(ObjectListDiffKind::Insert, NO_INDEX, ti, ti, NO_INDEX);
+			ti++;
+			continue;
+		}
+
+		if (source_ids[si] == target_ids[ti]) {
+			if (!equals(si, ti)) {
+				diff.emplace_back(ObjectListDiffKind::Update, si, ti, ti, NO_INDEX);
+			}
+
+			si++;
+			ti++;
+			continue;
+		}
+
+		diff.clear();
+		break;
+	}
+}
+
+// テスト用のリストの要素 (オブジェクトIDと内容のバージョン)
+using TestItem = std::pair<std::size_t, std::size_t>;
+
+using TestDiffFn = void(*)(std::vector<std::size_t> const&, std::vector<std::size_t> const&, ObjectListEqualsFn const&, std::vector<ObjectListDiff>&);
+
+static auto test_items_to_ids(std::vector<TestItem> const& items) -> std::vector<std::size_t> {
+	auto ids = std::vector<std::size_t>{};
+	for (auto&& item : items) {
+		ids.push_back(item.first);
+	}
+	return ids;
+}
+
+// 差分を計算して、元のリストに適用した結果を返す。不正な差分なら nullopt を返す。
+static auto test_diff_apply(std::vector<TestItem> const& source, std::vector<TestItem> const& target, TestDiffFn diff_fn, std::size_t& move_count) -> std::optional<std::vector<TestItem>> {
+	auto diff = std::vector<ObjectListDiff>{};
+	diff_fn(
+		test_items_to_ids(source),
+		test_items_to_ids(target),
+		[&](std::size_t si, std::size_t ti) { return source[si].second == target[ti].second; },
+		diff
+	);
+
+	auto list = source;
+	move_count = 0;
+
+	for (auto&& d : diff) {
+		switch (d.kind()) {
+		case ObjectListDiffKind::Insert:
+			if (d.index() > list.size()) {
+				return std::nullopt;
+			}
+			list.insert(list.begin() + d.index(), target[d.target_index()]);
+			break;
+
+		case ObjectListDiffKind::Remove:
+			if (d.index() >= list.size() || list[d.index()].first != source[d.source_index()].first) {
+				return std::nullopt;
+			}
+			list.erase(list.begin() + d.index());
+			break;
+
+		case ObjectListDiffKind::Update:
+			if (d.index() >= list.size() || list[d.index()].first != target[d.target_index()].first) {
+				return std::nullopt;
+			}
+			list[d.index()] = target[d.target_index()];
+			break;
+
+		case ObjectListDiffKind::Move:
+			if (d.from_index() >= list.size() || list[d.from_index()].first != target[d.target_index()].first) {
+				return std::nullopt;
+			}
+			list.erase(list.begin() + d.from_index());
+
+			if (d.index() > list.size()) {
+				return std::nullopt;
+			}
+			list.insert(list.begin() + d.index(), target[d.target_index()]);
+			move_count++;
+			break;
+
+		default:
+			return std::nullopt;
+		}
+	}
+
+	return list;
+}
+
+// ランダムなリストの組を生成する。
+// shuffle が偽なら、両方に含まれる要素の相対的な順番は変わらない。
+static void test_generate_lists(std::mt19937& random, std::size_t size, bool shuffle, std::vector<TestItem>& source, std::vector<TestItem>& target) {
+	auto percent = std::uniform_int_distribution<int>{ 0, 99 };
+	auto next_id = std::size_t{ 1 };
+
+	source.clear();
+	target.clear();
+
+	for (auto i = std::size_t{}; i < size; i++) {
+		auto id = next_id++;
+		source.emplace_back(id, 0);
+
+		auto p = percent(random);
+		if (p < 10) {
+			// 削除
+			continue;
+		}
+
+		target.emplace_back(id, p < 30 ? 1 : 0);
+
+		if (percent(random) < 10) {
+			// 挿入
+			target.emplace_back(next_id++, 0);
+		}
+	}
+
+	if (shuffle) {
+		auto swap_count = std::uniform_int_distribution<std::size_t>{ 0, size / 8 + 1 }(random);
+		for (auto k = std::size_t{}; k < swap_count && target.size() >= 2; k++) {
+			auto index = std::uniform_int_distribution<std::size_t>{ 0, target.size() - 1 };
+			std::swap(target[index(random)], target[index(random)]);
+		}
+	}
+}
+
+void object_list_diff_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"object_list_diff");
+
+	suite.test(
+		u8"挿入・削除・更新",
+		[](TestCaseContext& t) {
+			auto source = std::vector<TestItem>{ { 1, 0 }, { 2, 0 }, { 3, 0 }, { 4, 0 } };
+			auto target = std::vector<TestItem>{ { 1, 0 }, { 5, 0 }, { 3, 1 }, { 4, 0 }, { 6, 0 } };
+
+			auto move_count = std::size_t{};
+			auto list_opt = test_diff_apply(source, target, object_list_diff, move_count);
+
+			return t.eq(list_opt.has_value(), true)
+				&& t.eq(*list_opt == target, true)
+				&& t.eq(move_count, 0);
+		});
+
+	suite.test(
+		u8"入れ替わった要素を移動する",
+		[](TestCaseContext& t) {
+			auto source = std::vector<TestItem>{ { 1, 0 }, { 2, 0 }, { 3, 0 }, { 4, 0 } };
+			auto target = std::vector<TestItem>{ { 2, 0 }, { 3, 0 }, { 4, 0 }, { 1, 0 } };
+
+			auto diff = std::vector<ObjectListDiff>{};
+			object_list_diff(
+				test_items_to_ids(source),
+				test_items_to_ids(target),
+				[&](std::size_t si, std::size_t ti) { return source[si].second == target[ti].second; },
+				diff
+			);
+
+			return t.eq(diff.size(), 1)
+				&& t.eq(diff[0].kind() == ObjectListDiffKind::Move, true)
+				&& t.eq(diff[0].from_index(), 0)
+				&& t.eq(diff[0].index(), 3);
+		});
+
+	suite.test(
+		u8"ランダムなリストで以前の実装と結果が一致する",
+		[](TestCaseContext& t) {
+			auto random = std::mt19937{ 42 };
+			auto source = std::vector<TestItem>{};
+			auto target = std::vector<TestItem>{};
+
+			for (auto round = 0; round < 300; round++) {
+				auto size = std::uniform_int_distribution<std::size_t>{ 0, 60 }(random);
+				test_generate_lists(random, size, false, source, target);
+
+				auto move_count = std::size_t{};
+				auto expected_opt = test_diff_apply(source, target, object_list_diff_naive, move_count);
+				auto actual_opt = test_diff_apply(source, target, object_list_diff, move_count);
+
+				if (!t.eq(expected_opt.has_value(), true)
+					|| !t.eq(actual_opt.has_value(), true)
+					|| !t.eq(*actual_opt == *expected_opt, true)
+					|| !t.eq(*actual_opt == target, true)
+					|| !t.eq(move_count, 0)) {
+					return false;
+				}
+			}
+			return true;
+		});
+
+	suite.test(
+		u8"順番が入れ替わったランダムなリストでも差分を適用できる",
+		[](TestCaseContext& t) {
+			auto random = std::mt19937{ 7 };
+			auto source = std::vector<TestItem>{};
+			auto target = std::vector<TestItem>{};
+
+			for (auto round = 0; round < 300; round++) {
+				auto size = std::uniform_int_distribution<std::size_t>{ 0, 60 }(random);
+				test_generate_lists(random, size, true, source, target);
+
+				auto move_count = std::size_t{};
+				auto actual_opt = test_diff_apply(source, target, object_list_diff, move_count);
+
+				if (!t.eq(actual_opt.has_value(), true)
+					|| !t.eq(*actual_opt == target, true)
+					|| !t.eq(move_count <= source.size(), true)) {
+					return false;
+				}
+			}
+			return true;
+		});
+
+	suite.test(
+		u8"ベンチマーク: 以前の実装との比較",
+		[](TestCaseContext& t) {
+			static constexpr auto SIZE = std::size_t{ 5000 };
+			static constexpr auto REPEAT = 5;
+
+			auto random = std::mt19937{ 1 };
+			auto source = std::vector<TestItem>{};
+			auto target = std::vector<TestItem>{};
+			test_generate_lists(random, SIZE, false, source, target);
+
+			auto source_ids = test_items_to_ids(source);
+			auto target_ids = test_items_to_ids(target);
+			auto equals = ObjectListEqualsFn{ [&](std::size_t si, std::size_t ti) { return source[si].second == target[ti].second; } };
+
+			auto measure = [&](TestDiffFn diff_fn, std::size_t& diff_size) {
+				auto start = std::chrono::steady_clock::now();
+				for (auto i = 0; i < REPEAT; i++) {
+					auto diff = std::vector<ObjectListDiff>{};
+					diff_fn(source_ids, target_ids, equals, diff);
+					diff_size = diff.size();
+				}
+				auto elapsed = std::chrono::steady_clock::now() - start;
+				return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / REPEAT;
+			};
+
+			auto naive_size = std::size_t{};
+			auto fast_size = std::size_t{};
+			auto naive_us = measure(object_list_diff_naive, naive_size);
+			auto fast_us = measure(object_list_diff, fast_size);
+
+			t.output()
+				<< u8"    要素数 " << SIZE
+				<< u8": 以前の実装 " << naive_us << u8" us"
+				<< u8" / 新しい実装 " << fast_us << u8" us" << std::endl;
+
+			return t.eq(fast_size, naive_size);
+		});
+}
@@ -0,0 +1,90 @@
+//! オブジェクトリストの差分計算
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+class Tests;
+
+// 差分の要素の種類
+enum class ObjectListDiffKind {
+	// 新しい要素を index の位置に挿入する。
+	Insert,
+
+	// index の位置にある要素を取り除く。
+	Remove,
+
+	// index の位置にある要素の内容を置き換える。
+	Update,
+
+	// from_index の位置にある要素を取り除いて、index の位置に挿入する。(内容も置き換える。)
+	Move,
+};
+
+// オブジェクトリストの差分の要素。
+//
+// 差分は先頭から順番に適用するものとする。
+// index, from_index は、その差分を適用する時点でのリスト上の位置を表す。
+class ObjectListDiff {
+	ObjectListDiffKind kind_;
+
+	// 元のリスト上の位置 (Insert 以外)
+	std::size_t source_index_;
+
+	// 新しいリスト上の位置 (Remove 以外)
+	std::size_t target_index_;
+
+	std::size_t index_;
+
+	std::size_t from_index_;
+
+public:
+	ObjectListDiff(ObjectListDiffKind kind, std::size_t source_index, std::size_t target_index, std::size_t index, std::size_t from_index)
+		: kind_(kind)
+		, source_index_(source_index)
+		, target_index_(target_index)
+		, index_(index)
+		, from_index_(from_index)
+	{
+	}
+
+	auto kind() const -> ObjectListDiffKind {
+		return kind_;
+	}
+
+	auto source_index() const -> std::size_t {
+		return source_index_;
+	}
+
+	auto target_index() const -> std::size_t {
+		return target_index_;
+	}
+
+	auto index() const -> std::size_t {
+		return index_;
+	}
+
+	auto from_index() const -> std::size_t {
+		return from_index_;
+	}
+};
+
+// 要素が等しいか判定する関数。(元のリスト上の位置, 新しいリスト上の位置) を受け取る。
+// オブジェクトIDが一致するペアに対してだけ呼ばれる。
+using ObjectListEqualsFn = std::function<bool(std::size_t source_index, std::size_t target_index)>;
+
+// オブジェクトIDの列の差分を計算して、diff の末尾に追加する。
+//
+// 各リストのオブジェクトIDは重複しないものとする。
+// 順番が入れ替わった要素は、最長増加部分列に含まれないものだけを Move で移動する。
+// 計算量は O(n log n)。
+extern void object_list_diff(
+	std::vector<std::size_t> const& source_ids,
+	std::vector<std::size_t> const& target_ids,
+	ObjectListEqualsFn const& equals,
+	std::vector<ObjectListDiff>& diff
+);
+
+extern void object_list_diff_tests(Tests& tests);
@@ -0,0 +1,250 @@
+#include "pch.h"
+#include <algorithm>
+#include "hsp_line_table.h"
+#include "sampling_profiler.h"
+#include "string_format.h"
+#include "test_suite.h"
+
+SamplingProfiler::SamplingProfiler(HspLineTable const& table, Source source, std::chrono::milliseconds interval)
+	: table_(table)
+	, entry_counts_(table.size())
+	, file_counts_(table.file_id_end())
+	, sample_count_()
+	, unknown_count_()
+	, source_(std::move(source))
+	, interval_(interval)
+	, paused_()
+	, mutex_()
+	, stop_cond_()
+	, stopping_()
+	, thread_()
+{
+}
+
+SamplingProfiler::~SamplingProfiler() {
+	stop();
+}
+
+void SamplingProfiler::start() {
+	if (thread_.joinable()) {
+		assert(false && u8"double start");
+		return;
+	}
+
+	thread_ = std::thread{ [this] { run(); } };
+}
+
+void SamplingProfiler::stop() {
+	if (!thread_.joinable()) {
+		return;
+	}
+
+	{
+		auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		stopping_ = true;
+	}
+	stop_cond_.notify_all();
+
+	thread_.join();
+}
+
+void SamplingProfiler::record(std::optional<std::size_t> code_offset) {
+	sample_count_.fetch_add(1, std::memory_order_relaxed);
+
+	auto&& index_opt = table_.position_to_entry_index(code_offset);
+	if (!index_opt) {
+		unknown_count_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	entry_counts_[*index_opt].fetch_add(1, std::memory_order_relaxed);
+	file_counts_[table_.entry_at(*index_opt).file_id()].fetch_add(1, std::memory_order_relaxed);
+}
+
+auto SamplingProfiler::file_sample_count(std::size_t file_id) const -> std::uint64_t {
+	if (file_id >= file_counts_.size()) {
+		return 0;
+	}
+	return file_counts_[file_id].load(std::memory_order_relaxed);
+}
+
+auto SamplingProfiler::to_hot_lines(std::size_t limit) const -> std::vector<SampledLine> {
+	// 同じ行が複数の項目に分かれていることがあるので、行ごとにまとめる。
+	auto lines = std::vector<SampledLine>{};
+	for (auto i = std::size_t{}; i < entry_counts_.size(); i++) {
+		auto count = entry_counts_[i].load(std::memory_order_relaxed);
+		if (count != 0) {
+			auto&& entry = table_.entry_at(i);
+			lines.emplace_back(entry.file_id(), entry.line_index(), count);
+		}
+	}
+
+	std::sort(
+		lines.begin(), lines.end(),
+		[](SampledLine const& l, SampledLine const& r) {
+			return std::make_pair(l.file_id(), l.line_index()) < std::make_pair(r.file_id(), r.line_index());
+		});
+
+	auto merged = std::vector<SampledLine>{};
+	for (auto&& line : lines) {
+		if (!merged.empty() && merged.back().file_id() == line.file_id() && merged.back().line_index() == line.line_index()) {
+			merged.back() = SampledLine{ line.file_id(), line.line_index(), merged.back().count() + line.count() };
+		} else {
+			merged.push_back(line);
+		}
+	}
+
+	std::stable_sort(
+		merged.begin(), merged.end(),
+		[](SampledLine const& l, SampledLine const& r) {
+			return l.count() > r.count();
+		});
+
+	if (merged.size() > limit) {
+		merged.erase(merged.begin() + limit, merged.end());
+	}
+	return merged;
+}
+
+auto SamplingProfiler::to_report(std::size_t limit, std::vector<Utf8String> const& file_names) const -> Utf8String {
+	auto total = sample_count();
+	auto percent = [&](std::uint64_t count) {
+		return total != 0 ? count * 100.0 / total : 0.0;
+	};
+
+	auto name_of = [&](std::size_t file_id) {
+		if (file_id < file_names.size() && !file_names[file_id].empty()) {
+			return file_names[file_id];
+		}
+		return to_owned(as_utf8(strf("#%d", file_id)));
+	};
+
+	auto text = to_owned(as_utf8(strf("%12s %8s  %s\r\n", "samples", "%", "line")));
+	for (auto&& line : to_hot_lines(limit)) {
+		text += as_utf8(strf("%12d %8.2f  ", line.count(), percent(line.count())));
+		text += name_of(line.file_id());
+		text += as_utf8(strf(":%d\r\n", line.line_index() + 1));
+	}
+
+	text += as_utf8(u8"\r\n");
+	text += as_utf8(strf("%12s %8s  %s\r\n", "samples", "%", "file"));
+	for (auto file_id = std::size_t{}; file_id < file_counts_.size(); file_id++) {
+		auto count = file_sample_count(file_id);
+		if (count == 0) {
+			continue;
+		}
+
+		text += as_utf8(strf("%12d %8.2f  ", count, percent(count)));
+		text += name_of(file_id);
+		text += as_utf8(u8"\r\n");
+	}
+
+	text += as_utf8(strf("%12d %8.2f  (その他)\r\n", unknown_count(), percent(unknown_count())));
+	return text;
+}
+
+void SamplingProfiler::run() {
+	auto lock = std::unique_lock<std::mutex>{ mutex_ };
+	while (!stop_cond_.wait_for(lock, interval_, [&] { return stopping_; })) {
+		if (paused_.load()) {
+			continue;
+		}
+
+		record(source_());
+	}
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+void sampling_profiler_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"sampling_profiler");
+
+	suite.test(
+		u8"サンプルを行とファイルごとに数える",
+		[](TestCaseContext& t) {
+			// ファイル 0 の行 0 (コード位置 0～9)、ファイル 1 の行 5 (10～19)、ファイル 0 の行 0 (20～29)
+			auto builder = HspLineTableBuilder{};
+			builder.add(0, 10, 0, 0);
+			builder.add(10, 10, 1, 5);
+			builder.add(20, 10, 0, 0);
+			auto table = builder.finish();
+
+			auto profiler = SamplingProfiler{ table, [] { return std::nullopt; }, std::chrono::milliseconds{ 1 } };
+
+			profiler.record(1);
+			profiler.record(25);
+			profiler.record(30);
+			profiler.record(15);
+			profiler.record(0);
+			profiler.record(std::nullopt);
+
+			auto&& hot_lines = profiler.to_hot_lines(10);
+
+			return t.eq(profiler.sample_count(), std::uint64_t{ 6 })
+				&& t.eq(profiler.unknown_count(), std::uint64_t{ 2 })
+				&& t.eq(profiler.file_sample_count(0), std::uint64_t{ 3 })
+				&& t.eq(profiler.file_sample_count(1), std::uint64_t{ 1 })
+				&& t.eq(profiler.file_sample_count(9), std::uint64_t{ 0 })
+				&& t.eq(hot_lines.size(), std::size_t{ 2 })
+				&& t.eq(hot_lines[0].file_id(), std::size_t{ 0 })
+				&& t.eq(hot_lines[0].count(), std::uint64_t{ 3 })
+				&& t.eq(hot_lines[1].line_index(), std::size_t{ 5 })
+				&& t.eq(profiler.to_hot_lines(1).size(), std::size_t{ 1 });
+		});
+
+	suite.test(
+		u8"表にファイル名と行番号を出力する",
+		[](TestCaseContext& t) {
+			auto builder = HspLineTableBuilder{};
+			builder.add(0, 10, 0, 0);
+			builder.add(10, 10, 1, 5);
+			auto table = builder.finish();
+
+			auto profiler = SamplingProfiler{ table, [] { return std::nullopt; }, std::chrono::milliseconds{ 1 } };
+			profiler.record(15);
+			profiler.record(15);
+			profiler.record(5);
+			profiler.record(std::nullopt);
+
+			auto file_names = std::vector<Utf8String>{ to_owned(as_utf8(u8"main.hsp")) };
+			auto report = as_native(profiler.to_report(10, file_names));
+
+			return t.eq(report.find(u8"50.00  #1:6\r\n") != std::string::npos, true)
+				&& t.eq(report.find(u8"25.00  main.hsp:1\r\n") != std::string::npos, true)
+				&& t.eq(report.find(u8"25.00  main.hsp\r\n") != std::string::npos, true)
+				&& t.eq(report.find(u8"25.00  (その他)") != std::string::npos, true);
+		});
+
+	suite.test(
+		u8"スレッドで定期的にサンプルを取り、停止中は取らない",
+		[](TestCaseContext& t) {
+			auto builder = HspLineTableBuilder{};
+			builder.add(0, 10, 0, 0);
+			auto table = builder.finish();
+
+			auto source_count = std::atomic<std::size_t>{};
+			auto source = [&]() -> std::optional<std::size_t> {
+				source_count++;
+				return std::size_t{ 5 };
+			};
+
+			auto profiler = SamplingProfiler{ table, source, std::chrono::milliseconds{ 1 } };
+			profiler.set_paused(true);
+			profiler.start();
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 20 });
+			auto paused_count = source_count.load();
+
+			profiler.set_paused(false);
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ 5 };
+			while (profiler.sample_count() < 5 && std::chrono::steady_clock::now() < deadline) {
+				std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+			}
+			profiler.stop();
+
+			return t.eq(paused_count, std::size_t{ 0 })
+				&& t.eq(profiler.sample_count() >= 5, true)
+				&& t.eq(profiler.file_sample_count(0), profiler.sample_count());
+		});
+}
@@ -0,0 +1,122 @@
+//! サンプリングプロファイラー
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "encoding.h"
+
+class HspLineTable;
+class Tests;
+
+// サンプリングで数えた、行ごとのサンプル数
+class SampledLine {
+	std::size_t file_id_;
+	std::size_t line_index_;
+	std::uint64_t count_;
+
+public:
+	SampledLine(std::size_t file_id, std::size_t line_index, std::uint64_t count)
+		: file_id_(file_id)
+		, line_index_(line_index)
+		, count_(count)
+	{
+	}
+
+	auto file_id() const -> std::size_t {
+		return file_id_;
+	}
+
+	auto line_index() const -> std::size_t {
+		return line_index_;
+	}
+
+	auto count() const -> std::uint64_t {
+		return count_;
+	}
+};
+
+// デバッギの実行位置を一定の間隔で読み取って、どの行で時間を使っているかを数えるもの。
+//
+// 専用のスレッドで、デバッギを止めずに実行位置 (ctx->mcs) を読む。
+// (HSP のスレッドのタイマーでは、ランタイムがメッセージを処理する await などの位置しか観測できない。)
+// 実行位置はコード位置と行の対応表で行に変換して、対応表の項目ごとのカウンターに数える。
+// カウンターは対応表の項目とファイルIDで引く配列なので、記録にメモリー確保はいらない。
+class SamplingProfiler {
+public:
+	// 実行位置 (ctx->mcs のコード位置) を読む関数。(サンプリングのスレッドから呼ばれる。)
+	using Source = std::function<std::optional<std::size_t>()>;
+
+private:
+	HspLineTable const& table_;
+
+	// 対応表の項目ごとのサンプル数
+	std::vector<std::atomic<std::uint32_t>> entry_counts_;
+
+	// ファイルごとのサンプル数
+	std::vector<std::atomic<std::uint32_t>> file_counts_;
+
+	std::atomic<std::uint64_t> sample_count_;
+
+	// どの行でもない位置のサンプル数
+	std::atomic<std::uint64_t> unknown_count_;
+
+	Source source_;
+	std::chrono::milliseconds interval_;
+
+	// デバッギが停止している間はサンプルを取らない。
+	std::atomic<bool> paused_;
+
+	std::mutex mutex_;
+	std::condition_variable stop_cond_;
+	bool stopping_;
+	std::thread thread_;
+
+public:
+	SamplingProfiler(HspLineTable const& table, Source source, std::chrono::milliseconds interval);
+
+	~SamplingProfiler();
+
+	SamplingProfiler(SamplingProfiler const& other) = delete;
+
+	auto operator=(SamplingProfiler const& other)->SamplingProfiler & = delete;
+
+	void start();
+
+	void stop();
+
+	void set_paused(bool paused) {
+		paused_.store(paused);
+	}
+
+	// 実行位置を1つ数える。
+	void record(std::optional<std::size_t> code_offset);
+
+	auto sample_count() const -> std::uint64_t {
+		return sample_count_.load(std::memory_order_relaxed);
+	}
+
+	auto unknown_count() const -> std::uint64_t {
+		return unknown_count_.load(std::memory_order_relaxed);
+	}
+
+	auto file_sample_count(std::size_t file_id) const->std::uint64_t;
+
+	// サンプル数の多い行を、多い順に最大 limit 個返す。
+	auto to_hot_lines(std::size_t limit) const->std::vector<SampledLine>;
+
+	// サンプル数の多い行とファイルごとのサンプル数を表にする。(file_names: ファイルIDごとのファイルの名前)
+	auto to_report(std::size_t limit, std::vector<Utf8String> const& file_names) const->Utf8String;
+
+private:
+	void run();
+};
+
+extern void sampling_profiler_tests(Tests& tests);
@@ -0,0 +1,650 @@
+#include "pch.h"
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <random>
+#include <thread>
+#include "shared_ring.h"
+#include "test_suite.h"
+#include "transfer_protocol.h"
+
+#ifndef _WIN32
+// hsp3plugin.h の stat マクロがシステムのヘッダーの宣言を壊さないように、一時的に取り除く。
+#pragma push_macro("stat")
+#undef stat
+#include <cerrno>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#pragma pop_macro("stat")
+#endif
+
+static auto is_power_of_two(std::size_t n) -> bool {
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+auto SharedRing::create(void* memory, std::size_t memory_size, std::size_t capacity) -> std::optional<SharedRing> {
+	if (memory == nullptr
+		|| !is_power_of_two(capacity)
+		|| capacity > std::size_t{ 0x80000000 }
+		|| required_size(capacity) > memory_size
+		|| (std::uintptr_t)memory % alignof(SharedRingHeader) != 0
+		) {
+		return std::nullopt;
+	}
+
+	auto header = new(memory) SharedRingHeader{};
+	header->magic = SharedRingHeader::MAGIC;
+	header->capacity = (std::uint32_t)capacity;
+	header->closed.store(0);
+	header->write_position.store(0);
+	header->read_position.store(0);
+
+	return SharedRing{ header };
+}
+
+auto SharedRing::attach(void* memory, std::size_t memory_size) -> std::optional<SharedRing> {
+	if (memory == nullptr || memory_size <= sizeof(SharedRingHeader) || (std::uintptr_t)memory % alignof(SharedRingHeader) != 0) {
+		return std::nullopt;
+	}
+
+	auto header = (SharedRingHeader*)memory;
+	if (header->magic != SharedRingHeader::MAGIC
+		|| !is_power_of_two(header->capacity)
+		|| required_size(header->capacity) > memory_size
+		) {
+		return std::nullopt;
+	}
+
+	return SharedRing{ header };
+}
+
+auto SharedRing::readable_size() const -> std::size_t {
+	return (std::size_t)(header_->write_position.load(std::memory_order_acquire) - header_->read_position.load(std::memory_order_acquire));
+}
+
+auto SharedRing::write_some(Utf8StringView data) -> std::size_t {
+	auto write_position = header_->write_position.load(std::memory_order_relaxed);
+	auto read_position = header_->read_position.load(std::memory_order_acquire);
+
+	auto free_size = (std::size_t)(capacity() - (write_position - read_position));
+	auto size = std::min(free_size, data.size());
+	if (size == 0) {
+		return 0;
+	}
+
+	// 末尾で折り返す。
+	auto offset = (std::size_t)(write_position & mask_);
+	auto first = std::min(size, capacity() - offset);
+	std::memcpy(data_ + offset, data.data(), first);
+	std::memcpy(data_, data.data() + first, size - first);
+
+	header_->write_position.store(write_position + size, std::memory_order_release);
+	return size;
+}
+
+auto SharedRing::read_some(Utf8Char* buffer, std::size_t buffer_size) -> std::size_t {
+	auto read_position = header_->read_position.load(std::memory_order_relaxed);
+	auto write_position = header_->write_position.load(std::memory_order_acquire);
+
+	auto size = std::min((std::size_t)(write_position - read_position), buffer_size);
+	if (size == 0) {
+		return 0;
+	}
+
+	auto offset = (std::size_t)(read_position & mask_);
+	auto first = std::min(size, capacity() - offset);
+	std::memcpy(buffer, data_ + offset, first);
+	std::memcpy(buffer + first, data_, size - first);
+
+	header_->read_position.store(read_position + size, std::memory_order_release);
+	return size;
+}
+
+void SharedRing::close() {
+	header_->closed.store(1, std::memory_order_release);
+}
+
+auto SharedRing::is_closed() const -> bool {
+	return header_->closed.load(std::memory_order_acquire) != 0;
+}
+
+void SharedRingLocalSignal::notify() {
+	{
+		auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		signaled_ = true;
+	}
+	cond_.notify_one();
+}
+
+auto SharedRingLocalSignal::wait() -> bool {
+	auto lock = std::unique_lock<std::mutex>{ mutex_ };
+	cond_.wait(lock, [&] { return signaled_ || abandoned_; });
+	if (abandoned_) {
+		return false;
+	}
+
+	signaled_ = false;
+	return true;
+}
+
+void SharedRingLocalSignal::abandon() {
+	{
+		auto lock = std::lock_guard<std::mutex>{ mutex_ };
+		abandoned_ = true;
+	}
+	cond_.notify_all();
+}
+
+auto SharedRingSink::write(Utf8StringView data) -> bool {
+	while (!data.empty()) {
+		if (ring_.is_closed()) {
+			return false;
+		}
+
+		auto written = ring_.write_some(data);
+		if (written == 0) {
+			// 満杯なので、読み取り側が空けるまで眠る。
+			if (!signals_.writable_->wait()) {
+				// 読み取り側がいなくなったので、もう空かない。
+				close();
+				return false;
+			}
+			continue;
+		}
+
+		data = data.substr(written);
+		signals_.readable_->notify();
+	}
+	return true;
+}
+
+void SharedRingSink::close() {
+	ring_.close();
+	signals_.notify_all();
+}
+
+auto SharedRingSource::read(Utf8Char* buffer, std::size_t buffer_size) -> std::size_t {
+	while (true) {
+		auto size = ring_.read_some(buffer, buffer_size);
+		if (size != 0) {
+			signals_.writable_->notify();
+			return size;
+		}
+
+		// 閉じられていたら、残りのデータがないことを確かめてから終える。
+		if (cancelled_.load() || (ring_.is_closed() && ring_.readable_size() == 0)) {
+			return 0;
+		}
+
+		// 空なので、書き込まれるか閉じられるまで眠る。
+		if (!signals_.readable_->wait()) {
+			// 書き込み側がいなくなったので、閉じて残りを読み終える。
+			ring_.close();
+			signals_.notify_all();
+		}
+	}
+}
+
+#ifndef _WIN32
+
+// -----------------------------------------------
+// POSIX
+// -----------------------------------------------
+
+auto SharedRingPosixMemory::create(std::string name, std::size_t size) -> std::unique_ptr<SharedRingPosixMemory> {
+	auto fd = shm_open(name.data(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	if (ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		shm_unlink(name.data());
+		return nullptr;
+	}
+
+	auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		shm_unlink(name.data());
+		return nullptr;
+	}
+
+	return std::unique_ptr<SharedRingPosixMemory>{ new SharedRingPosixMemory{ std::move(name), data, size, true } };
+}
+
+auto SharedRingPosixMemory::open(std::string name) -> std::unique_ptr<SharedRingPosixMemory> {
+	auto fd = shm_open(name.data(), O_RDWR, 0);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	// 大きさは作った側が決めたものを使う。
+	auto end = lseek(fd, 0, SEEK_END);
+	if (end <= 0) {
+		close(fd);
+		return nullptr;
+	}
+
+	auto size = (std::size_t)end;
+	auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return nullptr;
+	}
+
+	return std::unique_ptr<SharedRingPosixMemory>{ new SharedRingPosixMemory{ std::move(name), data, size, false } };
+}
+
+SharedRingPosixMemory::~SharedRingPosixMemory() {
+	munmap(data_, size_);
+
+	if (owner_) {
+		shm_unlink(name_.data());
+	}
+}
+
+auto SharedRingPosixSignal::create(std::string name) -> std::unique_ptr<SharedRingPosixSignal> {
+	auto semaphore = sem_open(name.data(), O_CREAT | O_EXCL, 0600, 0u);
+	if (semaphore == SEM_FAILED) {
+		return nullptr;
+	}
+
+	return std::unique_ptr<SharedRingPosixSignal>{ new SharedRingPosixSignal{ std::move(name), semaphore, true } };
+}
+
+auto SharedRingPosixSignal::open(std::string name) -> std::unique_ptr<SharedRingPosixSignal> {
+	auto semaphore = sem_open(name.data(), 0);
+	if (semaphore == SEM_FAILED) {
+		return nullptr;
+	}
+
+	return std::unique_ptr<SharedRingPosixSignal>{ new SharedRingPosixSignal{ std::move(name), semaphore, false } };
+}
+
+SharedRingPosixSignal::~SharedRingPosixSignal() {
+	sem_close((sem_t*)semaphore_);
+
+	if (owner_) {
+		sem_unlink(name_.data());
+	}
+}
+
+void SharedRingPosixSignal::notify() {
+	sem_post((sem_t*)semaphore_);
+}
+
+auto SharedRingPosixSignal::wait() -> bool {
+	while (sem_wait((sem_t*)semaphore_) != 0) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+// リングバッファーのための領域 (キャッシュラインに揃える)
+class SharedRingMemory {
+	class alignas(SharedRingHeader::CACHE_LINE_SIZE) Block {
+		unsigned char bytes_[SharedRingHeader::CACHE_LINE_SIZE];
+	};
+
+	std::vector<Block> blocks_;
+
+public:
+	explicit SharedRingMemory(std::size_t size)
+		: blocks_((size + sizeof(Block) - 1) / sizeof(Block))
+	{
+	}
+
+	auto data() -> void* {
+		return blocks_.data();
+	}
+
+	auto size() const -> std::size_t {
+		return blocks_.size() * sizeof(Block);
+	}
+};
+
+// wait が呼ばれた回数を数える通知
+class CountingSignal
+	: public SharedRingSignal
+{
+	SharedRingLocalSignal inner_;
+	std::atomic<std::size_t> wait_count_;
+
+public:
+	CountingSignal()
+		: inner_()
+		, wait_count_()
+	{
+	}
+
+	auto wait_count() const -> std::size_t {
+		return wait_count_.load();
+	}
+
+	void notify() override {
+		inner_.notify();
+	}
+
+	auto wait() -> bool override {
+		wait_count_++;
+		return inner_.wait();
+	}
+};
+
+static auto new_local_signals() -> SharedRingSignals {
+	return SharedRingSignals{ std::make_shared<SharedRingLocalSignal>(), std::make_shared<SharedRingLocalSignal>() };
+}
+
+void shared_ring_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"shared_ring");
+
+	suite.test(
+		u8"折り返して読み書きできる",
+		[](TestCaseContext& t) {
+			auto memory = SharedRingMemory{ SharedRing::required_size(8) };
+			auto ring = *SharedRing::create(memory.data(), memory.size(), 8);
+			auto buffer = std::array<Utf8Char, 16>{};
+
+			auto written1 = ring.write_some(as_utf8(u8"abcdef"));
+			auto read1 = ring.read_some(buffer.data(), 4);
+			auto text1 = Utf8String{ buffer.data(), read1 };
+
+			// 容量を超える分は書き込まれない。
+			auto written2 = ring.write_some(as_utf8(u8"ghijklmn"));
+			auto read2 = ring.read_some(buffer.data(), buffer.size());
+			auto text2 = Utf8String{ buffer.data(), read2 };
+
+			return t.eq(ring.capacity(), 8)
+				&& t.eq(written1, 6)
+				&& t.eq(text1, as_utf8(u8"abcd"))
+				&& t.eq(written2, 6)
+				&& t.eq(text2, as_utf8(u8"efghijkl"))
+				&& t.eq(ring.readable_size(), 0);
+		});
+
+	suite.test(
+		u8"他方から開く",
+		[](TestCaseContext& t) {
+			auto memory = SharedRingMemory{ SharedRing::required_size(64) };
+
+			auto broken_opt = SharedRing::attach(memory.data(), memory.size());
+
+			auto writer = *SharedRing::create(memory.data(), memory.size(), 64);
+			auto reader_opt = SharedRing::attach(memory.data(), memory.size());
+
+			auto signals = new_local_signals();
+			auto sink = SharedRingSink{ writer, signals };
+			sink.write(as_utf8(u8"hello"));
+			sink.close();
+
+			auto buffer = std::array<Utf8Char, 16>{};
+			auto source = SharedRingSource{ *reader_opt, signals };
+			auto read1 = source.read(buffer.data(), buffer.size());
+			auto read2 = source.read(buffer.data(), buffer.size());
+
+			return t.eq(broken_opt.has_value(), false)
+				&& t.eq(reader_opt.has_value(), true)
+				&& t.eq(Utf8StringView{ buffer.data(), read1 }, as_utf8(u8"hello"))
+				&& t.eq(read2, 0)
+				&& t.eq(sink.write(as_utf8(u8"x")), false);
+		});
+
+	suite.test(
+		u8"データがないときは通知されるまで眠る",
+		[](TestCaseContext& t) {
+			auto memory = SharedRingMemory{ SharedRing::required_size(64) };
+			auto writer_ring = *SharedRing::create(memory.data(), memory.size(), 64);
+			auto reader_ring = *SharedRing::attach(memory.data(), memory.size());
+
+			auto readable = std::make_shared<CountingSignal>();
+			auto signals = SharedRingSignals{ readable, std::make_shared<SharedRingLocalSignal>() };
+
+			auto received = Utf8String{};
+			auto reader = std::thread{ [&] {
+				auto source = SharedRingSource{ reader_ring, signals };
+				auto buffer = std::array<Utf8Char, 16>{};
+				while (auto size = source.read(buffer.data(), buffer.size())) {
+					received += Utf8StringView{ buffer.data(), size };
+				}
+			} };
+
+			// 読み取り側が空のリングバッファーを待っている間に、少し間を置いて書き込む。
+			auto sink = SharedRingSink{ writer_ring, signals };
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+			sink.write(as_utf8(u8"hello"));
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+			sink.close();
+			reader.join();
+
+			// 書き込みと閉じることの通知でだけ起きる。(ポーリングしていれば、待つ回数が間隔に比例して増える。)
+			return t.eq(received, as_utf8(u8"hello"))
+				&& t.eq(readable->wait_count() <= 3, true);
+		});
+
+	suite.test(
+		u8"cancel で待っている読み取りが終わる",
+		[](TestCaseContext& t) {
+			auto memory = SharedRingMemory{ SharedRing::required_size(64) };
+			auto ring = *SharedRing::create(memory.data(), memory.size(), 64);
+			auto source = SharedRingSource{ ring, new_local_signals() };
+
+			auto read_size = std::size_t{ 1 };
+			auto reader = std::thread{ [&] {
+				auto buffer = std::array<Utf8Char, 16>{};
+				read_size = source.read(buffer.data(), buffer.size());
+			} };
+
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
+			source.cancel();
+			reader.join();
+
+			return t.eq(read_size, 0);
+		});
+
+	suite.test(
+		u8"読み取り側がいなくなったら満杯でも書き込みが返る",
+		[](TestCaseContext& t) {
+			auto memory = SharedRingMemory{ SharedRing::required_size(8) };
+			auto writer_ring = *SharedRing::create(memory.data(), memory.size(), 8);
+			auto reader_ring = *SharedRing::attach(memory.data(), memory.size());
+
+			auto writable = std::make_shared<SharedRingLocalSignal>();
+			auto signals = SharedRingSignals{ std::make_shared<SharedRingLocalSignal>(), writable };
+			auto sink = SharedRingSink{ writer_ring, signals };
+
+			// 読み取り側は読まないまま止まっているので、容量を超える書き込みは空きを待つ。
+			auto result1 = true;
+			auto writer = std::thread{ [&] {
+				result1 = sink.write(as_utf8(u8"abcdefghijklmnop"));
+			} };
+
+			// 読み取り側のプロセスが異常終了したことにする。
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
+			writable->abandon();
+			writer.join();
+
+			auto result2 = sink.write(as_utf8(u8"x"));
+
+			return t.eq(result1, false)
+				&& t.eq(result2, false)
+				&& t.eq(reader_ring.is_closed(), true);
+		});
+
+	suite.test(
+		u8"ストレステスト: 容量より大きなメッセージを別スレッドで受け取る",
+		[](TestCaseContext& t) {
+			static constexpr auto RING_CAPACITY = std::size_t{ 4096 };
+			static constexpr auto MESSAGE_COUNT = 2000;
+
+			auto memory = SharedRingMemory{ SharedRing::required_size(RING_CAPACITY) };
+			auto writer_ring = *SharedRing::create(memory.data(), memory.size(), RING_CAPACITY);
+			auto reader_ring = *SharedRing::attach(memory.data(), memory.size());
+
+			// 大きさがばらばらなメッセージを作る。(最大で容量の16倍)
+			auto random = std::mt19937{ 42 };
+			auto bodies = std::vector<Utf8String>{};
+			for (auto i = 0; i < MESSAGE_COUNT; i++) {
+				auto size = std::uniform_int_distribution<std::size_t>{ 0, i % 50 == 0 ? RING_CAPACITY * 16 : 300 }(random);
+				auto body = Utf8String{};
+				for (auto j = std::size_t{}; j < size; j++) {
+					body.push_back((Utf8Char)(unsigned char)('a' + (i + j) % 26));
+				}
+				bodies.push_back(std::move(body));
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			auto total_size = std::size_t{};
+
+			auto signals = new_local_signals();
+
+			auto writer = std::thread{ [&] {
+				auto sink = SharedRingSink{ writer_ring, signals };
+				for (auto&& body : bodies) {
+					auto frame = Utf8String{ as_utf8(u8"Content-Length: ") };
+					frame += as_utf8(std::to_string(body.size()));
+					frame += as_utf8(u8"\r\n\r\n");
+					frame += body;
+					sink.write(frame);
+				}
+				sink.close();
+			} };
+
+			// 受信側は、小さなバッファーで読んでメッセージを組み立てる。
+			auto received = std::vector<Utf8String>{};
+			{
+				auto source = SharedRingSource{ reader_ring, signals };
+				auto framer = TransferProtocolFramer{};
+				auto buffer = std::vector<Utf8Char>(1000);
+
+				while (auto size = source.read(buffer.data(), buffer.size())) {
+					total_size += size;
+					framer.push(Utf8StringView{ buffer.data(), size });
+
+					while (auto body_opt = framer.next()) {
+						received.emplace_back(*body_opt);
+					}
+				}
+			}
+
+			writer.join();
+
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			auto sec = std::chrono::duration<double>(elapsed).count();
+			t.output()
+				<< u8"    " << total_size / 1024 << u8" KiB"
+				<< u8", " << (int)(sec > 0 ? (double)total_size / sec / (1024 * 1024) : 0.0) << u8" MB/s" << std::endl;
+
+			return t.eq(received.size(), bodies.size())
+				&& t.eq(received == bodies, true);
+		});
+
+#ifndef _WIN32
+	suite.test(
+		u8"ストレステスト: POSIX の共有メモリーを介して別プロセスで受け取る",
+		[](TestCaseContext& t) {
+			static constexpr auto RING_CAPACITY = std::size_t{ 16 * 1024 };
+			static constexpr auto MESSAGE_COUNT = 5000;
+
+			auto prefix = std::string{ "/knowbug_test_" } + std::to_string((long)getpid());
+			auto memory_name = prefix + "_ring";
+			auto readable_name = prefix + "_readable";
+			auto writable_name = prefix + "_writable";
+
+			auto memory = SharedRingPosixMemory::create(memory_name, SharedRing::required_size(RING_CAPACITY));
+			auto readable = std::shared_ptr<SharedRingPosixSignal>{ SharedRingPosixSignal::create(readable_name) };
+			auto writable = std::shared_ptr<SharedRingPosixSignal>{ SharedRingPosixSignal::create(writable_name) };
+			if (!t.eq(memory != nullptr && readable != nullptr && writable != nullptr, true)) {
+				return false;
+			}
+
+			auto writer_ring = *SharedRing::create(memory->data(), memory->size(), RING_CAPACITY);
+
+			// 大きさがばらばらなメッセージを作る。(最大で 200 KB)
+			auto random = std::mt19937{ 7 };
+			auto bodies = std::vector<Utf8String>{};
+			for (auto i = 0; i < MESSAGE_COUNT; i++) {
+				auto size = std::uniform_int_distribution<std::size_t>{ 0, i % 100 == 0 ? 200 * 1000 : 500 }(random);
+				auto body = Utf8String{};
+				for (auto j = std::size_t{}; j < size; j++) {
+					body.push_back((Utf8Char)(unsigned char)('a' + (i * 7 + j) % 26));
+				}
+				bodies.push_back(std::move(body));
+			}
+
+			auto pid = fork();
+			if (pid < 0) {
+				return t.eq(pid >= 0, true);
+			}
+
+			if (pid == 0) {
+				// 子プロセス: 名前で開き直して受け取り、すべて一致したら 0 で終わる。
+				auto child_memory = SharedRingPosixMemory::open(memory_name);
+				auto child_readable = std::shared_ptr<SharedRingPosixSignal>{ SharedRingPosixSignal::open(readable_name) };
+				auto child_writable = std::shared_ptr<SharedRingPosixSignal>{ SharedRingPosixSignal::open(writable_name) };
+				if (!child_memory || !child_readable || !child_writable) {
+					_exit(2);
+				}
+
+				auto reader_ring_opt = SharedRing::attach(child_memory->data(), child_memory->size());
+				if (!reader_ring_opt) {
+					_exit(3);
+				}
+
+				auto source = SharedRingSource{ *reader_ring_opt, SharedRingSignals{ child_readable, child_writable } };
+				auto framer = TransferProtocolFramer{};
+				auto buffer = std::vector<Utf8Char>(1000);
+				auto index = std::size_t{};
+
+				while (auto size = source.read(buffer.data(), buffer.size())) {
+					framer.push(Utf8StringView{ buffer.data(), size });
+
+					while (auto body_opt = framer.next()) {
+						if (index >= bodies.size() || *body_opt != bodies[index]) {
+							_exit(4);
+						}
+						index++;
+					}
+				}
+
+				_exit(index == bodies.size() ? 0 : 5);
+			}
+
+			// 親プロセス: 別スレッドで書き込んでから閉じる。
+			auto sink = SharedRingSink{ writer_ring, SharedRingSignals{ readable, writable } };
+			auto writer = std::thread{ [&] {
+				for (auto&& body : bodies) {
+					auto frame = Utf8String{ as_utf8(u8"Content-Length: ") };
+					frame += as_utf8(std::to_string(body.size()));
+					frame += as_utf8(u8"\r\n\r\n");
+					frame += body;
+					if (!sink.write(frame)) {
+						break;
+					}
+				}
+				sink.close();
+			} };
+
+			auto status = 0;
+			waitpid(pid, &status, 0);
+
+			// セマフォは子プロセスの終了を知らせないので、途中で終わっていたら閉じて書き込み側を起こす。
+			sink.close();
+			writer.join();
+
+			return t.eq(WIFEXITED(status), true)
+				&& t.eq(WEXITSTATUS(status), 0);
+		});
+#endif
+}
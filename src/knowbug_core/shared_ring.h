@@ -0,0 +1,279 @@
+//! 共有メモリー上のリングバッファー
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include "encoding.h"
+#include "message_receiver.h"
+#include "message_sender.h"
+
+class Tests;
+
+// 共有メモリーの先頭に置くヘッダー。
+//
+// 書き込み位置と読み取り位置は単調に増加する64ビットの通し番号で、容量で割った余りがバッファー上の位置になる。
+// 位置はそれぞれ片方のプロセスだけが書き換えるので、ロックは要らない。
+// プロセス間で共有するので、ポインターや OS 固有の型を含めてはいけない。
+class SharedRingHeader {
+public:
+	static constexpr auto MAGIC = std::uint32_t{ 0x4B425247 }; // "KBRG"
+
+	static constexpr auto CACHE_LINE_SIZE = std::size_t{ 64 };
+
+	std::uint32_t magic;
+
+	// データ部のバイト数 (2の累乗)
+	std::uint32_t capacity;
+
+	// どちらかの側が閉じたら 1
+	std::atomic<std::uint32_t> closed;
+
+	alignas(CACHE_LINE_SIZE) std::atomic<std::uint64_t> write_position;
+
+	alignas(CACHE_LINE_SIZE) std::atomic<std::uint64_t> read_position;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "shared ring requires lock-free 64-bit atomics");
+
+// 共有メモリー上の単一生産者・単一消費者のバイト列のリングバッファー。
+//
+// メモリー領域を所有しない。(領域の確保は Win32 のファイルマッピングや POSIX の shm_open などで行う。)
+// 書き込みと読み取りは、空いている分・溜まっている分だけ行ってすぐに返る。
+// 容量より大きなデータは、何回かに分けて流す。
+class SharedRing {
+	SharedRingHeader* header_;
+	Utf8Char* data_;
+	std::uint64_t mask_;
+
+	SharedRing(SharedRingHeader* header)
+		: header_(header)
+		, data_((Utf8Char*)(header + 1))
+		, mask_((std::uint64_t)header->capacity - 1)
+	{
+	}
+
+public:
+	// 容量 capacity (2の累乗) のリングバッファーに必要な領域のバイト数
+	static auto required_size(std::size_t capacity) -> std::size_t {
+		return sizeof(SharedRingHeader) + capacity;
+	}
+
+	// 領域を初期化して、容量 capacity (2の累乗) のリングバッファーを作る。
+	// 領域が小さすぎるときは nullopt を返す。
+	static auto create(void* memory, std::size_t memory_size, std::size_t capacity) -> std::optional<SharedRing>;
+
+	// 他のプロセスが作ったリングバッファーを開く。
+	static auto attach(void* memory, std::size_t memory_size) -> std::optional<SharedRing>;
+
+	auto capacity() const -> std::size_t {
+		return (std::size_t)header_->capacity;
+	}
+
+	// 読み取れるバイト数
+	auto readable_size() const -> std::size_t;
+
+	// 書き込めるだけ書き込んで、書き込んだバイト数を返す。(書き込み側から呼ぶ。)
+	auto write_some(Utf8StringView data) -> std::size_t;
+
+	// 読み取れるだけ読み取って、読み取ったバイト数を返す。(読み取り側から呼ぶ。)
+	auto read_some(Utf8Char* buffer, std::size_t buffer_size) -> std::size_t;
+
+	// リングバッファーを閉じる。(どちらの側から呼んでもよい。)
+	// 以降の書き込みは失敗し、読み取り側は残りのデータを読み終えた後に終端を知る。
+	void close();
+
+	auto is_closed() const -> bool;
+};
+
+// リングバッファーの相手側を起こすための通知。
+//
+// 自動リセットのイベントのように振る舞う。notify は待っている側を起こし、待っている側がいなければ次の wait がすぐに返る。
+// そのため、状態を確かめてから wait するまでの間に notify されても取りこぼさない。
+// (プロセス間では Win32 の名前付きイベントなどで実装する。)
+class SharedRingSignal {
+public:
+	virtual ~SharedRingSignal() {
+	}
+
+	virtual void notify() = 0;
+
+	// notify されるまで待つ。
+	// 相手側がいなくなって、もう notify されないときは false を返す。(例えば相手のプロセスが異常終了したとき。)
+	virtual auto wait() -> bool = 0;
+};
+
+// 同じプロセスの中で使う通知
+class SharedRingLocalSignal
+	: public SharedRingSignal
+{
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool signaled_;
+	bool abandoned_;
+
+public:
+	SharedRingLocalSignal()
+		: mutex_()
+		, cond_()
+		, signaled_(false)
+		, abandoned_(false)
+	{
+	}
+
+	void notify() override;
+
+	auto wait() -> bool override;
+
+	// 相手側がいなくなったことにする。以降の wait はすぐに false を返す。
+	void abandon();
+};
+
+// リングバッファー1つに付随する通知の組
+class SharedRingSignals {
+public:
+	// データが書き込まれたこと (書き込み側が通知し、読み取り側が待つ)
+	std::shared_ptr<SharedRingSignal> readable_;
+
+	// データが読み取られて空きができたこと (読み取り側が通知し、書き込み側が待つ)
+	std::shared_ptr<SharedRingSignal> writable_;
+
+	// 両方を通知して、待っている側をすべて起こす。(閉じたときに使う。)
+	void notify_all() const {
+		readable_->notify();
+		writable_->notify();
+	}
+};
+
+// リングバッファーにメッセージを書き込むもの。
+// リングバッファーが満杯なら、読み取り側から通知されるまで待つ。
+// 読み取り側がいなくなったら、リングバッファーを閉じて書き込みを失敗させる。
+class SharedRingSink
+	: public MessageSink
+{
+	SharedRing ring_;
+	SharedRingSignals signals_;
+
+public:
+	SharedRingSink(SharedRing ring, SharedRingSignals signals)
+		: ring_(ring)
+		, signals_(std::move(signals))
+	{
+	}
+
+	auto write(Utf8StringView data) -> bool override;
+
+	// リングバッファーを閉じて、待っている読み取り側を起こす。
+	void close();
+};
+
+// リングバッファーからメッセージを読み取るもの。
+// データがなければ、書き込まれるか閉じられるか cancel されるまで、通知を待ってブロックする。
+// 書き込み側がいなくなったら、リングバッファーを閉じて、残りのデータを読み終えた後に終わる。
+class SharedRingSource
+	: public MessageSource
+{
+	SharedRing ring_;
+	SharedRingSignals signals_;
+	std::atomic<bool> cancelled_;
+
+public:
+	SharedRingSource(SharedRing ring, SharedRingSignals signals)
+		: ring_(ring)
+		, signals_(std::move(signals))
+		, cancelled_(false)
+	{
+	}
+
+	auto read(Utf8Char* buffer, std::size_t buffer_size) -> std::size_t override;
+
+	void cancel() override {
+		cancelled_.store(true);
+		signals_.readable_->notify();
+	}
+};
+
+#ifndef _WIN32
+
+// POSIX の共有メモリーオブジェクト (shm_open) を対応付けた領域。
+// 作った側が破棄するときに名前を削除する。
+class SharedRingPosixMemory {
+	std::string name_;
+	void* data_;
+	std::size_t size_;
+	bool owner_;
+
+	SharedRingPosixMemory(std::string name, void* data, std::size_t size, bool owner)
+		: name_(std::move(name))
+		, data_(data)
+		, size_(size)
+		, owner_(owner)
+	{
+	}
+
+public:
+	// 名前 name ("/" で始まる) の共有メモリーオブジェクトを大きさ size で作る。失敗したら nullptr を返す。
+	static auto create(std::string name, std::size_t size) -> std::unique_ptr<SharedRingPosixMemory>;
+
+	// 他のプロセスが作った共有メモリーオブジェクトを開く。失敗したら nullptr を返す。
+	static auto open(std::string name) -> std::unique_ptr<SharedRingPosixMemory>;
+
+	~SharedRingPosixMemory();
+
+	SharedRingPosixMemory(SharedRingPosixMemory const& other) = delete;
+
+	auto operator=(SharedRingPosixMemory const& other) -> SharedRingPosixMemory& = delete;
+
+	auto data() const -> void* {
+		return data_;
+	}
+
+	auto size() const -> std::size_t {
+		return size_;
+	}
+};
+
+// POSIX の名前付きセマフォ (sem_open) による通知。
+// セマフォは notify の回数を数えるので、余分に起きることがある。(読み書きする側は状態を確かめ直すので問題ない。)
+// 相手のプロセスがいなくなったことは検知しない。
+class SharedRingPosixSignal
+	: public SharedRingSignal
+{
+	std::string name_;
+	void* semaphore_;
+	bool owner_;
+
+	SharedRingPosixSignal(std::string name, void* semaphore, bool owner)
+		: name_(std::move(name))
+		, semaphore_(semaphore)
+		, owner_(owner)
+	{
+	}
+
+public:
+	// 名前 name ("/" で始まる) のセマフォを作る。失敗したら nullptr を返す。
+	static auto create(std::string name) -> std::unique_ptr<SharedRingPosixSignal>;
+
+	// 他のプロセスが作ったセマフォを開く。失敗したら nullptr を返す。
+	static auto open(std::string name) -> std::unique_ptr<SharedRingPosixSignal>;
+
+	~SharedRingPosixSignal();
+
+	SharedRingPosixSignal(SharedRingPosixSignal const& other) = delete;
+
+	auto operator=(SharedRingPosixSignal const& other) -> SharedRingPosixSignal& = delete;
+
+	void notify() override;
+
+	auto wait() -> bool override;
+};
+
+#endif
+
+extern void shared_ring_tests(Tests& tests);
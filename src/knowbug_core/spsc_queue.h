@@ -0,0 +1,92 @@
+//! 単一生産者・単一消費者のキュー
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// 固定容量のリングバッファーによるロックフリーなキュー。
+//
+// push するスレッドと pop するスレッドはそれぞれ1つでなければいけない。
+// 書き込み位置と読み取り位置は別々のキャッシュラインに置き、それぞれ片方のスレッドだけが書き換える。
+template<typename T>
+class SpscQueue {
+	static constexpr auto CACHE_LINE_SIZE = std::size_t{ 64 };
+
+	std::vector<T> slots_;
+
+	// slots_.size() - 1 (容量は2の累乗)
+	std::size_t mask_;
+
+	// 次に pop する位置 (消費者が書き換える)
+	alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> head_;
+
+	// 次に push する位置 (生産者が書き換える)
+	alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> tail_;
+
+public:
+	// capacity は2の累乗に切り上げる。
+	explicit SpscQueue(std::size_t capacity)
+		: slots_(round_up_to_power_of_two(capacity))
+		, mask_(slots_.size() - 1)
+		, head_(0)
+		, tail_(0)
+	{
+	}
+
+	SpscQueue(SpscQueue const& other) = delete;
+
+	auto operator=(SpscQueue const& other) -> SpscQueue& = delete;
+
+	auto capacity() const -> std::size_t {
+		return slots_.size();
+	}
+
+	// キューに入っている要素の数。(他方のスレッドが操作中なら近似値になる。)
+	auto size() const -> std::size_t {
+		return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+	}
+
+	auto empty() const -> bool {
+		return size() == 0;
+	}
+
+	// 生産者スレッドから呼ぶ。満杯なら false を返し、value はそのまま残る。
+	auto try_push(T& value) -> bool {
+		auto tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) >= slots_.size()) {
+			return false;
+		}
+
+		slots_[tail & mask_] = std::move(value);
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// 消費者スレッドから呼ぶ。空なら false を返す。
+	auto try_pop(T& value) -> bool {
+		auto head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire)) {
+			return false;
+		}
+
+		value = std::move(slots_[head & mask_]);
+		slots_[head & mask_] = T{};
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	static auto round_up_to_power_of_two(std::size_t capacity) -> std::size_t {
+		assert(capacity >= 1);
+
+		auto n = std::size_t{ 1 };
+		while (n < capacity) {
+			n <<= 1;
+		}
+		return n;
+	}
+};
@@ -1,7 +1,9 @@
 #include "pch.h"
 #include <cassert>
+#include "hsp_line_table.h"
 #include "hsx.h"
 #include "step_controller.h"
+#include "test_suite.h"
 
 static auto step_mode_to_debug_mode(StepMode mode) -> int {
 	switch (mode) {
@@ -62,6 +64,11 @@ void KnowbugStepController::update(StepControl step_control) {
 		step_controller_.do_step_return(step_control.sublev());
 		break;
 
+	case StepControlKind::RunToLocation:
+		assert(step_control.goal_location_opt());
+		step_controller_.do_run_to_location(*step_control.goal_location_opt(), step_control.start_location_opt());
+		break;
+
 	default:
 		assert(false && u8"Unknown StepControlKind");
 		throw new std::exception{};
@@ -70,6 +77,24 @@ void KnowbugStepController::update(StepControl step_control) {
 	end_update();
 }
 
+auto KnowbugStepController::is_running_to_location() const -> bool {
+	return step_controller_.is_running_to_location();
+}
+
+void KnowbugStepController::update_location(std::optional<StepLocation> location) {
+	step_controller_.update_location(location);
+}
+
+void KnowbugStepController::set_trace(bool trace) {
+	step_controller_.set_trace(trace);
+}
+
+void KnowbugStepController::change_trace(bool trace) {
+	begin_update();
+	step_controller_.do_change_trace(trace);
+	end_update();
+}
+
 void KnowbugStepController::begin_update() {
 	step_controller_.update(ctx->sublev);
 }
@@ -79,3 +104,205 @@ void KnowbugStepController::end_update() {
 		hsx::debug_do_set_mode(step_mode_to_debug_mode(step_controller_.mode()), debug_);
 	}
 }
+
+auto step_location_from_line(std::optional<HspLineTableEntry> const& line_opt) -> std::optional<StepLocation> {
+	if (!line_opt) {
+		return std::nullopt;
+	}
+	return StepLocation{ line_opt->file_id(), line_opt->line_index() };
+}
+
+// -----------------------------------------------
+// テスト
+// -----------------------------------------------
+
+// 位置の列を順に与えて、それぞれの命令の後で実行を続けたかを記録する。
+static auto run_locations(StepController& controller, std::vector<std::optional<StepLocation>> const& locations) -> std::vector<bool> {
+	auto continued = std::vector<bool>{};
+	for (auto&& location : locations) {
+		controller.update(0);
+		controller.update_location(location);
+		continued.push_back(controller.continue_step_running());
+	}
+	return continued;
+}
+
+void step_controller_tests(Tests& tests) {
+	auto&& suite = tests.suite(u8"step_controller");
+
+	suite.test(
+		u8"指定した行に入ったら停止する",
+		[](TestCaseContext& t) {
+			auto controller = StepController{};
+			controller.do_run_to_location(StepLocation{ 0, 5 }, StepLocation{ 0, 1 });
+
+			auto mode = controller.mode();
+			auto continued = run_locations(controller, {
+				StepLocation{ 0, 2 },
+				StepLocation{ 1, 5 },
+				StepLocation{ 0, 5 },
+			});
+
+			return t.eq(mode == StepMode::StepIn, true)
+				&& t.eq(continued == std::vector<bool>{ true, true, false }, true)
+				&& t.eq(controller.is_running_to_location(), false);
+		});
+
+	suite.test(
+		u8"開始した行を指定したら、いったん出てから戻ったときに停止する",
+		[](TestCaseContext& t) {
+			auto controller = StepController{};
+			controller.do_run_to_location(StepLocation{ 0, 5 }, StepLocation{ 0, 5 });
+
+			auto continued = run_locations(controller, {
+				StepLocation{ 0, 5 },
+				StepLocation{ 0, 6 },
+				StepLocation{ 0, 7 },
+				StepLocation{ 0, 5 },
+			});
+
+			return t.eq(continued == std::vector<bool>{ true, true, true, false }, true);
+		});
+
+	suite.test(
+		u8"位置が分からない命令では停止しない",
+		[](TestCaseContext& t) {
+			auto controller = StepController{};
+			controller.do_run_to_location(StepLocation{ 2, 0 }, std::nullopt);
+
+			auto continued = run_locations(controller, {
+				std::nullopt,
+				StepLocation{ 2, 0 },
+			});
+
+			return t.eq(continued == std::vector<bool>{ true, false }, true);
+		});
+
+	suite.test(
+		u8"停止や他の操作をすると、条件付き実行は取り消される",
+		[](TestCaseContext& t) {
+			auto controller = StepController{};
+			controller.do_run_to_location(StepLocation{ 0, 5 }, StepLocation{ 0, 1 });
+			controller.do_stop();
+			auto stopped = !controller.is_running_to_location() && controller.mode() == StepMode::Stop;
+
+			// ステップオーバーの途中で停止してからステップインしたら、1命令で止まる。
+			controller.update(1);
+			controller.do_step_over();
+			controller.update(2);
+			auto over_continued = controller.continue_step_running();
+			controller.do_stop();
+			controller.do_step_in();
+			controller.update(2);
+			auto in_continued = controller.continue_step_running();
+
+			return t.eq(stopped, true)
+				&& t.eq(over_continued, true)
+				&& t.eq(in_continued, false);
+		});
+
+	suite.test(
+		u8"sublev が戻るまで実行を続ける",
+		[](TestCaseContext& t) {
+			auto controller = StepController{};
+			controller.update(1);
+			controller.do_step_over();
+
+			auto continued = std::vector<bool>{};
+			for (auto sublev : { 2, 3, 2, 1 }) {
+				controller.update(sublev);
+				continued.push_back(controller.continue_step_running());
+			}
+
+			controller.update(2);
+			controller.do_step_return(0);
+			controller.update(1);
+			auto return_continued = controller.continue_step_running();
+			controller.update(0);
+			auto return_stopped = !controller.continue_step_running();
+
+			// 最上位からの脱出は実行と同じ
+			controller.update(0);
+			controller.do_step_out();
+			auto out_runs = controller.mode() == StepMode::Run;
+
+			return t.eq(continued == std::vector<bool>{ true, true, true, false }, true)
+				&& t.eq(return_continued, true)
+				&& t.eq(return_stopped, true)
+				&& t.eq(out_runs, true);
+		});
+
+	suite.test(
+		u8"トレースモードでは実行の代わりにステップインを繰り返す",
+		[](TestCaseContext& t) {
+			auto controller = StepController{};
+			controller.set_trace(true);
+			controller.do_run();
+
+			auto mode = controller.mode();
+			controller.update(0);
+			auto continued = controller.continue_step_running();
+
+			controller.do_stop();
+			controller.update(0);
+			auto stopped = !controller.continue_step_running();
+
+			return t.eq(mode == StepMode::StepIn, true)
+				&& t.eq(continued, true)
+				&& t.eq(stopped, true);
+		});
+
+	suite.test(
+		u8"実行中にトレースモードを切り替えても、位置までの実行は続く",
+		[](TestCaseContext& t) {
+			auto controller = StepController{};
+			controller.do_run_to_location(StepLocation{ 0, 5 }, StepLocation{ 0, 1 });
+
+			controller.update(0);
+			controller.do_change_trace(true);
+			auto mode1 = controller.mode();
+			controller.do_change_trace(false);
+			auto mode2 = controller.mode();
+
+			auto continued = run_locations(controller, {
+				StepLocation{ 0, 2 },
+				StepLocation{ 0, 5 },
+			});
+
+			return t.eq(mode1 == StepMode::StepIn, true)
+				&& t.eq(mode2 == StepMode::StepIn, true)
+				&& t.eq(continued == std::vector<bool>{ true, false }, true);
+		});
+
+	suite.test(
+		u8"実行中にトレースモードを切り替えると、実行のモードが変わる",
+		[](TestCaseContext& t) {
+			auto controller = StepController{};
+			controller.do_run();
+
+			controller.update(0);
+			controller.do_change_trace(true);
+			auto traced_mode = controller.mode();
+			controller.update(0);
+			auto traced_continued = controller.continue_step_running();
+
+			controller.do_change_trace(false);
+			auto untraced_mode = controller.mode();
+
+			// ステップオーバーの途中なら、目標の sublev に戻るまで続く。
+			controller.update(1);
+			controller.do_step_over();
+			controller.update(2);
+			controller.do_change_trace(true);
+			controller.update(2);
+			auto over_continued = controller.continue_step_running();
+			controller.update(1);
+			auto over_stopped = !controller.continue_step_running();
+
+			return t.eq(traced_mode == StepMode::StepIn, true)
+				&& t.eq(traced_continued, true)
+				&& t.eq(untraced_mode == StepMode::Run, true)
+				&& t.eq(over_continued, true)
+				&& t.eq(over_stopped, true);
+		});
+}
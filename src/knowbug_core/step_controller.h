@@ -2,10 +2,13 @@
 
 #pragma once
 
+#include <cstddef>
 #include <optional>
 
 struct HSP3DEBUG;
+class HspLineTableEntry;
 class KnowbugStepController;
+class Tests;
 
 // 実行モードを表す。HSPDEBUG_RUN_* と同じ。
 enum class StepMode {
@@ -14,6 +17,35 @@ enum class StepMode {
 	StepIn,
 };
 
+// 実行位置 (ソースファイルの行) を表す。
+class StepLocation {
+	std::size_t file_id_;
+	std::size_t line_index_;
+
+public:
+	StepLocation(std::size_t file_id, std::size_t line_index)
+		: file_id_(file_id)
+		, line_index_(line_index)
+	{
+	}
+
+	auto file_id() const -> std::size_t {
+		return file_id_;
+	}
+
+	auto line_index() const -> std::size_t {
+		return line_index_;
+	}
+
+	auto operator==(StepLocation const& other) const -> bool {
+		return file_id_ == other.file_id_ && line_index_ == other.line_index_;
+	}
+
+	auto operator!=(StepLocation const& other) const -> bool {
+		return !(*this == other);
+	}
+};
+
 // ステップ実行の操作の種類を表す。
 enum class StepControlKind {
 	// (実行)
@@ -40,6 +72,10 @@ enum class StepControlKind {
 	// 「この呼び出しから脱出する」
 	// 指定したユーザー定義命令から return するまで実行して、停止する。
 	StepReturn,
+
+	// (カーソルの行まで実行)
+	// 指定した行に入るまで実行して、停止する。
+	RunToLocation,
 };
 
 // ステップ実行の操作を表す。
@@ -47,9 +83,15 @@ class StepControl {
 	StepControlKind kind_;
 	int sublev_;
 
+	// RunToLocation の目標の位置と、開始時の位置
+	std::optional<StepLocation> goal_location_opt_;
+	std::optional<StepLocation> start_location_opt_;
+
 	StepControl(StepControlKind kind, int sublev)
 		: kind_(kind)
 		, sublev_(sublev)
+		, goal_location_opt_()
+		, start_location_opt_()
 	{
 	}
 
@@ -78,6 +120,14 @@ public:
 		return StepControl{ StepControlKind::StepReturn, sublev };
 	}
 
+	// start: 現在の位置 (開始時にいる行で停止しないために使う)
+	static auto new_run_to_location(StepLocation goal, std::optional<StepLocation> start) -> StepControl {
+		auto step_control = StepControl{ StepControlKind::RunToLocation, 0 };
+		step_control.goal_location_opt_ = goal;
+		step_control.start_location_opt_ = start;
+		return step_control;
+	}
+
 	auto kind() const -> StepControlKind {
 		return kind_;
 	}
@@ -85,6 +135,14 @@ public:
 	auto sublev() const -> int {
 		return sublev_;
 	}
+
+	auto goal_location_opt() const -> std::optional<StepLocation> const& {
+		return goal_location_opt_;
+	}
+
+	auto start_location_opt() const -> std::optional<StepLocation> const& {
+		return start_location_opt_;
+	}
 };
 
 // ステップ操作を受け取ってステップ実行モードを制御する機能を担当する。
@@ -92,19 +150,38 @@ class StepController {
 	// 条件付き実行の終了条件となる sublev
 	std::optional<int> goal_sublev_opt_;
 
+	// 条件付き実行の終了条件となる位置
+	std::optional<StepLocation> goal_location_opt_;
+
 	// 現在のサブルーチンレベル
 	int current_sublev_;
 
+	// 現在の位置と、前回の判定時の位置 (位置まで実行している間だけ更新される)
+	std::optional<StepLocation> current_location_opt_;
+	std::optional<StepLocation> last_location_opt_;
+
 	// 現在の実行モード
 	StepMode mode_;
 	bool mode_dirty_;
 
+	// トレースモード: 命令ごとに停止の通知を受け取るために、実行の代わりに stepin を繰り返す。
+	// (行ブレークポイントかデータブレークポイントがあるとき、行カバレッジか実行トレースを記録しているときに使う。)
+	bool trace_;
+
+	// トレースモードで「実行」しているか
+	bool tracing_run_;
+
 public:
 	StepController()
 		: goal_sublev_opt_()
+		, goal_location_opt_()
 		, current_sublev_(0)
+		, current_location_opt_()
+		, last_location_opt_()
 		, mode_(StepMode::Run)
 		, mode_dirty_(false)
+		, trace_(false)
+		, tracing_run_(false)
 	{
 	}
 
@@ -113,23 +190,62 @@ public:
 		mode_dirty_ = false;
 	}
 
+	// 現在の位置を更新する。(位置まで実行している間、命令ごとに呼ばれる。)
+	void update_location(std::optional<StepLocation> location) {
+		current_location_opt_ = location;
+	}
+
 	auto mode() const -> StepMode {
 		return mode_;
 	}
 
+	auto is_running_to_location() const -> bool {
+		return goal_location_opt_.has_value();
+	}
+
 	auto is_mode_changed() const -> bool {
 		return mode_dirty_;
 	}
 
+	auto is_trace() const -> bool {
+		return trace_;
+	}
+
+	// トレースモードを切り替える。(次の「実行」から有効になる。)
+	void set_trace(bool trace) {
+		trace_ = trace;
+	}
+
+	// 実行中にトレースモードを切り替える。
+	// 条件付き実行 (ステップオーバーや位置までの実行など) の目標は保ったまま、「実行」しているときだけ実行モードを切り替える。
+	void do_change_trace(bool trace) {
+		trace_ = trace;
+
+		if (goal_sublev_opt_ || goal_location_opt_) {
+			return;
+		}
+
+		if (mode_ == StepMode::Run || tracing_run_) {
+			tracing_run_ = trace;
+			set_step_mode(trace ? StepMode::StepIn : StepMode::Run);
+		}
+	}
+
 	void do_stop() {
+		clear_goals();
+		tracing_run_ = false;
 		set_step_mode(StepMode::Stop);
 	}
 
 	void do_run() {
-		set_step_mode(StepMode::Run);
+		clear_goals();
+		tracing_run_ = trace_;
+		set_step_mode(trace_ ? StepMode::StepIn : StepMode::Run);
 	}
 
 	void do_step_in() {
+		clear_goals();
+		tracing_run_ = false;
 		set_step_mode(StepMode::StepIn);
 	}
 
@@ -145,7 +261,20 @@ public:
 	void do_step_return(int sublev) {
 		if (sublev < 0) return do_run();
 
+		clear_goals();
 		goal_sublev_opt_ = sublev;
+		tracing_run_ = false;
+		set_step_mode(StepMode::StepIn);
+	}
+
+	// 別の行から goal の行に入るまで step を繰り返す
+	// (start の行が goal なら、いったんその行を出てから再び入ったときに止まる。)
+	void do_run_to_location(StepLocation goal, std::optional<StepLocation> start) {
+		clear_goals();
+		goal_location_opt_ = goal;
+		current_location_opt_ = start;
+		last_location_opt_ = start;
+		tracing_run_ = false;
 		set_step_mode(StepMode::StepIn);
 	}
 
@@ -160,10 +289,31 @@ public:
 				goal_sublev_opt_ = std::nullopt;
 			}
 		}
+
+		if (goal_location_opt_) {
+			auto entered = current_location_opt_ == goal_location_opt_ && last_location_opt_ != current_location_opt_;
+			last_location_opt_ = current_location_opt_;
+
+			if (!entered) {
+				set_step_mode(StepMode::StepIn); // stepin を繰り返す
+				return true;
+			}
+			goal_location_opt_ = std::nullopt;
+		}
+
+		if (tracing_run_) {
+			set_step_mode(StepMode::StepIn);
+			return true;
+		}
 		return false;
 	}
 
 private:
+	void clear_goals() {
+		goal_sublev_opt_ = std::nullopt;
+		goal_location_opt_ = std::nullopt;
+	}
+
 	void set_step_mode(StepMode mode) {
 		mode_ = mode;
 		mode_dirty_ = true;
@@ -182,7 +332,23 @@ public:
 
 	void update(StepControl step_control);
 
+	auto is_running_to_location() const -> bool;
+
+	// 現在の位置を知らせる。(位置まで実行している間、命令ごとに呼ぶ。)
+	void update_location(std::optional<StepLocation> location);
+
+	// トレースモードを切り替える。(次の「実行」から有効になる。)
+	void set_trace(bool trace);
+
+	// 実行中にトレースモードを切り替える。(ステップ実行の目標は保つ。)
+	void change_trace(bool trace);
+
 private:
 	void begin_update();
 	void end_update();
 };
+
+// 対応表の項目から行の位置を取り出す。
+extern auto step_location_from_line(std::optional<HspLineTableEntry> const& line_opt) -> std::optional<StepLocation>;
+
+extern void step_controller_tests(Tests& tests);
@@ -1,7 +1,13 @@
 #include "pch.h"
+#include <array>
+#include <chrono>
 #include "encoding.h"
 #include "knowbug_protocol.h"
 #include "test_suite.h"
+#include "transfer_protocol.h"
+
+// 読み終わった部分がこの大きさを超えて、かつバッファーの半分以上を占めるときに、バッファーを詰める。
+static constexpr auto COMPACT_THRESHOLD = std::size_t{ 64 * 1024 };
 
 static auto char_is_space(Utf8Char c) -> bool {
 	return c == Utf8Char{ u8' ' } || c == Utf8Char{ u8'\t' };
@@ -23,6 +29,233 @@ static auto skip_others(Utf8StringView str, std::size_t start_index, Utf8Char c)
 	return i;
 }
 
+static auto parse_content_length(Utf8StringView str) -> std::optional<std::size_t> {
+	auto value = std::size_t{};
+	auto i = std::size_t{};
+
+	while (i < str.size() && Utf8Char{ u8'0' } <= str[i] && str[i] <= Utf8Char{ u8'9' }) {
+		value = value * 10 + (std::size_t)((char)str[i] - u8'0');
+		i++;
+	}
+
+	if (i == 0) {
+		return std::nullopt;
+	}
+	return value;
+}
+
+// Chunk ヘッダーの値 (空白区切りの3つの整数) を解析する。
+static auto parse_chunk(Utf8StringView str) -> std::optional<TransferProtocolChunk> {
+	auto values = std::array<std::size_t, 3>{};
+	auto i = std::size_t{};
+
+	for (auto&& value : values) {
+		i = skip_spaces(str, i);
+
+		auto start = i;
+		while (i < str.size() && Utf8Char{ u8'0' } <= str[i] && str[i] <= Utf8Char{ u8'9' }) {
+			i++;
+		}
+
+		auto value_opt = parse_content_length(str.substr(start, i - start));
+		if (!value_opt) {
+			return std::nullopt;
+		}
+		value = *value_opt;
+	}
+
+	if (values[1] > values[2]) {
+		return std::nullopt;
+	}
+	return TransferProtocolChunk{ (std::uint64_t)values[0], values[1], values[2] };
+}
+
+// -----------------------------------------------
+// TransferProtocolFramer
+// -----------------------------------------------
+
+TransferProtocolFramer::TransferProtocolFramer()
+	: buffer_()
+	, read_()
+	, line_start_()
+	, line_search_()
+	, content_length_opt_()
+	, body_start_opt_()
+	, chunk_opt_()
+	, last_chunk_opt_()
+{
+}
+
+void TransferProtocolFramer::push(Utf8StringView chunk) {
+	compact();
+	buffer_ += chunk;
+}
+
+auto TransferProtocolFramer::next() -> std::optional<Utf8StringView> {
+	while (!body_start_opt_) {
+		auto line_end = buffer_.find(Utf8Char{ u8'\n' }, line_search_);
+		if (line_end == Utf8String::npos) {
+			// 行の途中までしかデータが来ていないとき
+			line_search_ = buffer_.size();
+			return std::nullopt;
+		}
+
+		auto line = Utf8StringView{ buffer_.data() + line_start_, line_end - line_start_ };
+		line_start_ = line_end + 1;
+		line_search_ = line_start_;
+
+		if (!line.empty() && line.back() == Utf8Char{ u8'\r' }) {
+			line.remove_suffix(1);
+		}
+
+		auto key_start = skip_spaces(line, 0);
+
+		// ボディー直前の空行のとき
+		if (key_start == line.size()) {
+			if (!content_length_opt_) {
+				// Content-Length がないとき
+				assert(false && u8"missing Content-Length");
+				reset_message();
+				read_ = line_start_;
+				continue;
+			}
+
+			body_start_opt_ = line_start_;
+			break;
+		}
+
+		auto key_end = skip_others(line, key_start, Utf8Char{ u8':' });
+		if (key_end == line.size()) {
+			assert(false && u8"missing : in header");
+			continue;
+		}
+
+		auto value_start = skip_spaces(line, key_end + 1);
+
+		// ヘッダーを解釈する。
+		auto header_key = line.substr(key_start, key_end - key_start);
+		auto header_value = line.substr(value_start);
+
+		if (header_key == as_utf8("Content-Length")) {
+			content_length_opt_ = parse_content_length(header_value);
+			continue;
+		}
+
+		if (header_key == as_utf8("Chunk")) {
+			chunk_opt_ = parse_chunk(header_value);
+			assert(chunk_opt_ && u8"bad Chunk header");
+			continue;
+		}
+
+		// 不明なヘッダーを無視する。
+	}
+
+	auto body_start = *body_start_opt_;
+	auto content_length = *content_length_opt_;
+
+	if (buffer_.size() - body_start < content_length) {
+		// ボディーの途中までしかデータが来ていないとき
+		return std::nullopt;
+	}
+
+	auto body = Utf8StringView{ buffer_.data() + body_start, content_length };
+
+	read_ = body_start + content_length;
+	last_chunk_opt_ = chunk_opt_;
+	reset_message();
+	return body;
+}
+
+void TransferProtocolFramer::compact() {
+	if (read_ == 0) {
+		return;
+	}
+
+	// すべて読み終わっているなら、単に空にする。
+	if (read_ == buffer_.size()) {
+		buffer_.clear();
+		read_ = 0;
+		line_start_ = 0;
+		line_search_ = 0;
+		return;
+	}
+
+	if (read_ < COMPACT_THRESHOLD || read_ * 2 < buffer_.size()) {
+		return;
+	}
+
+	buffer_.erase(0, read_);
+	line_start_ -= read_;
+	line_search_ -= read_;
+	if (body_start_opt_) {
+		*body_start_opt_ -= read_;
+	}
+	read_ = 0;
+}
+
+void TransferProtocolFramer::reset_message() {
+	line_start_ = std::max(line_start_, read_);
+	line_search_ = line_start_;
+	content_length_opt_ = std::nullopt;
+	body_start_opt_ = std::nullopt;
+	chunk_opt_ = std::nullopt;
+}
+
+// -----------------------------------------------
+// TransferProtocolReassembler
+// -----------------------------------------------
+
+TransferProtocolReassembler::TransferProtocolReassembler()
+	: streams_()
+{
+}
+
+auto TransferProtocolReassembler::push(TransferProtocolChunk const& chunk, Utf8StringView data) -> std::optional<Utf8String> {
+	auto iter = streams_.find(chunk.stream_id());
+	if (iter == streams_.end()) {
+		if (chunk.offset() != 0) {
+			assert(false && u8"missing first chunk");
+			return std::nullopt;
+		}
+
+		iter = streams_.emplace(chunk.stream_id(), Stream{ chunk.total_length(), Utf8String{} }).first;
+		iter->second.body.reserve(chunk.total_length());
+	}
+
+	auto&& body = iter->second.body;
+	if (chunk.total_length() != iter->second.total_length
+		|| chunk.offset() != body.size()
+		|| chunk.total_length() - chunk.offset() < data.size()
+		) {
+		assert(false && u8"bad chunk");
+		streams_.erase(iter);
+		return std::nullopt;
+	}
+
+	body += data;
+
+	if (body.size() < chunk.total_length()) {
+		return std::nullopt;
+	}
+
+	auto complete = std::move(body);
+	streams_.erase(iter);
+	return complete;
+}
+
+void transfer_protocol_write_chunk(Utf8String& output, TransferProtocolChunk const& chunk, Utf8StringView data) {
+	output += as_utf8(u8"Content-Length: ");
+	output += as_utf8(std::to_string(data.size()));
+	output += as_utf8(u8"\r\nChunk: ");
+	output += as_utf8(std::to_string(chunk.stream_id()));
+	output += Utf8Char{ u8' ' };
+	output += as_utf8(std::to_string(chunk.offset()));
+	output += Utf8Char{ u8' ' };
+	output += as_utf8(std::to_string(chunk.total_length()));
+	output += as_utf8(u8"\r\n\r\n");
+	output += data;
+}
+
 auto transfer_protocol_parse(Utf8String& body, Utf8String& buffer) -> bool {
 	auto index = std::size_t{};
 	auto content_length_opt = std::optional<std::size_t>{};
@@ -159,4 +392,216 @@ void transfer_protocol_tests(Tests& tests) {
 				&& t.eq(body, as_utf8(u8"Good bye!\r\n"))
 				&& t.eq(buffer.empty(), true);
 		});
+
+	suite.test(
+		u8"TransferProtocolFramer: 1バイトずつ届くケース",
+		[](TestCaseContext& t) {
+			auto data = Utf8StringView{ as_utf8(u8"Content-Length: 15\r\n\r\nHello, world!\r\nContent-Length: 11\r\n\r\nGood bye!\r\n") };
+			auto framer = TransferProtocolFramer{};
+			auto bodies = std::vector<Utf8String>{};
+
+			for (auto&& c : data) {
+				framer.push(Utf8StringView{ &c, 1 });
+
+				while (auto body_opt = framer.next()) {
+					bodies.emplace_back(*body_opt);
+				}
+			}
+
+			return t.eq(bodies.size(), 2)
+				&& t.eq(bodies[0], as_utf8(u8"Hello, world!\r\n"))
+				&& t.eq(bodies[1], as_utf8(u8"Good bye!\r\n"))
+				&& t.eq(framer.pending_size(), 0);
+		});
+
+	suite.test(
+		u8"TransferProtocolFramer: 不明なヘッダーを無視する",
+		[](TestCaseContext& t) {
+			auto framer = TransferProtocolFramer{};
+			framer.push(as_utf8(u8"X-Foo: bar\r\n  Content-Length:3\r\n\r\nabcContent-Length: 0\r\n\r\n"));
+
+			auto first_opt = framer.next();
+			if (!t.eq(first_opt.has_value(), true) || !t.eq(*first_opt, as_utf8(u8"abc"))) {
+				return false;
+			}
+
+			auto second_opt = framer.next();
+			return t.eq(second_opt.has_value(), true)
+				&& t.eq(second_opt->empty(), true)
+				&& t.eq(framer.next().has_value(), false);
+		});
+
+	suite.test(
+		u8"TransferProtocolFramer: Chunk ヘッダーを読む",
+		[](TestCaseContext& t) {
+			auto data = Utf8String{};
+			transfer_protocol_write_chunk(data, TransferProtocolChunk{ 7, 3, 10 }, as_utf8(u8"defg"));
+			data += as_utf8(u8"Content-Length: 2\r\n\r\nok");
+
+			auto framer = TransferProtocolFramer{};
+			framer.push(data);
+
+			auto first_opt = framer.next();
+			auto first_chunk_opt = framer.last_chunk();
+			auto second_opt = framer.next();
+			auto second_chunk_opt = framer.last_chunk();
+
+			return t.eq(first_opt.has_value(), true)
+				&& t.eq(*first_opt, as_utf8(u8"defg"))
+				&& t.eq(first_chunk_opt.has_value(), true)
+				&& t.eq(first_chunk_opt->stream_id(), 7)
+				&& t.eq(first_chunk_opt->offset(), 3)
+				&& t.eq(first_chunk_opt->total_length(), 10)
+				&& t.eq(second_opt.has_value(), true)
+				&& t.eq(*second_opt, as_utf8(u8"ok"))
+				&& t.eq(second_chunk_opt.has_value(), false);
+		});
+
+	suite.test(
+		u8"TransferProtocolReassembler: 小さなメッセージを挟みながら大きなメッセージを組み立てる",
+		[](TestCaseContext& t) {
+			static constexpr auto LARGE_SIZE = std::size_t{ 10 * 1024 * 1024 };
+			static constexpr auto CHUNK_SIZE = std::size_t{ 64 * 1024 };
+			static constexpr auto READ_SIZE = std::size_t{ 4096 };
+
+			auto large_body = Utf8String{};
+			large_body.reserve(LARGE_SIZE);
+			for (auto i = std::size_t{}; i < LARGE_SIZE; i++) {
+				large_body.push_back((Utf8Char)(unsigned char)('a' + i % 26));
+			}
+			auto medium_body = Utf8String(LARGE_SIZE / 8, Utf8Char{ u8'm' });
+
+			// 2つの大きなメッセージの断片を交互に並べ、断片ごとに小さなメッセージを挟む。
+			auto data = Utf8String{};
+			auto small_count = std::size_t{};
+			auto write_chunk = [&](std::uint64_t stream_id, Utf8StringView body, std::size_t offset) {
+				if (offset >= body.size()) {
+					return;
+				}
+
+				auto chunk = TransferProtocolChunk{ stream_id, offset, body.size() };
+				transfer_protocol_write_chunk(data, chunk, body.substr(offset, CHUNK_SIZE));
+
+				data += as_utf8(u8"Content-Length: 5\r\n\r\nsmall");
+				small_count++;
+			};
+			for (auto offset = std::size_t{}; offset < LARGE_SIZE; offset += CHUNK_SIZE) {
+				write_chunk(1, large_body, offset);
+				write_chunk(2, medium_body, offset);
+			}
+
+			auto start = std::chrono::steady_clock::now();
+
+			auto framer = TransferProtocolFramer{};
+			auto reassembler = TransferProtocolReassembler{};
+			auto bodies = std::vector<Utf8String>{};
+			auto small_received = std::size_t{};
+			auto large_index = std::size_t{};
+			auto max_small_gap = std::size_t{};
+			auto small_gap = std::size_t{};
+
+			for (auto i = std::size_t{}; i < data.size(); i += READ_SIZE) {
+				framer.push(Utf8StringView{ data }.substr(i, READ_SIZE));
+
+				while (auto body_opt = framer.next()) {
+					auto&& chunk_opt = framer.last_chunk();
+					if (!chunk_opt) {
+						small_received++;
+						max_small_gap = std::max(max_small_gap, small_gap);
+						small_gap = 0;
+						continue;
+					}
+
+					// 小さなメッセージが届かずに読んだデータの量を数える。
+					small_gap += body_opt->size();
+
+					if (auto complete_opt = reassembler.push(*chunk_opt, *body_opt)) {
+						if (chunk_opt->stream_id() == 1) {
+							large_index = bodies.size();
+						}
+						bodies.push_back(std::move(*complete_opt));
+					}
+				}
+			}
+
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			auto sec = std::chrono::duration<double>(elapsed).count();
+			t.output()
+				<< u8"    " << data.size() / (1024 * 1024) << u8" MiB"
+				<< u8", " << (int)(sec > 0 ? (double)data.size() / sec / (1024 * 1024) : 0.0) << u8" MB/s" << std::endl;
+
+			return t.eq(bodies.size(), 2)
+				&& t.eq(bodies[large_index] == large_body, true)
+				&& t.eq(bodies[1 - large_index] == medium_body, true)
+				&& t.eq(small_received, small_count)
+				&& t.eq(max_small_gap <= CHUNK_SIZE * 2, true)
+				&& t.eq(reassembler.pending_count(), 0)
+				&& t.eq(framer.pending_size(), 0);
+		});
+
+	suite.test(
+		u8"ベンチマーク: TransferProtocolFramer",
+		[](TestCaseContext& t) {
+			static constexpr auto MESSAGE_COUNT = std::size_t{ 1024 };
+			static constexpr auto BODY_SIZE = std::size_t{ 1000 };
+
+			auto message = Utf8String{ as_utf8(u8"Content-Length: ") };
+			message += as_utf8(std::to_string(BODY_SIZE));
+			message += as_utf8(u8"\r\n\r\n");
+			message += Utf8String(BODY_SIZE, Utf8Char{ u8'x' });
+
+			auto data = Utf8String{};
+			for (auto i = std::size_t{}; i < MESSAGE_COUNT; i++) {
+				data += message;
+			}
+
+			auto to_mb_per_sec = [&](std::chrono::steady_clock::duration elapsed) {
+				auto sec = std::chrono::duration<double>(elapsed).count();
+				return sec > 0 ? (double)data.size() / sec / (1024 * 1024) : 0.0;
+			};
+
+			auto success = true;
+
+			for (auto chunk_size : { std::size_t{ 1 }, std::size_t{ 4 * 1024 }, std::size_t{ 1024 * 1024 } }) {
+				// 以前の方法: バッファーに連結して transfer_protocol_parse を呼ぶ。
+				auto old_count = std::size_t{};
+				auto old_start = std::chrono::steady_clock::now();
+				{
+					auto buffer = Utf8String{};
+					auto body = Utf8String{};
+					for (auto i = std::size_t{}; i < data.size(); i += chunk_size) {
+						buffer += Utf8StringView{ data }.substr(i, chunk_size);
+
+						while (transfer_protocol_parse(body, buffer)) {
+							old_count++;
+						}
+					}
+				}
+				auto old_elapsed = std::chrono::steady_clock::now() - old_start;
+
+				auto new_count = std::size_t{};
+				auto new_start = std::chrono::steady_clock::now();
+				{
+					auto framer = TransferProtocolFramer{};
+					for (auto i = std::size_t{}; i < data.size(); i += chunk_size) {
+						framer.push(Utf8StringView{ data }.substr(i, chunk_size));
+
+						while (framer.next()) {
+							new_count++;
+						}
+					}
+				}
+				auto new_elapsed = std::chrono::steady_clock::now() - new_start;
+
+				t.output()
+					<< u8"    チャンク " << chunk_size << u8" バイト"
+					<< u8": 以前の方法 " << (int)to_mb_per_sec(old_elapsed) << u8" MB/s"
+					<< u8" / TransferProtocolFramer " << (int)to_mb_per_sec(new_elapsed) << u8" MB/s" << std::endl;
+
+				success = success
+					&& t.eq(old_count, MESSAGE_COUNT)
+					&& t.eq(new_count, MESSAGE_COUNT);
+			}
+			return success;
+		});
 }
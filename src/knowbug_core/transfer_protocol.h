@@ -2,10 +2,133 @@
 
 #pragma once
 
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
 #include "encoding.h"
 
 class Tests;
 
+// 分割されたメッセージの断片であることを表すヘッダー (Chunk: <stream_id> <offset> <total_length>) の内容。
+//
+// 大きなメッセージは、ボディー部を先頭から順に区切って、それぞれを1つのメッセージとして送る。
+// 同じメッセージの断片は同じ stream_id を持ち、offset の順に届く。
+// 異なるメッセージの断片や、分割されていないメッセージが間に挟まってもよい。
+class TransferProtocolChunk {
+	std::uint64_t stream_id_;
+
+	// この断片がボディー部全体のどこから始まるか
+	std::size_t offset_;
+
+	// ボディー部全体の大きさ
+	std::size_t total_length_;
+
+public:
+	TransferProtocolChunk(std::uint64_t stream_id, std::size_t offset, std::size_t total_length)
+		: stream_id_(stream_id)
+		, offset_(offset)
+		, total_length_(total_length)
+	{
+	}
+
+	auto stream_id() const -> std::uint64_t {
+		return stream_id_;
+	}
+
+	auto offset() const -> std::size_t {
+		return offset_;
+	}
+
+	auto total_length() const -> std::size_t {
+		return total_length_;
+	}
+};
+
+// 受信したデータからメッセージを順番に取り出すもの。
+//
+// 読み取り位置を持ち、取り出したメッセージの分だけ位置を進める。
+// バッファーを詰める処理は、読み終わった部分が十分に大きくなったときにだけ行う。
+// ヘッダーの解析は行単位で中断・再開できるので、データが少しずつ届いても先頭から解析し直さない。
+class TransferProtocolFramer {
+	Utf8String buffer_;
+
+	// 次のメッセージの開始位置
+	std::size_t read_;
+
+	// 解析中のヘッダー行の開始位置
+	std::size_t line_start_;
+
+	// 改行文字を探す位置 (解析中の行のうち、改行がないと分かっている部分の後ろ)
+	std::size_t line_search_;
+
+	std::optional<std::size_t> content_length_opt_;
+
+	// ボディー部の開始位置 (ヘッダーを読み終わっているとき)
+	std::optional<std::size_t> body_start_opt_;
+
+	// 解析中のメッセージの Chunk ヘッダー
+	std::optional<TransferProtocolChunk> chunk_opt_;
+
+	// 最後に取り出したメッセージの Chunk ヘッダー
+	std::optional<TransferProtocolChunk> last_chunk_opt_;
+
+public:
+	TransferProtocolFramer();
+
+	// 受信したデータを追加する。
+	// 注意: 以前に next で取り出したボディーへの参照は無効になる。
+	void push(Utf8StringView chunk);
+
+	// 次のメッセージのボディー部を取り出す。まだ届いていなければ nullopt を返す。
+	// 返される参照は、次に push を呼ぶまで有効。
+	auto next() -> std::optional<Utf8StringView>;
+
+	// 最後に next で取り出したメッセージが断片なら、その Chunk ヘッダーを返す。
+	auto last_chunk() const -> std::optional<TransferProtocolChunk> const& {
+		return last_chunk_opt_;
+	}
+
+	// 取り出されていないデータの大きさ
+	auto pending_size() const -> std::size_t {
+		return buffer_.size() - read_;
+	}
+
+private:
+	void compact();
+
+	void reset_message();
+};
+
+// 断片からメッセージのボディー部を組み立てるもの。
+//
+// 最初の断片が届いた時点でボディー部全体の大きさの領域を確保して、以降の断片はその後ろに書き足す。
+// (断片ごとに文字列を連結し直すことはしない。)
+class TransferProtocolReassembler {
+	class Stream {
+	public:
+		std::size_t total_length;
+		Utf8String body;
+	};
+
+	// 組み立て中のメッセージ (stream_id ごと)
+	std::unordered_map<std::uint64_t, Stream> streams_;
+
+public:
+	TransferProtocolReassembler();
+
+	// 断片を追加する。ボディー部が揃ったら、それを返す。
+	// 順番が飛んでいたり、大きさが合わない断片を受け取ったら、そのメッセージ全体を捨てる。
+	auto push(TransferProtocolChunk const& chunk, Utf8StringView data) -> std::optional<Utf8String>;
+
+	// 組み立て中のメッセージの数
+	auto pending_count() const -> std::size_t {
+		return streams_.size();
+	}
+};
+
+// メッセージの断片を書き込む。
+extern void transfer_protocol_write_chunk(Utf8String& output, TransferProtocolChunk const& chunk, Utf8StringView data);
+
 // バッファーからメッセージを取り出す。
 // 取り出したら true を返し、バッファーからメッセージを取り除き、ボディー部分を body にコピーする。
 extern auto transfer_protocol_parse(Utf8String& body, Utf8String& buffer) -> bool;
@@ -1,9 +1,12 @@
 
 #include "pch.h"
+#include <chrono>
 #include <fstream>
+#include <sstream>
 #include "../hspsdk/hsp3plugin.h"
 #include "../knowbug_core/encoding.h"
 #include "../knowbug_core/hsp_object_path.h"
+#include "../knowbug_core/hsp_object_path_table.h"
 #include "../knowbug_core/hsp_object_writer.h"
 #include "../knowbug_core/hsp_objects.h"
 #include "../knowbug_core/hsp_wrap_call.h"
@@ -48,6 +51,21 @@ static auto get_hsp_dir() -> OsString {
 	return full_path;
 }
 
+// カレントディレクトリの絶対パス (末尾は区切り文字)
+static auto get_current_dir() -> OsString {
+	auto buffer = std::array<TCHAR, MAX_PATH>{};
+	auto len = GetCurrentDirectory((DWORD)buffer.size(), buffer.data());
+	if (len == 0 || len >= buffer.size()) {
+		return OsString{};
+	}
+
+	auto dir = OsString{ buffer.data() };
+	if (dir.back() != TEXT('/') && dir.back() != TEXT('\\')) {
+		dir += TEXT('\\');
+	}
+	return dir;
+}
+
 class KnowbugAppImpl
 	: public KnowbugApp
 {
@@ -57,6 +75,13 @@ class KnowbugAppImpl
 	std::unique_ptr<HspObjects> objects_;
 	std::shared_ptr<KnowbugServer> server_;
 
+	// ブレークポイントの判定をした回数と、かかった時間の合計 (デバッグビルドでだけ測る)
+	std::uint64_t break_check_count_;
+	std::chrono::steady_clock::duration break_check_time_;
+
+	// スクリプトのあるディレクトリ (起動時のカレントディレクトリ。行カバレッジの出力先)
+	OsString script_dir_;
+
 public:
 	KnowbugAppImpl(
 		std::unique_ptr<KnowbugStepController> step_controller,
@@ -65,6 +90,9 @@ public:
 		: step_controller_(std::move(step_controller))
 		, objects_(std::move(objects))
 		, server_(KnowbugServer::create(*g_debug_opt, this->objects(), g_dll_instance, *step_controller_))
+		, break_check_count_()
+		, break_check_time_()
+		, script_dir_(get_current_dir())
 	{
 	}
 
@@ -83,18 +111,88 @@ public:
 	}
 
 	void will_exit() {
+		// ランタイムが終了する前に、実行位置を読むスレッドを止める。
+		objects().sampler_do_stop();
+
 		server().will_exit();
+
+		if (objects().coverage_is_running()) {
+			write_coverage();
+		}
+
+		if (objects().execution_trace_is_running()) {
+#if _DEBUG
+			auto count = objects().execution_trace_to_record_count();
+#endif
+			objects().execution_trace_do_stop();
+
+			auto text = Utf8String{ as_utf8(u8"knowbug: execution trace: ") };
+			text += to_utf8(execution_trace_file_path());
+			text += as_utf8(u8"\n");
+			OutputDebugString(to_os(text).data());
+
+#if _DEBUG
+			auto stats_text = std::stringstream{};
+			stats_text << u8"knowbug: execution trace: " << count << u8" statements\n";
+			OutputDebugString(to_os(as_utf8(stats_text.str())).data());
+#endif
+		}
+
+#if _DEBUG
+		if (break_check_count_ != 0) {
+			auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(break_check_time_).count();
+			auto text = std::stringstream{};
+			text << u8"knowbug: break check: " << break_check_count_ << u8" steps, " << ns / break_check_count_ << u8" ns/step\n";
+			OutputDebugString(to_os(as_utf8(text.str())).data());
+		}
+#endif
 	}
 
 	void did_hsp_pause() {
+		// トレースモードでは命令ごとに呼ばれるので、実行した行を記録する。
+		if (objects().coverage_is_running()) {
+			objects().coverage_record();
+		}
+
+		if (objects().execution_trace_is_running()) {
+			objects().execution_trace_record();
+		}
+
+		// ブレークポイントがあれば、命令ごとに停止するか判定する。(命令ごとに実行されるので、デバッグビルドではかかる時間を測っておく。)
+		if (!objects().breakpoint_is_empty() || !objects().data_watch_is_empty()) {
+#if _DEBUG
+			auto start = std::chrono::steady_clock::now();
+			auto hit = check_breakpoints();
+			break_check_time_ += std::chrono::steady_clock::now() - start;
+			break_check_count_++;
+#else
+			auto hit = check_breakpoints();
+#endif
+
+			if (hit) {
+				return;
+			}
+		}
+
+		// 位置まで実行している間は、命令ごとに現在の行を知らせる。
+		if (step_controller_->is_running_to_location()) {
+			step_controller_->update_location(step_location_from_line(objects().script_to_code_line()));
+		}
+
 		if (step_controller_->continue_step_running()) {
-			// HACK: すべてのウィンドウに無意味なメッセージを送信する。
+			// HACK: HSP のウィンドウに無意味なメッセージを送信する。
 			//       HSP のウィンドウがこれを受信したとき、デバッグモードの変化が再検査されて、
 			//       ステップ実行モードが変化したことに気づいてくれる (実装依存)。
-			PostMessage(HWND_BROADCAST, WM_NULL, 0, 0);
+			//       命令ごとに行うことがあるので、できるだけ全体へのブロードキャストは避ける。
+			auto hwnd = (HWND)ctx->wnd_parent;
+			if (!hwnd) {
+				hwnd = HWND_BROADCAST;
+			}
+			PostMessage(hwnd, WM_NULL, 0, 0);
 			return;
 		}
 
+		objects().debuggee_did_stop();
 		server().debuggee_did_stop();
 	}
 
@@ -106,8 +204,82 @@ public:
 	}
 
 	void step_run(StepControl const& step_control) override {
+		objects().debuggee_did_resume();
 		step_controller_->update(step_control);
 	}
+
+	void execution_trace_do_start() override {
+		auto file_path = execution_trace_file_path();
+		auto handle = CreateFile(file_path.data(), GENERIC_WRITE, DWORD{}, LPSECURITY_ATTRIBUTES{}, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, HANDLE{});
+		if (handle == INVALID_HANDLE_VALUE) {
+			auto text = Utf8String{ as_utf8(u8"knowbug: execution trace: failed to open ") };
+			text += to_utf8(file_path);
+			text += as_utf8(u8"\n");
+			OutputDebugString(to_os(text).data());
+			return;
+		}
+
+		// 書き出し用のスレッドで書き込み、記録を終えたらファイルを閉じる。
+		auto file = std::shared_ptr<void>{ handle, CloseHandle };
+		objects().execution_trace_do_start([file](std::uint8_t const* data, std::size_t size) {
+			auto written_size = DWORD{};
+			WriteFile(file.get(), data, (DWORD)size, &written_size, LPOVERLAPPED{});
+		});
+	}
+
+private:
+	// 実行トレースの書き出し先 (スクリプトのあるディレクトリ)
+	auto execution_trace_file_path() const -> OsString {
+		return script_dir_ + TEXT("knowbug.trace");
+	}
+
+	// 行カバレッジを lcov の形式でスクリプトのあるディレクトリに書き出す。
+	void write_coverage() {
+		auto file_path = script_dir_ + TEXT("lcov.info");
+		auto lcov = objects().coverage_to_lcov();
+
+		auto ok = false;
+		auto file = CreateFile(file_path.data(), GENERIC_WRITE, DWORD{}, LPSECURITY_ATTRIBUTES{}, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, HANDLE{});
+		if (file != INVALID_HANDLE_VALUE) {
+			auto written_size = DWORD{};
+			ok = WriteFile(file, lcov.data(), (DWORD)lcov.size(), &written_size, LPOVERLAPPED{}) && written_size == lcov.size();
+			CloseHandle(file);
+		}
+
+		auto text = Utf8String{ as_utf8(u8"knowbug: coverage: ") };
+		if (!ok) {
+			text += as_utf8(u8"failed to write ");
+		}
+		text += to_utf8(file_path);
+		text += as_utf8(u8"\n");
+		OutputDebugString(to_os(text).data());
+	}
+
+	// ブレークポイントかデータブレークポイントに当たったら停止する。
+	auto check_breakpoints() -> bool {
+		if (!objects().breakpoint_is_empty()) {
+			if (auto&& line_opt = objects().breakpoint_check()) {
+				step_controller_->update(StepControl::new_stop());
+
+				objects().debuggee_did_stop();
+				server().debuggee_did_hit_breakpoint(line_opt->file_id(), line_opt->line_index());
+				return true;
+			}
+		}
+
+		if (!objects().data_watch_is_empty()) {
+			auto fired = objects().data_watch_check();
+			if (!fired.empty()) {
+				step_controller_->update(StepControl::new_stop());
+
+				objects().debuggee_did_stop();
+				server().debuggee_did_hit_data_breakpoint(fired);
+				return true;
+			}
+		}
+
+		return false;
+	}
 };
 
 // -----------------------------------------------
@@ -18,4 +18,7 @@ public:
 	virtual auto objects()->HspObjects & = 0;
 
 	virtual void step_run(StepControl const& step_control) = 0;
+
+	// 実行トレースをスクリプトのあるディレクトリに書き出し始める。
+	virtual void execution_trace_do_start() = 0;
 };
@@ -6,13 +6,19 @@
 #include <optional>
 #include <unordered_set>
 #include <vector>
+#include "../knowbug_core/content_hash.h"
 #include "../knowbug_core/encoding.h"
 #include "../knowbug_core/hsp_object_path.h"
 #include "../knowbug_core/hsp_object_writer.h"
 #include "../knowbug_core/hsp_objects.h"
 #include "../knowbug_core/hsx.h"
 #include "../knowbug_core/knowbug_protocol.h"
+#include "../knowbug_core/latency_histogram.h"
+#include "../knowbug_core/message_receiver.h"
+#include "../knowbug_core/message_sender.h"
+#include "../knowbug_core/object_list_diff.h"
 #include "../knowbug_core/platform.h"
+#include "../knowbug_core/shared_ring.h"
 #include "../knowbug_core/step_controller.h"
 #include "../knowbug_core/string_writer.h"
 #include "knowbug_app.h"
@@ -22,6 +28,30 @@ class KnowbugServerImpl;
 
 static constexpr auto MEMORY_BUFFER_SIZE = std::size_t{ 1024 * 1024 };
 
+// list_batch_updated_event 1つに詰める名前と値の合計サイズの上限。
+// (テキスト形式ではエスケープで最大4倍になるので、送信バッファーの 1/4 にする。)
+static constexpr auto LIST_BATCH_SIZE_LIMIT = MEMORY_BUFFER_SIZE / 4;
+
+// 分割送信に対応しているクライアントに、大きなメッセージを分割して送るときの断片の大きさ
+static constexpr auto MESSAGE_CHUNK_SIZE = std::size_t{ 64 * 1024 };
+
+// オブジェクトリストで、クライアントに見えている範囲の前後に余分に名前と値を作る行数。
+// (少しスクロールしただけで空の行が見えないようにする。)
+static constexpr auto LIST_VIEWPORT_MARGIN = std::size_t{ 50 };
+
+// 変数のスナップショットが使うメモリーの上限 (MB) の既定値。
+// (クライアントが snapshot_memory_limit_mb を指定しなかったときに使う。0 ならスナップショットを取らない。)
+static constexpr auto DEFAULT_SNAPSHOT_MEMORY_LIMIT_MB = 64;
+
+// list_updated_event で送る、前回の停止時から変化した要素の番号の個数の上限
+static constexpr auto LIST_CHANGED_ELEMENTS_LIMIT = std::size_t{ 256 };
+
+// サンプリングを終えたときに hot_lines_event で送る行の個数
+static constexpr auto SAMPLING_REPORT_LIMIT = std::size_t{ 30 };
+
+// 呼び出し履歴の記録を終えたときに call_history_event で送る呼び出しの個数
+static constexpr auto CALL_HISTORY_TEXT_LIMIT = std::size_t{ 100 };
+
 // -----------------------------------------------
 // バージョン
 // -----------------------------------------------
@@ -63,6 +93,87 @@ public:
 	virtual auto is_expanded(HspObjectPath const& path) const -> bool = 0;
 };
 
+class HspObjectListItem;
+
+// オブジェクトリストの構築の統計 (計測用)
+class HspObjectListStats {
+public:
+	// 更新の回数
+	std::size_t update_count;
+
+	// 値を文字列にした回数
+	std::size_t format_count;
+
+	// メモリーの指紋が変わっていなかったので、前回の文字列を使った回数
+	std::size_t reuse_count;
+
+	// 停止中に作った値か、スナップショットの差分で変化がないと分かったので、指紋も計算せずに前回の文字列を使った回数
+	std::size_t unchanged_count;
+
+	HspObjectListStats()
+		: update_count()
+		, format_count()
+		, reuse_count()
+		, unchanged_count()
+	{
+	}
+
+	auto to_summary(Utf8StringView title) const -> Utf8String {
+		auto text = Utf8String{ title };
+		text += as_utf8(u8": updates=");
+		text += as_utf8(std::to_string(update_count));
+		text += as_utf8(u8", formatted=");
+		text += as_utf8(std::to_string(format_count));
+		text += as_utf8(u8", reused=");
+		text += as_utf8(std::to_string(reuse_count));
+		text += as_utf8(u8", unchanged=");
+		text += as_utf8(std::to_string(unchanged_count));
+		return text;
+	}
+};
+
+// オブジェクトリストのうち、名前と値を作る行の範囲
+class HspObjectListViewport {
+public:
+	virtual auto is_visible(std::size_t row_index) const -> bool = 0;
+
+	// 前回の更新で作った行
+	virtual auto last_item(std::size_t object_id) const -> std::optional<HspObjectListItem const*> = 0;
+};
+
+// 行が指す値の、前回の停止時からの変化 (スナップショットの差分から分かる。)
+class HspObjectListChange {
+	bool changed_;
+
+	// 変化した要素の番号のカンマ区切り (配列の静的変数の行だけ。先頭の LIST_CHANGED_ELEMENTS_LIMIT 個まで)
+	Utf8String changed_elements_;
+
+public:
+	HspObjectListChange()
+		: changed_(false)
+		, changed_elements_()
+	{
+	}
+
+	HspObjectListChange(bool changed, Utf8String changed_elements)
+		: changed_(changed)
+		, changed_elements_(std::move(changed_elements))
+	{
+	}
+
+	auto is_changed() const -> bool {
+		return changed_;
+	}
+
+	auto changed_elements() const -> Utf8StringView {
+		return changed_elements_;
+	}
+
+	auto equals(HspObjectListChange const& other) const -> bool {
+		return changed_ == other.changed_ && changed_elements_ == other.changed_elements_;
+	}
+};
+
 class HspObjectListItem {
 	std::size_t object_id_;
 	std::size_t depth_;
@@ -70,13 +181,24 @@ class HspObjectListItem {
 	Utf8String value_;
 	std::size_t child_count_;
 
+	// 値を文字列にしたときのメモリーの指紋 (変化がなければ文字列を作り直さない。)
+	std::optional<ContentFingerprint> fingerprint_opt_;
+
+	// 値を文字列にしたときの停止エポック (停止中に作ったときだけ)
+	std::optional<std::size_t> stop_epoch_opt_;
+
+	HspObjectListChange change_;
+
 public:
-	HspObjectListItem(std::size_t object_id, std::size_t depth, Utf8String name, Utf8String value, std::size_t child_count)
+	HspObjectListItem(std::size_t object_id, std::size_t depth, Utf8String name, Utf8String value, std::size_t child_count, std::optional<ContentFingerprint> fingerprint_opt, std::optional<std::size_t> stop_epoch_opt, HspObjectListChange change)
 		: object_id_(object_id)
 		, depth_(depth)
 		, name_(std::move(name))
 		, value_(std::move(value))
 		, child_count_(child_count)
+		, fingerprint_opt_(fingerprint_opt)
+		, stop_epoch_opt_(stop_epoch_opt)
+		, change_(std::move(change))
 	{
 	}
 
@@ -100,12 +222,32 @@ public:
 		return child_count_;
 	}
 
+	auto fingerprint_opt() const -> std::optional<ContentFingerprint> const& {
+		return fingerprint_opt_;
+	}
+
+	auto stop_epoch_opt() const -> std::optional<std::size_t> const& {
+		return stop_epoch_opt_;
+	}
+
+	auto change() const -> HspObjectListChange const& {
+		return change_;
+	}
+
+	// 変化だけを置き換えた行を作る。
+	auto with_change(HspObjectListChange change) const -> HspObjectListItem {
+		auto item = *this;
+		item.change_ = std::move(change);
+		return item;
+	}
+
 	auto equals(HspObjectListItem const& other) const -> bool {
 		return object_id() == other.object_id()
 			&& depth() == other.depth()
 			&& name() == other.name()
 			&& value() == other.value()
-			&& child_count() == other.child_count();
+			&& child_count() == other.child_count()
+			&& change().equals(other.change());
 	}
 };
 
@@ -140,20 +282,26 @@ public:
 };
 
 // オブジェクトリストを構築する関数。
+//
+// 見えている範囲の外にある行は、名前と値を作らずに、ID と子要素の数だけを記録する。
 class HspObjectListWriter {
 	HspObjects& objects_;
 	HspObjectList& object_list_;
 	HspObjectIdProvider& id_provider_;
 	HspObjectListExpansion& expansion_;
+	HspObjectListViewport const& viewport_;
+	HspObjectListStats& stats_;
 
 	std::size_t depth_;
 
 public:
-	HspObjectListWriter(HspObjects& objects, HspObjectList& object_list, HspObjectIdProvider& id_provider, HspObjectListExpansion& expansion)
+	HspObjectListWriter(HspObjects& objects, HspObjectList& object_list, HspObjectIdProvider& id_provider, HspObjectListExpansion& expansion, HspObjectListViewport const& viewport, HspObjectListStats& stats)
 		: objects_(objects)
 		, object_list_(object_list)
 		, id_provider_(id_provider)
 		, expansion_(expansion)
+		, viewport_(viewport)
+		, stats_(stats)
 		, depth_()
 	{
 	}
@@ -206,29 +354,141 @@ public:
 
 private:
 	void add_scope(HspObjectPath const& path) {
-		auto name = path.name(objects());
 		auto item_count = path.visual_child_count(objects());
+		auto object_id = id_provider_.path_to_object_id(path);
 
-		auto value = Utf8String{ as_utf8(u8"(") };
-		value += as_utf8(std::to_string(item_count));
-		value += as_utf8(u8"):");
+		if (viewport_.is_visible(object_list_.size())) {
+			auto name = path.name(objects());
+
+			auto value = Utf8String{ as_utf8(u8"(") };
+			value += as_utf8(std::to_string(item_count));
+			value += as_utf8(u8"):");
+
+			object_list_.add_item(HspObjectListItem{ object_id, depth_, name, value, item_count, std::nullopt, std::nullopt, path_to_change(path) });
+		} else {
+			add_hidden(object_id, item_count);
+		}
 
-		auto object_id = id_provider_.path_to_object_id(path);
-		object_list_.add_item(HspObjectListItem{ object_id, depth_, name, value, item_count });
 		depth_++;
 		add_children(path);
 		depth_--;
 	}
 
 	void add_value(HspObjectPath const& path, HspObjectPath const& value_path) {
+		auto object_id = id_provider_.path_to_object_id(path);
+
+		if (!viewport_.is_visible(object_list_.size())) {
+			add_hidden(object_id, 0);
+			return;
+		}
+
+		auto changed_opt = objects().path_is_changed_since_last_stop(path);
+		auto change = HspObjectListChange{ changed_opt.value_or(false), Utf8String{} };
+		auto stop_epoch_opt = objects().debuggee_is_stopped() ? std::make_optional(objects().stop_epoch()) : std::nullopt;
+
+		auto last_opt = viewport_.last_item(object_id);
+		if (last_opt && ((**last_opt).depth() != depth_ || (**last_opt).child_count() != 0)) {
+			last_opt = std::nullopt;
+		}
+
+		// 前回の値がいまのメモリーから作ったものと分かれば、そのまま使う。
+		if (last_opt && is_unchanged_since(**last_opt, stop_epoch_opt, changed_opt)) {
+			stats_.unchanged_count++;
+			object_list_.add_item((**last_opt).with_change(std::move(change)));
+			return;
+		}
+
+		// メモリーの内容が前回から変わっていなければ、前回の名前と値を使う。
+		// (スナップショットの差分で変化したと分かっているときは、指紋を計算しない。)
+		auto fingerprint_opt = changed_opt.value_or(false) ? std::nullopt : path_to_fingerprint(path);
+		if (fingerprint_opt && last_opt && (**last_opt).fingerprint_opt() == fingerprint_opt) {
+			stats_.reuse_count++;
+			object_list_.add_item((**last_opt).with_change(std::move(change)));
+			return;
+		}
+
 		auto name = path.name(objects());
 
 		auto value_writer = StringWriter{};
 		HspObjectWriter{ objects(), value_writer }.write_flow_form(value_path);
 		auto value = value_writer.finish();
+		stats_.format_count++;
 
-		auto object_id = id_provider_.path_to_object_id(path);
-		object_list_.add_item(HspObjectListItem{ object_id, depth_, name, value, 0 });
+		object_list_.add_item(HspObjectListItem{ object_id, depth_, name, value, 0, fingerprint_opt, stop_epoch_opt, std::move(change) });
+	}
+
+	// 前回の値が、いまのメモリーの内容から作ったものと同じになるか。
+	// - 同じ停止の間に作った値 (停止中はメモリーが変化しない。)
+	// - 前回の停止時に作った値で、スナップショットの差分で変化がないと分かっている
+	static auto is_unchanged_since(HspObjectListItem const& last, std::optional<std::size_t> stop_epoch_opt, std::optional<bool> changed_opt) -> bool {
+		if (!stop_epoch_opt || !last.stop_epoch_opt()) {
+			return false;
+		}
+
+		auto last_epoch = *last.stop_epoch_opt();
+		if (last_epoch == *stop_epoch_opt) {
+			return true;
+		}
+
+		return last_epoch + 1 == *stop_epoch_opt && changed_opt && !*changed_opt;
+	}
+
+	// 前回の停止時からの変化を調べる。
+	// 配列の静的変数なら、変化した要素の番号も列挙する。
+	auto path_to_change(HspObjectPath const& path) -> HspObjectListChange {
+		if (path.kind() == HspObjectKind::StaticVar) {
+			auto&& diff_opt = objects().static_var_to_snapshot_diff(path.as_static_var().static_var_id());
+			if (!diff_opt) {
+				return HspObjectListChange{};
+			}
+
+			auto&& diff = **diff_opt;
+			auto changed_elements = Utf8String{};
+			auto&& elements = diff.changed_elements();
+			for (auto i = std::size_t{}; i < std::min(elements.size(), LIST_CHANGED_ELEMENTS_LIMIT); i++) {
+				if (i != 0) {
+					changed_elements += Utf8Char{ u8',' };
+				}
+				changed_elements += as_utf8(std::to_string(elements[i]));
+			}
+
+			return HspObjectListChange{ diff.is_changed(), std::move(changed_elements) };
+		}
+
+		return HspObjectListChange{ objects().path_is_changed_since_last_stop(path).value_or(false), Utf8String{} };
+	}
+
+	// 値の文字列が依存するメモリーの指紋を計算する。(メモリーが特定できないときは nullopt)
+	auto path_to_fingerprint(HspObjectPath const& path) -> std::optional<ContentFingerprint> {
+		switch (path.kind()) {
+		case HspObjectKind::StaticVar:
+		case HspObjectKind::Element:
+		case HspObjectKind::Param:
+			break;
+
+		default:
+			return std::nullopt;
+		}
+
+		auto memory_view_opt = objects().path_to_memory_view(path);
+		if (!memory_view_opt) {
+			return std::nullopt;
+		}
+
+		return ContentFingerprint::from_memory_view(*memory_view_opt);
+	}
+
+	// 見えていない行を追加する。
+	// 前回と同じ形の行なら、前回の名前と値をそのまま使う。(差分が出ないので、何も送らずに済む。)
+	// 見えるようになったときに作り直して、変化があれば更新する。
+	void add_hidden(std::size_t object_id, std::size_t child_count) {
+		auto last_opt = viewport_.last_item(object_id);
+		if (last_opt && (**last_opt).depth() == depth_ && (**last_opt).child_count() == child_count) {
+			object_list_.add_item(HspObjectListItem{ **last_opt });
+			return;
+		}
+
+		object_list_.add_item(HspObjectListItem{ object_id, depth_, Utf8String{}, Utf8String{}, child_count, std::nullopt, std::nullopt, HspObjectListChange{} });
 	}
 
 	auto objects() -> HspObjects& {
@@ -242,6 +502,7 @@ public:
 		Insert,
 		Remove,
 		Update,
+		Move,
 	};
 
 	static auto kind_to_string(Kind kind) -> Utf8StringView {
@@ -255,6 +516,29 @@ public:
 		case Kind::Update:
 			return as_utf8(u8"update");
 
+		case Kind::Move:
+			return as_utf8(u8"move");
+
+		default:
+			throw std::exception{};
+		}
+	}
+
+	// list_batch_updated_event の kinds 列で使う1文字の表現
+	static auto kind_to_char(Kind kind) -> Utf8Char {
+		switch (kind) {
+		case Kind::Insert:
+			return Utf8Char{ u8'i' };
+
+		case Kind::Remove:
+			return Utf8Char{ u8'r' };
+
+		case Kind::Update:
+			return Utf8Char{ u8'u' };
+
+		case Kind::Move:
+			return Utf8Char{ u8'm' };
+
 		default:
 			throw std::exception{};
 		}
@@ -264,18 +548,22 @@ private:
 	Kind kind_;
 	std::size_t object_id_;
 	std::size_t index_;
+	std::size_t from_index_;
 	std::size_t depth_;
 	Utf8String name_;
 	Utf8String value_;
+	HspObjectListChange change_;
 
 public:
-	HspObjectListDelta(Kind kind, std::size_t object_id, std::size_t index, std::size_t depth, Utf8String name, Utf8String value)
+	HspObjectListDelta(Kind kind, std::size_t object_id, std::size_t index, std::size_t from_index, std::size_t depth, Utf8String name, Utf8String value, HspObjectListChange change)
 		: kind_(kind)
 		, object_id_(object_id)
 		, index_(index)
+		, from_index_(from_index)
 		, depth_(depth)
 		, name_(std::move(name))
 		, value_(std::move(value))
+		, change_(std::move(change))
 	{
 	}
 
@@ -284,9 +572,11 @@ public:
 			Kind::Insert,
 			item.object_id(),
 			index,
+			std::size_t{},
 			item.depth(),
 			Utf8String{ item.name() },
-			Utf8String{ item.value() }
+			Utf8String{ item.value() },
+			item.change()
 		};
 	}
 
@@ -296,8 +586,10 @@ public:
 			object_id,
 			index,
 			std::size_t{},
+			std::size_t{},
 			Utf8String{},
-			Utf8String{}
+			Utf8String{},
+			HspObjectListChange{}
 		};
 	}
 
@@ -306,9 +598,25 @@ public:
 			Kind::Update,
 			item.object_id(),
 			index,
+			std::size_t{},
+			item.depth(),
+			Utf8String{ item.name() },
+			Utf8String{ item.value() },
+			item.change()
+		};
+	}
+
+	// from_index の位置にある要素を取り除いて、index の位置に挿入する。
+	static auto new_move(std::size_t from_index, std::size_t index, HspObjectListItem const& item) -> HspObjectListDelta {
+		return HspObjectListDelta{
+			Kind::Move,
+			item.object_id(),
+			index,
+			from_index,
 			item.depth(),
 			Utf8String{ item.name() },
-			Utf8String{ item.value() }
+			Utf8String{ item.value() },
+			item.change()
 		};
 	}
 
@@ -324,6 +632,11 @@ public:
 		return index_;
 	}
 
+	// 移動元の位置 (Move のときだけ有効)
+	auto from_index() const -> std::size_t {
+		return from_index_;
+	}
+
 	auto name() const -> Utf8String {
 		static constexpr auto SPACES = u8"                ";
 
@@ -335,68 +648,146 @@ public:
 	auto value() const -> Utf8StringView {
 		return value_;
 	}
+
+	auto change() const -> HspObjectListChange const& {
+		return change_;
+	}
 };
 
-static auto diff_object_list(HspObjectList const& source, HspObjectList const& target, std::vector<HspObjectListDelta>& diff) {
-	auto source_done = std::vector<bool>{};
-	source_done.resize(source.size());
+// 複数の差分を1つの list_batch_updated_event にまとめるもの。
+// 差分ごとの値を列ごとに連結して持つ。(knowbug-protocol.md を参照。)
+class HspObjectListDeltaBatch {
+	std::size_t count_;
 
-	auto target_done = std::vector<bool>{};
-	target_done.resize(target.size());
+	// 差分の種類を1文字ずつ並べたもの
+	Utf8String kinds_;
 
-	// FIXME: 高速化
-	for (auto si = std::size_t{}; si < source.size(); si++) {
-		if (source_done[si]) {
-			continue;
-		}
+	// 前回の停止時から変化したか ('1' または '0') を1文字ずつ並べたもの
+	Utf8String changes_;
 
-		for (auto ti = std::size_t{}; ti < target.size(); ti++) {
-			if (target_done[ti]) {
-				continue;
-			}
+	// 整数の列 (カンマ区切り)
+	Utf8String object_ids_;
+	Utf8String indexes_;
+	Utf8String from_indexes_;
 
-			if (source[si].object_id() == target[ti].object_id()) {
-				source_done[si] = true;
-				target_done[ti] = true;
-				break;
-			}
+	// 名前と値は連結して、それぞれのバイト数の列を別に持つ。
+	Utf8String name_lens_;
+	Utf8String names_;
+	Utf8String value_lens_;
+	Utf8String values_;
+
+public:
+	HspObjectListDeltaBatch()
+		: count_()
+		, kinds_()
+		, changes_()
+		, object_ids_()
+		, indexes_()
+		, from_indexes_()
+		, name_lens_()
+		, names_()
+		, value_lens_()
+		, values_()
+	{
+	}
+
+	auto size() const -> std::size_t {
+		return count_;
+	}
+
+	// 名前と値の合計サイズ
+	auto text_size() const -> std::size_t {
+		return names_.size() + values_.size();
+	}
+
+	void add(HspObjectListDelta const& delta) {
+		auto name = delta.name();
+		auto value = delta.value();
+
+		kinds_ += HspObjectListDelta::kind_to_char(delta.kind());
+		changes_ += Utf8Char{ delta.change().is_changed() ? u8'1' : u8'0' };
+		append_int(object_ids_, delta.object_id());
+		append_int(indexes_, delta.index());
+		append_int(from_indexes_, delta.kind() == HspObjectListDelta::Kind::Move ? delta.from_index() : 0);
+		append_int(name_lens_, name.size());
+		names_ += name;
+		append_int(value_lens_, value.size());
+		values_ += value;
+
+		count_++;
+	}
+
+	auto to_message() const -> KnowbugMessage {
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"list_batch_updated_event") });
+		message.insert_int(Utf8String{ as_utf8(u8"count") }, (int)count_);
+		message.insert(Utf8String{ as_utf8(u8"kinds") }, kinds_);
+		message.insert(Utf8String{ as_utf8(u8"changes") }, changes_);
+		message.insert(Utf8String{ as_utf8(u8"object_ids") }, object_ids_);
+		message.insert(Utf8String{ as_utf8(u8"indexes") }, indexes_);
+		message.insert(Utf8String{ as_utf8(u8"from_indexes") }, from_indexes_);
+		message.insert(Utf8String{ as_utf8(u8"name_lens") }, name_lens_);
+		message.insert(Utf8String{ as_utf8(u8"names") }, names_);
+		message.insert(Utf8String{ as_utf8(u8"value_lens") }, value_lens_);
+		message.insert(Utf8String{ as_utf8(u8"values") }, values_);
+		return message;
+	}
+
+	void clear() {
+		*this = HspObjectListDeltaBatch{};
+	}
+
+private:
+	static void append_int(Utf8String& column, std::size_t value) {
+		if (!column.empty()) {
+			column += Utf8Char{ u8',' };
 		}
+		column += as_utf8(std::to_string(value));
 	}
+};
 
-	{
-		auto si = std::size_t{};
-		auto ti = std::size_t{};
+static auto diff_object_list(HspObjectList const& source, HspObjectList const& target, std::vector<HspObjectListDelta>& diff) {
+	auto source_ids = std::vector<std::size_t>{};
+	source_ids.reserve(source.size());
+	for (auto&& item : source.items()) {
+		source_ids.push_back(item.object_id());
+	}
 
-		while (si < source.size() || ti < target.size()) {
-			if (ti == target.size() || (si < source.size() && !source_done[si])) {
-				diff.push_back(HspObjectListDelta::new_remove(source[si].object_id(), ti));
-				si++;
-				continue;
-			}
+	auto target_ids = std::vector<std::size_t>{};
+	target_ids.reserve(target.size());
+	for (auto&& item : target.items()) {
+		target_ids.push_back(item.object_id());
+	}
 
-			if (si == source.size() || (ti < target.size() && !target_done[ti])) {
-				diff.push_back(HspObjectListDelta::new_insert(ti, target[ti]));
-				ti++;
-				continue;
-			}
+	auto list_diff = std::vector<ObjectListDiff>{};
+	object_list_diff(
+		source_ids,
+		target_ids,
+		[&](std::size_t si, std::size_t ti) { return source[si].equals(target[ti]); },
+		list_diff
+	);
 
-			assert(si < source.size() && ti < target.size());
-			assert(source_done[si] && target_done[ti]);
+	diff.reserve(diff.size() + list_diff.size());
 
-			if (source[si].object_id() == target[ti].object_id()) {
-				auto&& s = source[si];
-				auto&& t = target[ti];
-				if (!s.equals(t)) {
-					diff.push_back(HspObjectListDelta::new_update(ti, target[ti]));
-				}
+	for (auto&& d : list_diff) {
+		switch (d.kind()) {
+		case ObjectListDiffKind::Insert:
+			diff.push_back(HspObjectListDelta::new_insert(d.index(), target[d.target_index()]));
+			break;
 
-				si++;
-				ti++;
-				continue;
-			}
+		case ObjectListDiffKind::Remove:
+			diff.push_back(HspObjectListDelta::new_remove(source[d.source_index()].object_id(), d.index()));
+			break;
+
+		case ObjectListDiffKind::Update:
+			diff.push_back(HspObjectListDelta::new_update(d.index(), target[d.target_index()]));
+			break;
+
+		case ObjectListDiffKind::Move:
+			diff.push_back(HspObjectListDelta::new_move(d.from_index(), d.index(), target[d.target_index()]));
+			break;
 
-			assert(false && u8"パスの順番が入れ替わるケースは未実装。");
-			diff.clear();
+		default:
+			assert(false && u8"Unknown ObjectListDiffKind");
 			break;
 		}
 	}
@@ -405,6 +796,7 @@ static auto diff_object_list(HspObjectList const& source, HspObjectList const& t
 class HspObjectListEntity
 	: public HspObjectIdProvider
 	, public HspObjectListExpansion
+	, public HspObjectListViewport
 {
 	HspObjectList object_list_;
 
@@ -414,6 +806,16 @@ class HspObjectListEntity
 
 	std::unordered_map<std::shared_ptr<HspObjectPath const>, bool> expanded_;
 
+	// クライアントに見えている行の範囲 (list_viewport_notification で決まる。届くまではすべての行が見えているとみなす。)
+	bool viewport_enabled_;
+	std::size_t viewport_first_;
+	std::size_t viewport_count_;
+
+	// 前回の更新で作ったリストの、オブジェクトIDから行番号への表 (更新の間だけ使う。)
+	std::unordered_map<std::size_t, std::size_t> last_indexes_;
+
+	HspObjectListStats stats_;
+
 public:
 	HspObjectListEntity()
 		: object_list_()
@@ -421,6 +823,11 @@ public:
 		, id_to_paths_()
 		, path_to_ids_()
 		, expanded_()
+		, viewport_enabled_(false)
+		, viewport_first_()
+		, viewport_count_()
+		, last_indexes_()
+		, stats_()
 	{
 	}
 
@@ -428,6 +835,10 @@ public:
 		return object_list_.size();
 	}
 
+	auto stats() const -> HspObjectListStats const& {
+		return stats_;
+	}
+
 	auto path_to_object_id(HspObjectPath const& path) -> std::size_t override {
 		auto iter = path_to_ids_.find(path.self());
 		if (iter == path_to_ids_.end()) {
@@ -459,9 +870,47 @@ public:
 		return iter->second;
 	}
 
+	auto is_visible(std::size_t row_index) const -> bool override {
+		if (!viewport_enabled_) {
+			return true;
+		}
+
+		return row_index + LIST_VIEWPORT_MARGIN >= viewport_first_
+			&& row_index < viewport_first_ + viewport_count_ + LIST_VIEWPORT_MARGIN;
+	}
+
+	auto last_item(std::size_t object_id) const -> std::optional<HspObjectListItem const*> override {
+		auto iter = last_indexes_.find(object_id);
+		if (iter == last_indexes_.end()) {
+			return std::nullopt;
+		}
+
+		return &object_list_[iter->second];
+	}
+
+	// 見えている行の範囲を設定する。範囲が変わったら true を返す。
+	auto set_viewport(std::size_t first, std::size_t count) -> bool {
+		if (viewport_enabled_ && viewport_first_ == first && viewport_count_ == count) {
+			return false;
+		}
+
+		viewport_enabled_ = true;
+		viewport_first_ = first;
+		viewport_count_ = count;
+		return true;
+	}
+
 	auto update(HspObjects& objects) -> std::vector<HspObjectListDelta> {
+		last_indexes_.clear();
+		last_indexes_.reserve(object_list_.size());
+		for (auto i = std::size_t{}; i < object_list_.size(); i++) {
+			last_indexes_.emplace(object_list_[i].object_id(), i);
+		}
+
 		auto new_list = HspObjectList{};
-		HspObjectListWriter{ objects, new_list, *this, *this }.add_children(objects.root_path());
+		HspObjectListWriter{ objects, new_list, *this, *this, *this, stats_ }.add_children(objects.root_path());
+		stats_.update_count++;
+		last_indexes_.clear();
 
 		auto diff = std::vector<HspObjectListDelta>{};
 		diff_object_list(object_list_, new_list, diff);
@@ -574,6 +1023,8 @@ using MemoryMappedFile = std::unique_ptr<HANDLE, Win32CloseHandleFn>;
 
 using MemoryMappedFileView = std::unique_ptr<LPVOID, Win32UnmapViewOfFileFn>;
 
+using EventHandle = std::unique_ptr<HANDLE, Win32CloseHandleFn>;
+
 using PipeHandle = std::unique_ptr<HANDLE, Win32CloseHandleFn>;
 
 using ProcessHandle = std::unique_ptr<HANDLE, Win32CloseHandleFn>;
@@ -597,6 +1048,9 @@ static void fail_with(OsStringView reason) {
 // 隠しウィンドウ
 // -----------------------------------------------
 
+// クライアントからメッセージが届いたことを隠しウィンドウに知らせるメッセージ
+static constexpr auto WM_KNOWBUG_CLIENT_MESSAGE = UINT{ WM_APP + 1 };
+
 static auto WINAPI process_hidden_window(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp) -> LRESULT;
 
 static auto create_hidden_window(HINSTANCE instance) -> WindowHandle {
@@ -676,59 +1130,346 @@ public:
 	ProcessHandle process_handle_;
 };
 
-// FIXME: knowbug_app と重複
-static auto get_hsp_dir() -> OsString {
-	// DLL の絶対パスを取得する。
-	auto buffer = std::array<TCHAR, MAX_PATH>{};
-	GetModuleFileName(GetModuleHandle(nullptr), buffer.data(), (DWORD)buffer.size());
-	auto full_path = OsString{ buffer.data() };
-
-	// ファイル名の部分を削除
-	while (!full_path.empty()) {
-		auto last = full_path[full_path.length() - 1];
-		if (last == TEXT('/') || last == TEXT('\\')) {
-			break;
-		}
+// クライアントの標準入力にメッセージを書き込むもの。(送信スレッドから使う。)
+class ClientStdinSink
+	: public MessageSink
+{
+	HANDLE handle_;
 
-		full_path.pop_back();
+public:
+	explicit ClientStdinSink(HANDLE handle)
+		: handle_(handle)
+	{
 	}
 
-	return full_path;
-}
+	auto write(Utf8StringView data) -> bool override {
+		while (!data.empty()) {
+			auto written_size = DWORD{};
+			if (!WriteFile(handle_, data.data(), (DWORD)data.size(), &written_size, LPOVERLAPPED{})) {
+				return false;
+			}
 
-static auto start_client_process() -> std::optional<KnowbugClientProcess> {
-	// クライアントプロセスの起動コマンドラインを構成する。
-	auto hsp_dir = get_hsp_dir();
-	auto name = hsp_dir + TEXT("knowbug_client.exe");
+			data = data.substr(written_size);
+		}
+		return true;
+	}
+};
 
-	auto cmdline = OsString{ TEXT("\"") };
-	cmdline += name;
-	cmdline += TEXT("\"");
+// クライアントの標準出力からデータを読むもの。(受信スレッドから使う。)
+class ClientStdoutSource
+	: public MessageSource
+{
+	HANDLE handle_;
 
-	// 標準入出力のためのパイプを作成する。
-	auto client_stdin_pipe_opt = create_anonymous_pipe();
-	if (!client_stdin_pipe_opt) {
-		return std::nullopt;
+	// read を呼んだスレッドのハンドル (cancel で使う)
+	std::atomic<HANDLE> thread_;
+
+public:
+	explicit ClientStdoutSource(HANDLE handle)
+		: handle_(handle)
+		, thread_(HANDLE{})
+	{
 	}
 
-	auto client_stdout_pipe_opt = create_anonymous_pipe();
-	if (!client_stdout_pipe_opt) {
-		return std::nullopt;
+	~ClientStdoutSource() {
+		if (auto thread = thread_.load()) {
+			CloseHandle(thread);
+		}
 	}
 
-	// クライアントプロセスとデータをやり取りするパイプが継承されないようにする。
-	// (標準入力への書き込みと、標準出力からの読み取り。)
-	if (!SetHandleInformation(client_stdin_pipe_opt->write_.get(), HANDLE_FLAG_INHERIT, DWORD{})) {
-		return std::nullopt;
+	auto read(Utf8Char* buffer, std::size_t buffer_size) -> std::size_t override {
+		if (!thread_.load()) {
+			auto thread = HANDLE{};
+			if (DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &thread, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+				thread_.store(thread);
+			}
+		}
+
+		// パイプが閉じられるか、CancelSynchronousIo されるまでブロックする。
+		auto read_size = DWORD{};
+		if (!ReadFile(handle_, buffer, (DWORD)buffer_size, &read_size, LPOVERLAPPED{})) {
+			return 0;
+		}
+		return (std::size_t)read_size;
 	}
 
-	if (!SetHandleInformation(client_stdout_pipe_opt->read_.get(), HANDLE_FLAG_INHERIT, DWORD{})) {
-		return std::nullopt;
+	void cancel() override {
+		if (auto thread = thread_.load()) {
+			CancelSynchronousIo(thread);
+		}
 	}
+};
 
-	// クライアントプロセスの標準入出力のリダイレクトを設定する。
-	auto startup_info = STARTUPINFO{ sizeof(STARTUPINFO) };
-	auto process_info = PROCESS_INFORMATION{};
+// -----------------------------------------------
+// 通信路
+// -----------------------------------------------
+
+// クライアントとの通信路
+class ClientTransport {
+public:
+	virtual ~ClientTransport() {
+	}
+
+	virtual auto new_sink() -> std::unique_ptr<MessageSink> = 0;
+
+	virtual auto new_source() -> std::unique_ptr<MessageSource> = 0;
+};
+
+// クライアントの標準入出力のパイプによる通信路
+class PipeTransport
+	: public ClientTransport
+{
+	HANDLE stdin_write_;
+	HANDLE stdout_read_;
+
+public:
+	PipeTransport(HANDLE stdin_write, HANDLE stdout_read)
+		: stdin_write_(stdin_write)
+		, stdout_read_(stdout_read)
+	{
+	}
+
+	auto new_sink() -> std::unique_ptr<MessageSink> override {
+		return std::make_unique<ClientStdinSink>(stdin_write_);
+	}
+
+	auto new_source() -> std::unique_ptr<MessageSource> override {
+		return std::make_unique<ClientStdoutSource>(stdout_read_);
+	}
+};
+
+// 名前付きの自動リセットのイベントによる、リングバッファーの通知
+//
+// 相手のプロセスのハンドルも一緒に待つので、相手が異常終了して通知が来なくなっても眠り続けない。
+class NamedEventSignal
+	: public SharedRingSignal
+{
+	EventHandle event_;
+
+	// 相手のプロセスのハンドル (所有しない。終了したらシグナル状態になる。)
+	HANDLE peer_process_;
+
+	NamedEventSignal(EventHandle event, HANDLE peer_process)
+		: event_(std::move(event))
+		, peer_process_(peer_process)
+	{
+	}
+
+public:
+	static auto create(Utf8StringView name, HANDLE peer_process) -> std::shared_ptr<NamedEventSignal> {
+		auto event = EventHandle{ CreateEvent(LPSECURITY_ATTRIBUTES{}, FALSE, FALSE, to_os(name).data()) };
+		if (!event) {
+			return nullptr;
+		}
+		return std::shared_ptr<NamedEventSignal>{ new NamedEventSignal{ std::move(event), peer_process } };
+	}
+
+	void notify() override {
+		SetEvent(event_.get());
+	}
+
+	auto wait() -> bool override {
+		auto handles = std::array<HANDLE, 2>{ event_.get(), peer_process_ };
+		auto result = WaitForMultipleObjects((DWORD)handles.size(), handles.data(), FALSE, INFINITE);
+		return result == WAIT_OBJECT_0;
+	}
+};
+
+// 名前付きの共有メモリー上のリングバッファーによる通信路
+//
+// 前半はサーバーからクライアントへ、後半はクライアントからサーバーへのリングバッファーに使う。
+// リングバッファーより大きなメッセージは分割して流れるので、メッセージの大きさに制限はない。
+// リングバッファーごとに「書き込まれた」「読み取られた」を知らせる名前付きイベントを作り、空や満杯のときはそれを待って眠る。
+// クライアントのプロセスが終了したら、リングバッファーは閉じられる。
+class SharedMemoryTransport
+	: public ClientTransport
+{
+	Utf8String name_;
+	std::size_t ring_capacity_;
+	MemoryMappedFile file_;
+	MemoryMappedFileView view_;
+	SharedRing outgoing_;
+	SharedRing incoming_;
+	SharedRingSignals outgoing_signals_;
+	SharedRingSignals incoming_signals_;
+
+	SharedMemoryTransport(Utf8String name, std::size_t ring_capacity, MemoryMappedFile file, MemoryMappedFileView view, SharedRing outgoing, SharedRing incoming, SharedRingSignals outgoing_signals, SharedRingSignals incoming_signals)
+		: name_(std::move(name))
+		, ring_capacity_(ring_capacity)
+		, file_(std::move(file))
+		, view_(std::move(view))
+		, outgoing_(outgoing)
+		, incoming_(incoming)
+		, outgoing_signals_(std::move(outgoing_signals))
+		, incoming_signals_(std::move(incoming_signals))
+	{
+	}
+
+public:
+	// イベントの名前の接尾辞 (共有メモリーの名前の後ろにつける)
+	static constexpr auto OUTGOING_READABLE_SUFFIX = u8"-s2c-readable";
+	static constexpr auto OUTGOING_WRITABLE_SUFFIX = u8"-s2c-writable";
+	static constexpr auto INCOMING_READABLE_SUFFIX = u8"-c2s-readable";
+	static constexpr auto INCOMING_WRITABLE_SUFFIX = u8"-c2s-writable";
+
+	// client_process はクライアントのプロセスのハンドル。(通信路より長く生存すること。)
+	static auto create(Utf8String name, std::size_t ring_capacity, HANDLE client_process) -> std::unique_ptr<SharedMemoryTransport> {
+		auto event_name = [&](char const* suffix) {
+			auto event_name = name;
+			event_name += as_utf8(suffix);
+			return event_name;
+		};
+
+		auto outgoing_signals = SharedRingSignals{
+			NamedEventSignal::create(event_name(OUTGOING_READABLE_SUFFIX), client_process),
+			NamedEventSignal::create(event_name(OUTGOING_WRITABLE_SUFFIX), client_process),
+		};
+		auto incoming_signals = SharedRingSignals{
+			NamedEventSignal::create(event_name(INCOMING_READABLE_SUFFIX), client_process),
+			NamedEventSignal::create(event_name(INCOMING_WRITABLE_SUFFIX), client_process),
+		};
+		if (!outgoing_signals.readable_ || !outgoing_signals.writable_ || !incoming_signals.readable_ || !incoming_signals.writable_) {
+			return nullptr;
+		}
+
+		auto ring_size = SharedRing::required_size(ring_capacity);
+		auto total_size = ring_size * 2;
+
+		auto file = MemoryMappedFile{ CreateFileMapping(
+			INVALID_HANDLE_VALUE,
+			LPSECURITY_ATTRIBUTES{},
+			PAGE_READWRITE,
+			DWORD{},
+			(DWORD)total_size,
+			to_os(name).data()
+		) };
+		if (!file) {
+			return nullptr;
+		}
+
+		auto view = MemoryMappedFileView{ MapViewOfFile(file.get(), FILE_MAP_ALL_ACCESS, DWORD{}, DWORD{}, total_size) };
+		if (!view) {
+			return nullptr;
+		}
+
+		auto memory = (unsigned char*)view.get();
+		auto outgoing_opt = SharedRing::create(memory, ring_size, ring_capacity);
+		auto incoming_opt = SharedRing::create(memory + ring_size, ring_size, ring_capacity);
+		if (!outgoing_opt || !incoming_opt) {
+			return nullptr;
+		}
+
+		return std::unique_ptr<SharedMemoryTransport>{ new SharedMemoryTransport{
+			std::move(name),
+			ring_capacity,
+			std::move(file),
+			std::move(view),
+			*outgoing_opt,
+			*incoming_opt,
+			std::move(outgoing_signals),
+			std::move(incoming_signals)
+		} };
+	}
+
+	~SharedMemoryTransport() {
+		outgoing_.close();
+		incoming_.close();
+		outgoing_signals_.notify_all();
+		incoming_signals_.notify_all();
+	}
+
+	auto name() const -> Utf8StringView {
+		return name_;
+	}
+
+	auto ring_capacity() const -> std::size_t {
+		return ring_capacity_;
+	}
+
+	auto new_sink() -> std::unique_ptr<MessageSink> override {
+		return std::make_unique<SharedRingSink>(outgoing_, outgoing_signals_);
+	}
+
+	auto new_source() -> std::unique_ptr<MessageSource> override {
+		return std::make_unique<SharedRingSource>(incoming_, incoming_signals_);
+	}
+};
+
+// 送信キューの設定
+// クライアントが詰まったときは、ログを捨て、オブジェクトリストの更新を連結する。それ以外はブロックする。
+// chunk_size が 0 でなければ、大きなメッセージを分割して送る。
+static auto client_sender_options(std::size_t chunk_size) -> MessageSenderOptions {
+	static constexpr auto QUEUE_CAPACITY = std::size_t{ 256 };
+	static constexpr auto BACKLOG_LIMIT = std::size_t{ 1024 };
+
+	return MessageSenderOptions{ QUEUE_CAPACITY, BACKLOG_LIMIT, true, true, chunk_size };
+}
+
+static auto method_to_frame_kind(Utf8StringView method) -> MessageFrameKind {
+	if (method == as_utf8(u8"output_event")) {
+		return MessageFrameKind::Log;
+	}
+
+	if (method == as_utf8(u8"list_updated_event") || method == as_utf8(u8"list_batch_updated_event")) {
+		return MessageFrameKind::ListUpdate;
+	}
+
+	return MessageFrameKind::Control;
+}
+
+// FIXME: knowbug_app と重複
+static auto get_hsp_dir() -> OsString {
+	// DLL の絶対パスを取得する。
+	auto buffer = std::array<TCHAR, MAX_PATH>{};
+	GetModuleFileName(GetModuleHandle(nullptr), buffer.data(), (DWORD)buffer.size());
+	auto full_path = OsString{ buffer.data() };
+
+	// ファイル名の部分を削除
+	while (!full_path.empty()) {
+		auto last = full_path[full_path.length() - 1];
+		if (last == TEXT('/') || last == TEXT('\\')) {
+			break;
+		}
+
+		full_path.pop_back();
+	}
+
+	return full_path;
+}
+
+static auto start_client_process() -> std::optional<KnowbugClientProcess> {
+	// クライアントプロセスの起動コマンドラインを構成する。
+	auto hsp_dir = get_hsp_dir();
+	auto name = hsp_dir + TEXT("knowbug_client.exe");
+
+	auto cmdline = OsString{ TEXT("\"") };
+	cmdline += name;
+	cmdline += TEXT("\"");
+
+	// 標準入出力のためのパイプを作成する。
+	auto client_stdin_pipe_opt = create_anonymous_pipe();
+	if (!client_stdin_pipe_opt) {
+		return std::nullopt;
+	}
+
+	auto client_stdout_pipe_opt = create_anonymous_pipe();
+	if (!client_stdout_pipe_opt) {
+		return std::nullopt;
+	}
+
+	// クライアントプロセスとデータをやり取りするパイプが継承されないようにする。
+	// (標準入力への書き込みと、標準出力からの読み取り。)
+	if (!SetHandleInformation(client_stdin_pipe_opt->write_.get(), HANDLE_FLAG_INHERIT, DWORD{})) {
+		return std::nullopt;
+	}
+
+	if (!SetHandleInformation(client_stdout_pipe_opt->read_.get(), HANDLE_FLAG_INHERIT, DWORD{})) {
+		return std::nullopt;
+	}
+
+	// クライアントプロセスの標準入出力のリダイレクトを設定する。
+	auto startup_info = STARTUPINFO{ sizeof(STARTUPINFO) };
+	auto process_info = PROCESS_INFORMATION{};
 
 	startup_info.hStdInput = client_stdin_pipe_opt->read_.get();
 	startup_info.hStdOutput = client_stdout_pipe_opt->write_.get();
@@ -825,7 +1566,29 @@ class KnowbugServerImpl
 
 	std::optional<KnowbugClientProcess> client_process_opt_;
 
-	std::optional<UINT_PTR> timer_opt_;
+	// クライアントとの通信路 (最後のものを送信に使う。)
+	std::vector<std::unique_ptr<ClientTransport>> transports_;
+
+	// クライアントへの送信を行う。(通信路より先に破棄する。)
+	std::unique_ptr<MessageSender> sender_;
+
+	// クライアントからの受信を行う。(通信路ごとに1つ)
+	std::vector<std::unique_ptr<MessageReceiver>> receivers_;
+
+	// メッセージが届いてから処理を始めるまでの時間
+	LatencyHistogram command_wait_latency_;
+
+	// メッセージが届いてから処理が終わるまでの時間
+	LatencyHistogram command_total_latency_;
+
+	// メッセージのボディー部の形式 (initialize_notification で決まる)
+	KnowbugBodyFormat body_format_;
+
+	// オブジェクトリストの差分をまとめて送るか (initialize_notification で決まる)
+	bool list_batch_enabled_;
+
+	// 大きなメッセージを分割して送るときの断片の大きさ (0 なら分割しない。initialize_notification で決まる)
+	std::size_t chunk_size_;
 
 	HspObjectListEntity object_list_entity_;
 
@@ -838,6 +1601,14 @@ public:
 		, started_(false)
 		, hidden_window_opt_()
 		, client_process_opt_()
+		, transports_()
+		, sender_()
+		, receivers_()
+		, command_wait_latency_()
+		, command_total_latency_()
+		, body_format_(KnowbugBodyFormat::Text)
+		, list_batch_enabled_(false)
+		, chunk_size_()
 		, object_list_entity_()
 	{
 	}
@@ -856,17 +1627,31 @@ public:
 			return;
 		}
 
-		timer_opt_ = SetTimer(hidden_window_opt_->get(), 1, 16, NULL);
+		transports_.push_back(std::make_unique<PipeTransport>(
+			client_process_opt_->stdin_write_.get(),
+			client_process_opt_->stdout_read_.get()
+		));
+		start_transport(*transports_.back());
 	}
 
 	void will_exit() override {
-		if (hidden_window_opt_ && timer_opt_) {
-			if (!KillTimer(hidden_window_opt_->get(), *timer_opt_)) {
-				assert(false && "KillTimer");
-			}
+		send_terminated_event();
+
+		// 溜まっているメッセージを送り切る。
+		if (sender_) {
+			sender_->stop();
 		}
 
-		send_terminated_event();
+		for (auto&& receiver : receivers_) {
+			receiver->stop();
+		}
+
+#if _DEBUG
+		// 計測の結果をデバッガーの出力に書く。(開発用)
+		debug_print(command_wait_latency_.to_summary(as_utf8(u8"knowbug: command wait latency")));
+		debug_print(command_total_latency_.to_summary(as_utf8(u8"knowbug: command total latency")));
+		debug_print(object_list_entity_.stats().to_summary(as_utf8(u8"knowbug: object list")));
+#endif
 	}
 
 	void logmes(HspStringView text) override {
@@ -878,49 +1663,28 @@ public:
 		send_stopped_event();
 	}
 
-	void read_client_stdout() {
-		if (!client_process_opt_) {
-			return;
-		}
-
-		auto stdout_handle = client_process_opt_->stdout_read_.get();
-
-		static auto s_buffer = Utf8String{};
-		if (s_buffer.size() == 0) {
-			s_buffer.resize(1024 * 1024);
-		}
-
-		auto peek_size = DWORD{};
-		auto total_size = DWORD{};
-		auto left_size = DWORD{};
-		if (!PeekNamedPipe(stdout_handle, s_buffer.data(), (DWORD)s_buffer.size(), &peek_size, &total_size, &left_size)) {
-			assert(false);
-			return;
-		}
+	void debuggee_did_hit_data_breakpoint(std::vector<std::size_t> const& watch_ids) override {
+		send_data_breakpoint_stopped_event(watch_ids);
+	}
 
-		if (peek_size == 0) {
-			return;
-		}
+	void debuggee_did_hit_breakpoint(std::size_t source_file_id, std::size_t line_index) override {
+		send_breakpoint_stopped_event(source_file_id, line_index);
+	}
 
-		auto read_size = DWORD{};
-		if (!ReadFile(stdout_handle, s_buffer.data(), (DWORD)s_buffer.size(), &read_size, LPOVERLAPPED{})) {
-			assert(false);
-			return;
+	// 受信スレッドが受け取ったメッセージを処理する。
+	void process_client_messages() {
+		auto messages = std::vector<ReceivedMessage>{};
+		for (auto&& receiver : receivers_) {
+			receiver->take(messages);
 		}
 
-		static auto s_data = Utf8String{};
-
-		auto chunk = Utf8StringView{ s_buffer.data(), (std::size_t)read_size };
+		for (auto&& received : messages) {
+			auto start = std::chrono::steady_clock::now();
+			client_did_send_something(received.message());
+			auto end = std::chrono::steady_clock::now();
 
-		s_data += chunk;
-
-		while (true) {
-			auto message_opt = knowbug_protocol_parse(s_data);
-			if (!message_opt) {
-				break;
-			}
-
-			client_did_send_something(*message_opt);
+			command_wait_latency_.record(start - received.received_at());
+			command_total_latency_.record(end - received.received_at());
 		}
 	}
 
@@ -929,7 +1693,7 @@ public:
 		auto method_str = as_native(method);
 
 		if (method == as_utf8(u8"initialize_notification")) {
-			client_did_initialize();
+			client_did_initialize(message);
 			return;
 		}
 
@@ -963,6 +1727,13 @@ public:
 			return;
 		}
 
+		if (method == as_utf8(u8"run_to_location_notification")) {
+			auto source_file_id = message.get_int(as_utf8(u8"source_file_id")).value_or(-1);
+			auto line_index = message.get_int(as_utf8(u8"line_index")).value_or(-1);
+			client_did_run_to_location(source_file_id, line_index);
+			return;
+		}
+
 		if (method == as_utf8(u8"location_notification")) {
 			client_did_location_update();
 			return;
@@ -985,12 +1756,108 @@ public:
 			return;
 		}
 
+		if (method == as_utf8(u8"list_viewport_notification")) {
+			auto first = message.get_int(as_utf8(u8"first")).value_or(0);
+			auto count = message.get_int(as_utf8(u8"count")).value_or(0);
+			client_did_list_viewport(first, count);
+			return;
+		}
+
 		if (method == as_utf8(u8"list_details_notification")) {
 			auto object_id = message.get_int(as_utf8(u8"object_id")).value_or(0);
 			client_did_list_details(object_id);
 			return;
 		}
 
+		if (method == as_utf8(u8"data_breakpoint_add_notification")) {
+			auto object_id = message.get_int(as_utf8(u8"object_id")).value_or(0);
+			client_did_data_breakpoint_add(object_id);
+			return;
+		}
+
+		if (method == as_utf8(u8"data_breakpoint_remove_notification")) {
+			auto watch_id = message.get_int(as_utf8(u8"watch_id")).value_or(0);
+			client_did_data_breakpoint_remove(watch_id);
+			return;
+		}
+
+		if (method == as_utf8(u8"data_breakpoint_clear_notification")) {
+			client_did_data_breakpoint_clear();
+			return;
+		}
+
+		if (method == as_utf8(u8"breakpoint_set_notification")) {
+			auto source_file_id = message.get_int(as_utf8(u8"source_file_id")).value_or(-1);
+			auto line_index = message.get_int(as_utf8(u8"line_index")).value_or(-1);
+			auto enabled = message.get_bool(as_utf8(u8"enabled")).value_or(true);
+			client_did_breakpoint_set(source_file_id, line_index, enabled);
+			return;
+		}
+
+		if (method == as_utf8(u8"breakpoint_clear_notification")) {
+			client_did_breakpoint_clear();
+			return;
+		}
+
+		if (method == as_utf8(u8"profile_start_notification")) {
+			client_did_profile_start();
+			return;
+		}
+
+		if (method == as_utf8(u8"profile_stop_notification")) {
+			client_did_profile_stop();
+			return;
+		}
+
+		if (method == as_utf8(u8"sampling_start_notification")) {
+			auto interval_ms = message.get_int(as_utf8(u8"interval_ms")).value_or(16);
+			client_did_sampling_start(interval_ms);
+			return;
+		}
+
+		if (method == as_utf8(u8"sampling_stop_notification")) {
+			client_did_sampling_stop();
+			return;
+		}
+
+		if (method == as_utf8(u8"hot_lines_notification")) {
+			auto limit = message.get_int(as_utf8(u8"limit")).value_or(20);
+			client_did_hot_lines(limit);
+			return;
+		}
+
+		if (method == as_utf8(u8"call_history_start_notification")) {
+			client_did_call_history_start();
+			return;
+		}
+
+		if (method == as_utf8(u8"call_history_stop_notification")) {
+			client_did_call_history_stop();
+			return;
+		}
+
+		if (method == as_utf8(u8"call_history_notification")) {
+			auto limit = message.get_int(as_utf8(u8"limit")).value_or(50);
+			client_did_call_history(limit);
+			return;
+		}
+
+		if (method == as_utf8(u8"call_graph_start_notification")) {
+			client_did_call_graph_start();
+			return;
+		}
+
+		if (method == as_utf8(u8"call_graph_stop_notification")) {
+			client_did_call_graph_stop();
+			return;
+		}
+
+		if (method == as_utf8(u8"call_graph_export_notification")) {
+			auto format = Utf8String{ message.get(as_utf8(u8"format")).value_or(as_utf8(u8"dot")) };
+			client_did_call_graph_export(format);
+			return;
+		}
+
 		if (method.empty()) {
 			return;
 		}
@@ -998,8 +1865,56 @@ public:
 		assert(false && u8"unknown method");
 	}
 
-	void client_did_initialize() {
-		send_initialized_event();
+	void client_did_initialize(KnowbugMessage const& message) {
+		auto body_format_opt = knowbug_body_format_from_name(message.get(as_utf8(u8"body_format")).value_or(as_utf8(u8"text")));
+		auto body_format = body_format_opt.value_or(KnowbugBodyFormat::Text);
+		auto list_batch = message.get_bool(as_utf8(u8"list_batch")).value_or(false);
+		auto chunked = message.get_bool(as_utf8(u8"chunked")).value_or(false);
+		auto snapshot_memory_limit_mb = message.get_int(as_utf8(u8"snapshot_memory_limit_mb")).value_or(DEFAULT_SNAPSHOT_MEMORY_LIMIT_MB);
+		auto coverage = message.get_bool(as_utf8(u8"coverage")).value_or(false);
+		auto execution_trace = message.get_bool(as_utf8(u8"execution_trace")).value_or(false);
+
+		objects().snapshot_do_set_memory_limit((std::size_t)std::max(0, snapshot_memory_limit_mb) * 1024 * 1024);
+
+		if (coverage) {
+			objects().coverage_do_start();
+			trace_did_change();
+		}
+
+		if (execution_trace) {
+			if (auto&& app = KnowbugApp::instance()) {
+				app->execution_trace_do_start();
+			}
+			trace_did_change();
+		}
+
+		auto shared_memory_transport = std::unique_ptr<SharedMemoryTransport>{};
+		if (message.get(as_utf8(u8"transport")) == as_utf8(u8"shared_memory")) {
+			shared_memory_transport = create_shared_memory_transport();
+		}
+
+		// 応答はテキスト形式で、いまの通信路で送る。その後の通信で形式と通信路を切り替える。
+		send_initialized_event(body_format, chunked, shared_memory_transport.get());
+		body_format_ = body_format;
+		list_batch_enabled_ = list_batch;
+		chunk_size_ = chunked ? MESSAGE_CHUNK_SIZE : 0;
+
+		if (shared_memory_transport) {
+			// 溜まっているメッセージを送り切ってから切り替える。
+			sender_->stop();
+
+			// クライアントはもうパイプに書かないので、パイプの受信スレッドを止める。(受信済みのメッセージは残るので、処理される。)
+			for (auto&& receiver : receivers_) {
+				receiver->stop();
+			}
+
+			transports_.push_back(std::move(shared_memory_transport));
+			start_transport(*transports_.back());
+		} else if (chunked) {
+			// 送信の設定だけを変える。
+			sender_->stop();
+			start_sender(*transports_.back());
+		}
 	}
 
 	void client_did_terminate() {
@@ -1007,25 +1922,28 @@ public:
 	}
 
 	void client_did_step_continue() {
-		hsx::debug_do_set_mode(HSPDEBUG_RUN, debug_);
+		objects().debuggee_did_resume();
+		step_controller_.update(StepControl::new_run());
 		touch_all_windows();
 
 		send_continued_event();
 	}
 
 	void client_did_step_pause() {
-		hsx::debug_do_set_mode(HSPDEBUG_STOP, debug_);
+		step_controller_.update(StepControl::new_stop());
 		touch_all_windows();
 	}
 
 	void client_did_step_in() {
-		hsx::debug_do_set_mode(HSPDEBUG_STEPIN, debug_);
+		objects().debuggee_did_resume();
+		step_controller_.update(StepControl::new_step_in());
 		touch_all_windows();
 
 		send_continued_event();
 	}
 
 	void client_did_step_over() {
+		objects().debuggee_did_resume();
 		step_controller_.update(StepControl::new_step_over());
 		touch_all_windows();
 
@@ -1033,12 +1951,35 @@ public:
 	}
 
 	void client_did_step_out() {
+		objects().debuggee_did_resume();
 		step_controller_.update(StepControl::new_step_out());
 		touch_all_windows();
 
 		send_continued_event();
 	}
 
+	void client_did_run_to_location(int source_file_id, int line_index) {
+		if (source_file_id < 0 || line_index < 0) {
+			assert(false && u8"bad location");
+			return;
+		}
+
+		// コードがない行なら、その後でコードがある最初の行まで実行する。
+		auto&& code_line_opt = objects().line_table().find_code_line((std::size_t)source_file_id, (std::size_t)line_index);
+		if (!code_line_opt) {
+			return;
+		}
+
+		auto goal = StepLocation{ (std::size_t)source_file_id, *code_line_opt };
+		auto start_opt = step_location_from_line(objects().script_to_code_line());
+
+		objects().debuggee_did_resume();
+		step_controller_.update(StepControl::new_run_to_location(goal, start_opt));
+		touch_all_windows();
+
+		send_continued_event();
+	}
+
 	void client_did_location_update() {
 		send_location_event();
 	}
@@ -1067,6 +2008,18 @@ public:
 		send_list_updated_events();
 	}
 
+	void client_did_list_viewport(int first, int count) {
+		if (first < 0 || count < 0) {
+			assert(false && u8"bad viewport");
+			return;
+		}
+
+		// 新しく見えるようになった行の名前と値を送る。
+		if (object_list_entity_.set_viewport((std::size_t)first, (std::size_t)count)) {
+			send_list_updated_events();
+		}
+	}
+
 	void client_did_list_details(int object_id) {
 		if (object_id < 0) {
 			assert(false && u8"bad object_id");
@@ -1076,33 +2029,189 @@ public:
 		send_list_details_event((std::size_t)object_id);
 	}
 
+	void client_did_data_breakpoint_add(int object_id) {
+		if (object_id < 0) {
+			assert(false && u8"bad object_id");
+			return;
+		}
+
+		auto watch_id_opt = std::optional<std::size_t>{};
+
+		auto&& path_opt = object_list_entity_.object_id_to_path((std::size_t)object_id);
+		if (path_opt) {
+			watch_id_opt = objects().data_watch_do_add(*path_opt);
+		}
+
+		trace_did_change();
+		send_data_breakpoint_added_event((std::size_t)object_id, watch_id_opt);
+	}
+
+	void client_did_data_breakpoint_remove(int watch_id) {
+		if (watch_id < 0) {
+			assert(false && u8"bad watch_id");
+			return;
+		}
+
+		objects().data_watch_do_remove((std::size_t)watch_id);
+		trace_did_change();
+	}
+
+	void client_did_data_breakpoint_clear() {
+		objects().data_watch_do_clear();
+		trace_did_change();
+	}
+
+	void client_did_breakpoint_set(int source_file_id, int line_index, bool enabled) {
+		if (source_file_id < 0 || line_index < 0) {
+			assert(false && u8"bad breakpoint location");
+			return;
+		}
+
+		objects().breakpoint_do_set((std::size_t)source_file_id, (std::size_t)line_index, enabled);
+		trace_did_change();
+
+		send_breakpoints_event((std::size_t)source_file_id);
+	}
+
+	void client_did_breakpoint_clear() {
+		objects().breakpoint_do_clear();
+		trace_did_change();
+	}
+
+	void client_did_profile_start() {
+		objects().profiler_do_start();
+	}
+
+	void client_did_profile_stop() {
+		objects().profiler_do_stop();
+		send_profile_event();
+	}
+
+	void client_did_sampling_start(int interval_ms) {
+		if (interval_ms <= 0) {
+			assert(false && u8"bad interval_ms");
+			return;
+		}
+
+		objects().sampler_do_start((std::size_t)interval_ms);
+	}
+
+	void client_did_sampling_stop() {
+		objects().sampler_do_stop();
+		send_hot_lines_event(SAMPLING_REPORT_LIMIT);
+	}
+
+	void client_did_hot_lines(int limit) {
+		if (limit <= 0) {
+			assert(false && u8"bad limit");
+			return;
+		}
+
+		send_hot_lines_event((std::size_t)limit);
+	}
+
+	void client_did_call_history_start() {
+		objects().call_history_do_start();
+	}
+
+	void client_did_call_history_stop() {
+		objects().call_history_do_stop();
+		send_call_history_event(CALL_HISTORY_TEXT_LIMIT);
+	}
+
+	void client_did_call_history(int limit) {
+		if (limit <= 0) {
+			assert(false && u8"bad limit");
+			return;
+		}
+
+		send_call_history_event((std::size_t)limit);
+	}
+
+	void client_did_call_graph_start() {
+		objects().call_graph_do_start();
+	}
+
+	void client_did_call_graph_stop() {
+		objects().call_graph_do_stop();
+	}
+
+	void client_did_call_graph_export(Utf8StringView format) {
+		if (format != as_utf8(u8"dot") && format != as_utf8(u8"json")) {
+			assert(false && u8"unknown format");
+			return;
+		}
+
+		send_call_graph_event(format);
+	}
+
 private:
 	auto objects() -> HspObjects& {
 		return objects_;
 	}
 
-	void send_message(KnowbugMessage const& message) {
-		auto text = knowbug_protocol_serialize(message);
+	// ブレークポイントやデータブレークポイントがあるとき、行カバレッジや実行トレースを記録しているときは、命令ごとに判定・記録できるように、トレースモードで実行する。
+	void trace_did_change() {
+		auto trace = !objects().breakpoint_is_empty()
+			|| !objects().data_watch_is_empty()
+			|| objects().coverage_is_running()
+			|| objects().execution_trace_is_running();
 
-		if (text.size() >= MEMORY_BUFFER_SIZE) {
-			// FIXME: ログ出力
-			assert(false && u8"too large to send");
+		if (objects().debuggee_is_stopped()) {
+			step_controller_.set_trace(trace);
 			return;
 		}
 
-		if (!client_process_opt_) {
-			return;
+		// 実行中なら、ステップ実行の目標を保ったままモードを切り替える。
+		step_controller_.change_trace(trace);
+		touch_all_windows();
+	}
+
+	// 通信路を使って送受信を始める。
+	void start_transport(ClientTransport& transport) {
+		start_sender(transport);
+
+		// メッセージが届いたら、隠しウィンドウを介して HSP のスレッドで処理する。
+		auto hwnd = hidden_window_opt_->get();
+		auto receiver = std::make_unique<MessageReceiver>(
+			transport.new_source(),
+			[hwnd] {
+				PostMessage(hwnd, WM_KNOWBUG_CLIENT_MESSAGE, WPARAM{}, LPARAM{});
+			}
+		);
+		receiver->start();
+		receivers_.push_back(std::move(receiver));
+	}
+
+	void start_sender(ClientTransport& transport) {
+		sender_ = std::make_unique<MessageSender>(transport.new_sink(), client_sender_options(chunk_size_));
+		sender_->start();
+	}
+
+	auto create_shared_memory_transport() -> std::unique_ptr<SharedMemoryTransport> {
+		static constexpr auto RING_CAPACITY = MEMORY_BUFFER_SIZE;
+
+		auto name = Utf8String{ as_utf8(u8"Local\\knowbug-") };
+		name += as_utf8(std::to_string(GetCurrentProcessId()));
+
+		auto transport = SharedMemoryTransport::create(std::move(name), RING_CAPACITY, client_process_opt_->process_handle_.get());
+		if (!transport) {
+			// パイプで通信を続ける。
+			assert(false && u8"couldn't create shared memory");
+			return nullptr;
 		}
+		return transport;
+	}
 
-		// クライアントの標準入力に流す。
-		auto handle = client_process_opt_->stdin_write_.get();
-		auto written_size = DWORD{};
+	void send_message(KnowbugMessage const& message) {
+		auto text = knowbug_protocol_serialize(message, body_format_);
 
-		if (!WriteFile(handle, text.data(), (DWORD)text.size(), &written_size, LPOVERLAPPED{})) {
-			assert(false && u8"WriteFile failed");
+		if (!sender_) {
 			return;
 		}
-		assert(written_size == text.size());
+
+		// 送信スレッドが通信路に流す。(大きなメッセージは、クライアントが対応していれば分割される。)
+		sender_->send(MessageFrame{ method_to_frame_kind(message.method()), std::move(text) });
 	}
 
 	void send_message(Utf8StringView method) {
@@ -1110,11 +2219,25 @@ private:
 		send_message(message);
 	}
 
-	void send_initialized_event() {
+	void send_initialized_event(KnowbugBodyFormat body_format, bool chunked, SharedMemoryTransport const* shared_memory_transport) {
 		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"initialized_event") });
 
 		message.insert(Utf8String{ as_utf8(u8"version") }, Utf8String{ as_utf8(KNOWBUG_VERSION) });
 
+		if (body_format == KnowbugBodyFormat::Binary) {
+			message.insert(Utf8String{ as_utf8(u8"body_format") }, Utf8String{ as_utf8(u8"binary") });
+		}
+
+		if (chunked) {
+			message.insert_bool(Utf8String{ as_utf8(u8"chunked") }, true);
+		}
+
+		if (shared_memory_transport) {
+			message.insert(Utf8String{ as_utf8(u8"transport") }, Utf8String{ as_utf8(u8"shared_memory") });
+			message.insert(Utf8String{ as_utf8(u8"shared_memory_name") }, Utf8String{ shared_memory_transport->name() });
+			message.insert_int(Utf8String{ as_utf8(u8"shared_memory_ring_capacity") }, (int)shared_memory_transport->ring_capacity());
+		}
+
 		send_message(message);
 	}
 
@@ -1130,6 +2253,115 @@ private:
 		send_message(as_utf8(u8"stopped_event"));
 	}
 
+	void send_data_breakpoint_stopped_event(std::vector<std::size_t> const& watch_ids) {
+		assert(!watch_ids.empty());
+
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"stopped_event") });
+
+		message.insert(Utf8String{ as_utf8(u8"reason") }, Utf8String{ as_utf8(u8"data_breakpoint") });
+		message.insert_int(Utf8String{ as_utf8(u8"watch_id") }, (int)watch_ids[0]);
+
+		if (auto&& name_opt = objects().data_watch_to_name(watch_ids[0])) {
+			message.insert(Utf8String{ as_utf8(u8"watch_name") }, Utf8String{ *name_opt });
+		}
+
+		auto ids = Utf8String{};
+		for (auto i = std::size_t{}; i < watch_ids.size(); i++) {
+			if (i != 0) {
+				ids += Utf8Char{ u8',' };
+			}
+			ids += as_utf8(std::to_string(watch_ids[i]));
+		}
+		message.insert(Utf8String{ as_utf8(u8"watch_ids") }, std::move(ids));
+
+		send_message(message);
+	}
+
+	void send_breakpoint_stopped_event(std::size_t source_file_id, std::size_t line_index) {
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"stopped_event") });
+
+		message.insert(Utf8String{ as_utf8(u8"reason") }, Utf8String{ as_utf8(u8"breakpoint") });
+		message.insert_int(Utf8String{ as_utf8(u8"source_file_id") }, (int)source_file_id);
+		message.insert_int(Utf8String{ as_utf8(u8"line_index") }, (int)line_index);
+
+		send_message(message);
+	}
+
+	void send_breakpoints_event(std::size_t source_file_id) {
+		auto line_indexes = Utf8String{};
+		auto&& lines = objects().breakpoint_to_lines(source_file_id);
+		for (auto i = std::size_t{}; i < lines.size(); i++) {
+			if (i != 0) {
+				line_indexes += Utf8Char{ u8',' };
+			}
+			line_indexes += as_utf8(std::to_string(lines[i]));
+		}
+
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"breakpoints_event") });
+
+		message.insert_int(Utf8String{ as_utf8(u8"source_file_id") }, (int)source_file_id);
+		message.insert(Utf8String{ as_utf8(u8"line_indexes") }, std::move(line_indexes));
+
+		send_message(message);
+	}
+
+	void send_profile_event() {
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"profile_event") });
+
+		message.insert(Utf8String{ as_utf8(u8"report") }, objects().profiler_to_report().value_or(Utf8String{}));
+		message.insert(Utf8String{ as_utf8(u8"collapsed_stacks") }, objects().profiler_to_collapsed_stacks().value_or(Utf8String{}));
+
+		send_message(message);
+	}
+
+	void send_hot_lines_event(std::size_t limit) {
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"hot_lines_event") });
+
+		message.insert_int(Utf8String{ as_utf8(u8"sample_count") }, (int)objects().sampler_to_sample_count());
+		message.insert(Utf8String{ as_utf8(u8"report") }, objects().sampler_to_report(limit).value_or(Utf8String{}));
+
+		send_message(message);
+	}
+
+	void send_call_graph_event(Utf8StringView format) {
+		auto text_opt = format == as_utf8(u8"json")
+			? objects().call_graph_to_json()
+			: objects().call_graph_to_dot();
+
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"call_graph_event") });
+
+		message.insert(Utf8String{ as_utf8(u8"format") }, Utf8String{ format });
+		message.insert(Utf8String{ as_utf8(u8"text") }, text_opt.value_or(Utf8String{}));
+
+		send_message(message);
+	}
+
+	void send_call_history_event(std::size_t limit) {
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"call_history_event") });
+
+		message.insert(Utf8String{ as_utf8(u8"text") }, objects().call_history_to_text(limit).value_or(Utf8String{}));
+
+		send_message(message);
+	}
+
+	void send_data_breakpoint_added_event(std::size_t object_id, std::optional<std::size_t> watch_id_opt) {
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"data_breakpoint_added_event") });
+
+		message.insert_int(Utf8String{ as_utf8(u8"object_id") }, (int)object_id);
+
+		if (watch_id_opt) {
+			message.insert_int(Utf8String{ as_utf8(u8"watch_id") }, (int)*watch_id_opt);
+
+			if (auto&& name_opt = objects().data_watch_to_name(*watch_id_opt)) {
+				message.insert(Utf8String{ as_utf8(u8"name") }, Utf8String{ *name_opt });
+			}
+		} else {
+			message.insert(Utf8String{ as_utf8(u8"error") }, Utf8String{ as_utf8(u8"この値のメモリーは監視できません。") });
+		}
+
+		send_message(message);
+	}
+
 	void send_location_event() {
 		objects().script_do_update_location();
 
@@ -1166,38 +2398,79 @@ private:
 	void send_list_updated_events() {
 		auto diff = object_list_entity_.update(objects());
 
-		for (auto i = std::size_t{}; i < diff.size(); i++) {
-			auto&& delta = diff[i];
+		if (!list_batch_enabled_) {
+			for (auto&& delta : diff) {
+				send_list_updated_event(delta);
+			}
+			return;
+		}
+
+		// 差分をまとめて送る。
+		auto batch = HspObjectListDeltaBatch{};
 
-			auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"list_updated_event") });
+		for (auto&& delta : diff) {
+			batch.add(delta);
 
-			message.insert(
-				Utf8String{ as_utf8(u8"kind") },
-				Utf8String{ HspObjectListDelta::kind_to_string(delta.kind()) }
-			);
+			if (batch.text_size() >= LIST_BATCH_SIZE_LIMIT) {
+				send_message(batch.to_message());
+				batch.clear();
+			}
+		}
 
-			message.insert_int(
-				Utf8String{ as_utf8(u8"object_id") },
-				(int)delta.object_id()
-			);
+		if (batch.size() != 0) {
+			send_message(batch.to_message());
+		}
+	}
+
+	// 差分を1つずつ送る。(list_batch に対応していないクライアント向け)
+	void send_list_updated_event(HspObjectListDelta const& delta) {
+		auto message = KnowbugMessage::new_with_method(Utf8String{ as_utf8(u8"list_updated_event") });
+
+		message.insert(
+			Utf8String{ as_utf8(u8"kind") },
+			Utf8String{ HspObjectListDelta::kind_to_string(delta.kind()) }
+		);
 
+		message.insert_int(
+			Utf8String{ as_utf8(u8"object_id") },
+			(int)delta.object_id()
+		);
+
+		message.insert_int(
+			Utf8String{ as_utf8(u8"index") },
+			(int)delta.index()
+		);
+
+		if (delta.kind() == HspObjectListDelta::Kind::Move) {
 			message.insert_int(
-				Utf8String{ as_utf8(u8"index") },
-				(int)delta.index()
+				Utf8String{ as_utf8(u8"from_index") },
+				(int)delta.from_index()
 			);
+		}
 
-			message.insert(
-				Utf8String{ as_utf8(u8"name") },
-				delta.name()
-			);
+		message.insert(
+			Utf8String{ as_utf8(u8"name") },
+			delta.name()
+		);
+
+		message.insert(
+			Utf8String{ as_utf8(u8"value") },
+			Utf8String{ delta.value() }
+		);
+
+		message.insert_bool(
+			Utf8String{ as_utf8(u8"changed") },
+			delta.change().is_changed()
+		);
 
+		if (!delta.change().changed_elements().empty()) {
 			message.insert(
-				Utf8String{ as_utf8(u8"value") },
-				Utf8String{ delta.value() }
+				Utf8String{ as_utf8(u8"changed_elements") },
+				Utf8String{ delta.change().changed_elements() }
 			);
-
-			send_message(message);
 		}
+
+		send_message(message);
 	}
 
 	void send_list_details_event(std::size_t object_id) {
@@ -1229,6 +2502,12 @@ private:
 		send_message(message);
 	}
 
+	static void debug_print(Utf8StringView text) {
+		auto line = Utf8String{ text };
+		line += as_utf8(u8"\n");
+		OutputDebugString(to_os(line).data());
+	}
+
 	void touch_all_windows() {
 		auto hwnd = (HWND)debug_->hspctx->wnd_parent;
 		if (!hwnd) {
@@ -1262,11 +2541,11 @@ static auto WINAPI process_hidden_window(HWND hwnd, UINT msg, WPARAM wp, LPARAM
 		PostQuitMessage(0);
 		break;
 
-	case WM_TIMER: {
+	case WM_KNOWBUG_CLIENT_MESSAGE: {
 		if (auto server = s_server.lock()) {
-			server->read_client_stdout();
+			server->process_client_messages();
 		}
-		break;
+		return 0;
 	}
 	}
 	return DefWindowProc(hwnd, msg, wp, lp);
@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <thread>
+#include <vector>
 #include "../hspsdk/hsp3debug.h"
 #include "../knowbug_core/platform.h"
 
@@ -21,4 +22,10 @@ public:
 	virtual void logmes(HspStringView text) = 0;
 
 	virtual void debuggee_did_stop() = 0;
+
+	// データブレークポイントで停止した。(watch_ids は変化した監視対象の番号)
+	virtual void debuggee_did_hit_data_breakpoint(std::vector<std::size_t> const& watch_ids) = 0;
+
+	// ブレークポイントのある行に入ったので停止した。
+	virtual void debuggee_did_hit_breakpoint(std::size_t source_file_id, std::size_t line_index) = 0;
 };
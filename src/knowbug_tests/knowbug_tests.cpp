@@ -2,10 +2,31 @@
 
 #include "pch.h"
 #include <iostream>
+#include "../knowbug_core/call_graph.h"
+#include "../knowbug_core/call_history.h"
+#include "../knowbug_core/call_profiler.h"
+#include "../knowbug_core/content_hash.h"
+#include "../knowbug_core/data_watch.h"
+#include "../knowbug_core/execution_trace.h"
+#include "../knowbug_core/hsp_line_table.h"
 #include "../knowbug_core/hsp_objects_module_tree.h"
+#include "../knowbug_core/hsp_object_path_cache.h"
+#include "../knowbug_core/hsp_object_path_table.h"
 #include "../knowbug_core/hsp_object_writer.h"
+#include "../knowbug_core/hsp_snapshot.h"
+#include "../knowbug_core/hsp_snapshot_diff.h"
+#include "../knowbug_core/hsp_wrap_call.h"
 #include "../knowbug_core/knowbug_protocol.h"
+#include "../knowbug_core/latency_histogram.h"
+#include "../knowbug_core/line_breakpoint.h"
+#include "../knowbug_core/line_coverage.h"
+#include "../knowbug_core/message_receiver.h"
+#include "../knowbug_core/message_sender.h"
+#include "../knowbug_core/object_list_diff.h"
+#include "../knowbug_core/sampling_profiler.h"
+#include "../knowbug_core/shared_ring.h"
 #include "../knowbug_core/source_files.h"
+#include "../knowbug_core/step_controller.h"
 #include "../knowbug_core/string_split.h"
 #include "../knowbug_core/string_writer.h"
 #include "../knowbug_core/transfer_protocol.h"
@@ -52,9 +73,30 @@ auto main() -> int {
 	hello_tests(tests);
 	string_writer_tests(tests);
 	module_tree_tests(tests);
+	call_graph_tests(tests);
+	call_history_tests(tests);
+	call_profiler_tests(tests);
+	content_hash_tests(tests);
+	data_watch_tests(tests);
+	execution_trace_tests(tests);
+	hsp_line_table_tests(tests);
+	hsp_object_path_cache_tests(tests);
+	hsp_object_path_table_tests(tests);
 	hsp_object_writer_tests(tests);
+	hsp_snapshot_tests(tests);
+	hsp_snapshot_diff_tests(tests);
+	hsp_wrap_call_tests(tests);
 	knowbug_protocol_tests(tests);
+	latency_histogram_tests(tests);
+	line_breakpoint_tests(tests);
+	line_coverage_tests(tests);
+	message_receiver_tests(tests);
+	message_sender_tests(tests);
+	object_list_diff_tests(tests);
+	sampling_profiler_tests(tests);
+	shared_ring_tests(tests);
 	source_files_tests(tests);
+	step_controller_tests(tests);
 	string_lines_tests(tests);
 	transfer_protocol_tests(tests);
 